@@ -0,0 +1,106 @@
+# Writes the JPEG corpus of kernel_bench with Pillow (libjpeg). The files
+# are committed; this is only needed to add to them.
+#
+#   python3 make_corpus.py
+
+import math
+import struct
+from PIL import Image
+
+WIDTH = 100  # not a whole number of MCUs either way
+HEIGHT = 75
+
+
+def pattern():
+    image = Image.new("RGB", (WIDTH, HEIGHT))
+    pixels = image.load()
+    for y in range(HEIGHT):
+        for x in range(WIDTH):
+            ring = ((x - 50) ** 2 + (y - 37) ** 2) // 90 % 2
+            checker = (x // 5 + y // 5) % 2
+            pixels[x, y] = (x * 255 // WIDTH, y * 255 // HEIGHT,
+                            255 if ring else 40 + 120 * checker)
+    return image
+
+
+# An 8x8 block whose DCT coefficients are all about 12, with the signs
+# that make the largest sums in the IDCT's row pass.
+def overflow_block():
+    rows = [1, -1, 1, -1, 1, -1, 1, -1]
+    cols = [1, -1, 1, 1, -1, 1, -1, 1]
+
+    def scale(u):
+        return math.sqrt(0.5) if u == 0 else 1.0
+
+    block = []
+    for y in range(8):
+        for x in range(8):
+            s = 0.0
+            for v in range(8):
+                for u in range(8):
+                    s += (scale(u) * scale(v) / 4 * 12 * rows[v] * cols[u]
+                          * math.cos((2 * x + 1) * u * math.pi / 16)
+                          * math.cos((2 * y + 1) * v * math.pi / 16))
+            block.append(int(round(128 + s)))
+    return block
+
+
+# Sets every quantization table entry to 255, as a damaged frame might,
+# so that the coefficients above all land on the decoder's clamps.
+def max_quant(data):
+    out = bytearray(data)
+    pos = 2
+    while True:
+        marker = out[pos + 1]
+        length = struct.unpack(">H", out[pos + 2:pos + 4])[0]
+        if marker == 0xDA:
+            return bytes(out)
+        if marker == 0xDB:
+            for i in range(pos + 4, pos + 2 + length, 65):
+                out[i + 1:i + 65] = b"\xff" * 64
+        pos += 2 + length
+
+
+# Drops the DHT segments, as cameras do; libjpeg's tables without
+# optimize are the standard ones the decoder falls back on.
+def strip_dht(data):
+    out = bytearray(data[:2])
+    pos = 2
+    while True:
+        marker = data[pos + 1]
+        length = struct.unpack(">H", data[pos + 2:pos + 4])[0]
+        if marker == 0xDA:
+            return bytes(out + data[pos:])
+        if marker != 0xC4:
+            out += data[pos:pos + 2 + length]
+        pos += 2 + length
+
+
+def main():
+    image = pattern()
+    image.save("444.jpg", quality=90, subsampling=0)
+    image.save("422.jpg", quality=90, subsampling=1)
+    image.save("420.jpg", quality=90, subsampling=2)
+    image.convert("L").save("gray.jpg", quality=90)
+    image.save("420-rst.jpg", quality=90, subsampling=2, restart_marker_blocks=3)
+    image.save("422-rst.jpg", quality=90, subsampling=1, restart_marker_rows=1)
+
+    image.save("422-nodht.jpg", quality=75, subsampling=1)
+    with open("422-nodht.jpg", "rb") as f:
+        data = f.read()
+    with open("422-nodht.jpg", "wb") as f:
+        f.write(strip_dht(data))
+
+    block = overflow_block()
+    tiles = Image.new("L", (WIDTH, HEIGHT))
+    tiles.putdata([block[y % 8 * 8 + x % 8]
+                   for y in range(HEIGHT) for x in range(WIDTH)])
+    tiles.save("gray-corrupt.jpg", qtables=[[1] * 64])
+    with open("gray-corrupt.jpg", "rb") as f:
+        data = f.read()
+    with open("gray-corrupt.jpg", "wb") as f:
+        f.write(max_quant(data))
+
+
+if __name__ == "__main__":
+    main()
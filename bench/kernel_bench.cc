@@ -0,0 +1,1174 @@
+// Throughput and golden-output checks for the pixel kernels.
+//
+// Every kernel runs on the same pseudo-random frame at each size; its
+// output hash must match the one in the baseline, which also holds the
+// MPix/s a kernel must not fall more than --tolerance percent below.
+// Checksums are portable, throughput numbers belong to the machine that
+// wrote them with --write-baseline.
+
+#include <ctype.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <functional>
+#include <map>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "compose_stage.h"
+#include "cpu_features.h"
+#include "frame_pool.h"
+#include "frame_trace.h"
+#include "image_encoder.h"
+#include "image_mask.h"
+#include "image_scaler.h"
+#include "image_transform.h"
+#include "jpeg_decoder.h"
+#include "mask_shape.h"
+#include "pipeline.h"
+#include "raw_recording.h"
+#include "replay_ring.h"
+#include "test_pattern.h"
+#include "worker_pool.h"
+#include "yuv_format.h"
+#include "yuv_scaler.h"
+
+#if CPU_X86
+#if defined(_MSC_VER)
+#include <intrin.h>
+#else
+#include <x86intrin.h>
+#endif
+#endif
+
+#ifndef BENCH_BASELINE
+#define BENCH_BASELINE "baseline.json"
+#endif
+
+#ifndef BENCH_JPEG_DIR
+#define BENCH_JPEG_DIR "jpeg"
+#endif
+
+struct FrameSize {
+    uint32_t width;
+    uint32_t height;
+};
+
+static const FrameSize kSizes[] = {
+    { 640, 480 },
+    { 1280, 720 },
+    { 1920, 1080 },
+    { 3840, 2160 },
+};
+
+struct Options {
+    std::string baseline = BENCH_BASELINE;
+    std::string write_baseline;
+    std::string filter;
+    std::string trace;
+    double tolerance = 10.0;  // percent
+    double min_time = 0.2;    // seconds per case
+    bool check_perf = true;
+};
+
+struct Baseline {
+    std::map<std::string, std::string> checksums;
+    std::map<std::string, double> mpix_per_s;
+};
+
+struct Result {
+    std::string key;       // kernel.tier/size, throughput is kept per tier
+    std::string out_key;   // kernel/size, all tiers share one checksum
+    double mpix_per_s;
+    double cycles_per_pixel;
+    std::string checksum;
+};
+
+static uint64_t ReadCycles()
+{
+#if CPU_X86
+    return __rdtsc();
+#else
+    return 0;
+#endif
+}
+
+static std::string Hash(const uint8_t* data, size_t size)
+{
+    uint64_t h = 0xcbf29ce484222325ull;  // FNV-1a
+    for (size_t i = 0; i < size; ++i) {
+        h ^= data[i];
+        h *= 0x100000001b3ull;
+    }
+
+    char buf[17];
+    snprintf(buf, sizeof(buf), "%016llx", (unsigned long long)h);
+    return buf;
+}
+
+static void FillRandom(std::vector<uint8_t>* buf, uint32_t seed)
+{
+    uint32_t s = seed * 2654435761u + 1;
+    for (uint8_t& v : *buf) {
+        s = s * 1664525u + 1013904223u;
+        v = (uint8_t)(s >> 24);
+    }
+}
+
+static std::string SizeName(const FrameSize& size)
+{
+    return std::to_string(size.width) + "x" + std::to_string(size.height);
+}
+
+// Runs |fn| at least three times and for |min_time| seconds, and keeps the
+// fastest run, which is the least disturbed by the rest of the system.
+static void Measure(const std::function<void()>& fn, double min_time,
+    double* seconds, uint64_t* cycles)
+{
+    *seconds = 1e30;
+    *cycles = UINT64_MAX;
+    double total = 0;
+
+    for (int rep = 0; rep < 3 || total < min_time; ++rep) {
+        auto t0 = std::chrono::steady_clock::now();
+        uint64_t c0 = ReadCycles();
+        fn();
+        uint64_t c1 = ReadCycles();
+        auto t1 = std::chrono::steady_clock::now();
+
+        double s = std::chrono::duration<double>(t1 - t0).count();
+        total += s;
+        *seconds = std::min(*seconds, s);
+        *cycles = std::min(*cycles, c1 - c0);
+    }
+}
+
+struct Kernel {
+    std::string name;
+    std::string tier;
+    PlaneLayout layout;
+    uint32_t bytes_per_pixel;  // of plane 0
+    IMAGE_TRANSFORM_FN xform;
+    bool mirror;
+};
+
+static std::string FourccName(uint32_t fourcc)
+{
+    std::string name;
+    for (int i = 0; i < 4; ++i)
+        name += (char)tolower((int)((fourcc >> (i * 8)) & 0xFF));
+
+    return name;
+}
+
+template <class Format>
+static void AddYuvKernels(std::vector<Kernel>* kernels)
+{
+    const std::string name = FourccName(Format::fourcc);
+    const uint32_t bpp = Format::layout == PLANE_LAYOUT_PACKED
+        ? 2 : (uint32_t)sizeof(typename Format::Sample);
+
+    kernels->push_back({ name, "c", Format::layout, bpp, TransformYuv<Format>, false });
+#if CPU_X86
+    const CpuFeatures& cpu = GetCpuFeatures();
+    if (cpu.sse2)
+        kernels->push_back({ name, "sse2", Format::layout, bpp, TransformYuv_SSE2<Format>, false });
+
+    if (cpu.avx2)
+        kernels->push_back({ name, "avx2", Format::layout, bpp, TransformYuv_AVX2<Format>, false });
+#endif
+}
+
+#define ADD_YUV_KERNELS(Format) AddYuvKernels<Format>(&kernels);
+
+static std::vector<Kernel> ListKernels()
+{
+    std::vector<Kernel> kernels;
+    kernels.push_back({ "rgb24", "c", PLANE_LAYOUT_PACKED, 3, TransformImage_RGB24, false });
+
+    // RGB32 is a plain copy, the mirrored one is what mirror mode runs.
+    for (int mirror = 0; mirror < 2; ++mirror) {
+        const char* name = mirror ? "rgb32-mirror" : "rgb32";
+        kernels.push_back({ name, "c", PLANE_LAYOUT_PACKED, 4, TransformImage_RGB32, mirror != 0 });
+#if CPU_X86
+        const CpuFeatures& cpu = GetCpuFeatures();
+        if (cpu.sse2)
+            kernels.push_back({ name, "sse2", PLANE_LAYOUT_PACKED, 4, TransformImage_RGB32_SSE2, mirror != 0 });
+
+        if (cpu.avx2)
+            kernels.push_back({ name, "avx2", PLANE_LAYOUT_PACKED, 4, TransformImage_RGB32_AVX2, mirror != 0 });
+#endif
+    }
+
+    FOR_EACH_YUV_FORMAT(ADD_YUV_KERNELS)
+    return kernels;
+}
+
+static Result RunKernel(const Kernel& k, const FrameSize& size, double min_time)
+{
+    const uint32_t w = size.width;
+    const uint32_t h = size.height;
+    const int32_t stride = (int32_t)(w * k.bytes_per_pixel);
+
+    uint32_t rows = h;
+    if (k.layout != PLANE_LAYOUT_PACKED)
+        rows += (h + 1) / 2;
+
+    std::vector<uint8_t> src_buf((size_t)stride * rows);
+    FillRandom(&src_buf, w * h);
+    const SourceImage src = MakeSourceImage(k.layout, src_buf.data(), stride, h);
+
+    std::vector<uint8_t> dst_buf((size_t)w * h * 4);
+    TargetImage dst = {};
+    dst.data = dst_buf.data();
+    dst.stride = (int32_t)(w * 4);
+    dst.mirror = k.mirror;
+
+    double seconds = 0;
+    uint64_t cycles = 0;
+    Measure([&]() { k.xform(dst, src, w, h); }, min_time, &seconds, &cycles);
+
+    Result r;
+    r.out_key = k.name + "/" + SizeName(size);
+    r.key = k.name + "." + k.tier + "/" + SizeName(size);
+    r.mpix_per_s = (double)w * h / seconds / 1e6;
+    r.cycles_per_pixel = (double)cycles / ((double)w * h);
+    r.checksum = Hash(dst_buf.data(), dst_buf.size());
+    return r;
+}
+
+// An inscribed circle with a one pixel ramp, like the circle mask mode.
+static std::vector<uint8_t> CircleMask(const FrameSize& size)
+{
+    std::vector<uint8_t> mask((size_t)size.width * size.height);
+    const double cx = size.width / 2.0;
+    const double cy = size.height / 2.0;
+    const double radius = std::min(cx, cy);
+
+    for (uint32_t y = 0; y < size.height; ++y) {
+        for (uint32_t x = 0; x < size.width; ++x) {
+            double dx = x + 0.5 - cx;
+            double dy = y + 0.5 - cy;
+            double d = radius - sqrt(dx * dx + dy * dy) + 0.5;
+            d = std::min(1.0, std::max(0.0, d));
+            mask[(size_t)y * size.width + x] = (uint8_t)(d * 255 + 0.5);
+        }
+    }
+
+    return mask;
+}
+
+// Circle mode at 80% opacity.
+static const uint8_t kMaskOpacity = 204;
+
+struct MaskTier {
+    const char* tier;
+    APPLY_MASK_FN fn;
+};
+
+static std::vector<MaskTier> ListMaskTiers()
+{
+    std::vector<MaskTier> tiers;
+    tiers.push_back({ "c", ApplyMask_C });
+#if CPU_X86
+    const CpuFeatures& cpu = GetCpuFeatures();
+    if (cpu.sse2)
+        tiers.push_back({ "sse2", ApplyMask_SSE2 });
+
+    if (cpu.avx2)
+        tiers.push_back({ "avx2", ApplyMask_AVX2 });
+#endif
+    return tiers;
+}
+
+// Frames come out of the converters opaque.
+static std::vector<uint8_t> OpaqueFrame(const FrameSize& size)
+{
+    std::vector<uint8_t> frame((size_t)size.width * size.height * 4);
+    FillRandom(&frame, size.width + size.height);
+    for (size_t i = 3; i < frame.size(); i += 4)
+        frame[i] = 0xFF;
+
+    return frame;
+}
+
+static Result RunMask(const MaskTier& t, const FrameSize& size, double min_time)
+{
+    const uint32_t w = size.width;
+    const uint32_t h = size.height;
+    const std::vector<uint8_t> mask = CircleMask(size);
+    std::vector<uint8_t> dst_buf = OpaqueFrame(size);
+
+    // Masking works in place; the checksum is of one pass over the frame,
+    // the timed passes after it run on the already masked pixels, which
+    // costs the same.
+    t.fn(dst_buf.data(), (int32_t)(w * 4), mask.data(), w, h, kMaskOpacity);
+
+    Result r;
+    r.out_key = "mask/" + SizeName(size);
+    r.key = std::string("mask.") + t.tier + "/" + SizeName(size);
+    r.checksum = Hash(dst_buf.data(), dst_buf.size());
+
+    double seconds = 0;
+    uint64_t cycles = 0;
+    Measure([&]() { t.fn(dst_buf.data(), (int32_t)(w * 4), mask.data(), w, h, kMaskOpacity); },
+        min_time, &seconds, &cycles);
+
+    r.mpix_per_s = (double)w * h / seconds / 1e6;
+    r.cycles_per_pixel = (double)cycles / ((double)w * h);
+    return r;
+}
+
+// The same mask as runs; at kMaskOpacity the output must match the dense
+// one. At full opacity the opaque runs are skipped, which is the common
+// case.
+static const char* const kSpanMaskNames[] = { "mask-span", "mask-span-full" };
+
+static Result RunSpanMask(const MaskTier& t, const FrameSize& size, bool full,
+    double min_time)
+{
+    const char* name = kSpanMaskNames[full];
+    const uint8_t opacity = full ? 0xFF : kMaskOpacity;
+    const uint32_t w = size.width;
+    const uint32_t h = size.height;
+    const std::vector<uint8_t> dense = CircleMask(size);
+    SpanMask mask;
+    mask.Assign(dense.data(), w, h);
+    std::vector<uint8_t> dst_buf = OpaqueFrame(size);
+
+    ApplySpanMask(dst_buf.data(), (int32_t)(w * 4), mask, opacity, t.fn);
+
+    Result r;
+    r.out_key = (full ? "mask-full/" : "mask/") + SizeName(size);
+    r.key = std::string(name) + "." + t.tier + "/" + SizeName(size);
+    r.checksum = Hash(dst_buf.data(), dst_buf.size());
+
+    double seconds = 0;
+    uint64_t cycles = 0;
+    Measure([&]() { ApplySpanMask(dst_buf.data(), (int32_t)(w * 4), mask, opacity, t.fn); },
+        min_time, &seconds, &cycles);
+
+    r.mpix_per_s = (double)w * h / seconds / 1e6;
+    r.cycles_per_pixel = (double)cycles / ((double)w * h);
+    return r;
+}
+
+// Building a mask on a display size change; throughput is of mask
+// pixels, the checksum is of the mask expanded to bytes.
+static const char* const kShapeNames[] = { "circle", "ellipse", "rrect" };
+
+static Result RunShapeMask(MaskShape shape, const FrameSize& size, double min_time)
+{
+    const uint32_t w = size.width;
+    const uint32_t h = size.height;
+    SpanMask mask;
+
+    double seconds = 0;
+    uint64_t cycles = 0;
+    Measure([&]() { BuildShapeMask(shape, w, h, &mask); }, min_time, &seconds, &cycles);
+
+    std::vector<uint8_t> dense((size_t)w * h);
+    for (uint32_t y = 0; y < h; ++y) {
+        uint8_t* row = &dense[(size_t)y * w];
+        for (const SpanMask::Run* run = mask.RowBegin(y); run != mask.RowEnd(y); ++run) {
+            if (run->opaque)
+                memset(row + run->x, 0xFF, run->length);
+            else
+                memcpy(row + run->x, mask.Coverage(*run), run->length);
+        }
+    }
+
+    const std::string name = std::string("shape-") + kShapeNames[shape];
+    Result r;
+    r.out_key = name + "/" + SizeName(size);
+    r.key = name + ".c/" + SizeName(size);
+    r.mpix_per_s = (double)w * h / seconds / 1e6;
+    r.cycles_per_pixel = (double)cycles / ((double)w * h);
+    r.checksum = Hash(dense.data(), dense.size());
+    return r;
+}
+
+// The menu scales that resample; throughput is of output pixels.
+static const int kScalePercents[] = { 50, 75, 150, 200 };
+
+static Result RunScale(const FrameSize& size, int percent, bool simd, double min_time)
+{
+    const uint32_t w = size.width;
+    const uint32_t h = size.height;
+    const uint32_t dw = w * percent / 100;
+    const uint32_t dh = h * percent / 100;
+
+    std::vector<uint8_t> src_buf((size_t)w * h * 4);
+    FillRandom(&src_buf, w ^ h);
+    std::vector<uint8_t> dst_buf((size_t)dw * dh * 4);
+
+    const BgraImage src = { src_buf.data(), (int32_t)(w * 4), w, h };
+    const BgraImage dst = { dst_buf.data(), (int32_t)(dw * 4), dw, dh };
+    ImageScaler scaler(simd);
+
+    double seconds = 0;
+    uint64_t cycles = 0;
+    Measure([&]() { scaler.Scale(src, dst); }, min_time, &seconds, &cycles);
+
+    const std::string name = "scale" + std::to_string(percent);
+    Result r;
+    r.out_key = name + "/" + SizeName(size);
+    r.key = name + (simd ? ".avx2/" : ".c/") + SizeName(size);
+    r.mpix_per_s = (double)dw * dh / seconds / 1e6;
+    r.cycles_per_pixel = (double)cycles / ((double)dw * dh);
+    r.checksum = Hash(dst_buf.data(), dst_buf.size());
+    return r;
+}
+
+// Preview below 100%: shrinking the YUV planes and converting only the
+// output, against scaleNN, which converts the frame and shrinks the RGB.
+struct YuvScaleCase {
+    const char* name;
+    uint32_t format;
+    PlaneLayout layout;
+    uint32_t bytes_per_pixel;
+};
+
+static const YuvScaleCase kYuvScaleCases[] = {
+    { "yuy2", FormatYUY2::fourcc, PLANE_LAYOUT_PACKED, 2 },
+    { "nv12", FormatNV12::fourcc, PLANE_LAYOUT_NV12, 1 },
+};
+
+static const int kYuvScalePercents[] = { 50, 75 };
+
+static Result RunYuvScale(const YuvScaleCase& c, const FrameSize& size, int percent,
+    bool simd, double min_time)
+{
+    const uint32_t w = size.width;
+    const uint32_t h = size.height;
+    const uint32_t dw = w * percent / 100;
+    const uint32_t dh = h * percent / 100;
+    const int32_t stride = (int32_t)(w * c.bytes_per_pixel);
+
+    uint32_t rows = h;
+    if (c.layout != PLANE_LAYOUT_PACKED)
+        rows += (h + 1) / 2;
+
+    std::vector<uint8_t> src_buf((size_t)stride * rows);
+    FillRandom(&src_buf, w * h);
+    const SourceImage src = MakeSourceImage(c.layout, src_buf.data(), stride, h);
+
+    std::vector<uint8_t> dst_buf((size_t)dw * dh * 4);
+    TargetImage dst = {};
+    dst.data = dst_buf.data();
+    dst.stride = (int32_t)(dw * 4);
+    YuvScaler scaler(simd);
+
+    double seconds = 0;
+    uint64_t cycles = 0;
+    Measure([&]() { scaler.ScaleConvert(c.format, src, w, h, dst, dw, dh); },
+        min_time, &seconds, &cycles);
+
+    const std::string name = std::string(c.name) + "-scale" + std::to_string(percent);
+    Result r;
+    r.out_key = name + "/" + SizeName(size);
+    r.key = name + (simd ? ".avx2/" : ".c/") + SizeName(size);
+    r.mpix_per_s = (double)dw * dh / seconds / 1e6;
+    r.cycles_per_pixel = (double)cycles / ((double)dw * dh);
+    r.checksum = Hash(dst_buf.data(), dst_buf.size());
+    return r;
+}
+
+// The preview path run headless: synthetic YUY2 frames are converted,
+// shrunk to 50% and masked on stages of their own, and a null sink hashes
+// what comes out. Queues wait instead of dropping, so every frame arrives
+// and the output is the same on every run; throughput is of source pixels.
+static const uint32_t kPipelineFrames = 8;
+
+class ConvertStage : public PipelineStage
+{
+public:
+    const char* Name() const override { return "convert"; }
+
+    bool Process(FrameRef* frame) override
+    {
+        const Frame& src = **frame;
+        FrameFormat format = {};
+        format.fourcc = kFrameFormatBgra;
+        format.width = src.Width();
+        format.height = src.Height();
+        format.stride = (int32_t)(src.Width() * 4);
+
+        FrameRef out = pool_.Acquire(format);
+        out->SetTimestamp(src.Timestamp());
+
+        TargetImage dst = {};
+        dst.data = out->Data();
+        dst.stride = out->Stride();
+        const SourceImage image = MakeSourceImage(PLANE_LAYOUT_PACKED,
+            src.Data(), src.Stride(), src.Height());
+        FindImageTransform(FormatYUY2::fourcc)->xform(dst, image, src.Width(), src.Height());
+
+        *frame = std::move(out);
+        return true;
+    }
+
+private:
+    FramePool pool_;
+};
+
+class HashSink : public PipelineStage
+{
+public:
+    const char* Name() const override { return "sink"; }
+
+    bool Process(FrameRef* frame) override
+    {
+        if (hashes_.size() < kPipelineFrames) {
+            const Frame& f = **frame;
+            hashes_ += Hash(f.Data(), (size_t)f.Stride() * f.Height());
+        }
+
+        return true;
+    }
+
+    std::string Checksum() const
+    {
+        return Hash((const uint8_t*)hashes_.data(), hashes_.size());
+    }
+
+private:
+    std::string hashes_;
+};
+
+static Result RunPipeline(const FrameSize& size, double min_time)
+{
+    const uint32_t w = size.width;
+    const uint32_t h = size.height;
+
+    std::vector<uint8_t> source((size_t)w * h * 2);
+    FillRandom(&source, w * h);
+
+    ConvertStage convert;
+    ComposeStage compose;
+    HashSink sink;
+
+    ComposeSettings settings = {};
+    settings.width = w / 2;
+    settings.height = h / 2;
+    settings.mask = true;
+    settings.shape = MASK_SHAPE_CIRCLE;
+    settings.opacity = 0xFF;
+    compose.SetSettings(settings);
+
+    StageConfig config;
+    config.queue_depth = 2;
+    config.drop = DROP_NONE;
+
+    Pipeline pipeline;
+    pipeline.AddStage(&convert, config);
+    pipeline.AddStage(&compose, config);
+    pipeline.AddStage(&sink, config);
+    pipeline.Start();
+
+    FramePool pool;
+    FrameFormat format = {};
+    format.fourcc = FormatYUY2::fourcc;
+    format.width = w;
+    format.height = h;
+    format.stride = (int32_t)(w * 2);
+    int64_t timestamp = 0;
+
+    auto run = [&]() {
+        for (uint32_t i = 0; i < kPipelineFrames; ++i) {
+            FrameRef frame = pool.Acquire(format);
+            memcpy(frame->Data(), source.data(), source.size());
+            frame->Data()[i] = (uint8_t)(timestamp & 0xFF);
+            frame->SetTimestamp(timestamp);
+            TRACE_SCOPE_ID("Push", timestamp++);
+            pipeline.Push(std::move(frame));
+        }
+
+        pipeline.Flush();
+    };
+
+    double seconds = 0;
+    uint64_t cycles = 0;
+    Measure(run, min_time, &seconds, &cycles);
+    pipeline.Stop();
+
+    const double pixels = (double)w * h * kPipelineFrames;
+    Result r;
+    r.out_key = "pipeline/" + SizeName(size);
+    r.key = "pipeline.c/" + SizeName(size);
+    r.mpix_per_s = pixels / seconds / 1e6;
+    r.cycles_per_pixel = (double)cycles / pixels;
+    r.checksum = sink.Checksum();
+    return r;
+}
+
+typedef std::function<RawFrame(uint64_t index)> RawFrameFn;
+
+// The capture path without a camera: NV12 frames from |next| are
+// converted on the calling thread as DrawDevice does and then composed
+// and hashed like above.
+static Result RunRawPipeline(const std::string& name, const std::string& out_name,
+    const RawFrameFn& next, const FrameSize& size, double min_time)
+{
+    const ImageTransformEntry* convert = FindImageTransform(FormatNV12::fourcc);
+
+    ComposeStage compose;
+    HashSink sink;
+
+    ComposeSettings settings = {};
+    settings.width = size.width / 2;
+    settings.height = size.height / 2;
+    settings.mask = true;
+    settings.shape = MASK_SHAPE_CIRCLE;
+    settings.opacity = 0xFF;
+    compose.SetSettings(settings);
+
+    StageConfig config;
+    config.queue_depth = 2;
+    config.drop = DROP_NONE;
+
+    Pipeline pipeline;
+    pipeline.AddStage(&compose, config);
+    pipeline.AddStage(&sink, config);
+    pipeline.Start();
+
+    FramePool pool;
+    FrameFormat bgra = {};
+    bgra.fourcc = kFrameFormatBgra;
+    bgra.width = size.width;
+    bgra.height = size.height;
+    bgra.stride = (int32_t)(size.width * 4);
+    uint64_t index = 0;
+
+    auto run = [&]() {
+        for (uint32_t i = 0; i < kPipelineFrames; ++i) {
+            const RawFrame raw = next(index++);
+            FrameRef frame = pool.Acquire(bgra);
+            frame->SetTimestamp(raw.timestamp);
+
+            TargetImage dst = {};
+            dst.data = frame->Data();
+            dst.stride = frame->Stride();
+            const SourceImage src = MakeSourceImage(convert->layout,
+                raw.data, raw.stride, raw.format.height);
+            convert->xform(dst, src, raw.format.width, raw.format.height);
+            pipeline.Push(std::move(frame));
+        }
+
+        pipeline.Flush();
+    };
+
+    double seconds = 0;
+    uint64_t cycles = 0;
+    Measure(run, min_time, &seconds, &cycles);
+    pipeline.Stop();
+
+    const double pixels = (double)size.width * size.height * kPipelineFrames;
+    Result r;
+    r.out_key = out_name + "/" + SizeName(size);
+    r.key = name + ".c/" + SizeName(size);
+    r.mpix_per_s = pixels / seconds / 1e6;
+    r.cycles_per_pixel = (double)cycles / pixels;
+    r.checksum = sink.Checksum();
+    return r;
+}
+
+static CaptureFormat SourceFormat(const FrameSize& size)
+{
+    CaptureFormat format = {};
+    format.fourcc = FormatNV12::fourcc;
+    format.width = size.width;
+    format.height = size.height;
+    return format;
+}
+
+static Result RunSourcePipeline(TestPattern pattern, const FrameSize& size, double min_time)
+{
+    TestPatternSource source(pattern, SourceFormat(size), false);
+    const std::string name = std::string("source-") + TestPatternName(pattern);
+    return RunRawPipeline(name, name, [&](uint64_t index) { return source.Render(index); },
+        size, min_time);
+}
+
+// The same with the first frames of the color bars recorded and read back
+// from the mapped file, which must give the output of the live source.
+static bool RunReplayPipeline(const FrameSize& size, double min_time, Result* result)
+{
+    const char* dir = getenv("TMPDIR");
+    if (!dir)
+        dir = getenv("TEMP");
+
+    const std::string path = std::string(dir ? dir : ".") + "/kernel_bench_replay.wcr";
+    TestPatternSource source(TEST_PATTERN_COLOR_BARS, SourceFormat(size), false);
+    RecordingInfo info = {};
+    info.format = source.Format();
+
+    FrameRecorder recorder;
+    if (!recorder.Open(path, info))
+        return false;
+
+    for (uint64_t n = 0; n < kPipelineFrames; ) {
+        if (recorder.Write(source.Render(n)))
+            ++n;
+        else
+            std::this_thread::yield();
+    }
+
+    RecordingReader reader;
+    bool ok = recorder.Close() && reader.Open(path) && reader.FrameNum() == kPipelineFrames;
+    if (ok) {
+        *result = RunRawPipeline("replay", std::string("source-")
+            + TestPatternName(TEST_PATTERN_COLOR_BARS),
+            [&](uint64_t index) { return reader.Frame((size_t)(index % kPipelineFrames)); },
+            size, min_time);
+    }
+
+    reader.Close();
+    remove(path.c_str());
+    return ok;
+}
+
+struct PngTier {
+    const char* tier;
+    PNG_FILTER_ROW_FN fn;
+};
+
+static std::vector<PngTier> ListPngTiers()
+{
+    std::vector<PngTier> tiers;
+    tiers.push_back({ "c", PngFilterRow_C });
+#if CPU_X86
+    const CpuFeatures& cpu = GetCpuFeatures();
+    if (cpu.sse2)
+        tiers.push_back({ "sse2", PngFilterRow_SSE2 });
+
+    if (cpu.avx2)
+        tiers.push_back({ "avx2", PngFilterRow_AVX2 });
+#endif
+    return tiers;
+}
+
+// A snapshot of the zone plate, filtered and deflated on all CPUs. Random
+// pixels would not compress, so this is closer to a camera frame.
+static Result RunPng(const PngTier& t, const FrameSize& size, WorkerPool* pool,
+    double min_time)
+{
+    TestPatternSource source(TEST_PATTERN_ZONE_PLATE, SourceFormat(size), false);
+    const RawFrame raw = source.Render(0);
+    const ImageTransformEntry* convert = FindImageTransform(raw.format.fourcc);
+
+    std::vector<uint8_t> frame((size_t)size.width * size.height * 4);
+    TargetImage dst = {};
+    dst.data = frame.data();
+    dst.stride = (int32_t)(size.width * 4);
+    convert->xform(dst, MakeSourceImage(convert->layout, raw.data, raw.stride, raw.format.height),
+        raw.format.width, raw.format.height);
+
+    BgraImage image = {};
+    image.data = frame.data();
+    image.stride = dst.stride;
+    image.width = size.width;
+    image.height = size.height;
+
+    std::vector<uint8_t> png;
+    EncodePng(image, pool, &png, t.fn);
+
+    Result r;
+    r.out_key = "png/" + SizeName(size);
+    r.key = std::string("png.") + t.tier + "/" + SizeName(size);
+    r.checksum = Hash(png.data(), png.size());
+
+    double seconds = 0;
+    uint64_t cycles = 0;
+    Measure([&]() { EncodePng(image, pool, &png, t.fn); }, min_time, &seconds, &cycles);
+
+    const double pixels = (double)size.width * size.height;
+    r.mpix_per_s = pixels / seconds / 1e6;
+    r.cycles_per_pixel = (double)cycles / pixels;
+    return r;
+}
+
+// Delta coding of one zone plate frame against the one before, as the
+// instant replay ring does; the checksum is of the coded bytes, and a
+// frame that does not decode back gives a checksum of its own.
+static Result RunRingDelta(const FrameSize& size, double min_time)
+{
+    TestPatternSource source(TEST_PATTERN_ZONE_PLATE, SourceFormat(size), false);
+    const RawFrame first = source.Render(0);
+    const std::vector<uint8_t> ref(first.data, first.data + first.size);
+    const RawFrame raw = source.Render(1);
+
+    std::vector<uint8_t> coded(DeltaEncodeBound(raw.size));
+    coded.resize(DeltaEncode(raw.data, ref.data(), raw.size, coded.data()));
+
+    std::vector<uint8_t> decoded(raw.size);
+    const bool same = DeltaDecode(coded.data(), coded.size(), ref.data(), raw.size, decoded.data())
+        && memcmp(decoded.data(), raw.data, raw.size) == 0;
+
+    Result r;
+    r.out_key = "ring-delta/" + SizeName(size);
+    r.key = "ring-delta.c/" + SizeName(size);
+    r.checksum = same ? Hash(coded.data(), coded.size()) : "decode-mismatch";
+
+    double seconds = 0;
+    uint64_t cycles = 0;
+    std::vector<uint8_t> scratch(DeltaEncodeBound(raw.size));
+    Measure([&]() { DeltaEncode(raw.data, ref.data(), raw.size, scratch.data()); },
+        min_time, &seconds, &cycles);
+
+    const double pixels = (double)size.width * size.height;
+    r.mpix_per_s = pixels / seconds / 1e6;
+    r.cycles_per_pixel = (double)cycles / pixels;
+    return r;
+}
+
+// The corpus make_corpus.py wrote: each chroma sampling, gray, restart
+// intervals by blocks and by rows, a frame without DHT as cameras send
+// them, and a damaged one whose coefficients all sit at the clamps. All
+// are 100x75, which is no whole number of MCUs.
+static const char* const kJpegNames[] = {
+    "444", "422", "420", "gray", "420-rst", "422-rst", "422-nodht", "gray-corrupt",
+};
+
+static const uint32_t kJpegScales[] = { 1, 2, 4, 8 };
+
+static bool ReadFile(const std::string& path, std::vector<uint8_t>* data)
+{
+    std::ifstream file(path, std::ios::binary);
+    data->assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+    return file.good() || file.eof();
+}
+
+// Decoded on all CPUs, so that restart intervals go in parallel; a frame
+// that does not decode gives a checksum of its own.
+static Result RunJpeg(const std::string& name, const std::vector<uint8_t>& jpeg,
+    uint32_t scale_denom, WorkerPool* pool, double min_time)
+{
+    JpegDecoder decoder(pool);
+    uint32_t width = 0;
+    uint32_t height = 0;
+    const bool parsed = decoder.ReadInfo(jpeg.data(), jpeg.size(), &width, &height);
+    const uint32_t out_width = JpegDecoder::ScaledSize(width, scale_denom);
+    const uint32_t out_height = JpegDecoder::ScaledSize(height, scale_denom);
+
+    std::vector<uint8_t> frame((size_t)out_width * out_height * 4);
+    TargetImage dst = {};
+    dst.data = frame.data();
+    dst.stride = (int32_t)(out_width * 4);
+    const bool decoded = parsed
+        && decoder.Decode(jpeg.data(), jpeg.size(), scale_denom, dst);
+
+    const std::string scale = "1:" + std::to_string(scale_denom);
+    Result r;
+    r.out_key = "jpeg-" + name + "/" + scale;
+    r.key = "jpeg-" + name + ".c/" + scale;
+    r.checksum = decoded ? Hash(frame.data(), frame.size()) : "decode-failed";
+
+    double seconds = 0;
+    uint64_t cycles = 0;
+    Measure([&]() { decoder.Decode(jpeg.data(), jpeg.size(), scale_denom, dst); },
+        min_time, &seconds, &cycles);
+
+    const double pixels = (double)width * height;
+    r.mpix_per_s = pixels / seconds / 1e6;
+    r.cycles_per_pixel = (double)cycles / pixels;
+    return r;
+}
+
+// Reads the file --write-baseline produces: one "key": value per line,
+// in a "checksums" and a "mpix_per_s" object.
+static bool LoadBaseline(const std::string& path, Baseline* baseline)
+{
+    FILE* f = fopen(path.c_str(), "r");
+    if (!f)
+        return false;
+
+    std::string section;
+    char line[512];
+    while (fgets(line, sizeof(line), f)) {
+        char key[256];
+        char value[256];
+        if (sscanf(line, " \"%255[^\"]\" : {", key) == 1 && strchr(line, '{')) {
+            section = key;
+            continue;
+        }
+
+        if (sscanf(line, " \"%255[^\"]\" : %255[^,\n]", key, value) != 2)
+            continue;
+
+        if (section == "checksums") {
+            std::string v = value;
+            v.erase(std::remove(v.begin(), v.end(), '"'), v.end());
+            baseline->checksums[key] = v;
+        } else if (section == "mpix_per_s") {
+            baseline->mpix_per_s[key] = atof(value);
+        }
+    }
+
+    fclose(f);
+    return true;
+}
+
+static bool WriteBaseline(const std::string& path, const std::vector<Result>& results)
+{
+    FILE* f = fopen(path.c_str(), "w");
+    if (!f)
+        return false;
+
+    std::map<std::string, std::string> checksums;
+    for (const Result& r : results)
+        checksums[r.out_key] = r.checksum;
+
+    fprintf(f, "{\n  \"checksums\": {\n");
+    size_t i = 0;
+    for (const auto& c : checksums) {
+        fprintf(f, "    \"%s\": \"%s\"%s\n", c.first.c_str(), c.second.c_str(),
+            ++i < checksums.size() ? "," : "");
+    }
+
+    fprintf(f, "  },\n  \"mpix_per_s\": {\n");
+    for (i = 0; i < results.size(); ++i) {
+        fprintf(f, "    \"%s\": %.1f%s\n", results[i].key.c_str(), results[i].mpix_per_s,
+            i + 1 < results.size() ? "," : "");
+    }
+
+    fprintf(f, "  }\n}\n");
+    fclose(f);
+    return true;
+}
+
+static void Usage()
+{
+    printf(
+        "usage: kernel_bench [options]\n"
+        "  --baseline FILE        golden checksums and throughput (default %s)\n"
+        "  --write-baseline FILE  record this run as the baseline\n"
+        "  --tolerance PCT        allowed throughput drop, default 10\n"
+        "  --min-time SEC         time spent per case, default 0.2\n"
+        "  --filter TEXT          only cases whose name contains TEXT\n"
+        "  --trace FILE           write a Chrome trace of the pipeline cases\n"
+        "  --no-perf              check checksums only\n",
+        BENCH_BASELINE);
+}
+
+static bool ParseOptions(int argc, char** argv, Options* opt)
+{
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        const bool has_value = i + 1 < argc;
+        if (arg == "--baseline" && has_value)
+            opt->baseline = argv[++i];
+        else if (arg == "--write-baseline" && has_value)
+            opt->write_baseline = argv[++i];
+        else if (arg == "--tolerance" && has_value)
+            opt->tolerance = atof(argv[++i]);
+        else if (arg == "--min-time" && has_value)
+            opt->min_time = atof(argv[++i]);
+        else if (arg == "--filter" && has_value)
+            opt->filter = argv[++i];
+        else if (arg == "--trace" && has_value)
+            opt->trace = argv[++i];
+        else if (arg == "--no-perf")
+            opt->check_perf = false;
+        else
+            return false;
+    }
+
+    return true;
+}
+
+int main(int argc, char** argv)
+{
+    Options opt;
+    if (!ParseOptions(argc, argv, &opt)) {
+        Usage();
+        return 2;
+    }
+
+    Baseline baseline;
+    const bool writing = !opt.write_baseline.empty();
+    if (!writing && !LoadBaseline(opt.baseline, &baseline))
+        printf("no baseline at %s, reporting only\n", opt.baseline.c_str());
+
+    if (!opt.trace.empty()) {
+        Tracer::SetThreadName("source");
+        Tracer::Start();
+    }
+
+    const CpuFeatures& cpu = GetCpuFeatures();
+    printf("cpu: sse2=%d sse41=%d avx2=%d\n", cpu.sse2, cpu.sse41, cpu.avx2);
+    printf("%-28s %10s %10s %9s  %s\n", "case", "MPix/s", "cyc/px", "baseline", "output");
+
+    std::vector<Result> results;
+    int failures = 0;
+
+    auto report = [&](const Result& r) {
+        results.push_back(r);
+
+        std::string out_status = "new";
+        auto c = baseline.checksums.find(r.out_key);
+        if (c != baseline.checksums.end()) {
+            out_status = c->second == r.checksum ? "ok" : "MISMATCH";
+            if (c->second != r.checksum)
+                ++failures;
+        }
+
+        char perf_status[32] = "-";
+        auto p = baseline.mpix_per_s.find(r.key);
+        if (p != baseline.mpix_per_s.end() && p->second > 0) {
+            const double change = (r.mpix_per_s / p->second - 1.0) * 100.0;
+            snprintf(perf_status, sizeof(perf_status), "%+.1f%%", change);
+            if (opt.check_perf && change < -opt.tolerance) {
+                strcat(perf_status, "!");
+                ++failures;
+            }
+        }
+
+        printf("%-28s %10.1f %10.2f %9s  %s\n", r.key.c_str(), r.mpix_per_s,
+            r.cycles_per_pixel, perf_status, out_status.c_str());
+        fflush(stdout);
+    };
+
+    const std::vector<Kernel> kernels = ListKernels();
+    const std::vector<MaskTier> mask_tiers = ListMaskTiers();
+    const std::vector<PngTier> png_tiers = ListPngTiers();
+    WorkerPool pool;
+    for (const FrameSize& size : kSizes) {
+        for (const Kernel& k : kernels) {
+            const std::string key = k.name + "." + k.tier + "/" + SizeName(size);
+            if (key.find(opt.filter) != std::string::npos)
+                report(RunKernel(k, size, opt.min_time));
+        }
+
+        for (const MaskTier& t : mask_tiers) {
+            const std::string key = std::string("mask.") + t.tier + "/" + SizeName(size);
+            if (key.find(opt.filter) != std::string::npos)
+                report(RunMask(t, size, opt.min_time));
+        }
+
+        for (int full = 0; full < 2; ++full) {
+            for (const MaskTier& t : mask_tiers) {
+                const std::string key = std::string(kSpanMaskNames[full]) + "."
+                    + t.tier + "/" + SizeName(size);
+                if (key.find(opt.filter) != std::string::npos)
+                    report(RunSpanMask(t, size, full != 0, opt.min_time));
+            }
+        }
+
+        for (int shape = MASK_SHAPE_CIRCLE; shape <= MASK_SHAPE_ROUNDED_RECT; ++shape) {
+            const std::string key = std::string("shape-") + kShapeNames[shape]
+                + ".c/" + SizeName(size);
+            if (key.find(opt.filter) != std::string::npos)
+                report(RunShapeMask((MaskShape)shape, size, opt.min_time));
+        }
+
+        if (std::string("pipeline.c/" + SizeName(size)).find(opt.filter) != std::string::npos)
+            report(RunPipeline(size, opt.min_time));
+
+        for (int pattern = 0; pattern < TEST_PATTERN_NUM; ++pattern) {
+            std::string key = std::string("source-") + TestPatternName((TestPattern)pattern)
+                + ".c/" + SizeName(size);
+            if (key.find(opt.filter) != std::string::npos)
+                report(RunSourcePipeline((TestPattern)pattern, size, opt.min_time));
+        }
+
+        if (std::string("replay.c/" + SizeName(size)).find(opt.filter) != std::string::npos) {
+            Result r;
+            if (RunReplayPipeline(size, opt.min_time, &r)) {
+                report(r);
+            } else {
+                printf("replay.c/%s: cannot record or read back\n", SizeName(size).c_str());
+                ++failures;
+            }
+        }
+
+        if (std::string("ring-delta.c/" + SizeName(size)).find(opt.filter) != std::string::npos)
+            report(RunRingDelta(size, opt.min_time));
+
+        for (const PngTier& t : png_tiers) {
+            const std::string key = std::string("png.") + t.tier + "/" + SizeName(size);
+            if (key.find(opt.filter) != std::string::npos)
+                report(RunPng(t, size, &pool, opt.min_time));
+        }
+
+        for (int percent : kScalePercents) {
+            for (int simd = 0; simd < 2; ++simd) {
+                if (simd && !cpu.avx2)
+                    continue;
+
+                const std::string key = "scale" + std::to_string(percent)
+                    + (simd ? ".avx2/" : ".c/") + SizeName(size);
+                if (key.find(opt.filter) != std::string::npos)
+                    report(RunScale(size, percent, simd != 0, opt.min_time));
+            }
+        }
+
+        for (const YuvScaleCase& c : kYuvScaleCases) {
+            for (int percent : kYuvScalePercents) {
+                for (int simd = 0; simd < 2; ++simd) {
+                    if (simd && !cpu.avx2)
+                        continue;
+
+                    const std::string key = std::string(c.name) + "-scale"
+                        + std::to_string(percent) + (simd ? ".avx2/" : ".c/") + SizeName(size);
+                    if (key.find(opt.filter) != std::string::npos)
+                        report(RunYuvScale(c, size, percent, simd != 0, opt.min_time));
+                }
+            }
+        }
+    }
+
+    for (const char* name : kJpegNames) {
+        std::vector<uint8_t> jpeg;
+        const std::string path = std::string(BENCH_JPEG_DIR) + "/" + name + ".jpg";
+        bool read = false;
+        for (uint32_t scale_denom : kJpegScales) {
+            const std::string key = std::string("jpeg-") + name + ".c/1:"
+                + std::to_string(scale_denom);
+            if (key.find(opt.filter) == std::string::npos)
+                continue;
+
+            if (!read && !(read = ReadFile(path, &jpeg) && jpeg.size())) {
+                printf("%s: cannot read %s\n", key.c_str(), path.c_str());
+                ++failures;
+                break;
+            }
+
+            report(RunJpeg(name, jpeg, scale_denom, &pool, opt.min_time));
+        }
+    }
+
+    if (!opt.trace.empty()) {
+        Tracer::Stop();
+        std::ofstream file(opt.trace);
+        Tracer::WriteJson(&file);
+        if (!file) {
+            printf("cannot write %s\n", opt.trace.c_str());
+            return 1;
+        }
+
+        printf("trace written to %s\n", opt.trace.c_str());
+    }
+
+    if (writing) {
+        if (!WriteBaseline(opt.write_baseline, results)) {
+            printf("cannot write %s\n", opt.write_baseline.c_str());
+            return 1;
+        }
+
+        printf("baseline written to %s\n", opt.write_baseline.c_str());
+        return 0;
+    }
+
+    if (failures)
+        printf("%d case(s) failed\n", failures);
+
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,336 @@
+#include "capability_cache.h"
+#include <stdio.h>
+#include <string.h>
+#include <chrono>
+#include "file_util.h"
+
+static const char kCacheMagic[8] = { 'W', 'C', 'A', 'M', 'C', 'A', 'P', 'S' };
+static const uint32_t kCacheVersion = 1;
+
+// Files much larger than kMaxDevices devices could make are not read.
+static const size_t kMaxFileBytes = 1 << 20;
+static const uint32_t kMaxLinkBytes = 4096;
+static const uint32_t kMaxModes = 4096;
+
+static const uint32_t kFlagPinned = 1;
+
+struct CacheHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t device_num;
+    uint32_t bytes;  // after the header
+    uint32_t crc;    // of those bytes
+};
+
+static_assert(sizeof(CacheHeader) == 24, "cache header size");
+
+template <typename T>
+static void Append(std::vector<uint8_t>* out, const T& v)
+{
+    const uint8_t* p = (const uint8_t*)&v;
+    out->insert(out->end(), p, p + sizeof(v));
+}
+
+// Reads stop at the end of the data and fail from then on.
+class CacheReader
+{
+public:
+    CacheReader(const uint8_t* data, size_t size) : p_(data), end_(data + size) {}
+
+    template <typename T>
+    bool Get(T* v)
+    {
+        return Get(v, sizeof(*v));
+    }
+
+    bool Get(void* v, size_t n)
+    {
+        if ((size_t)(end_ - p_) < n)
+            return false;
+
+        memcpy(v, p_, n);
+        p_ += n;
+        return true;
+    }
+
+    bool AtEnd() const
+    {
+        return p_ == end_;
+    }
+
+private:
+    const uint8_t* p_;
+    const uint8_t* end_;
+};
+
+static bool Lists(const std::vector<CaptureFormat>& modes, const CaptureFormat& mode)
+{
+    for (const CaptureFormat& m : modes) {
+        if (SameMode(m, mode))
+            return true;
+    }
+
+    return false;
+}
+
+static bool SameModes(const std::vector<CaptureFormat>& a, const std::vector<CaptureFormat>& b)
+{
+    if (a.size() != b.size())
+        return false;
+
+    for (size_t i = 0; i < a.size(); ++i) {
+        if (!SameMode(a[i], b[i]))
+            return false;
+    }
+
+    return true;
+}
+
+static bool SameNeeds(const ModeNeeds& a, const ModeNeeds& b)
+{
+    return a.width == b.width && a.height == b.height && a.cores == b.cores;
+}
+
+// Modes the device does not list are dropped; a device with no modes
+// cached yet keeps its pin.
+static void DropUnlisted(DeviceCaps* caps)
+{
+    if (caps->modes.empty())
+        return;
+
+    if (caps->chosen.width && !Lists(caps->modes, caps->chosen))
+        caps->chosen = {};
+
+    if (caps->pinned && !Lists(caps->modes, caps->pin)) {
+        caps->pinned = false;
+        caps->pin = {};
+    }
+}
+
+uint64_t CapabilityCache::Now()
+{
+    return (uint64_t)std::chrono::duration_cast<std::chrono::seconds>(
+        std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+bool CapabilityCache::Load(const std::string& path)
+{
+    std::vector<uint8_t> data;
+    FILE* file = OpenFileForRead(path);
+    if (file) {
+        uint8_t buf[4096];
+        size_t n = 0;
+        while (data.size() <= kMaxFileBytes && (n = fread(buf, 1, sizeof(buf), file)) > 0)
+            data.insert(data.end(), buf, buf + n);
+
+        fclose(file);
+    }
+
+    if (!file || data.size() > kMaxFileBytes || !Parse(data.data(), data.size())) {
+        std::unique_lock<std::mutex> lock(mtx_);
+        devices_.clear();
+        return false;
+    }
+
+    return true;
+}
+
+// Written beside |path| and then moved over it, so that a save that is
+// cut short leaves the file saved before.
+bool CapabilityCache::Save(const std::string& path) const
+{
+    std::unique_lock<std::mutex> lock(save_mtx_);
+    const std::vector<uint8_t> data = Serialize();
+    const std::string tmp_path = path + ".tmp";
+    FILE* file = CreateFileForWrite(tmp_path);
+    if (!file)
+        return false;
+
+    const bool ok = fwrite(data.data(), 1, data.size(), file) == data.size();
+    return (fclose(file) == 0) && ok && MoveFileOver(tmp_path, path);
+}
+
+std::vector<uint8_t> CapabilityCache::Serialize() const
+{
+    std::unique_lock<std::mutex> lock(mtx_);
+    std::vector<uint8_t> out(sizeof(CacheHeader));
+    for (const auto& device : devices_) {
+        const DeviceCaps& caps = device.second;
+        Append(&out, (uint32_t)device.first.size());
+        out.insert(out.end(), device.first.begin(), device.first.end());
+        Append(&out, caps.last_used);
+        Append(&out, caps.pinned ? kFlagPinned : 0u);
+        Append(&out, caps.needs.width);
+        Append(&out, caps.needs.height);
+        Append(&out, caps.needs.cores);
+        Append(&out, caps.chosen);
+        Append(&out, caps.pin);
+        Append(&out, (uint32_t)caps.modes.size());
+        for (const CaptureFormat& mode : caps.modes)
+            Append(&out, mode);
+    }
+
+    CacheHeader header = {};
+    memcpy(header.magic, kCacheMagic, sizeof(header.magic));
+    header.version = kCacheVersion;
+    header.device_num = (uint32_t)devices_.size();
+    header.bytes = (uint32_t)(out.size() - sizeof(header));
+    header.crc = Crc32(0, out.data() + sizeof(header), header.bytes);
+    memcpy(out.data(), &header, sizeof(header));
+    return out;
+}
+
+// All or nothing: the cache is only replaced by a file that reads whole.
+bool CapabilityCache::Parse(const uint8_t* data, size_t size)
+{
+    CacheHeader header = {};
+    CacheReader reader(data, size);
+    if (!reader.Get(&header) || memcmp(header.magic, kCacheMagic, sizeof(header.magic))
+        || header.version != kCacheVersion || header.bytes != size - sizeof(header)
+        || header.crc != Crc32(0, data + sizeof(header), header.bytes))
+        return false;
+
+    std::map<std::string, DeviceCaps> devices;
+    for (uint32_t i = 0; i < header.device_num; ++i) {
+        uint32_t link_bytes = 0;
+        if (!reader.Get(&link_bytes) || link_bytes > kMaxLinkBytes)
+            return false;
+
+        std::string link(link_bytes, '\0');
+        DeviceCaps caps = {};
+        uint32_t flags = 0;
+        uint32_t mode_num = 0;
+        if (!reader.Get(&link[0], link_bytes) || !reader.Get(&caps.last_used)
+            || !reader.Get(&flags) || !reader.Get(&caps.needs.width)
+            || !reader.Get(&caps.needs.height) || !reader.Get(&caps.needs.cores)
+            || !reader.Get(&caps.chosen) || !reader.Get(&caps.pin)
+            || !reader.Get(&mode_num) || mode_num > kMaxModes)
+            return false;
+
+        caps.pinned = (flags & kFlagPinned) != 0;
+        caps.modes.resize(mode_num);
+        for (CaptureFormat& mode : caps.modes) {
+            if (!reader.Get(&mode))
+                return false;
+        }
+
+        DropUnlisted(&caps);
+        devices[link] = caps;
+    }
+
+    if (!reader.AtEnd())
+        return false;
+
+    std::unique_lock<std::mutex> lock(mtx_);
+    devices_.swap(devices);
+    return true;
+}
+
+bool CapabilityCache::Find(const std::string& link, DeviceCaps* caps) const
+{
+    std::unique_lock<std::mutex> lock(mtx_);
+    auto it = devices_.find(link);
+    if (it == devices_.end())
+        return false;
+
+    *caps = it->second;
+    return true;
+}
+
+bool CapabilityCache::CachedMode(const std::string& link, const ModeNeeds& needs,
+    CaptureFormat* mode, const std::function<double(uint32_t)>& rate) const
+{
+    DeviceCaps caps = {};
+    if (!Find(link, &caps))
+        return false;
+
+    if (caps.pinned) {
+        *mode = caps.pin;
+        return true;
+    }
+
+    if (caps.chosen.width && SameNeeds(caps.needs, needs)) {
+        *mode = caps.chosen;
+        return true;
+    }
+
+    const std::vector<size_t> order = RankModes(caps.modes, needs, rate);
+    if (order.empty())
+        return false;
+
+    *mode = caps.modes[order[0]];
+    return true;
+}
+
+void CapabilityCache::Put(const std::string& link, const std::vector<CaptureFormat>& modes,
+    const CaptureFormat& chosen, const ModeNeeds& needs, uint64_t now)
+{
+    std::unique_lock<std::mutex> lock(mtx_);
+    DeviceCaps& caps = devices_[link];
+    caps.modes = modes;
+    caps.chosen = chosen;
+    caps.needs = needs;
+    caps.last_used = now;
+    DropUnlisted(&caps);
+    Prune(now);
+}
+
+bool CapabilityCache::Validate(const std::string& link, const std::vector<CaptureFormat>& modes,
+    uint64_t now)
+{
+    std::unique_lock<std::mutex> lock(mtx_);
+    DeviceCaps& caps = devices_[link];
+    caps.last_used = now;
+    const bool same = SameModes(caps.modes, modes);
+    if (!same) {
+        caps.modes = modes;
+        DropUnlisted(&caps);
+    }
+
+    Prune(now);
+    return same;
+}
+
+void CapabilityCache::Pin(const std::string& link, const CaptureFormat* mode, uint64_t now)
+{
+    std::unique_lock<std::mutex> lock(mtx_);
+    DeviceCaps& caps = devices_[link];
+    caps.pinned = mode != nullptr;
+    caps.pin = mode ? *mode : CaptureFormat();
+    caps.last_used = now;
+    Prune(now);
+}
+
+void CapabilityCache::Remove(const std::string& link)
+{
+    std::unique_lock<std::mutex> lock(mtx_);
+    devices_.erase(link);
+}
+
+size_t CapabilityCache::Size() const
+{
+    std::unique_lock<std::mutex> lock(mtx_);
+    return devices_.size();
+}
+
+// Clocks may go back; only what is older than kMaxAge by the current
+// clock goes for age.
+void CapabilityCache::Prune(uint64_t now)
+{
+    for (auto it = devices_.begin(); it != devices_.end();) {
+        if (it->second.last_used + kMaxAge < now)
+            it = devices_.erase(it);
+        else
+            ++it;
+    }
+
+    while (devices_.size() > kMaxDevices) {
+        auto oldest = devices_.begin();
+        for (auto it = devices_.begin(); it != devices_.end(); ++it) {
+            if (it->second.last_used < oldest->second.last_used)
+                oldest = it;
+        }
+
+        devices_.erase(oldest);
+    }
+}
@@ -0,0 +1,73 @@
+#pragma once
+#include <map>
+#include <mutex>
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include "capture_mode.h"
+
+// What opening a device found out about it, so that the next time it is
+// opened straight away in a mode, without listing the modes first.
+struct DeviceCaps {
+    std::vector<CaptureFormat> modes;  // that can be shown, as listed
+    CaptureFormat chosen;              // opened in last; zero if none
+    ModeNeeds needs;                   // that |chosen| was picked for
+    bool pinned;
+    CaptureFormat pin;
+    uint64_t last_used;                // seconds since the epoch
+};
+
+// The devices seen lately by symbolic link, kept in a small file.
+//
+// The file is a 24-byte header with the number of devices, the size and
+// the CRC-32 of the rest, then one record per device. A file that is
+// damaged, cut short or of another version loads as an empty cache, and
+// an entry whose modes the device no longer lists the same way is
+// replaced by what it lists; a mode that went with them is dropped.
+// Devices unused for kMaxAge, and the least recently used beyond
+// kMaxDevices, are forgotten. Any thread.
+class CapabilityCache
+{
+public:
+    static const size_t kMaxDevices = 32;
+    static const uint64_t kMaxAge = 90 * 24 * 3600;
+
+    static uint64_t Now();
+
+    // |path| is UTF-8. A cache that fails to load is left empty; saves
+    // are one at a time and replace the file in one step.
+    bool Load(const std::string& path);
+    bool Save(const std::string& path) const;
+
+    std::vector<uint8_t> Serialize() const;
+    bool Parse(const uint8_t* data, size_t size);
+
+    bool Find(const std::string& link, DeviceCaps* caps) const;
+
+    // The mode to open the device in without listing its modes: the
+    // pinned one, the one chosen last if |needs| are the same, or else
+    // the best of the cached modes. False if the device is not cached.
+    bool CachedMode(const std::string& link, const ModeNeeds& needs, CaptureFormat* mode,
+        const std::function<double(uint32_t)>& rate = ConversionRate) const;
+
+    // Records the modes the device lists and the one picked for |needs|;
+    // a pin that is still listed stays.
+    void Put(const std::string& link, const std::vector<CaptureFormat>& modes,
+        const CaptureFormat& chosen, const ModeNeeds& needs, uint64_t now);
+
+    // Checks the cached modes against those the device lists now. False
+    // if they differ; the entry then takes |modes|.
+    bool Validate(const std::string& link, const std::vector<CaptureFormat>& modes, uint64_t now);
+
+    // Pins |mode|, or with nullptr goes back to picking one.
+    void Pin(const std::string& link, const CaptureFormat* mode, uint64_t now);
+    void Remove(const std::string& link);
+    size_t Size() const;
+
+private:
+    void Prune(uint64_t now);
+
+    mutable std::mutex mtx_;
+    mutable std::mutex save_mtx_;
+    std::map<std::string, DeviceCaps> devices_;
+};
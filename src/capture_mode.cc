@@ -0,0 +1,159 @@
+#include "capture_mode.h"
+#include <math.h>
+#include <stdio.h>
+#include <algorithm>
+#include <chrono>
+#include <map>
+#include <mutex>
+#include "image_transform.h"
+#include "test_pattern.h"
+
+// A guess at the baseline decoder on one core, between what it does on
+// small and on large frames.
+static const double kJpegMpixPerSec = 80;
+
+// Frame rates above this add nothing to a preview, and modes that report
+// no rate are taken to be this.
+static const double kMaxUsefulFps = 60;
+static const double kDefaultFps = 30;
+
+// The load at which a mode gives up as much as halving its frame rate.
+static const double kLoadWeight = 1.0;
+static const double kUnsustainable = 1000;
+
+static double MeasureRate(uint32_t fourcc)
+{
+    if (fourcc == kFourccMjpg)
+        return kJpegMpixPerSec;
+
+    const ImageTransformEntry* entry = FindImageTransform(fourcc);
+    if (!entry || !TestPatternSource::IsSupported(fourcc))
+        return 0;
+
+    CaptureFormat format = {};
+    format.fourcc = fourcc;
+    format.width = 640;
+    format.height = 480;
+    TestPatternSource source(TEST_PATTERN_ZONE_PLATE, format, false);
+    const RawFrame& raw = source.Render(0);
+
+    std::vector<uint8_t> bgra((size_t)format.width * format.height * 4);
+    TargetImage dst = {};
+    dst.data = bgra.data();
+    dst.stride = (int32_t)(format.width * 4);
+    const SourceImage src = MakeSourceImage(entry->layout, raw.data, raw.stride, format.height);
+
+    // The best of a few runs, the first of which warms the caches.
+    double best = 1e30;
+    for (int i = 0; i < 5; ++i) {
+        auto t0 = std::chrono::steady_clock::now();
+        entry->xform(dst, src, format.width, format.height);
+        auto t1 = std::chrono::steady_clock::now();
+        best = std::min(best, std::chrono::duration<double>(t1 - t0).count());
+    }
+
+    return (double)format.width * format.height / std::max(best, 1e-9) / 1e6;
+}
+
+double ConversionRate(uint32_t fourcc)
+{
+    static std::mutex mtx;
+    static std::map<uint32_t, double> rates;
+
+    std::unique_lock<std::mutex> lock(mtx);
+    auto it = rates.find(fourcc);
+    if (it != rates.end())
+        return it->second;
+
+    const double rate = MeasureRate(fourcc);
+    rates[fourcc] = rate;
+    return rate;
+}
+
+static double ModeFps(const CaptureFormat& mode)
+{
+    if (!mode.fps_num || !mode.fps_den)
+        return kDefaultFps;
+
+    return (double)mode.fps_num / mode.fps_den;
+}
+
+double ModeLoad(const CaptureFormat& mode, double rate)
+{
+    if (rate <= 0)
+        return HUGE_VAL;
+
+    return (double)mode.width * mode.height * ModeFps(mode) / (rate * 1e6);
+}
+
+double ScoreMode(const CaptureFormat& mode, double rate, const ModeNeeds& needs)
+{
+    const double pixels = (double)mode.width * mode.height;
+    const double shown = std::min(pixels, (double)needs.width * needs.height);
+    if (shown < 1 || rate <= 0)
+        return -HUGE_VAL;
+
+    const double fps = std::min(ModeFps(mode), kMaxUsefulFps);
+    const double load = ModeLoad(mode, rate);
+    const double cores = needs.cores > 0 ? needs.cores : 1;
+
+    double score = log2(shown) + log2(std::max(fps, 1.0)) - kLoadWeight * load / cores;
+    if (load > cores)
+        score -= kUnsustainable;
+
+    return score;
+}
+
+std::vector<size_t> RankModes(const std::vector<CaptureFormat>& modes, const ModeNeeds& needs,
+    const std::function<double(uint32_t)>& rate)
+{
+    std::vector<size_t> order;
+    std::vector<double> scores(modes.size());
+    for (size_t i = 0; i < modes.size(); ++i) {
+        scores[i] = ScoreMode(modes[i], rate(modes[i].fourcc), needs);
+        if (scores[i] > -HUGE_VAL)
+            order.push_back(i);
+    }
+
+    // Equal scores keep the order the device lists its modes in.
+    std::stable_sort(order.begin(), order.end(),
+        [&](size_t a, size_t b) { return scores[a] > scores[b]; });
+    return order;
+}
+
+std::string ModeName(const CaptureFormat& mode)
+{
+    char fourcc[5] = {};
+    for (int i = 0; i < 4; ++i) {
+        const char c = (char)(mode.fourcc >> (8 * i));
+        fourcc[i] = (c >= 32 && c < 127) ? c : '?';
+    }
+
+    std::string name = std::to_string(mode.width) + "x" + std::to_string(mode.height);
+    if (mode.fps_num && mode.fps_den) {
+        const double fps = (double)mode.fps_num / mode.fps_den;
+        char buf[32];
+        snprintf(buf, sizeof(buf), " %.*f fps", fps == floor(fps) ? 0 : 2, fps);
+        name += buf;
+    }
+
+    // RGB modes are D3DFORMAT values rather than fourccs.
+    if (mode.fourcc == 20)
+        return name + " RGB24";
+
+    if (mode.fourcc == 22)
+        return name + " RGB32";
+
+    return name + " " + fourcc;
+}
+
+bool SameMode(const CaptureFormat& a, const CaptureFormat& b)
+{
+    if (a.fourcc != b.fourcc || a.width != b.width || a.height != b.height)
+        return false;
+
+    if (!a.fps_den || !b.fps_den)
+        return a.fps_num == b.fps_num && a.fps_den == b.fps_den;
+
+    return (uint64_t)a.fps_num * b.fps_den == (uint64_t)b.fps_num * a.fps_den;
+}
@@ -0,0 +1,45 @@
+#pragma once
+#include <functional>
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include "capture_source.h"
+
+// The fourcc of MJPEG modes, which JpegDecoder takes.
+static const uint32_t kFourccMjpg =
+    (uint32_t)'M' | (uint32_t)'J' << 8 | (uint32_t)'P' << 16 | (uint32_t)'G' << 24;
+
+// What the picked mode is for: frames beyond |width| x |height| are not
+// shown at full resolution, and converting them may take |cores| of CPU
+// time.
+struct ModeNeeds {
+    uint32_t width;
+    uint32_t height;
+    double cores;
+};
+
+// MPix/s one core converts frames of |fourcc| to BGRA at, measured once
+// per process on a test pattern; 0 if there is no conversion. MJPEG is an
+// estimate, as there is no frame to time the decoder on.
+double ConversionRate(uint32_t fourcc);
+
+// Cores converting |mode| takes at |rate| MPix/s.
+double ModeLoad(const CaptureFormat& mode, double rate);
+
+// Higher is better. Each doubling of the pixels that are shown or of the
+// frame rate up to 60 fps counts the same; the CPU time the conversion
+// takes counts against it, and modes that need more than |needs| allows
+// rank below all others.
+double ScoreMode(const CaptureFormat& mode, double rate, const ModeNeeds& needs);
+
+// The indices of |modes| best first, leaving out those with no
+// conversion.
+std::vector<size_t> RankModes(const std::vector<CaptureFormat>& modes, const ModeNeeds& needs,
+    const std::function<double(uint32_t)>& rate = ConversionRate);
+
+// "1280x720 30 fps YUY2", for menus and logs.
+std::string ModeName(const CaptureFormat& mode);
+
+// Frame rates are compared as fractions, so 60/2 is 30/1; one with a zero
+// denominator is no fraction and only matches itself.
+bool SameMode(const CaptureFormat& a, const CaptureFormat& b);
@@ -0,0 +1,42 @@
+#pragma once
+#include <functional>
+#include <stddef.h>
+#include <stdint.h>
+
+// What a source delivers: the fourcc or D3DFORMAT value an
+// ImageTransformEntry is keyed by, the frame size and the nominal rate.
+struct CaptureFormat {
+    uint32_t fourcc;
+    uint32_t width;
+    uint32_t height;
+    uint32_t fps_num;
+    uint32_t fps_den;
+};
+
+// One native frame as a camera hands it over, planes back to back as
+// MakeSourceImage expects them. The bytes are only valid during the
+// callback they are passed to.
+struct RawFrame {
+    CaptureFormat format;
+    const uint8_t* data;  // scan line 0
+    int32_t stride;
+    size_t size;          // bytes of all planes, or of the compressed frame
+                          // with no stride; bottom-up frames have a negative
+                          // stride and start size - |stride| before |data|
+    int64_t timestamp;    // 100 ns units
+    uint32_t flags;       // MF_SOURCE_READER_FLAG values, if any
+};
+
+typedef std::function<void(const RawFrame& frame)> RawFrameCallback;
+
+// A frame source that is not a Media Foundation device. Frames arrive one
+// at a time on a thread of the source, like the samples of a source
+// reader; Stop returns once the last callback did.
+class CaptureSource
+{
+public:
+    virtual ~CaptureSource() {}
+    virtual CaptureFormat Format() const = 0;
+    virtual bool Start(const RawFrameCallback& callback) = 0;
+    virtual void Stop() = 0;
+};
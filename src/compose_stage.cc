@@ -0,0 +1,108 @@
+#include "compose_stage.h"
+#include <string.h>
+#include "frame_trace.h"
+
+static BgraImage FrameImage(const FrameRef& frame)
+{
+    BgraImage image = {};
+    image.data = frame->Data();
+    image.stride = frame->Stride();
+    image.width = frame->Width();
+    image.height = frame->Height();
+    return image;
+}
+
+ComposeStage::ComposeStage(WorkerPool* pool)
+    : pool_(pool)
+{
+}
+
+void ComposeStage::SetWorkerPool(WorkerPool* pool)
+{
+    std::unique_lock<std::mutex> lock(mtx_);
+    pool_ = pool;
+}
+
+void ComposeStage::SetSettings(const ComposeSettings& settings)
+{
+    std::unique_lock<std::mutex> lock(mtx_);
+    settings_ = settings;
+}
+
+void ComposeStage::SetStats(FrameStats* stats)
+{
+    stats_ = stats;
+}
+
+void ComposeStage::SetFrameAllocator(FrameAllocator* allocator)
+{
+    frames_.SetAllocator(allocator);
+}
+
+const char* ComposeStage::Name() const
+{
+    return "compose";
+}
+
+bool ComposeStage::Process(FrameRef* frame)
+{
+    ComposeSettings s;
+    WorkerPool* pool = nullptr;
+    {
+        std::unique_lock<std::mutex> lock(mtx_);
+        s = settings_;
+        pool = pool_;
+    }
+
+    if (!*frame || (*frame)->Format().fourcc != kFrameFormatBgra || !s.width || !s.height)
+        return false;
+
+    const bool resize = (*frame)->Width() != s.width || (*frame)->Height() != s.height;
+    if (!resize && !s.mask)
+        return true;
+
+    const int64_t id = (*frame)->Timestamp();
+    uint64_t begin = stats_ ? StatsClockNs() : 0;
+    if (resize || !frame->Unique()) {
+        TRACE_SCOPE_ID("Scale", id);
+        FrameFormat format = {};
+        format.fourcc = kFrameFormatBgra;
+        format.width = s.width;
+        format.height = s.height;
+        format.stride = (int32_t)(s.width * 4);
+
+        FrameRef out = frames_.Acquire(format);
+        out->SetTimestamp((*frame)->Timestamp());
+        out->SetArrival((*frame)->Arrival());
+        const BgraImage src = FrameImage(*frame);
+        const BgraImage dst = FrameImage(out);
+
+        if (resize) {
+            scaler_.Scale(src, dst, pool);
+        } else {
+            for (uint32_t y = 0; y < dst.height; ++y) {
+                memcpy(dst.data + (intptr_t)y * dst.stride,
+                    src.data + (intptr_t)y * src.stride, dst.width * 4);
+            }
+        }
+
+        *frame = std::move(out);
+        if (stats_) {
+            const uint64_t end = StatsClockNs();
+            stats_->Record(STATS_SCALE, begin, end);
+            begin = end;
+        }
+    }
+
+    if (s.mask) {
+        TRACE_SCOPE_ID("BlendMask", id);
+        const BgraImage image = FrameImage(*frame);
+        ApplySpanMask(image.data, image.stride,
+            masks_.Get(s.shape, s.width, s.height), s.opacity);
+
+        if (stats_)
+            stats_->Record(STATS_MASK, begin, StatsClockNs());
+    }
+
+    return true;
+}
@@ -0,0 +1,48 @@
+#pragma once
+#include <mutex>
+#include <stdint.h>
+#include "frame_pool.h"
+#include "frame_stats.h"
+#include "image_scaler.h"
+#include "mask_shape.h"
+#include "pipeline.h"
+
+class WorkerPool;
+
+struct ComposeSettings {
+    uint32_t width;   // display size; 0 drops frames
+    uint32_t height;
+    bool mask;
+    MaskShape shape;
+    uint8_t opacity;  // folded into the alpha when masking
+};
+
+// Brings BGRA frames to the display size and masks them. Frames that
+// need neither pass through untouched, masking alone works in place
+// unless another stage still holds the frame.
+class ComposeStage : public PipelineStage
+{
+public:
+    explicit ComposeStage(WorkerPool* pool = nullptr);
+
+    void SetWorkerPool(WorkerPool* pool);
+    void SetSettings(const ComposeSettings& settings);
+
+    // Scaling and masking are timed into |stats| when given, and frames
+    // that are scaled or copied come from |allocator|; set before the
+    // first frame.
+    void SetStats(FrameStats* stats);
+    void SetFrameAllocator(FrameAllocator* allocator);
+
+    const char* Name() const override;
+    bool Process(FrameRef* frame) override;
+
+private:
+    std::mutex mtx_;
+    ComposeSettings settings_ = {};
+    WorkerPool* pool_ = nullptr;
+    FrameStats* stats_ = nullptr;
+    ImageScaler scaler_;
+    MaskCache masks_;
+    FramePool frames_;
+};
@@ -0,0 +1,67 @@
+#include "cpu_features.h"
+#include <stdint.h>
+
+#if CPU_X86
+#if defined(_MSC_VER)
+#include <intrin.h>
+#else
+#include <cpuid.h>
+#endif
+
+static void CpuId(int leaf, int sub_leaf, uint32_t regs[4])
+{
+#if defined(_MSC_VER)
+    int r[4] = {};
+    __cpuidex(r, leaf, sub_leaf);
+    for (int i = 0; i < 4; ++i)
+        regs[i] = (uint32_t)r[i];
+#else
+    __cpuid_count(leaf, sub_leaf, regs[0], regs[1], regs[2], regs[3]);
+#endif
+}
+
+static uint64_t ReadXcr0()
+{
+#if defined(_MSC_VER)
+    return _xgetbv(0);
+#else
+    uint32_t lo = 0;
+    uint32_t hi = 0;
+    __asm__ volatile("xgetbv" : "=a"(lo), "=d"(hi) : "c"(0));
+    return ((uint64_t)hi << 32) | lo;
+#endif
+}
+#endif
+
+static CpuFeatures DetectCpuFeatures()
+{
+    CpuFeatures f;
+#if CPU_X86
+    uint32_t regs[4] = {};
+    CpuId(0, 0, regs);
+    const uint32_t max_leaf = regs[0];
+    if (max_leaf < 1)
+        return f;
+
+    CpuId(1, 0, regs);
+    f.sse2 = (regs[3] & (1u << 26)) != 0;
+    f.ssse3 = (regs[2] & (1u << 9)) != 0;
+    f.sse41 = (regs[2] & (1u << 19)) != 0;
+
+    const bool os_xsave = (regs[2] & (1u << 27)) != 0;
+    const bool avx = (regs[2] & (1u << 28)) != 0;
+    const bool ymm_enabled = os_xsave && ((ReadXcr0() & 0x6) == 0x6);
+
+    if (max_leaf >= 7 && avx && ymm_enabled) {
+        CpuId(7, 0, regs);
+        f.avx2 = (regs[1] & (1u << 5)) != 0;
+    }
+#endif
+    return f;
+}
+
+const CpuFeatures& GetCpuFeatures()
+{
+    static const CpuFeatures features = DetectCpuFeatures();
+    return features;
+}
@@ -0,0 +1,29 @@
+#pragma once
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+#define CPU_X86 1
+#else
+#define CPU_X86 0
+#endif
+
+#if defined(_MSC_VER)
+#define FORCE_INLINE __forceinline
+#define TARGET_ISA(isa)
+#else
+#define FORCE_INLINE inline __attribute__((always_inline))
+#define TARGET_ISA(isa) __attribute__((target(isa)))
+#endif
+
+#define TARGET_SSE2 TARGET_ISA("sse2")
+#define TARGET_SSE41 TARGET_ISA("sse4.1")
+#define TARGET_AVX2 TARGET_ISA("avx2")
+
+struct CpuFeatures {
+    bool sse2 = false;
+    bool ssse3 = false;
+    bool sse41 = false;
+    bool avx2 = false;
+};
+
+// Detected once on first use, AVX2 also requires the OS to save YMM state.
+const CpuFeatures& GetCpuFeatures();
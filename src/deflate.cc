@@ -0,0 +1,648 @@
+#include "deflate.h"
+#include <algorithm>
+#include <string.h>
+#include "worker_pool.h"
+
+static const uint32_t kAdlerBase = 65521;
+
+static const size_t kWindow = 32768;
+static const int kHashBits = 15;
+static const uint32_t kMinMatch = 4;  // hashed bytes; shorter matches are not looked for
+static const uint32_t kMaxMatch = 258;
+static const int kMaxChain = 8;
+static const uint32_t kNiceMatch = 64;     // long enough to stop looking
+static const uint32_t kMaxInsert = 32;     // longer matches only hash their start
+static const size_t kBlockSymbols = 1 << 15;
+
+static const int kLitLenCodes = 286;
+static const int kDistCodes = 30;
+static const int kCodeLenCodes = 19;
+static const int kEndOfBlock = 256;
+
+static const uint16_t kLengthBase[29] = {
+    3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+    35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258,
+};
+
+static const uint8_t kLengthExtra[29] = {
+    0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+    3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0,
+};
+
+static const uint16_t kDistBase[30] = {
+    1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+    257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577,
+};
+
+static const uint8_t kDistExtra[30] = {
+    0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+    7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13,
+};
+
+static const uint8_t kCodeLenOrder[kCodeLenCodes] = {
+    16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15,
+};
+
+// Length code of each match length, distance code of each distance up
+// to 256 and of each 128 beyond.
+struct CodeTables {
+    uint8_t length_code[kMaxMatch + 1];
+    uint8_t dist_code[512];
+
+    CodeTables()
+    {
+        for (int code = 0; code < 29; ++code) {
+            const int end = code == 28 ? kMaxMatch + 1 : kLengthBase[code + 1];
+            for (int len = kLengthBase[code]; len < end; ++len)
+                length_code[len] = (uint8_t)code;
+        }
+
+        for (int code = 0; code < kDistCodes; ++code) {
+            const int end = code == kDistCodes - 1 ? 32769 : kDistBase[code + 1];
+            for (int dist = kDistBase[code]; dist < end; ++dist) {
+                if (dist <= 256)
+                    dist_code[dist - 1] = (uint8_t)code;
+                else
+                    dist_code[256 + ((dist - 1) >> 7)] = (uint8_t)code;
+            }
+        }
+    }
+
+    int DistCode(uint32_t dist) const
+    {
+        return dist <= 256 ? dist_code[dist - 1] : dist_code[256 + ((dist - 1) >> 7)];
+    }
+};
+
+static const CodeTables& Tables()
+{
+    static const CodeTables tables;
+    return tables;
+}
+
+uint32_t Adler32(uint32_t adler, const uint8_t* data, size_t size)
+{
+    // The most bytes the sums can take before they may overflow.
+    const size_t kMaxRun = 5552;
+    uint32_t a = adler & 0xFFFF;
+    uint32_t b = adler >> 16;
+
+    while (size) {
+        const size_t n = size < kMaxRun ? size : kMaxRun;
+        for (size_t i = 0; i < n; ++i) {
+            a += data[i];
+            b += a;
+        }
+
+        a %= kAdlerBase;
+        b %= kAdlerBase;
+        data += n;
+        size -= n;
+    }
+
+    return a | b << 16;
+}
+
+// The checksum of two byte strings joined, from theirs and the length of
+// the second, as zlib does it.
+static uint32_t Adler32Combine(uint32_t adler1, uint32_t adler2, size_t size2)
+{
+    const uint32_t rem = (uint32_t)(size2 % kAdlerBase);
+    uint32_t sum1 = adler1 & 0xFFFF;
+    uint32_t sum2 = (uint32_t)(((uint64_t)rem * sum1) % kAdlerBase);
+    sum1 += (adler2 & 0xFFFF) + kAdlerBase - 1;
+    sum2 += (adler1 >> 16) + (adler2 >> 16) + kAdlerBase - rem;
+    if (sum1 >= kAdlerBase)
+        sum1 -= kAdlerBase;
+
+    if (sum1 >= kAdlerBase)
+        sum1 -= kAdlerBase;
+
+    if (sum2 >= kAdlerBase * 2)
+        sum2 -= kAdlerBase * 2;
+
+    if (sum2 >= kAdlerBase)
+        sum2 -= kAdlerBase;
+
+    return sum1 | sum2 << 16;
+}
+
+// Bits go out from the lowest, as deflate packs them.
+class BitWriter
+{
+public:
+    explicit BitWriter(std::vector<uint8_t>* out) : out_(out) {}
+
+    // |n| at most 32.
+    void Put(uint32_t bits, int n)
+    {
+        bits_ |= (uint64_t)bits << count_;
+        count_ += n;
+        if (count_ >= 32) {
+            const uint8_t bytes[4] = {
+                (uint8_t)bits_, (uint8_t)(bits_ >> 8), (uint8_t)(bits_ >> 16), (uint8_t)(bits_ >> 24),
+            };
+            out_->insert(out_->end(), bytes, bytes + 4);
+            bits_ >>= 32;
+            count_ -= 32;
+        }
+    }
+
+    void AlignToByte()
+    {
+        while (count_ > 0) {
+            out_->push_back((uint8_t)bits_);
+            bits_ >>= 8;
+            count_ = count_ > 8 ? count_ - 8 : 0;
+        }
+
+        bits_ = 0;
+    }
+
+private:
+    std::vector<uint8_t>* out_;
+    uint64_t bits_ = 0;
+    int count_ = 0;
+};
+
+// Code lengths of at most |max_bits| for |freq|, zero for symbols that
+// never occur. Frequencies are halved until the Huffman tree is shallow
+// enough, which costs little and keeps the code complete.
+static void BuildLengths(const uint32_t* freq, int num, int max_bits, uint8_t* lengths)
+{
+    std::vector<uint32_t> f(freq, freq + num);
+    std::vector<int> leaves;
+    std::vector<uint64_t> weight;
+    std::vector<int> parent;
+    std::vector<int> depth;
+
+    memset(lengths, 0, num);
+    for (;;) {
+        leaves.clear();
+        for (int i = 0; i < num; ++i) {
+            if (f[i])
+                leaves.push_back(i);
+        }
+
+        if (leaves.empty())
+            return;
+
+        if (leaves.size() == 1) {
+            lengths[leaves[0]] = 1;
+            return;
+        }
+
+        std::sort(leaves.begin(), leaves.end(), [&f](int a, int b) {
+            return f[a] != f[b] ? f[a] < f[b] : a < b;
+        });
+
+        // Leaves and the nodes made of them are both taken in order of
+        // weight, from two queues.
+        const int n = (int)leaves.size();
+        weight.assign(2 * n - 1, 0);
+        parent.assign(2 * n - 1, 0);
+        depth.assign(2 * n - 1, 0);
+        for (int i = 0; i < n; ++i)
+            weight[i] = f[leaves[i]];
+
+        int next_leaf = 0;
+        int next_node = n;
+        auto take = [&](int end) {
+            if (next_leaf < n && (next_node >= end || weight[next_leaf] <= weight[next_node]))
+                return next_leaf++;
+
+            return next_node++;
+        };
+
+        for (int node = n; node < 2 * n - 1; ++node) {
+            const int a = take(node);
+            const int b = take(node);
+            weight[node] = weight[a] + weight[b];
+            parent[a] = node;
+            parent[b] = node;
+        }
+
+        int max_depth = 0;
+        for (int i = 2 * n - 3; i >= 0; --i) {
+            depth[i] = depth[parent[i]] + 1;
+            if (i < n && depth[i] > max_depth)
+                max_depth = depth[i];
+        }
+
+        if (max_depth <= max_bits) {
+            for (int i = 0; i < n; ++i)
+                lengths[leaves[i]] = (uint8_t)depth[i];
+
+            return;
+        }
+
+        for (uint32_t& v : f)
+            v = (v + 1) / 2;
+    }
+}
+
+// Canonical codes for |lengths|, bit-reversed to be put out as they are.
+static void BuildCodes(const uint8_t* lengths, int num, uint16_t* codes)
+{
+    uint16_t count[16] = {};
+    uint16_t next[16] = {};
+    for (int i = 0; i < num; ++i)
+        ++count[lengths[i]];
+
+    count[0] = 0;
+    uint16_t code = 0;
+    for (int bits = 1; bits < 16; ++bits) {
+        code = (uint16_t)((code + count[bits - 1]) << 1);
+        next[bits] = code;
+    }
+
+    for (int i = 0; i < num; ++i) {
+        const int len = lengths[i];
+        if (!len) {
+            codes[i] = 0;
+            continue;
+        }
+
+        uint16_t c = next[len]++;
+        uint16_t reversed = 0;
+        for (int b = 0; b < len; ++b) {
+            reversed = (uint16_t)(reversed << 1 | (c & 1));
+            c >>= 1;
+        }
+
+        codes[i] = reversed;
+    }
+}
+
+// A literal, or a match of |litlen| bytes |dist| back.
+struct Symbol {
+    uint16_t litlen;
+    uint16_t dist;  // 0 for a literal
+};
+
+class BlockWriter
+{
+public:
+    explicit BlockWriter(std::vector<uint8_t>* out) : bits_(out) {}
+
+    // |raw| are the bytes the symbols stand for, kept as they are if
+    // Huffman coding does not make them smaller.
+    void WriteBlock(const Symbol* syms, size_t num, const uint8_t* raw, size_t raw_size, bool final);
+
+    // An empty stored block, which leaves the stream on a byte boundary.
+    void WriteSyncMarker(bool final);
+
+    // Pads the last block to a whole byte.
+    void Finish() { bits_.AlignToByte(); }
+
+private:
+    void WriteStored(const uint8_t* raw, size_t size, bool final);
+
+    BitWriter bits_;
+};
+
+// Code lengths of both trees, run-length coded with codes 16 to 18.
+struct CodeLenRun {
+    uint8_t code;
+    uint8_t extra;
+};
+
+static void RunLengthCode(const uint8_t* lens, int num, std::vector<CodeLenRun>* runs)
+{
+    for (int i = 0; i < num; ) {
+        const uint8_t len = lens[i];
+        int run = 1;
+        while (i + run < num && lens[i + run] == len)
+            ++run;
+
+        i += run;
+        if (len == 0) {
+            while (run >= 11) {
+                const int n = run < 138 ? run : 138;
+                runs->push_back({ 18, (uint8_t)(n - 11) });
+                run -= n;
+            }
+
+            if (run >= 3) {
+                runs->push_back({ 17, (uint8_t)(run - 3) });
+                run = 0;
+            }
+        } else {
+            runs->push_back({ len, 0 });
+            --run;
+            while (run >= 3) {
+                const int n = run < 6 ? run : 6;
+                runs->push_back({ 16, (uint8_t)(n - 3) });
+                run -= n;
+            }
+        }
+
+        while (run-- > 0)
+            runs->push_back({ len, 0 });
+    }
+}
+
+void BlockWriter::WriteBlock(const Symbol* syms, size_t num, const uint8_t* raw, size_t raw_size, bool final)
+{
+    static const uint8_t kCodeLenExtra[3] = { 2, 3, 7 };
+    const CodeTables& tables = Tables();
+
+    uint32_t litlen_freq[kLitLenCodes] = {};
+    uint32_t dist_freq[kDistCodes] = {};
+    for (size_t i = 0; i < num; ++i) {
+        if (!syms[i].dist) {
+            ++litlen_freq[syms[i].litlen];
+        } else {
+            ++litlen_freq[257 + tables.length_code[syms[i].litlen]];
+            ++dist_freq[tables.DistCode(syms[i].dist)];
+        }
+    }
+
+    litlen_freq[kEndOfBlock] = 1;
+
+    // Old decoders want two distance codes at least.
+    int dist_used = 0;
+    for (uint32_t f : dist_freq)
+        dist_used += f != 0;
+
+    for (int i = 0; dist_used < 2; ++i) {
+        if (!dist_freq[i]) {
+            dist_freq[i] = 1;
+            ++dist_used;
+        }
+    }
+
+    uint8_t lens[kLitLenCodes + kDistCodes];
+    uint8_t* litlen_lens = lens;
+    uint8_t* dist_lens = lens + kLitLenCodes;
+    BuildLengths(litlen_freq, kLitLenCodes, 15, litlen_lens);
+    BuildLengths(dist_freq, kDistCodes, 15, dist_lens);
+
+    int hlit = kLitLenCodes;
+    while (hlit > 257 && !litlen_lens[hlit - 1])
+        --hlit;
+
+    int hdist = kDistCodes;
+    while (hdist > 1 && !dist_lens[hdist - 1])
+        --hdist;
+
+    // The two sets of lengths are coded as one sequence.
+    uint8_t seq[kLitLenCodes + kDistCodes];
+    memcpy(seq, litlen_lens, hlit);
+    memcpy(seq + hlit, dist_lens, hdist);
+    std::vector<CodeLenRun> runs;
+    RunLengthCode(seq, hlit + hdist, &runs);
+
+    uint32_t cl_freq[kCodeLenCodes] = {};
+    for (const CodeLenRun& r : runs)
+        ++cl_freq[r.code];
+
+    uint8_t cl_lens[kCodeLenCodes];
+    BuildLengths(cl_freq, kCodeLenCodes, 7, cl_lens);
+    int hclen = kCodeLenCodes;
+    while (hclen > 4 && !cl_lens[kCodeLenOrder[hclen - 1]])
+        --hclen;
+
+    uint64_t bits = 3 + 5 + 5 + 4 + 3 * (uint64_t)hclen;
+    for (const CodeLenRun& r : runs)
+        bits += cl_lens[r.code] + (r.code >= 16 ? kCodeLenExtra[r.code - 16] : 0);
+
+    for (int i = 0; i < kLitLenCodes; ++i) {
+        bits += (uint64_t)litlen_freq[i] * litlen_lens[i];
+        if (i > kEndOfBlock)
+            bits += (uint64_t)litlen_freq[i] * kLengthExtra[i - 257];
+    }
+
+    for (size_t i = 0; i < num; ++i) {
+        if (syms[i].dist) {
+            const int code = tables.DistCode(syms[i].dist);
+            bits += dist_lens[code] + kDistExtra[code];
+        }
+    }
+
+    // Stored blocks hold at most 64 KB and cost 5 bytes of header each.
+    const uint64_t stored_bits = (raw_size + 5 * ((raw_size + 65534) / 65535)) * 8 + 7;
+    if (stored_bits < bits) {
+        WriteStored(raw, raw_size, final);
+        return;
+    }
+
+    uint16_t litlen_codes[kLitLenCodes];
+    uint16_t dist_codes[kDistCodes];
+    uint16_t cl_codes[kCodeLenCodes];
+    BuildCodes(litlen_lens, kLitLenCodes, litlen_codes);
+    BuildCodes(dist_lens, kDistCodes, dist_codes);
+    BuildCodes(cl_lens, kCodeLenCodes, cl_codes);
+
+    bits_.Put(final ? 1 : 0, 1);
+    bits_.Put(2, 2);
+    bits_.Put(hlit - 257, 5);
+    bits_.Put(hdist - 1, 5);
+    bits_.Put(hclen - 4, 4);
+    for (int i = 0; i < hclen; ++i)
+        bits_.Put(cl_lens[kCodeLenOrder[i]], 3);
+
+    for (const CodeLenRun& r : runs) {
+        bits_.Put(cl_codes[r.code], cl_lens[r.code]);
+        if (r.code >= 16)
+            bits_.Put(r.extra, kCodeLenExtra[r.code - 16]);
+    }
+
+    for (size_t i = 0; i < num; ++i) {
+        const Symbol s = syms[i];
+        if (!s.dist) {
+            bits_.Put(litlen_codes[s.litlen], litlen_lens[s.litlen]);
+            continue;
+        }
+
+        const int len_code = tables.length_code[s.litlen];
+        bits_.Put(litlen_codes[257 + len_code], litlen_lens[257 + len_code]);
+        bits_.Put(s.litlen - kLengthBase[len_code], kLengthExtra[len_code]);
+
+        const int dist_code = tables.DistCode(s.dist);
+        bits_.Put(dist_codes[dist_code], dist_lens[dist_code]);
+        bits_.Put(s.dist - kDistBase[dist_code], kDistExtra[dist_code]);
+    }
+
+    bits_.Put(litlen_codes[kEndOfBlock], litlen_lens[kEndOfBlock]);
+}
+
+void BlockWriter::WriteStored(const uint8_t* raw, size_t size, bool final)
+{
+    do {
+        const size_t n = size < 65535 ? size : 65535;
+        bits_.Put(final && n == size ? 1 : 0, 1);
+        bits_.Put(0, 2);
+        bits_.AlignToByte();
+        bits_.Put((uint32_t)n, 16);
+        bits_.Put((uint32_t)n ^ 0xFFFF, 16);
+        for (size_t i = 0; i < n; ++i)
+            bits_.Put(raw[i], 8);
+
+        raw += n;
+        size -= n;
+    } while (size);
+}
+
+void BlockWriter::WriteSyncMarker(bool final)
+{
+    bits_.Put(final ? 1 : 0, 1);
+    bits_.Put(0, 2);
+    bits_.AlignToByte();
+    bits_.Put(0, 16);
+    bits_.Put(0xFFFF, 16);
+    bits_.AlignToByte();
+}
+
+static uint32_t Load32(const uint8_t* p)
+{
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static uint64_t Load64(const uint8_t* p)
+{
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static uint32_t HashAt(const uint8_t* p)
+{
+    return (Load32(p) * 2654435761u) >> (32 - kHashBits);
+}
+
+static uint32_t MatchLength(const uint8_t* a, const uint8_t* b, uint32_t max)
+{
+    uint32_t len = 0;
+    while (len + 8 <= max && Load64(a + len) == Load64(b + len))
+        len += 8;
+
+    while (len < max && a[len] == b[len])
+        ++len;
+
+    return len;
+}
+
+// Greedy LZ77 over hash chains, on data[begin, end) with data[history,
+// begin) to match against.
+static void CompressBlock(const uint8_t* data, size_t history, size_t begin, size_t end,
+    bool final, std::vector<uint8_t>* out)
+{
+    BlockWriter writer(out);
+    if (begin == end) {
+        writer.WriteSyncMarker(final);
+        return;
+    }
+
+    // Positions are kept relative to |history|.
+    const uint8_t* base = data + history;
+    const size_t size = end - history;
+    std::vector<int32_t> head((size_t)1 << kHashBits, -1);
+    std::vector<int32_t> prev(size);
+    auto insert = [&](size_t pos) {
+        const uint32_t h = HashAt(base + pos);
+        prev[pos] = head[h];
+        head[h] = (int32_t)pos;
+    };
+
+    for (size_t pos = 0; pos + kMinMatch <= size && pos < begin - history; ++pos)
+        insert(pos);
+
+    std::vector<Symbol> syms;
+    syms.reserve(kBlockSymbols);
+    size_t block_start = begin - history;
+    size_t pos = begin - history;
+
+    while (pos < size) {
+        uint32_t best_len = 0;
+        uint32_t best_dist = 0;
+        if (pos + kMinMatch <= size) {
+            const uint32_t max = size - pos < kMaxMatch ? (uint32_t)(size - pos) : kMaxMatch;
+            int32_t cand = head[HashAt(base + pos)];
+            insert(pos);
+
+            for (int chain = 0; cand >= 0 && chain < kMaxChain; ++chain) {
+                const size_t dist = pos - (size_t)cand;
+                if (dist > kWindow)
+                    break;
+
+                if (base[cand + best_len] == base[pos + best_len]) {
+                    const uint32_t len = MatchLength(base + cand, base + pos, max);
+                    if (len > best_len) {
+                        best_len = len;
+                        best_dist = (uint32_t)dist;
+                        if (len >= kNiceMatch || len == max)
+                            break;
+                    }
+                }
+
+                cand = prev[cand];
+            }
+        }
+
+        if (best_len >= kMinMatch) {
+            syms.push_back({ (uint16_t)best_len, (uint16_t)best_dist });
+            if (best_len <= kMaxInsert) {
+                for (size_t p = pos + 1; p < pos + best_len && p + kMinMatch <= size; ++p)
+                    insert(p);
+            }
+
+            pos += best_len;
+        } else {
+            syms.push_back({ base[pos], 0 });
+            ++pos;
+        }
+
+        if (syms.size() == kBlockSymbols && pos < size) {
+            writer.WriteBlock(syms.data(), syms.size(), base + block_start, pos - block_start, false);
+            syms.clear();
+            block_start = pos;
+        }
+    }
+
+    writer.WriteBlock(syms.data(), syms.size(), base + block_start, pos - block_start, final);
+    if (final)
+        writer.Finish();
+    else
+        writer.WriteSyncMarker(false);
+}
+
+void ZlibCompress(const uint8_t* data, size_t size, WorkerPool* pool, std::vector<uint8_t>* out)
+{
+    const size_t block_num = size ? (size + kDeflateBlockBytes - 1) / kDeflateBlockBytes : 1;
+    std::vector<std::vector<uint8_t>> blocks(block_num);
+    std::vector<uint32_t> adlers(block_num);
+
+    auto compress = [&](int i) {
+        const size_t begin = (size_t)i * kDeflateBlockBytes;
+        const size_t end = std::min(begin + kDeflateBlockBytes, size);
+        const size_t history = begin > kWindow ? begin - kWindow : 0;
+        CompressBlock(data, history, begin, end, (size_t)i + 1 == block_num, &blocks[i]);
+        adlers[i] = Adler32(1, data + begin, end - begin);
+    };
+
+    if (pool && block_num > 1) {
+        pool->Run((int)block_num, compress);
+    } else {
+        for (size_t i = 0; i < block_num; ++i)
+            compress((int)i);
+    }
+
+    // 32 KB window, no dictionary, fastest level.
+    out->push_back(0x78);
+    out->push_back(0x5E);
+
+    uint32_t adler = 1;
+    for (size_t i = 0; i < block_num; ++i) {
+        out->insert(out->end(), blocks[i].begin(), blocks[i].end());
+        const size_t begin = i * kDeflateBlockBytes;
+        adler = Adler32Combine(adler, adlers[i], std::min(kDeflateBlockBytes, size - begin));
+    }
+
+    const uint8_t trailer[4] = {
+        (uint8_t)(adler >> 24), (uint8_t)(adler >> 16), (uint8_t)(adler >> 8), (uint8_t)adler,
+    };
+    out->insert(out->end(), trailer, trailer + 4);
+}
@@ -0,0 +1,18 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+class WorkerPool;
+
+// Start with 1; pass the result of one call to the next to go on.
+uint32_t Adler32(uint32_t adler, const uint8_t* data, size_t size);
+
+// The input is cut into blocks this long.
+static const size_t kDeflateBlockBytes = 256 * 1024;
+
+// A zlib stream (RFC 1950, 1951) of |data|, appended to |out|. Blocks are
+// compressed at once on |pool|, each with the 32 KB before it as history,
+// and end on a byte boundary, so that they are simply joined; the output
+// does not depend on the number of threads. |pool| may be null.
+void ZlibCompress(const uint8_t* data, size_t size, WorkerPool* pool, std::vector<uint8_t>* out);
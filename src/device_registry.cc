@@ -0,0 +1,177 @@
+#include "device_registry.h"
+#include <mfapi.h>
+#include <functional>
+#include "frame_trace.h"
+#include "util.h"
+
+static HRESULT ListDevices(std::vector<DeviceInfo>* devices)
+{
+    IMFAttributes* attr = NULL;
+    HRESULT hr = MFCreateAttributes(&attr, 1);
+    if (FAILED(hr))
+        return hr;
+
+    SCOPE_EXIT([&]() { SafeRelease(&attr); });
+
+    hr = attr->SetGUID(
+        MF_DEVSOURCE_ATTRIBUTE_SOURCE_TYPE,
+        MF_DEVSOURCE_ATTRIBUTE_SOURCE_TYPE_VIDCAP_GUID);
+
+    if (FAILED(hr))
+        return hr;
+
+    IMFActivate** acts = NULL;
+    UINT32 num = 0;
+    hr = MFEnumDeviceSources(attr, &acts, &num);
+    if (FAILED(hr))
+        return hr;
+
+    for (UINT32 i = 0; i < num; ++i) {
+        DeviceInfo info;
+        info.name = GetDevPropStr(acts[i], MF_DEVSOURCE_ATTRIBUTE_FRIENDLY_NAME);
+        info.link = GetDevPropStr(acts[i],
+            MF_DEVSOURCE_ATTRIBUTE_SOURCE_TYPE_VIDCAP_SYMBOLIC_LINK);
+
+        if (info.name.empty())
+            info.name = L"unknown";
+
+        if (info.link.size())
+            devices->push_back(info);
+
+        acts[i]->Release();
+    }
+
+    CoTaskMemFree(acts);
+    return S_OK;
+}
+
+DeviceRegistry::~DeviceRegistry()
+{
+    Stop();
+}
+
+void DeviceRegistry::Start()
+{
+    std::unique_lock<std::mutex> lock(mtx_);
+    if (thread_.joinable())
+        return;
+
+    quit_ = false;
+    relist_ = true;
+    thread_ = std::thread(&DeviceRegistry::ListerMain, this);
+}
+
+// A listing under way is finished first.
+void DeviceRegistry::Stop()
+{
+    {
+        std::unique_lock<std::mutex> lock(mtx_);
+        quit_ = true;
+    }
+
+    cv_.notify_all();
+    if (thread_.joinable())
+        thread_.join();
+}
+
+std::vector<DeviceInfo> DeviceRegistry::Devices() const
+{
+    std::unique_lock<std::mutex> lock(mtx_);
+    return devices_;
+}
+
+std::vector<DeviceInfo> DeviceRegistry::WaitDevices() const
+{
+    std::unique_lock<std::mutex> lock(mtx_);
+    cv_.wait(lock, [this]() { return listed_ || quit_; });
+    return devices_;
+}
+
+void DeviceRegistry::OnDeviceChange(WPARAM event, PDEV_BROADCAST_HDR hdr)
+{
+    if (!hdr || hdr->dbch_devicetype != DBT_DEVTYP_DEVICEINTERFACE)
+        return;
+
+    if (event != DBT_DEVICEARRIVAL && event != DBT_DEVICEREMOVECOMPLETE)
+        return;
+
+    PCWSTR name = ((DEV_BROADCAST_DEVICEINTERFACE*)hdr)->dbcc_name;
+    {
+        std::unique_lock<std::mutex> lock(mtx_);
+        if (event == DBT_DEVICEREMOVECOMPLETE) {
+            for (auto it = devices_.begin(); it != devices_.end(); ++it) {
+                if (_wcsicmp(it->link.c_str(), name) == 0) {
+                    devices_.erase(it);
+                    break;
+                }
+            }
+        }
+
+        // A removal is listed again too, in case it raced a listing.
+        relist_ = true;
+    }
+
+    cv_.notify_all();
+}
+
+// Opens a device without listing the devices, by its link alone.
+HRESULT DeviceRegistry::Activate(const std::wstring& link, IMFActivate** act)
+{
+    IMFAttributes* attr = NULL;
+    HRESULT hr = MFCreateAttributes(&attr, 2);
+    if (FAILED(hr))
+        return hr;
+
+    SCOPE_EXIT([&]() { SafeRelease(&attr); });
+
+    hr = attr->SetGUID(
+        MF_DEVSOURCE_ATTRIBUTE_SOURCE_TYPE,
+        MF_DEVSOURCE_ATTRIBUTE_SOURCE_TYPE_VIDCAP_GUID);
+
+    if (FAILED(hr))
+        return hr;
+
+    hr = attr->SetString(MF_DEVSOURCE_ATTRIBUTE_SOURCE_TYPE_VIDCAP_SYMBOLIC_LINK, link.c_str());
+    if (FAILED(hr))
+        return hr;
+
+    return MFCreateDeviceSourceActivate(attr, act);
+}
+
+void DeviceRegistry::ListerMain()
+{
+    Tracer::SetThreadName("devices");
+    const HRESULT co_hr = CoInitializeEx(NULL, COINIT_MULTITHREADED);
+
+    for (;;) {
+        {
+            std::unique_lock<std::mutex> lock(mtx_);
+            cv_.wait(lock, [this]() { return quit_ || relist_; });
+            if (quit_)
+                break;
+
+            relist_ = false;
+        }
+
+        std::vector<DeviceInfo> devices;
+        HRESULT hr = S_OK;
+        {
+            TRACE_SCOPE("ListDevices");
+            hr = ListDevices(&devices);
+        }
+
+        // A failed listing keeps the devices listed before.
+        {
+            std::unique_lock<std::mutex> lock(mtx_);
+            if (SUCCEEDED(hr))
+                devices_.swap(devices);
+
+            listed_ = true;
+        }
+
+        cv_.notify_all();
+    }
+
+    if (SUCCEEDED(co_hr))
+        CoUninitialize();
+}
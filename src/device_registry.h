@@ -0,0 +1,53 @@
+#pragma once
+#include <mfidl.h>
+#include <dbt.h>  // PDEV_BROADCAST_HDR
+
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+struct DeviceInfo {
+    std::wstring name;  // friendly name, "unknown" if it has none
+    std::wstring link;  // symbolic link
+};
+
+// The capture devices, listed on a thread of its own so that the window
+// never waits for MFEnumDeviceSources. The list is kept in memory and
+// updated from WM_DEVICECHANGE: a device that goes is dropped at once,
+// and any change has the devices listed again in the background, several
+// changes in a row once. Devices are opened by link, without listing.
+class DeviceRegistry
+{
+public:
+    ~DeviceRegistry();
+
+    // After MFStartup; the first listing starts at once. Stop before
+    // MFShutdown.
+    void Start();
+    void Stop();
+
+    // Any thread. The devices as last listed, in the order Media
+    // Foundation lists them.
+    std::vector<DeviceInfo> Devices() const;
+
+    // The devices once the first listing is done.
+    std::vector<DeviceInfo> WaitDevices() const;
+
+    // Window thread, with the arguments of WM_DEVICECHANGE.
+    void OnDeviceChange(WPARAM event, PDEV_BROADCAST_HDR hdr);
+
+    static HRESULT Activate(const std::wstring& link, IMFActivate** act);
+
+private:
+    void ListerMain();
+
+    mutable std::mutex mtx_;
+    mutable std::condition_variable cv_;
+    std::thread thread_;
+    std::vector<DeviceInfo> devices_;
+    bool listed_ = false;
+    bool relist_ = false;
+    bool quit_ = false;
+};
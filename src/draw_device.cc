@@ -1,47 +1,11 @@
 #include "draw_device.h"
 #include <mfapi.h>
 #include <mferror.h>
-#include <d3d9.h>
 
+#include "frame_trace.h"
 #include "window.h"
 #include "util.h"
 
-void TransformImage_RGB24(
-    BYTE*       pDest,
-    LONG        lDestStride,
-    const BYTE* pSrc,
-    LONG        lSrcStride,
-    DWORD       dwWidthInPixels,
-    DWORD       dwHeightInPixels
-);
-
-void TransformImage_RGB32(
-    BYTE*       pDest,
-    LONG        lDestStride,
-    const BYTE* pSrc,
-    LONG        lSrcStride,
-    DWORD       dwWidthInPixels,
-    DWORD       dwHeightInPixels
-);
-
-void TransformImage_YUY2(
-    BYTE*       pDest,
-    LONG        lDestStride,
-    const BYTE* pSrc,
-    LONG        lSrcStride,
-    DWORD       dwWidthInPixels,
-    DWORD       dwHeightInPixels
-);
-
-void TransformImage_NV12(
-    BYTE* pDst, 
-    LONG dstStride, 
-    const BYTE* pSrc, 
-    LONG srcStride,
-    DWORD dwWidthInPixels,
-    DWORD dwHeightInPixels
-);
-
 HRESULT GetDefaultStride(IMFMediaType *pType, LONG *plStride);
 
 inline LONG Width(const RECT& r)
@@ -54,25 +18,22 @@ inline LONG Height(const RECT& r)
     return r.bottom - r.top;
 }
 
-struct ConversionFunction
+// Uncompressed subtypes are FOURCC or D3DFORMAT codes in Data1 of the
+// base media type GUID, which is also how the transforms are keyed.
+static bool IsBaseSubtype(REFGUID subtype)
 {
-    GUID subtype;
-    IMAGE_TRANSFORM_FN xform;
-};
-
-ConversionFunction g_FormatConversions[] = {
-    { MFVideoFormat_RGB32, TransformImage_RGB32 },
-    { MFVideoFormat_RGB24, TransformImage_RGB24 },
-    { MFVideoFormat_YUY2,  TransformImage_YUY2  },      
-    { MFVideoFormat_NV12,  TransformImage_NV12  }
-};
-
-const DWORD g_cFormats = ARRAYSIZE(g_FormatConversions);
+    GUID base = subtype;
+    base.Data1 = 0;
+    return base == MFVideoFormat_Base;
+}
 
 HRESULT DrawDevice::GetFormat(DWORD index, GUID *pSubtype) const
 {
-    if (index < g_cFormats) {
-        *pSubtype = g_FormatConversions[index].subtype;
+    uint32_t count = 0;
+    const ImageTransformEntry* entries = GetImageTransforms(&count);
+    if (index < count) {
+        *pSubtype = MFVideoFormat_Base;
+        pSubtype->Data1 = entries[index].format;
         return S_OK;
     }
 
@@ -81,31 +42,54 @@ HRESULT DrawDevice::GetFormat(DWORD index, GUID *pSubtype) const
 
 BOOL DrawDevice::IsFormatSupported(REFGUID subtype) const
 {
-    for (DWORD i = 0; i < g_cFormats; i++) {
-        if (subtype == g_FormatConversions[i].subtype)
-            return TRUE;
-    }
+    if (subtype == MFVideoFormat_MJPG)  // JpegDecoder
+        return TRUE;
+
+    return IsBaseSubtype(subtype) && FindImageTransform(subtype.Data1) != nullptr;
+}
 
-    return FALSE;
+// Cameras often leave the matrix unset; like the video renderer, assume
+// BT.709 for HD frames and BT.601 below.
+static const YuvConstants* StreamYuvConstants(IMFMediaType* pType, UINT32 height)
+{
+    UINT32 matrix = MFGetAttributeUINT32(pType, MF_MT_YUV_MATRIX,
+        height >= 720 ? MFVideoTransferMatrix_BT709 : MFVideoTransferMatrix_BT601);
+    UINT32 range = MFGetAttributeUINT32(pType, MF_MT_VIDEO_NOMINAL_RANGE,
+        MFNominalRange_16_235);
+
+    YuvMatrix yuv_matrix = YUV_MATRIX_BT601;
+    if (matrix == MFVideoTransferMatrix_BT709)
+        yuv_matrix = YUV_MATRIX_BT709;
+    else if (matrix == MFVideoTransferMatrix_BT2020_10 || matrix == MFVideoTransferMatrix_BT2020_12)
+        yuv_matrix = YUV_MATRIX_BT2020;
+
+    return GetYuvConstants(yuv_matrix, range == MFNominalRange_0_255);
 }
 
 void DrawDevice::Init(LayeredWindow* layered_win)
 {
     layered_win_ = layered_win;
+    layered_win_->SetWorkerPool(&pool_);
 }
 
 HRESULT DrawDevice::SetConversionFunction(REFGUID subtype)
 {
     m_convertFn = NULL;
+    m_subtype = subtype;
+    m_jpeg = (subtype == MFVideoFormat_MJPG);
 
-    for (DWORD i = 0; i < g_cFormats; i++) {
-        if (g_FormatConversions[i].subtype == subtype) {
-            m_convertFn = g_FormatConversions[i].xform;
-            return S_OK;
-        }
-    }
+    if (m_jpeg)
+        return S_OK;
+
+    const ImageTransformEntry* entry =
+        IsBaseSubtype(subtype) ? FindImageTransform(subtype.Data1) : nullptr;
+    if (entry == nullptr)
+        return MF_E_INVALIDMEDIATYPE;
 
-    return MF_E_INVALIDMEDIATYPE;
+    m_convertFn = entry->xform;
+    m_layout = entry->layout;
+    m_format = entry->format;
+    return S_OK;
 }
 
 HRESULT DrawDevice::SetVideoType(IMFMediaType *pType)
@@ -125,6 +109,17 @@ HRESULT DrawDevice::SetVideoType(IMFMediaType *pType)
     if (FAILED(hr))
         return hr;
 
+    if (FAILED(MFGetAttributeRatio(pType, MF_MT_FRAME_RATE, &m_fpsNum, &m_fpsDen))) {
+        m_fpsNum = 0;
+        m_fpsDen = 0;
+    }
+
+    // Compressed frames have no stride, and JPEG is full range BT.601.
+    if (m_jpeg)
+        return hr;
+
+    m_yuv = StreamYuvConstants(pType, m_height);
+
     hr = GetDefaultStride(pType, &m_lDefaultStride);
     if (FAILED(hr))
         return hr;
@@ -132,6 +127,49 @@ HRESULT DrawDevice::SetVideoType(IMFMediaType *pType)
     return hr;
 }
 
+HRESULT DrawDevice::SetFormat(const CaptureFormat& format)
+{
+    GUID subtype = MFVideoFormat_Base;
+    subtype.Data1 = format.fourcc;
+
+    HRESULT hr = SetConversionFunction(subtype);
+    if (FAILED(hr))
+        return hr;
+
+    // Sources other than cameras give no colorimetry; their frames carry
+    // their own stride.
+    m_width = format.width;
+    m_height = format.height;
+    m_fpsNum = format.fps_num;
+    m_fpsDen = format.fps_den;
+    m_yuv = GetYuvConstants(YUV_MATRIX_BT601, false);
+    m_lDefaultStride = 0;
+    return S_OK;
+}
+
+RecordingInfo DrawDevice::StreamInfo() const
+{
+    RecordingInfo info = {};
+    info.format.fourcc = m_subtype.Data1;
+    info.format.width = m_width;
+    info.format.height = m_height;
+    info.format.fps_num = m_fpsNum;
+    info.format.fps_den = m_fpsDen;
+    static_assert(sizeof(info.subtype) == sizeof(m_subtype), "GUID size");
+    memcpy(info.subtype, &m_subtype, sizeof(info.subtype));
+    return info;
+}
+
+void DrawDevice::SetRecorder(FrameRecorder* recorder)
+{
+    recorder_ = recorder;
+}
+
+void DrawDevice::SetReplayRing(ReplayRing* ring)
+{
+    ring_ = ring;
+}
+
 SIZE DrawDevice::FrameSize() const
 {
     SIZE s;
@@ -140,8 +178,39 @@ SIZE DrawDevice::FrameSize() const
     return s;
 }
 
-HRESULT DrawDevice::DrawFrame(IMFMediaBuffer *pBuffer)
+// The largest of 1, 2, 4 and 8 a frame can be divided by without going
+// below the display scale.
+static UINT32 JpegScaleDenom(double scale)
+{
+    UINT32 denom = 8;
+    while (denom > 1 && scale * denom > 1.0)
+        denom /= 2;
+
+    return denom;
+}
+
+HRESULT DrawDevice::DrawFrame(IMFMediaBuffer *pBuffer, LONGLONG timestamp, DWORD flags)
 {
+    // The sample is handed over right before this, so the latency of a
+    // frame counts from here.
+    const uint64_t arrival = StatsClockNs();
+    TRACE_SCOPE_ID("DrawFrame", timestamp);
+    FrameStats* stats = layered_win_->Stats();
+
+    if (m_jpeg) {
+        BYTE* data = NULL;
+        DWORD length = 0;
+        HRESULT hr = pBuffer->Lock(&data, NULL, &length);
+        if (FAILED(hr))
+            return hr;
+
+        SCOPE_EXIT([&]() { pBuffer->Unlock(); });
+        stats->Record(STATS_LOCK, arrival, StatsClockNs());
+        Record(data, 0, length, timestamp, flags);
+        DrawJpegFrame(data, length, timestamp, arrival);
+        return S_OK;
+    }
+
     if (m_convertFn == NULL)
         return MF_E_INVALIDREQUEST;
 
@@ -153,175 +222,103 @@ HRESULT DrawDevice::DrawFrame(IMFMediaBuffer *pBuffer)
     hr = buffer.LockBuffer(m_lDefaultStride, m_height, &pbScanline0, &lStride);
     if (FAILED(hr))
         return hr;
-    
-    m_convertFn((BYTE*)layered_win_->BmpBuffer(), layered_win_->BmpStride(),
-        pbScanline0, lStride, m_width, m_height);
 
-    layered_win_->OnNewFrame();
+    stats->Record(STATS_LOCK, arrival, StatsClockNs());
+    Record(pbScanline0, lStride, SourceImageBytes(m_layout, lStride, m_height), timestamp, flags);
+    ConvertFrame(pbScanline0, lStride, timestamp, arrival);
     return hr;
 }
 
-__forceinline BYTE Clip(int clr)
+HRESULT DrawDevice::DrawRawFrame(const RawFrame& frame)
 {
-    return (BYTE)(clr < 0 ? 0 : ( clr > 255 ? 255 : clr ));
-}
+    const uint64_t arrival = StatsClockNs();
+    TRACE_SCOPE_ID("DrawFrame", frame.timestamp);
 
-__forceinline RGBQUAD ConvertYCrCbToRGB(
-    int y,
-    int cr,
-    int cb
-)
-{
-    RGBQUAD rgbq;
+    if (frame.format.width != m_width || frame.format.height != m_height)
+        return MF_E_INVALIDREQUEST;
 
-    int c = y - 16;
-    int d = cb - 128;
-    int e = cr - 128;
+    if (m_jpeg) {
+        Record(frame.data, frame.stride, frame.size, frame.timestamp, frame.flags);
+        DrawJpegFrame(frame.data, (DWORD)frame.size, frame.timestamp, arrival);
+        return S_OK;
+    }
 
-    rgbq.rgbRed =   Clip(( 298 * c           + 409 * e + 128) >> 8);
-    rgbq.rgbGreen = Clip(( 298 * c - 100 * d - 208 * e + 128) >> 8);
-    rgbq.rgbBlue =  Clip(( 298 * c + 516 * d           + 128) >> 8);
-    rgbq.rgbReserved = 255;
+    // Frames from a file are only as whole as the file; one too short for
+    // its rows would be read past.
+    const ImageTransformEntry* entry = FindImageTransform(m_subtype.Data1);
+    if (m_convertFn == NULL || !entry
+        || !SourceImageFits(*entry, frame.stride, frame.size, m_width, m_height))
+        return MF_E_INVALIDREQUEST;
 
-    return rgbq;
+    Record(frame.data, frame.stride, frame.size, frame.timestamp, frame.flags);
+    ConvertFrame(frame.data, frame.stride, frame.timestamp, arrival);
+    return S_OK;
 }
 
-void TransformImage_RGB24(
-    BYTE*       pDest,
-    LONG        lDestStride,
-    const BYTE* pSrc,
-    LONG        lSrcStride,
-    DWORD       dwWidthInPixels,
-    DWORD       dwHeightInPixels
-)
+void DrawDevice::Record(const BYTE* scanline0, LONG stride, size_t size, LONGLONG timestamp, DWORD flags)
 {
-    for (DWORD y = 0; y < dwHeightInPixels; y++) {
-        RGBTRIPLE *pSrcPel = (RGBTRIPLE*)pSrc;
-        DWORD *pDestPel = (DWORD*)pDest;
-
-        for (DWORD x = 0; x < dwWidthInPixels; x++) {
-            pDestPel[x] = D3DCOLOR_XRGB(
-                pSrcPel[x].rgbtRed,
-                pSrcPel[x].rgbtGreen,
-                pSrcPel[x].rgbtBlue);
-        }
-
-        pSrc += lSrcStride;
-        pDest += lDestStride;
-    }
+    if (!recorder_ && !ring_)
+        return;
+
+    const RecordingInfo info = StreamInfo();
+    RawFrame frame = {};
+    frame.format = info.format;
+    frame.data = scanline0;
+    frame.stride = stride;
+    frame.size = size;
+    frame.timestamp = timestamp;
+    frame.flags = flags;
+    if (recorder_)
+        recorder_->Write(frame);
+
+    if (ring_)
+        ring_->Push(info, frame);
 }
 
-void TransformImage_RGB32(
-    BYTE*       pDest,
-    LONG        lDestStride,
-    const BYTE* pSrc,
-    LONG        lSrcStride,
-    DWORD       dwWidthInPixels,
-    DWORD       dwHeightInPixels
-)
+void DrawDevice::DrawJpegFrame(const BYTE* data, DWORD length, LONGLONG timestamp, uint64_t arrival)
 {
-    MFCopyImage(pDest, lDestStride, pSrc, lSrcStride, dwWidthInPixels * 4, dwHeightInPixels);
+    const uint64_t begin = StatsClockNs();
+
+    // USB cameras drop or truncate a frame now and then; skip it and keep
+    // the stream running.
+    uint32_t width = 0;
+    uint32_t height = 0;
+    if (!jpeg_.ReadInfo(data, length, &width, &height)
+        || width != m_width || height != m_height)
+        return;
+
+    UINT32 denom = JpegScaleDenom(layered_win_->Scale());
+    SIZE size;
+    size.cx = (LONG)JpegDecoder::ScaledSize(m_width, denom);
+    size.cy = (LONG)JpegDecoder::ScaledSize(m_height, denom);
+
+    if (!jpeg_.Decode(data, length, denom, layered_win_->FrameTarget(size)))
+        return;
+
+    layered_win_->Stats()->Record(STATS_CONVERT, begin, StatsClockNs());
+    layered_win_->OnNewFrame(timestamp, arrival);
 }
 
-void TransformImage_YUY2(
-    BYTE*       pDest,
-    LONG        lDestStride,
-    const BYTE* pSrc,
-    LONG        lSrcStride,
-    DWORD       dwWidthInPixels,
-    DWORD       dwHeightInPixels
-)
+void DrawDevice::ConvertFrame(const BYTE* scanline0, LONG stride, LONGLONG timestamp, uint64_t arrival)
 {
-    for (DWORD y = 0; y < dwHeightInPixels; y++) {
-        RGBQUAD *pDestPel = (RGBQUAD*)pDest;
-        WORD    *pSrcPel = (WORD*)pSrc;
-
-        for (DWORD x = 0; x < dwWidthInPixels; x += 2) {
-            // Byte order is U0 Y0 V0 Y1
-            int y0 = (int)LOBYTE(pSrcPel[x]); 
-            int u0 = (int)HIBYTE(pSrcPel[x]);
-            int y1 = (int)LOBYTE(pSrcPel[x + 1]);
-            int v0 = (int)HIBYTE(pSrcPel[x + 1]);
-
-            pDestPel[x] = ConvertYCrCbToRGB(y0, v0, u0);
-            pDestPel[x + 1] = ConvertYCrCbToRGB(y1, v0, u0);
-        }
-
-        pSrc += lSrcStride;
-        pDest += lDestStride;
+    const uint64_t begin = StatsClockNs();
+    SourceImage src = MakeSourceImage(m_layout, scanline0, stride, m_height);
+    src.yuv = m_yuv;
+
+    // Below 100% the planes are shrunk first, so that only the pixels on
+    // screen are converted and no RGB frame is scaled afterwards.
+    SIZE display = layered_win_->DisplaySize();
+    if (layered_win_->Scale() < 1.0 && YuvScaler::IsSupported(m_format)
+        && display.cx > 0 && display.cy > 0) {
+        yuv_scaler_.ScaleConvert(m_format, src, m_width, m_height,
+            layered_win_->FrameTarget(display), display.cx, display.cy, &pool_);
+    } else {
+        TargetImage dst = layered_win_->FrameTarget(FrameSize());
+        TransformImageStripes(&pool_, m_convertFn, dst, src, m_width, m_height);
     }
 
-}
-
-void TransformImage_NV12(
-    BYTE* pDst, 
-    LONG dstStride, 
-    const BYTE* pSrc, 
-    LONG srcStride,
-    DWORD dwWidthInPixels,
-    DWORD dwHeightInPixels
-)
-{
-    const BYTE* lpBitsY = pSrc;
-    const BYTE* lpBitsCb = lpBitsY  + (dwHeightInPixels * srcStride);
-    const BYTE* lpBitsCr = lpBitsCb + 1;
-	static const BYTE kAlpha = 255;
-
-    for (UINT y = 0; y < dwHeightInPixels; y += 2) {
-        const BYTE* lpLineY1 = lpBitsY;
-        const BYTE* lpLineY2 = lpBitsY + srcStride;
-        const BYTE* lpLineCr = lpBitsCr;
-        const BYTE* lpLineCb = lpBitsCb;
-
-        LPBYTE lpDibLine1 = pDst;
-        LPBYTE lpDibLine2 = pDst + dstStride;
-
-        for (UINT x = 0; x < dwWidthInPixels; x += 2) {
-            int  y0 = (int)lpLineY1[0];
-            int  y1 = (int)lpLineY1[1];
-            int  y2 = (int)lpLineY2[0];
-            int  y3 = (int)lpLineY2[1];
-            int  cb = (int)lpLineCb[0];
-            int  cr = (int)lpLineCr[0];
-
-            RGBQUAD r = ConvertYCrCbToRGB(y0, cr, cb);
-            lpDibLine1[0] = r.rgbBlue;
-            lpDibLine1[1] = r.rgbGreen;
-            lpDibLine1[2] = r.rgbRed;
-            lpDibLine1[3] = kAlpha;
-
-            r = ConvertYCrCbToRGB(y1, cr, cb);
-            lpDibLine1[4] = r.rgbBlue;
-            lpDibLine1[5] = r.rgbGreen;
-            lpDibLine1[6] = r.rgbRed;
-            lpDibLine1[7] = kAlpha;
-
-            r = ConvertYCrCbToRGB(y2, cr, cb);
-            lpDibLine2[0] = r.rgbBlue;
-            lpDibLine2[1] = r.rgbGreen;
-            lpDibLine2[2] = r.rgbRed;
-            lpDibLine2[3] = kAlpha;
-
-            r = ConvertYCrCbToRGB(y3, cr, cb);
-            lpDibLine2[4] = r.rgbBlue;
-            lpDibLine2[5] = r.rgbGreen;
-            lpDibLine2[6] = r.rgbRed;
-            lpDibLine2[7] = kAlpha;
-
-            lpLineY1 += 2;
-            lpLineY2 += 2;
-            lpLineCr += 2;
-            lpLineCb += 2;
-
-            lpDibLine1 += 8;
-            lpDibLine2 += 8;
-        }
-
-        pDst += (2 * dstStride);
-        lpBitsY   += (2 * srcStride);
-        lpBitsCr  += srcStride;
-        lpBitsCb  += srcStride;
-    }
+    layered_win_->Stats()->Record(STATS_CONVERT, begin, StatsClockNs());
+    layered_win_->OnNewFrame(timestamp, arrival);
 }
 
 HRESULT GetDefaultStride(IMFMediaType *pType, LONG *plStride)
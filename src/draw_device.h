@@ -1,14 +1,12 @@
 #pragma once
 #include <mfidl.h>
-
-typedef void (*IMAGE_TRANSFORM_FN)(
-    BYTE*       pDest,
-    LONG        lDestStride,
-    const BYTE* pSrc,
-    LONG        lSrcStride,
-    DWORD       dwWidthInPixels,
-    DWORD       dwHeightInPixels
-);
+#include "capture_source.h"
+#include "image_transform.h"
+#include "jpeg_decoder.h"
+#include "raw_recording.h"
+#include "replay_ring.h"
+#include "worker_pool.h"
+#include "yuv_scaler.h"
 
 class LayeredWindow;
 
@@ -18,19 +16,46 @@ public:
     void Init(LayeredWindow* layered_win);
     HRESULT SetVideoType(IMFMediaType *pType);
     SIZE FrameSize() const;
-    HRESULT DrawFrame(IMFMediaBuffer *pBuffer);
+    HRESULT DrawFrame(IMFMediaBuffer *pBuffer, LONGLONG timestamp, DWORD flags);
+
+    // Frames of a CaptureSource instead of a media type and buffers.
+    HRESULT SetFormat(const CaptureFormat& format);
+    HRESULT DrawRawFrame(const RawFrame& frame);
+
+    // Frames are handed to |recorder| as they arrive, before anything is
+    // done to them; nullptr stops that.
+    RecordingInfo StreamInfo() const;
+    void SetRecorder(FrameRecorder* recorder);
+
+    // The same for the instant replay ring.
+    void SetReplayRing(ReplayRing* ring);
 
     BOOL IsFormatSupported(REFGUID subtype) const;
     HRESULT GetFormat(DWORD index, GUID *pSubtype) const;
 
 private:
     HRESULT SetConversionFunction(REFGUID subtype);
+    void DrawJpegFrame(const BYTE* data, DWORD length, LONGLONG timestamp, uint64_t arrival);
+    void Record(const BYTE* scanline0, LONG stride, size_t size, LONGLONG timestamp, DWORD flags);
+    void ConvertFrame(const BYTE* scanline0, LONG stride, LONGLONG timestamp, uint64_t arrival);
 
     LayeredWindow* layered_win_ = nullptr;
     UINT32 m_width = 0;
     UINT32 m_height = 0;
+    UINT32 m_fpsNum = 0;
+    UINT32 m_fpsDen = 0;
+    GUID m_subtype = {};
     LONG m_lDefaultStride = 0;
     IMAGE_TRANSFORM_FN m_convertFn = nullptr;
+    PlaneLayout m_layout = PLANE_LAYOUT_PACKED;
+    uint32_t m_format = 0;
+    const YuvConstants* m_yuv = nullptr;
+    bool m_jpeg = false;
+    WorkerPool pool_;
+    JpegDecoder jpeg_{ &pool_ };
+    YuvScaler yuv_scaler_;
+    FrameRecorder* recorder_ = nullptr;
+    ReplayRing* ring_ = nullptr;
 };
 
 class VideoBufferLock
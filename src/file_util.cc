@@ -0,0 +1,84 @@
+#include "file_util.h"
+
+#if defined(_WIN32)
+#include <windows.h>
+#endif
+
+#if defined(_WIN32)
+std::wstring WidePath(const std::string& path)
+{
+    int n = MultiByteToWideChar(CP_UTF8, 0, path.c_str(), -1, NULL, 0);
+    if (n <= 0)
+        return std::wstring();
+
+    std::wstring wide(n, L'\0');
+    MultiByteToWideChar(CP_UTF8, 0, path.c_str(), -1, &wide[0], n);
+    wide.resize(n - 1);
+    return wide;
+}
+#endif
+
+FILE* CreateFileForWrite(const std::string& path)
+{
+#if defined(_WIN32)
+    FILE* file = nullptr;
+    if (_wfopen_s(&file, WidePath(path).c_str(), L"wb") != 0)
+        return nullptr;
+
+    return file;
+#else
+    return fopen(path.c_str(), "wb");
+#endif
+}
+
+FILE* OpenFileForRead(const std::string& path)
+{
+#if defined(_WIN32)
+    FILE* file = nullptr;
+    if (_wfopen_s(&file, WidePath(path).c_str(), L"rb") != 0)
+        return nullptr;
+
+    return file;
+#else
+    return fopen(path.c_str(), "rb");
+#endif
+}
+
+bool MoveFileOver(const std::string& from, const std::string& to)
+{
+#if defined(_WIN32)
+    return MoveFileExW(WidePath(from).c_str(), WidePath(to).c_str(),
+        MOVEFILE_REPLACE_EXISTING) != FALSE;
+#else
+    return rename(from.c_str(), to.c_str()) == 0;
+#endif
+}
+
+static const uint32_t* CrcTable()
+{
+    static const struct Table {
+        uint32_t v[256];
+        Table()
+        {
+            for (uint32_t n = 0; n < 256; ++n) {
+                uint32_t c = n;
+                for (int k = 0; k < 8; ++k)
+                    c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+
+                v[n] = c;
+            }
+        }
+    } table;
+
+    return table.v;
+}
+
+uint32_t Crc32(uint32_t crc, const uint8_t* data, size_t size)
+{
+    const uint32_t* table = CrcTable();
+    crc = ~crc;
+    for (size_t i = 0; i < size; ++i)
+        crc = table[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+
+    return ~crc;
+}
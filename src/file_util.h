@@ -0,0 +1,24 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string>
+
+// Paths are UTF-8 everywhere; on Windows they are widened for the wide
+// APIs.
+#if defined(_WIN32)
+std::wstring WidePath(const std::string& path);
+#endif
+
+// Creates or truncates |path| for binary writing.
+FILE* CreateFileForWrite(const std::string& path);
+
+// Opens |path| for binary reading.
+FILE* OpenFileForRead(const std::string& path);
+
+// Renames |from| to |to|, replacing |to| in one step if it exists.
+bool MoveFileOver(const std::string& from, const std::string& to);
+
+// CRC-32 as in zlib and PNG. Start with 0; pass the result of one call to
+// the next to go on.
+uint32_t Crc32(uint32_t crc, const uint8_t* data, size_t size);
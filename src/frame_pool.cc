@@ -0,0 +1,170 @@
+#include "frame_pool.h"
+
+static const size_t kFrameAlignment = 64;
+
+FrameRef::FrameRef(Frame* frame)
+    : frame_(frame)
+{
+    frame_->refs_.store(1, std::memory_order_relaxed);
+}
+
+FrameRef::FrameRef(const FrameRef& other)
+    : frame_(other.frame_)
+{
+    if (frame_)
+        frame_->refs_.fetch_add(1, std::memory_order_relaxed);
+}
+
+FrameRef::FrameRef(FrameRef&& other)
+    : frame_(other.frame_)
+{
+    other.frame_ = nullptr;
+}
+
+FrameRef& FrameRef::operator=(FrameRef other)
+{
+    Frame* frame = frame_;
+    frame_ = other.frame_;
+    other.frame_ = frame;
+    return *this;
+}
+
+FrameRef::~FrameRef()
+{
+    Reset();
+}
+
+void FrameRef::Reset()
+{
+    if (!frame_)
+        return;
+
+    // The holder of the last reference sees every write made through the
+    // others before the frame is handed out again.
+    if (frame_->refs_.fetch_sub(1, std::memory_order_acq_rel) == 1)
+        frame_->pool_->Recycle(frame_);
+
+    frame_ = nullptr;
+}
+
+bool FrameRef::Unique() const
+{
+    return frame_ && frame_->refs_.load(std::memory_order_acquire) == 1;
+}
+
+FramePool::~FramePool()
+{
+    for (Frame* frame : free_) {
+        FreeBuffer(frame);
+        delete frame;
+    }
+}
+
+void FramePool::SetAllocator(FrameAllocator* allocator)
+{
+    std::unique_lock<std::mutex> lock(mtx_);
+    for (Frame* frame : free_)
+        FreeBuffer(frame);
+
+    allocator_ = allocator;
+}
+
+FrameRef FramePool::Acquire(const FrameFormat& format)
+{
+    const int32_t row = format.stride < 0 ? -format.stride : format.stride;
+    const size_t size = (size_t)row * format.height;
+    const auto fits = [&](const Frame* f) {
+        return f->capacity_ >= size && (!f->handle_ || f->handle_stride_ == format.stride);
+    };
+
+    Frame* frame = nullptr;
+    {
+        std::unique_lock<std::mutex> lock(mtx_);
+
+        // Any buffer that is large enough; a new size takes over the
+        // smallest one instead of adding to the pool.
+        size_t pick = free_.size();
+        for (size_t i = 0; i < free_.size(); ++i) {
+            const size_t capacity = free_[i]->capacity_;
+            if (fits(free_[i])) {
+                pick = i;
+                break;
+            }
+
+            if (pick == free_.size() || capacity < free_[pick]->capacity_)
+                pick = i;
+        }
+
+        if (pick < free_.size()) {
+            frame = free_[pick];
+            free_.erase(free_.begin() + pick);
+        } else {
+            ++allocated_;
+        }
+    }
+
+    if (!frame) {
+        frame = new Frame;
+        frame->pool_ = this;
+    }
+
+    if (!fits(frame))
+        Allocate(frame, format, size);
+
+    frame->format_ = format;
+    frame->timestamp_ = 0;
+    frame->arrival_ = 0;
+    return FrameRef(frame);
+}
+
+// From the allocator if there is one that has a buffer for |format|,
+// else from the heap.
+void FramePool::Allocate(Frame* frame, const FrameFormat& format, size_t size)
+{
+    FreeBuffer(frame);
+
+    void* handle = nullptr;
+    uint8_t* data = allocator_ ? allocator_->Allocate(format, &handle) : nullptr;
+    if (data) {
+        frame->data_ = data;
+        frame->handle_ = handle;
+        frame->handle_stride_ = format.stride;
+    } else {
+        frame->storage_ = std::vector<uint8_t>(size + kFrameAlignment);
+        const uintptr_t p = (uintptr_t)frame->storage_.data();
+        frame->data_ = frame->storage_.data()
+            + ((kFrameAlignment - p % kFrameAlignment) % kFrameAlignment);
+    }
+
+    frame->capacity_ = size;
+}
+
+void FramePool::FreeBuffer(Frame* frame)
+{
+    if (frame->handle_)
+        allocator_->Free(frame->data_, frame->handle_);
+
+    std::vector<uint8_t>().swap(frame->storage_);
+    frame->handle_ = nullptr;
+    frame->handle_stride_ = 0;
+    frame->capacity_ = 0;
+    frame->data_ = nullptr;
+}
+
+void FramePool::Recycle(Frame* frame)
+{
+    std::unique_lock<std::mutex> lock(mtx_);
+    free_.push_back(frame);
+}
+
+size_t FramePool::InUse() const
+{
+    std::unique_lock<std::mutex> lock(mtx_);
+    return allocated_ - free_.size();
+}
+
+size_t FramePool::Allocated() const
+{
+    std::unique_lock<std::mutex> lock(mtx_);
+    return allocated_;
+}
@@ -0,0 +1,133 @@
+#pragma once
+#include <atomic>
+#include <mutex>
+#include <stdint.h>
+#include <vector>
+
+class FramePool;
+
+// The fourcc of 32-bit BGRA frames, rows from the top.
+static const uint32_t kFrameFormatBgra =
+    (uint32_t)'B' | (uint32_t)'G' << 8 | (uint32_t)'R' << 16 | (uint32_t)'A' << 24;
+
+struct FrameFormat {
+    uint32_t fourcc;
+    uint32_t width;
+    uint32_t height;
+    int32_t stride;  // bytes per row of the single plane
+};
+
+// Where the buffers of a pool come from, if not from the heap: memory a
+// frame can be shown from as it is, for one. A buffer is made for one
+// stride and only holds frames of that stride. Called on whatever threads
+// take and drop frames.
+class FrameAllocator
+{
+public:
+    virtual ~FrameAllocator() {}
+
+    // A buffer for |format| on a cache line and the |handle| it is freed
+    // by; nullptr if the allocator has none for it, and the pool takes
+    // one from the heap instead.
+    virtual uint8_t* Allocate(const FrameFormat& format, void** handle) = 0;
+    virtual void Free(uint8_t* data, void* handle) = 0;
+};
+
+// One buffer of a FramePool. Its pixels start on a cache line.
+class Frame
+{
+public:
+    uint8_t* Data() const { return data_; }
+    const FrameFormat& Format() const { return format_; }
+    uint32_t Width() const { return format_.width; }
+    uint32_t Height() const { return format_.height; }
+    int32_t Stride() const { return format_.stride; }
+
+    // Capture time in 100 ns units, set by whoever fills the frame.
+    int64_t Timestamp() const { return timestamp_; }
+    void SetTimestamp(int64_t t) { timestamp_ = t; }
+
+    // StatsClockNs() when the sample reached the app, for the latency
+    // stats.
+    uint64_t Arrival() const { return arrival_; }
+    void SetArrival(uint64_t ns) { arrival_ = ns; }
+
+    // What the pool's FrameAllocator returned with the buffer; null for
+    // buffers from the heap.
+    void* Handle() const { return handle_; }
+
+private:
+    friend class FramePool;
+    friend class FrameRef;
+
+    FramePool* pool_ = nullptr;
+    std::atomic<int> refs_{ 0 };
+    std::vector<uint8_t> storage_;
+    void* handle_ = nullptr;
+    int32_t handle_stride_ = 0;  // the stride the allocator made it for
+    size_t capacity_ = 0;
+    uint8_t* data_ = nullptr;
+    FrameFormat format_ = {};
+    int64_t timestamp_ = 0;
+    uint64_t arrival_ = 0;
+};
+
+// A counted reference to a Frame; the frame goes back to its pool when
+// the last reference to it is dropped, from whatever thread that is.
+class FrameRef
+{
+public:
+    FrameRef() = default;
+    FrameRef(const FrameRef& other);
+    FrameRef(FrameRef&& other);
+    FrameRef& operator=(FrameRef other);
+    ~FrameRef();
+
+    Frame* operator->() const { return frame_; }
+    Frame& operator*() const { return *frame_; }
+    explicit operator bool() const { return frame_ != nullptr; }
+    void Reset();
+
+    // No other reference to the frame, so it may be written in place.
+    bool Unique() const;
+
+private:
+    friend class FramePool;
+    explicit FrameRef(Frame* frame);
+
+    Frame* frame_ = nullptr;
+};
+
+// Recycles frame buffers, so that once a stream runs, taking a frame
+// allocates nothing. Buffers keep the largest size they were given. The
+// pool must outlive its frames.
+class FramePool
+{
+public:
+    FramePool() = default;
+    ~FramePool();
+
+    // Before the first frame; buffers pooled until then are freed. The
+    // allocator must outlive the pool.
+    void SetAllocator(FrameAllocator* allocator);
+
+    FrameRef Acquire(const FrameFormat& format);
+
+    // Frames handed out and not returned yet, and frames allocated.
+    size_t InUse() const;
+    size_t Allocated() const;
+
+private:
+    FramePool(const FramePool&) = delete;
+    FramePool& operator=(const FramePool&) = delete;
+
+    friend class FrameRef;
+    void Recycle(Frame* frame);
+    void Allocate(Frame* frame, const FrameFormat& format, size_t size);
+    void FreeBuffer(Frame* frame);
+
+    mutable std::mutex mtx_;
+    FrameAllocator* allocator_ = nullptr;
+    std::vector<Frame*> free_;
+    size_t allocated_ = 0;
+};
@@ -0,0 +1,272 @@
+#include "frame_stats.h"
+#include <chrono>
+#include <iomanip>
+
+uint64_t StatsClockNs()
+{
+    // The QueryPerformanceCounter on Windows.
+    return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static uint32_t HighestBit(uint64_t v)
+{
+    uint32_t bit = 0;
+    while (v >>= 1)
+        ++bit;
+
+    return bit;
+}
+
+uint32_t LatencyHistogram::BucketOf(uint64_t ns)
+{
+    const uint64_t kSubNum = 1u << kSubBits;
+    if (ns < kSubNum)
+        return (uint32_t)ns;
+
+    if (ns >> kMaxBits)
+        return kBucketNum - 1;
+
+    // The top kSubBits + 1 bits pick the bucket within the power of two.
+    const uint32_t shift = HighestBit(ns) - kSubBits;
+    return ((shift + 1) << kSubBits) + (uint32_t)((ns >> shift) - kSubNum);
+}
+
+uint64_t LatencyHistogram::BucketLow(uint32_t bucket)
+{
+    const uint64_t kSubNum = 1u << kSubBits;
+    if (bucket < kSubNum)
+        return bucket;
+
+    const uint32_t shift = (bucket >> kSubBits) - 1;
+    return (kSubNum + (bucket & (kSubNum - 1))) << shift;
+}
+
+uint64_t LatencyHistogram::BucketHigh(uint32_t bucket)
+{
+    return BucketLow(bucket + 1) - 1;
+}
+
+LatencyHistogram::LatencyHistogram()
+{
+    Reset();
+}
+
+void LatencyHistogram::Record(uint64_t ns)
+{
+    buckets_[BucketOf(ns)].fetch_add(1, std::memory_order_relaxed);
+    sum_.fetch_add(ns, std::memory_order_relaxed);
+
+    uint64_t v = min_.load(std::memory_order_relaxed);
+    while (ns < v && !min_.compare_exchange_weak(v, ns, std::memory_order_relaxed)) {}
+
+    v = max_.load(std::memory_order_relaxed);
+    while (ns > v && !max_.compare_exchange_weak(v, ns, std::memory_order_relaxed)) {}
+}
+
+LatencyHistogram::Snapshot LatencyHistogram::Take() const
+{
+    // Values recorded meanwhile may be in some fields and not yet in
+    // others; the count is taken from the buckets, so that percentiles
+    // always add up.
+    Snapshot s;
+    s.buckets.resize(kBucketNum);
+    for (uint32_t i = 0; i < kBucketNum; ++i) {
+        s.buckets[i] = buckets_[i].load(std::memory_order_relaxed);
+        s.count += s.buckets[i];
+    }
+
+    s.sum = sum_.load(std::memory_order_relaxed);
+    s.min = min_.load(std::memory_order_relaxed);
+    if (!s.count || s.min == UINT64_MAX)
+        s.min = 0;
+
+    s.max = max_.load(std::memory_order_relaxed);
+    return s;
+}
+
+void LatencyHistogram::Reset()
+{
+    for (auto& b : buckets_)
+        b.store(0, std::memory_order_relaxed);
+
+    sum_.store(0, std::memory_order_relaxed);
+    min_.store(UINT64_MAX, std::memory_order_relaxed);
+    max_.store(0, std::memory_order_relaxed);
+}
+
+uint64_t LatencyHistogram::Snapshot::Percentile(double percent) const
+{
+    if (!count)
+        return 0;
+
+    uint64_t rank = (uint64_t)(percent / 100.0 * count + 0.5);
+    if (rank < 1)
+        rank = 1;
+
+    uint64_t seen = 0;
+    for (uint32_t i = 0; i < buckets.size(); ++i) {
+        seen += buckets[i];
+        if (seen >= rank) {
+            const uint64_t high = BucketHigh(i);
+            return high < max ? high : max;
+        }
+    }
+
+    return max;
+}
+
+double LatencyHistogram::Snapshot::Mean() const
+{
+    return count ? (double)sum / count : 0;
+}
+
+const char* StatsStageName(StatsStage stage)
+{
+    static const char* const names[STATS_STAGE_NUM] = {
+        "lock", "ring", "convert", "scale", "mask", "present", "latency",
+    };
+
+    return names[stage];
+}
+
+const char* FrameCounterName(FrameCounter counter)
+{
+    static const char* const names[FRAME_COUNTER_NUM] = {
+        "captured", "presented", "dropped",
+    };
+
+    return names[counter];
+}
+
+const char* StatsGaugeName(StatsGauge gauge)
+{
+    static const char* const names[STATS_GAUGE_NUM] = {
+        "ring_frames", "ring_bytes", "ring_raw_bytes", "first_frame_us", "mode_cached",
+    };
+
+    return names[gauge];
+}
+
+FrameStats::FrameStats()
+{
+    for (auto& g : gauges_)
+        g.store(0, std::memory_order_relaxed);
+
+    Reset();
+}
+
+void FrameStats::Record(StatsStage stage, uint64_t begin_ns, uint64_t end_ns)
+{
+    stages_[stage].Record(end_ns > begin_ns ? end_ns - begin_ns : 0);
+}
+
+void FrameStats::Count(FrameCounter counter, uint64_t n)
+{
+    frames_[counter].fetch_add(n, std::memory_order_relaxed);
+}
+
+void FrameStats::Set(StatsGauge gauge, uint64_t value)
+{
+    gauges_[gauge].store(value, std::memory_order_relaxed);
+}
+
+StatsReport FrameStats::Report() const
+{
+    StatsReport r;
+    r.seconds = (StatsClockNs() - reset_ns_.load(std::memory_order_relaxed)) / 1e9;
+    for (int i = 0; i < FRAME_COUNTER_NUM; ++i)
+        r.frames[i] = frames_[i].load(std::memory_order_relaxed);
+
+    for (int i = 0; i < STATS_GAUGE_NUM; ++i)
+        r.gauges[i] = gauges_[i].load(std::memory_order_relaxed);
+
+    for (int i = 0; i < STATS_STAGE_NUM; ++i)
+        r.stages[i] = stages_[i].Take();
+
+    return r;
+}
+
+void FrameStats::Reset()
+{
+    for (auto& h : stages_)
+        h.Reset();
+
+    for (auto& f : frames_)
+        f.store(0, std::memory_order_relaxed);
+
+    reset_ns_.store(StatsClockNs(), std::memory_order_relaxed);
+}
+
+static double Micros(uint64_t ns)
+{
+    return ns / 1000.0;
+}
+
+void WriteStatsJson(const StatsReport& report, std::ostream* out)
+{
+    std::ostream& o = *out;
+    o << std::fixed << std::setprecision(3);
+    o << "{\n  \"seconds\": " << report.seconds << ",\n  \"frames\": {";
+    for (int i = 0; i < FRAME_COUNTER_NUM; ++i) {
+        o << (i ? ", " : "") << "\"" << FrameCounterName((FrameCounter)i)
+            << "\": " << report.frames[i];
+    }
+
+    o << "},\n  \"gauges\": {";
+    for (int i = 0; i < STATS_GAUGE_NUM; ++i) {
+        o << (i ? ", " : "") << "\"" << StatsGaugeName((StatsGauge)i)
+            << "\": " << report.gauges[i];
+    }
+
+    o << "},\n  \"stages\": {";
+    for (int i = 0; i < STATS_STAGE_NUM; ++i) {
+        const LatencyHistogram::Snapshot& s = report.stages[i];
+        o << (i ? "," : "") << "\n    \"" << StatsStageName((StatsStage)i) << "\": {\n"
+            << "      \"count\": " << s.count
+            << ", \"min_us\": " << Micros(s.min)
+            << ", \"mean_us\": " << s.Mean() / 1000.0
+            << ", \"p50_us\": " << Micros(s.Percentile(50))
+            << ", \"p90_us\": " << Micros(s.Percentile(90))
+            << ", \"p99_us\": " << Micros(s.Percentile(99))
+            << ", \"p999_us\": " << Micros(s.Percentile(99.9))
+            << ", \"max_us\": " << Micros(s.max) << ",\n"
+            << "      \"buckets\": [";
+
+        // [low, high, count] of the buckets with values.
+        bool first = true;
+        for (uint32_t b = 0; b < s.buckets.size(); ++b) {
+            if (!s.buckets[b])
+                continue;
+
+            o << (first ? "" : ", ") << "[" << Micros(LatencyHistogram::BucketLow(b))
+                << ", " << Micros(LatencyHistogram::BucketHigh(b)) << ", " << s.buckets[b] << "]";
+            first = false;
+        }
+
+        o << "]\n    }";
+    }
+
+    o << "\n  }\n}\n";
+}
+
+void WriteStatsCsv(const StatsReport& report, std::ostream* out)
+{
+    std::ostream& o = *out;
+    o << std::fixed << std::setprecision(3);
+    o << "stage,low_us,high_us,count,percentile\n";
+    for (int i = 0; i < STATS_STAGE_NUM; ++i) {
+        const LatencyHistogram::Snapshot& s = report.stages[i];
+        uint64_t seen = 0;
+        for (uint32_t b = 0; b < s.buckets.size(); ++b) {
+            if (!s.buckets[b])
+                continue;
+
+            seen += s.buckets[b];
+            o << StatsStageName((StatsStage)i) << ","
+                << Micros(LatencyHistogram::BucketLow(b)) << ","
+                << Micros(LatencyHistogram::BucketHigh(b)) << ","
+                << s.buckets[b] << "," << 100.0 * seen / s.count << "\n";
+        }
+    }
+}
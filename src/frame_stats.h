@@ -0,0 +1,125 @@
+#pragma once
+#include <atomic>
+#include <ostream>
+#include <stdint.h>
+#include <vector>
+
+// Monotonic time in nanoseconds, for the stats only.
+uint64_t StatsClockNs();
+
+// A latency histogram in the manner of HdrHistogram: below 2^kSubBits ns
+// every value has a bucket of its own, above that each power of two is
+// split into 2^kSubBits buckets, so a value is kept to about 3% up to
+// about a minute. Record takes no lock and may be called from any thread.
+class LatencyHistogram
+{
+public:
+    static const uint32_t kSubBits = 5;
+    static const uint32_t kMaxBits = 36;  // values are clamped to 2^36 ns
+    static const uint32_t kBucketNum = (kMaxBits - kSubBits + 1) << kSubBits;
+
+    static uint32_t BucketOf(uint64_t ns);
+    static uint64_t BucketLow(uint32_t bucket);
+    static uint64_t BucketHigh(uint32_t bucket);  // inclusive
+
+    // A copy of the counts, which a reader may look at in peace.
+    struct Snapshot {
+        uint64_t count = 0;
+        uint64_t sum = 0;
+        uint64_t min = 0;
+        uint64_t max = 0;
+        std::vector<uint64_t> buckets;
+
+        // The value |percent| of the values are at or below, to the
+        // precision of a bucket; 0 without values.
+        uint64_t Percentile(double percent) const;
+        double Mean() const;
+    };
+
+    LatencyHistogram();
+    void Record(uint64_t ns);
+    Snapshot Take() const;
+    void Reset();
+
+private:
+    LatencyHistogram(const LatencyHistogram&) = delete;
+    LatencyHistogram& operator=(const LatencyHistogram&) = delete;
+
+    std::atomic<uint64_t> buckets_[kBucketNum];
+    std::atomic<uint64_t> sum_;
+    std::atomic<uint64_t> min_;
+    std::atomic<uint64_t> max_;
+};
+
+// The steps a frame takes from the capture callback to the screen.
+// Mirroring is part of the conversion, and so is the shrinking of YUV
+// planes below 100%; ring is the copy into the instant replay ring, when
+// on. Latency is from the sample reaching the app to the window being
+// updated.
+enum StatsStage {
+    STATS_LOCK,
+    STATS_RING,
+    STATS_CONVERT,
+    STATS_SCALE,
+    STATS_MASK,
+    STATS_PRESENT,
+    STATS_LATENCY,
+    STATS_STAGE_NUM,
+};
+
+enum FrameCounter {
+    FRAMES_CAPTURED,
+    FRAMES_PRESENTED,
+    FRAMES_DROPPED,
+    FRAME_COUNTER_NUM,
+};
+
+// Current values rather than totals; a reset leaves them.
+enum StatsGauge {
+    GAUGE_RING_FRAMES,
+    GAUGE_RING_BYTES,      // held by the instant replay ring
+    GAUGE_RING_RAW_BYTES,  // the same frames uncompressed
+    GAUGE_FIRST_FRAME_US,  // from opening the device to its first frame
+    GAUGE_MODE_CACHED,     // 1 if it was opened in a cached mode
+    STATS_GAUGE_NUM,
+};
+
+const char* StatsStageName(StatsStage stage);
+const char* FrameCounterName(FrameCounter counter);
+const char* StatsGaugeName(StatsGauge gauge);
+
+struct StatsReport {
+    double seconds;  // since the stats were reset
+    uint64_t frames[FRAME_COUNTER_NUM];
+    uint64_t gauges[STATS_GAUGE_NUM];
+    LatencyHistogram::Snapshot stages[STATS_STAGE_NUM];
+};
+
+// Always-on frame timing: a histogram per stage and a few counters, all
+// updated without locks, so the frame path pays two clock reads and a
+// few atomic adds per stage.
+class FrameStats
+{
+public:
+    FrameStats();
+
+    void Record(StatsStage stage, uint64_t begin_ns, uint64_t end_ns);
+    void Count(FrameCounter counter, uint64_t n = 1);
+    void Set(StatsGauge gauge, uint64_t value);
+
+    StatsReport Report() const;
+    void Reset();
+
+private:
+    LatencyHistogram stages_[STATS_STAGE_NUM];
+    std::atomic<uint64_t> frames_[FRAME_COUNTER_NUM];
+    std::atomic<uint64_t> gauges_[STATS_GAUGE_NUM];
+    std::atomic<uint64_t> reset_ns_;
+};
+
+// Percentiles and the non-empty buckets of every stage, in microseconds.
+void WriteStatsJson(const StatsReport& report, std::ostream* out);
+
+// One row per non-empty bucket with the share of values up to it, the
+// percentile distribution HdrHistogram prints.
+void WriteStatsCsv(const StatsReport& report, std::ostream* out);
@@ -0,0 +1,173 @@
+#include "frame_trace.h"
+#include <algorithm>
+#include <iomanip>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+// One writer, the thread it belongs to; readers check the sequence of a
+// slot before and after reading it and skip slots written meanwhile.
+struct TraceRing {
+    struct Slot {
+        std::atomic<uint64_t> seq{ 0 };  // 2n + 1 while event n is written, 2n + 2 after
+        std::atomic<const char*> name{ nullptr };
+        std::atomic<uint64_t> begin{ 0 };
+        std::atomic<uint64_t> end{ 0 };
+        std::atomic<int64_t> id{ -1 };
+    };
+
+    uint32_t tid = 0;
+    std::atomic<const char*> thread_name{ nullptr };
+    std::atomic<uint64_t> head{ 0 };
+    Slot slots[Tracer::kRingCapacity];
+};
+
+struct TraceEvent {
+    const char* name;
+    uint64_t begin;
+    uint64_t end;
+    int64_t id;
+    uint32_t tid;
+};
+
+static std::mutex g_rings_mtx;
+static std::vector<std::unique_ptr<TraceRing>> g_rings;  // kept after their threads end
+static std::atomic<uint64_t> g_start_ns{ 0 };
+
+static thread_local TraceRing* t_ring = nullptr;
+static thread_local const char* t_thread_name = nullptr;
+
+static TraceRing* ThreadRing()
+{
+    if (t_ring)
+        return t_ring;
+
+    std::unique_ptr<TraceRing> ring(new TraceRing);
+    ring->thread_name = t_thread_name;
+
+    std::unique_lock<std::mutex> lock(g_rings_mtx);
+    ring->tid = (uint32_t)g_rings.size() + 1;
+    t_ring = ring.get();
+    g_rings.push_back(std::move(ring));
+    return t_ring;
+}
+
+static void WriteString(std::ostream& o, const char* s)
+{
+    o << '"';
+    for (; *s; ++s) {
+        if (*s == '"' || *s == '\\')
+            o << '\\';
+
+        o << *s;
+    }
+
+    o << '"';
+}
+
+std::atomic<bool> Tracer::enabled_{ false };
+
+void Tracer::Start()
+{
+    g_start_ns.store(StatsClockNs(), std::memory_order_relaxed);
+    enabled_.store(true, std::memory_order_relaxed);
+}
+
+void Tracer::Stop()
+{
+    enabled_.store(false, std::memory_order_relaxed);
+}
+
+void Tracer::SetThreadName(const char* name)
+{
+    t_thread_name = name;
+    if (t_ring)
+        t_ring->thread_name.store(name, std::memory_order_relaxed);
+}
+
+void Tracer::Record(const char* name, uint64_t begin_ns, uint64_t end_ns, int64_t id)
+{
+    TraceRing* ring = ThreadRing();
+    const uint64_t n = ring->head.load(std::memory_order_relaxed);
+    TraceRing::Slot& slot = ring->slots[n & (kRingCapacity - 1)];
+
+    slot.seq.store(2 * n + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    slot.name.store(name, std::memory_order_relaxed);
+    slot.begin.store(begin_ns, std::memory_order_relaxed);
+    slot.end.store(end_ns, std::memory_order_relaxed);
+    slot.id.store(id, std::memory_order_relaxed);
+    slot.seq.store(2 * n + 2, std::memory_order_release);
+    ring->head.store(n + 1, std::memory_order_release);
+}
+
+void Tracer::WriteJson(std::ostream* out)
+{
+    const uint64_t start = g_start_ns.load(std::memory_order_relaxed);
+    std::vector<TraceEvent> events;
+    std::vector<std::pair<uint32_t, const char*>> threads;
+
+    {
+        std::unique_lock<std::mutex> lock(g_rings_mtx);
+        for (const auto& ring : g_rings) {
+            threads.emplace_back(ring->tid, ring->thread_name.load(std::memory_order_relaxed));
+
+            const uint64_t head = ring->head.load(std::memory_order_acquire);
+            const uint64_t first = head > kRingCapacity ? head - kRingCapacity : 0;
+            for (uint64_t n = first; n < head; ++n) {
+                const TraceRing::Slot& slot = ring->slots[n & (kRingCapacity - 1)];
+                const uint64_t seq = slot.seq.load(std::memory_order_acquire);
+                if (seq != 2 * n + 2)
+                    continue;
+
+                TraceEvent e;
+                e.name = slot.name.load(std::memory_order_relaxed);
+                e.begin = slot.begin.load(std::memory_order_relaxed);
+                e.end = slot.end.load(std::memory_order_relaxed);
+                e.id = slot.id.load(std::memory_order_relaxed);
+                e.tid = ring->tid;
+                std::atomic_thread_fence(std::memory_order_acquire);
+                if (slot.seq.load(std::memory_order_relaxed) != seq || e.begin < start)
+                    continue;
+
+                events.push_back(e);
+            }
+        }
+    }
+
+    std::sort(events.begin(), events.end(), [](const TraceEvent& a, const TraceEvent& b) {
+        return a.begin < b.begin;
+    });
+
+    // Times in microseconds from Start.
+    std::ostream& o = *out;
+    o << std::fixed << std::setprecision(3);
+    o << "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [";
+
+    bool first = true;
+    for (const auto& t : threads) {
+        if (!t.second)
+            continue;
+
+        o << (first ? "\n" : ",\n") << "{\"ph\": \"M\", \"pid\": 1, \"tid\": " << t.first
+            << ", \"name\": \"thread_name\", \"args\": {\"name\": ";
+        WriteString(o, t.second);
+        o << "}}";
+        first = false;
+    }
+
+    for (const TraceEvent& e : events) {
+        o << (first ? "\n" : ",\n") << "{\"ph\": \"X\", \"pid\": 1, \"tid\": " << e.tid
+            << ", \"name\": ";
+        WriteString(o, e.name);
+        o << ", \"ts\": " << (e.begin - start) / 1000.0
+            << ", \"dur\": " << (e.end > e.begin ? e.end - e.begin : 0) / 1000.0;
+        if (e.id >= 0)
+            o << ", \"args\": {\"frame\": " << e.id << "}";
+
+        o << "}";
+        first = false;
+    }
+
+    o << "\n]}\n";
+}
@@ -0,0 +1,67 @@
+#pragma once
+#include <atomic>
+#include <ostream>
+#include <stdint.h>
+#include "frame_stats.h"
+
+// Per-frame timelines in the Chrome trace event format, which
+// chrome://tracing and Perfetto open. Spans go into a ring buffer of the
+// thread that records them, without locks, and the newest of them are
+// written out on demand. While tracing is off a span costs one relaxed
+// load.
+class Tracer
+{
+public:
+    // Events per thread; older ones are overwritten.
+    static const uint32_t kRingCapacity = 1 << 14;
+
+    static bool Enabled() { return enabled_.load(std::memory_order_relaxed); }
+
+    // Starting drops whatever an earlier run recorded.
+    static void Start();
+    static void Stop();
+
+    // Names the calling thread in the trace; |name| must outlive it.
+    static void SetThreadName(const char* name);
+
+    // A complete span of the calling thread. |name| must be a literal or
+    // outlive the tracer; |id| ties the spans of one frame together, -1
+    // for none.
+    static void Record(const char* name, uint64_t begin_ns, uint64_t end_ns, int64_t id);
+
+    // The spans recorded since Start, from all threads. Safe to call
+    // while threads still record.
+    static void WriteJson(std::ostream* out);
+
+private:
+    static std::atomic<bool> enabled_;
+};
+
+// Records the enclosing scope as a span while tracing is on.
+class TraceScope
+{
+public:
+    explicit TraceScope(const char* name, int64_t id = -1)
+        : name_(name), id_(id), begin_(Tracer::Enabled() ? StatsClockNs() : 0)
+    {
+    }
+
+    ~TraceScope()
+    {
+        if (begin_)
+            Tracer::Record(name_, begin_, StatsClockNs(), id_);
+    }
+
+private:
+    TraceScope(const TraceScope&) = delete;
+    TraceScope& operator=(const TraceScope&) = delete;
+
+    const char* name_;
+    int64_t id_;
+    uint64_t begin_;
+};
+
+#define TRACE_CAT_IMPL(a, b) a ## b
+#define TRACE_CAT(a, b) TRACE_CAT_IMPL(a, b)
+#define TRACE_SCOPE(name) TraceScope TRACE_CAT(trace_scope_, __LINE__)(name)
+#define TRACE_SCOPE_ID(name, id) TraceScope TRACE_CAT(trace_scope_, __LINE__)(name, id)
@@ -0,0 +1,232 @@
+#include "image_encoder.h"
+#include <stdlib.h>
+#include <string.h>
+#include "deflate.h"
+#include "file_util.h"
+#include "worker_pool.h"
+
+static uint8_t Paeth(int a, int b, int c)
+{
+    const int pa = abs(b - c);
+    const int pb = abs(a - c);
+    const int pc = abs(a + b - 2 * c);
+    if (pa <= pb && pa <= pc)
+        return (uint8_t)a;
+
+    return (uint8_t)(pb <= pc ? b : c);
+}
+
+// Byte |x| with |a| left of it, |b| above and |c| above left.
+static uint8_t FilterByte(int filter, int x, int a, int b, int c)
+{
+    switch (filter) {
+    case PNG_FILTER_SUB:
+        return (uint8_t)(x - a);
+    case PNG_FILTER_UP:
+        return (uint8_t)(x - b);
+    case PNG_FILTER_AVERAGE:
+        return (uint8_t)(x - ((a + b) >> 1));
+    case PNG_FILTER_PAETH:
+        return (uint8_t)(x - Paeth(a, b, c));
+    default:
+        return (uint8_t)x;
+    }
+}
+
+void PngFilterSums_C(const uint8_t* row, const uint8_t* prev,
+    uint32_t begin, uint32_t end, uint64_t sums[PNG_FILTER_NUM])
+{
+    const int bpp = (int)kPngPixelBytes;
+    for (uint32_t i = begin; i < end; ++i) {
+        for (int f = 0; f < PNG_FILTER_NUM; ++f) {
+            const uint8_t v = FilterByte(f, row[i], row[(int)i - bpp], prev[i], prev[(int)i - bpp]);
+            sums[f] += v < 128 ? v : 256 - v;
+        }
+    }
+}
+
+void PngFilterBytes_C(PngFilter filter, const uint8_t* row, const uint8_t* prev,
+    uint32_t begin, uint32_t end, uint8_t* out)
+{
+    const int bpp = (int)kPngPixelBytes;
+    for (uint32_t i = begin; i < end; ++i)
+        out[i] = FilterByte(filter, row[i], row[(int)i - bpp], prev[i], prev[(int)i - bpp]);
+}
+
+PngFilter PngBestFilter(const uint64_t sums[PNG_FILTER_NUM])
+{
+    int best = PNG_FILTER_NONE;
+    for (int f = PNG_FILTER_SUB; f < PNG_FILTER_NUM; ++f) {
+        if (sums[f] < sums[best])
+            best = f;
+    }
+
+    return (PngFilter)best;
+}
+
+void PngFilterRow_C(const uint8_t* row, const uint8_t* prev, uint32_t bytes, uint8_t* out)
+{
+    uint64_t sums[PNG_FILTER_NUM] = {};
+    PngFilterSums_C(row, prev, 0, bytes, sums);
+
+    const PngFilter filter = PngBestFilter(sums);
+    out[0] = (uint8_t)filter;
+    PngFilterBytes_C(filter, row, prev, 0, bytes, out + 1);
+}
+
+PNG_FILTER_ROW_FN GetPngFilterRow()
+{
+    static const PNG_FILTER_ROW_FN fn = []() {
+        PNG_FILTER_ROW_FN f = PngFilterRow_C;
+#if CPU_X86
+        const CpuFeatures& cpu = GetCpuFeatures();
+        if (cpu.avx2)
+            f = PngFilterRow_AVX2;
+        else if (cpu.sse2)
+            f = PngFilterRow_SSE2;
+#endif
+        return f;
+    }();
+
+    return fn;
+}
+
+static void RgbRow(const uint8_t* bgra, uint32_t width, uint8_t* rgb)
+{
+    for (uint32_t x = 0; x < width; ++x) {
+        rgb[0] = bgra[2];
+        rgb[1] = bgra[1];
+        rgb[2] = bgra[0];
+        bgra += 4;
+        rgb += 3;
+    }
+}
+
+static void PutBe32(std::vector<uint8_t>* out, uint32_t v)
+{
+    const uint8_t bytes[4] = { (uint8_t)(v >> 24), (uint8_t)(v >> 16), (uint8_t)(v >> 8), (uint8_t)v };
+    out->insert(out->end(), bytes, bytes + 4);
+}
+
+static void PutLe(std::vector<uint8_t>* out, uint32_t v, int bytes)
+{
+    for (int i = 0; i < bytes; ++i)
+        out->push_back((uint8_t)(v >> (8 * i)));
+}
+
+static void PutPngChunk(std::vector<uint8_t>* out, const char* type, const uint8_t* data, size_t size)
+{
+    PutBe32(out, (uint32_t)size);
+    const size_t start = out->size();
+    out->insert(out->end(), type, type + 4);
+    out->insert(out->end(), data, data + size);
+    PutBe32(out, Crc32(0, out->data() + start, size + 4));
+}
+
+bool EncodePng(const BgraImage& image, WorkerPool* pool, std::vector<uint8_t>* out,
+    PNG_FILTER_ROW_FN filter)
+{
+    // Rows of up to 2^31 bytes, as PNG allows.
+    if (!image.width || !image.height || image.width > 0x7FFFFFFE / kPngPixelBytes
+        || image.height > 0x7FFFFFFF)
+        return false;
+
+    if (!filter)
+        filter = GetPngFilterRow();
+
+    const uint32_t row_bytes = image.width * kPngPixelBytes;
+    const size_t line = (size_t)row_bytes + 1;
+    std::vector<uint8_t> filtered(line * image.height);
+
+    // Bands of rows are filtered at once; each converts the row above it
+    // again. Row buffers have zeros before them for the left neighbors.
+    const uint32_t kBandRows = 32;
+    const uint32_t kPad = 16;
+    const uint32_t band_num = (image.height + kBandRows - 1) / kBandRows;
+    auto filter_band = [&](int band) {
+        std::vector<uint8_t> rows(2 * ((size_t)kPad + row_bytes), 0);
+        uint8_t* prev = rows.data() + kPad;
+        uint8_t* cur = prev + row_bytes + kPad;
+
+        const uint32_t begin = (uint32_t)band * kBandRows;
+        const uint32_t end = begin + kBandRows < image.height ? begin + kBandRows : image.height;
+        if (begin > 0)
+            RgbRow(image.data + (intptr_t)(begin - 1) * image.stride, image.width, prev);
+
+        for (uint32_t y = begin; y < end; ++y) {
+            RgbRow(image.data + (intptr_t)y * image.stride, image.width, cur);
+            filter(cur, prev, row_bytes, filtered.data() + y * line);
+            std::swap(prev, cur);
+        }
+    };
+
+    if (pool && band_num > 1) {
+        pool->Run((int)band_num, filter_band);
+    } else {
+        for (uint32_t band = 0; band < band_num; ++band)
+            filter_band((int)band);
+    }
+
+    std::vector<uint8_t> idat;
+    ZlibCompress(filtered.data(), filtered.size(), pool, &idat);
+    filtered = std::vector<uint8_t>();
+
+    static const uint8_t kSignature[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n' };
+    out->assign(kSignature, kSignature + sizeof(kSignature));
+
+    std::vector<uint8_t> ihdr;
+    PutBe32(&ihdr, image.width);
+    PutBe32(&ihdr, image.height);
+    const uint8_t rest[5] = { 8, 2, 0, 0, 0 };  // 8 bits, RGB, deflate, adaptive filters, no interlace
+    ihdr.insert(ihdr.end(), rest, rest + sizeof(rest));
+    PutPngChunk(out, "IHDR", ihdr.data(), ihdr.size());
+
+    const size_t kIdatBytes = 1 << 20;
+    for (size_t pos = 0; pos < idat.size(); pos += kIdatBytes) {
+        const size_t n = idat.size() - pos < kIdatBytes ? idat.size() - pos : kIdatBytes;
+        PutPngChunk(out, "IDAT", idat.data() + pos, n);
+    }
+
+    PutPngChunk(out, "IEND", nullptr, 0);
+    return true;
+}
+
+bool EncodeBmp(const BgraImage& image, std::vector<uint8_t>* out)
+{
+    const uint32_t kHeaderBytes = 14 + 40;
+    const uint64_t row_bytes = ((uint64_t)image.width * 3 + 3) & ~3ull;
+    const uint64_t file_bytes = kHeaderBytes + row_bytes * image.height;
+    if (!image.width || !image.height || file_bytes > 0xFFFFFFFF || image.height > 0x7FFFFFFF)
+        return false;
+
+    out->clear();
+    out->reserve((size_t)file_bytes);
+    out->push_back('B');
+    out->push_back('M');
+    PutLe(out, (uint32_t)file_bytes, 4);
+    PutLe(out, 0, 4);
+    PutLe(out, kHeaderBytes, 4);
+
+    // BITMAPINFOHEADER, rows from the bottom, 72 DPI.
+    PutLe(out, 40, 4);
+    PutLe(out, image.width, 4);
+    PutLe(out, image.height, 4);
+    PutLe(out, 1, 2);
+    PutLe(out, 24, 2);
+    PutLe(out, 0, 4);
+    PutLe(out, (uint32_t)(row_bytes * image.height), 4);
+    PutLe(out, 2835, 4);
+    PutLe(out, 2835, 4);
+    PutLe(out, 0, 4);
+    PutLe(out, 0, 4);
+
+    out->resize((size_t)file_bytes, 0);
+    for (uint32_t y = 0; y < image.height; ++y) {
+        const uint8_t* src = image.data + (intptr_t)(image.height - 1 - y) * image.stride;
+        uint8_t* dst = out->data() + kHeaderBytes + y * row_bytes;
+        for (uint32_t x = 0; x < image.width; ++x)
+            memcpy(dst + x * 3, src + x * 4, 3);
+    }
+
+    return true;
+}
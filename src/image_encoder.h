@@ -0,0 +1,54 @@
+#pragma once
+#include <stdint.h>
+#include <vector>
+#include "cpu_features.h"
+#include "image_scaler.h"
+
+class WorkerPool;
+
+enum PngFilter {
+    PNG_FILTER_NONE,
+    PNG_FILTER_SUB,
+    PNG_FILTER_UP,
+    PNG_FILTER_AVERAGE,
+    PNG_FILTER_PAETH,
+    PNG_FILTER_NUM,
+};
+
+// Bytes of an RGB pixel, the only layout written.
+static const uint32_t kPngPixelBytes = 3;
+
+// Picks the filter of one row of |bytes| RGB bytes by the smallest sum of
+// the filtered bytes taken as signed, ties going to the lower filter, and
+// writes the filter byte and the filtered row to |out|. |row| and |prev|
+// must have 16 zero bytes before them; |prev| is all zeros for the first
+// row. Every tier gives the same bytes.
+typedef void (*PNG_FILTER_ROW_FN)(const uint8_t* row, const uint8_t* prev,
+    uint32_t bytes, uint8_t* out);
+
+void PngFilterRow_C(const uint8_t* row, const uint8_t* prev, uint32_t bytes, uint8_t* out);
+
+#if CPU_X86
+void PngFilterRow_SSE2(const uint8_t* row, const uint8_t* prev, uint32_t bytes, uint8_t* out);
+void PngFilterRow_AVX2(const uint8_t* row, const uint8_t* prev, uint32_t bytes, uint8_t* out);
+#endif
+
+// For the SIMD tiers: the sums of bytes [begin, end) under each filter,
+// added to |sums|, and the bytes filtered with |filter| into |out|.
+void PngFilterSums_C(const uint8_t* row, const uint8_t* prev,
+    uint32_t begin, uint32_t end, uint64_t sums[PNG_FILTER_NUM]);
+void PngFilterBytes_C(PngFilter filter, const uint8_t* row, const uint8_t* prev,
+    uint32_t begin, uint32_t end, uint8_t* out);
+PngFilter PngBestFilter(const uint64_t sums[PNG_FILTER_NUM]);
+
+// The fastest tier the CPU supports.
+PNG_FILTER_ROW_FN GetPngFilterRow();
+
+// An 8-bit RGB PNG of |image|, alpha dropped. Rows are filtered and
+// deflated on |pool|, which may be null; |filter| is the tier to use, or
+// null for the fastest.
+bool EncodePng(const BgraImage& image, WorkerPool* pool, std::vector<uint8_t>* out,
+    PNG_FILTER_ROW_FN filter = nullptr);
+
+// A 24-bit BMP of |image|, alpha dropped.
+bool EncodeBmp(const BgraImage& image, std::vector<uint8_t>* out);
@@ -0,0 +1,156 @@
+#include "image_encoder.h"
+
+#if CPU_X86
+#include <immintrin.h>
+
+// All five filters of 16 or 32 bytes at once. The neighbors are plain
+// loads 3 bytes back, which the zeros before each row make safe. Paeth
+// runs on 16-bit lanes, Average corrects the rounding of avg_epu8.
+
+FORCE_INLINE TARGET_SSE2 __m128i Abs16_SSE2(__m128i v)
+{
+    return _mm_max_epi16(v, _mm_sub_epi16(_mm_setzero_si128(), v));
+}
+
+FORCE_INLINE TARGET_SSE2 __m128i Paeth16_SSE2(__m128i a, __m128i b, __m128i c)
+{
+    const __m128i pa = Abs16_SSE2(_mm_sub_epi16(b, c));
+    const __m128i pb = Abs16_SSE2(_mm_sub_epi16(a, c));
+    const __m128i pc = Abs16_SSE2(_mm_sub_epi16(_mm_add_epi16(a, b), _mm_add_epi16(c, c)));
+    const __m128i not_a = _mm_or_si128(_mm_cmpgt_epi16(pa, pb), _mm_cmpgt_epi16(pa, pc));
+    const __m128i use_c = _mm_cmpgt_epi16(pb, pc);
+    const __m128i bc = _mm_or_si128(_mm_and_si128(use_c, c), _mm_andnot_si128(use_c, b));
+    return _mm_or_si128(_mm_andnot_si128(not_a, a), _mm_and_si128(not_a, bc));
+}
+
+FORCE_INLINE TARGET_SSE2 void Filter16_SSE2(const uint8_t* row, const uint8_t* prev, __m128i f[PNG_FILTER_NUM])
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i x = _mm_loadu_si128((const __m128i*)row);
+    const __m128i a = _mm_loadu_si128((const __m128i*)(row - kPngPixelBytes));
+    const __m128i b = _mm_loadu_si128((const __m128i*)prev);
+    const __m128i c = _mm_loadu_si128((const __m128i*)(prev - kPngPixelBytes));
+
+    const __m128i avg = _mm_sub_epi8(_mm_avg_epu8(a, b),
+        _mm_and_si128(_mm_xor_si128(a, b), _mm_set1_epi8(1)));
+    const __m128i paeth = _mm_packus_epi16(
+        Paeth16_SSE2(_mm_unpacklo_epi8(a, zero), _mm_unpacklo_epi8(b, zero), _mm_unpacklo_epi8(c, zero)),
+        Paeth16_SSE2(_mm_unpackhi_epi8(a, zero), _mm_unpackhi_epi8(b, zero), _mm_unpackhi_epi8(c, zero)));
+
+    f[PNG_FILTER_NONE] = x;
+    f[PNG_FILTER_SUB] = _mm_sub_epi8(x, a);
+    f[PNG_FILTER_UP] = _mm_sub_epi8(x, b);
+    f[PNG_FILTER_AVERAGE] = _mm_sub_epi8(x, avg);
+    f[PNG_FILTER_PAETH] = _mm_sub_epi8(x, paeth);
+}
+
+TARGET_SSE2 void PngFilterRow_SSE2(const uint8_t* row, const uint8_t* prev, uint32_t bytes, uint8_t* out)
+{
+    const uint32_t vec_bytes = bytes & ~15u;
+    const __m128i zero = _mm_setzero_si128();
+    __m128i acc[PNG_FILTER_NUM];
+    for (int i = 0; i < PNG_FILTER_NUM; ++i)
+        acc[i] = zero;
+
+    // |v| of a signed byte is min(v, -v) taken unsigned.
+    __m128i f[PNG_FILTER_NUM];
+    for (uint32_t i = 0; i < vec_bytes; i += 16) {
+        Filter16_SSE2(row + i, prev + i, f);
+        for (int k = 0; k < PNG_FILTER_NUM; ++k) {
+            const __m128i abs = _mm_min_epu8(f[k], _mm_sub_epi8(zero, f[k]));
+            acc[k] = _mm_add_epi64(acc[k], _mm_sad_epu8(abs, zero));
+        }
+    }
+
+    uint64_t sums[PNG_FILTER_NUM];
+    for (int k = 0; k < PNG_FILTER_NUM; ++k) {
+        uint64_t lanes[2];
+        _mm_storeu_si128((__m128i*)lanes, acc[k]);
+        sums[k] = lanes[0] + lanes[1];
+    }
+
+    PngFilterSums_C(row, prev, vec_bytes, bytes, sums);
+    const PngFilter filter = PngBestFilter(sums);
+    out[0] = (uint8_t)filter;
+    ++out;
+
+    for (uint32_t i = 0; i < vec_bytes; i += 16) {
+        Filter16_SSE2(row + i, prev + i, f);
+        _mm_storeu_si128((__m128i*)(out + i), f[filter]);
+    }
+
+    PngFilterBytes_C(filter, row, prev, vec_bytes, bytes, out);
+}
+
+FORCE_INLINE TARGET_AVX2 __m256i Paeth16_AVX2(__m256i a, __m256i b, __m256i c)
+{
+    const __m256i pa = _mm256_abs_epi16(_mm256_sub_epi16(b, c));
+    const __m256i pb = _mm256_abs_epi16(_mm256_sub_epi16(a, c));
+    const __m256i pc = _mm256_abs_epi16(_mm256_sub_epi16(_mm256_add_epi16(a, b), _mm256_add_epi16(c, c)));
+    const __m256i not_a = _mm256_or_si256(_mm256_cmpgt_epi16(pa, pb), _mm256_cmpgt_epi16(pa, pc));
+    const __m256i bc = _mm256_blendv_epi8(b, c, _mm256_cmpgt_epi16(pb, pc));
+    return _mm256_blendv_epi8(a, bc, not_a);
+}
+
+FORCE_INLINE TARGET_AVX2 void Filter32_AVX2(const uint8_t* row, const uint8_t* prev, __m256i f[PNG_FILTER_NUM])
+{
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i x = _mm256_loadu_si256((const __m256i*)row);
+    const __m256i a = _mm256_loadu_si256((const __m256i*)(row - kPngPixelBytes));
+    const __m256i b = _mm256_loadu_si256((const __m256i*)prev);
+    const __m256i c = _mm256_loadu_si256((const __m256i*)(prev - kPngPixelBytes));
+
+    const __m256i avg = _mm256_sub_epi8(_mm256_avg_epu8(a, b),
+        _mm256_and_si256(_mm256_xor_si256(a, b), _mm256_set1_epi8(1)));
+
+    // Unpacking and packing both stay within 128-bit lanes, so the bytes
+    // come back in order.
+    const __m256i paeth = _mm256_packus_epi16(
+        Paeth16_AVX2(_mm256_unpacklo_epi8(a, zero), _mm256_unpacklo_epi8(b, zero), _mm256_unpacklo_epi8(c, zero)),
+        Paeth16_AVX2(_mm256_unpackhi_epi8(a, zero), _mm256_unpackhi_epi8(b, zero), _mm256_unpackhi_epi8(c, zero)));
+
+    f[PNG_FILTER_NONE] = x;
+    f[PNG_FILTER_SUB] = _mm256_sub_epi8(x, a);
+    f[PNG_FILTER_UP] = _mm256_sub_epi8(x, b);
+    f[PNG_FILTER_AVERAGE] = _mm256_sub_epi8(x, avg);
+    f[PNG_FILTER_PAETH] = _mm256_sub_epi8(x, paeth);
+}
+
+TARGET_AVX2 void PngFilterRow_AVX2(const uint8_t* row, const uint8_t* prev, uint32_t bytes, uint8_t* out)
+{
+    const uint32_t vec_bytes = bytes & ~31u;
+    const __m256i zero = _mm256_setzero_si256();
+    __m256i acc[PNG_FILTER_NUM];
+    for (int i = 0; i < PNG_FILTER_NUM; ++i)
+        acc[i] = zero;
+
+    __m256i f[PNG_FILTER_NUM];
+    for (uint32_t i = 0; i < vec_bytes; i += 32) {
+        Filter32_AVX2(row + i, prev + i, f);
+        for (int k = 0; k < PNG_FILTER_NUM; ++k) {
+            const __m256i abs = _mm256_min_epu8(f[k], _mm256_sub_epi8(zero, f[k]));
+            acc[k] = _mm256_add_epi64(acc[k], _mm256_sad_epu8(abs, zero));
+        }
+    }
+
+    uint64_t sums[PNG_FILTER_NUM];
+    for (int k = 0; k < PNG_FILTER_NUM; ++k) {
+        uint64_t lanes[4];
+        _mm256_storeu_si256((__m256i*)lanes, acc[k]);
+        sums[k] = lanes[0] + lanes[1] + lanes[2] + lanes[3];
+    }
+
+    PngFilterSums_C(row, prev, vec_bytes, bytes, sums);
+    const PngFilter filter = PngBestFilter(sums);
+    out[0] = (uint8_t)filter;
+    ++out;
+
+    for (uint32_t i = 0; i < vec_bytes; i += 32) {
+        Filter32_AVX2(row + i, prev + i, f);
+        _mm256_storeu_si256((__m256i*)(out + i), f[filter]);
+    }
+
+    PngFilterBytes_C(filter, row, prev, vec_bytes, bytes, out);
+}
+
+#endif  // CPU_X86
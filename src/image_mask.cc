@@ -0,0 +1,139 @@
+#include "image_mask.h"
+#include <string.h>
+
+// (v + 127) / 255 for v up to 255 * 255, without the divide.
+static inline uint32_t Div255(uint32_t v)
+{
+    v += 128;
+    return (v + (v >> 8)) >> 8;
+}
+
+void ApplyMask_C(uint8_t* data, int32_t stride,
+    const uint8_t* mask, uint32_t width, uint32_t height, uint8_t opacity)
+{
+    for (uint32_t y = 0; y < height; ++y) {
+        uint8_t* p = data + (intptr_t)y * stride;
+        for (uint32_t x = 0; x < width; ++x, p += 4) {
+            const uint32_t a = Div255(mask[x] * opacity);
+            p[0] = (uint8_t)Div255(p[0] * a);
+            p[1] = (uint8_t)Div255(p[1] * a);
+            p[2] = (uint8_t)Div255(p[2] * a);
+            p[3] = (uint8_t)a;
+        }
+
+        mask += width;
+    }
+}
+
+APPLY_MASK_FN GetApplyMask()
+{
+    static const APPLY_MASK_FN fn = []() {
+        APPLY_MASK_FN f = ApplyMask_C;
+#if CPU_X86
+        const CpuFeatures& cpu = GetCpuFeatures();
+        if (cpu.avx2)
+            f = ApplyMask_AVX2;
+        else if (cpu.sse2)
+            f = ApplyMask_SSE2;
+#endif
+        return f;
+    }();
+
+    return fn;
+}
+
+void ApplyMask(uint8_t* data, int32_t stride,
+    const uint8_t* mask, uint32_t width, uint32_t height, uint8_t opacity)
+{
+    GetApplyMask()(data, stride, mask, width, height, opacity);
+}
+
+void SpanMask::Reset(uint32_t width, uint32_t height)
+{
+    width_ = width;
+    height_ = height;
+    runs_.clear();
+    row_runs_.assign(1, 0);
+    coverage_.assign(width, 0xFF);
+}
+
+void SpanMask::AddRow(const uint8_t* mask)
+{
+    uint32_t x = 0;
+    while (x < width_) {
+        const uint32_t begin = x;
+        if (!mask[x]) {
+            ++x;
+        } else if (mask[x] == 0xFF) {
+            while (x < width_ && mask[x] == 0xFF)
+                ++x;
+
+            AddOpaque(begin, x - begin);
+        } else {
+            while (x < width_ && mask[x] && mask[x] != 0xFF)
+                ++x;
+
+            AddEdge(begin, x - begin, mask + begin);
+        }
+    }
+
+    EndRow();
+}
+
+void SpanMask::AddOpaque(uint32_t x, uint32_t length)
+{
+    if (!length)
+        return;
+
+    Run run = { x, length, 0, true };
+    runs_.push_back(run);
+}
+
+void SpanMask::AddEdge(uint32_t x, uint32_t length, const uint8_t* mask)
+{
+    if (!length)
+        return;
+
+    Run run = { x, length, (uint32_t)coverage_.size(), false };
+    coverage_.insert(coverage_.end(), mask, mask + length);
+    runs_.push_back(run);
+}
+
+void SpanMask::EndRow()
+{
+    row_runs_.push_back((uint32_t)runs_.size());
+}
+
+void SpanMask::Assign(const uint8_t* mask, uint32_t width, uint32_t height)
+{
+    Reset(width, height);
+    for (uint32_t y = 0; y < height; ++y)
+        AddRow(mask + (size_t)y * width);
+}
+
+void ApplySpanMask(uint8_t* data, int32_t stride, const SpanMask& mask,
+    uint8_t opacity, APPLY_MASK_FN blend)
+{
+    for (uint32_t y = 0; y < mask.Height(); ++y) {
+        uint8_t* row = data + (intptr_t)y * stride;
+        uint32_t x = 0;
+
+        for (const SpanMask::Run* run = mask.RowBegin(y); run != mask.RowEnd(y); ++run) {
+            memset(row + x * 4, 0, (size_t)(run->x - x) * 4);
+            if (!run->opaque || opacity != 0xFF) {
+                blend(row + run->x * 4, stride, mask.Coverage(*run),
+                    run->length, 1, opacity);
+            }
+
+            x = run->x + run->length;
+        }
+
+        memset(row + x * 4, 0, (size_t)(mask.Width() - x) * 4);
+    }
+}
+
+void ApplySpanMask(uint8_t* data, int32_t stride, const SpanMask& mask,
+    uint8_t opacity)
+{
+    ApplySpanMask(data, stride, mask, opacity, GetApplyMask());
+}
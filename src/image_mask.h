@@ -0,0 +1,75 @@
+#pragma once
+#include <stdint.h>
+#include <vector>
+#include "cpu_features.h"
+
+// Gives each 32-bit BGRA pixel the alpha of its mask byte scaled by
+// |opacity|, and premultiplies the color by it, as UpdateLayeredWindow
+// expects. Rows of |mask| are |width| bytes apart. Products are divided
+// by 255 with exact rounding, so every tier gives the same pixels.
+typedef void (*APPLY_MASK_FN)(uint8_t* data, int32_t stride,
+    const uint8_t* mask, uint32_t width, uint32_t height, uint8_t opacity);
+
+void ApplyMask_C(uint8_t* data, int32_t stride,
+    const uint8_t* mask, uint32_t width, uint32_t height, uint8_t opacity);
+
+#if CPU_X86
+void ApplyMask_SSE2(uint8_t* data, int32_t stride,
+    const uint8_t* mask, uint32_t width, uint32_t height, uint8_t opacity);
+void ApplyMask_AVX2(uint8_t* data, int32_t stride,
+    const uint8_t* mask, uint32_t width, uint32_t height, uint8_t opacity);
+#endif
+
+// The fastest tier the CPU supports.
+APPLY_MASK_FN GetApplyMask();
+void ApplyMask(uint8_t* data, int32_t stride,
+    const uint8_t* mask, uint32_t width, uint32_t height, uint8_t opacity = 255);
+
+// A mask kept as runs per row. Pixels outside any run are transparent,
+// opaque runs need no blending and only the edge runs keep mask bytes, so
+// a shape of any outline costs the same per frame as its edge length.
+class SpanMask
+{
+public:
+    struct Run {
+        uint32_t x;
+        uint32_t length;
+        uint32_t coverage;  // offset of the run's mask bytes
+        bool opaque;
+    };
+
+    // Clears the mask; rows are then added from the top, either from mask
+    // bytes or run by run, left to right, each row closed by EndRow.
+    void Reset(uint32_t width, uint32_t height);
+    void AddRow(const uint8_t* mask);
+    void AddOpaque(uint32_t x, uint32_t length);
+    void AddEdge(uint32_t x, uint32_t length, const uint8_t* mask);
+    void EndRow();
+
+    // Takes a dense mask, |width| bytes per row.
+    void Assign(const uint8_t* mask, uint32_t width, uint32_t height);
+
+    uint32_t Width() const { return width_; }
+    uint32_t Height() const { return height_; }
+    bool Empty() const { return !width_ || !height_; }
+
+    const Run* RowBegin(uint32_t y) const { return runs_.data() + row_runs_[y]; }
+    const Run* RowEnd(uint32_t y) const { return runs_.data() + row_runs_[y + 1]; }
+    const uint8_t* Coverage(const Run& run) const { return coverage_.data() + run.coverage; }
+
+private:
+    uint32_t width_ = 0;
+    uint32_t height_ = 0;
+    std::vector<Run> runs_;
+    std::vector<uint32_t> row_runs_;  // first run of each row, then the end
+    std::vector<uint8_t> coverage_;   // a row of 255 for opaque runs, then the edges
+};
+
+// Same result as ApplyMask on the dense mask, for frames that are opaque
+// already, which is what the converters write: transparent runs are
+// zeroed, opaque runs are left alone at full opacity, and |blend| only
+// sees the edges.
+void ApplySpanMask(uint8_t* data, int32_t stride, const SpanMask& mask,
+    uint8_t opacity, APPLY_MASK_FN blend);
+void ApplySpanMask(uint8_t* data, int32_t stride, const SpanMask& mask,
+    uint8_t opacity = 255);
@@ -0,0 +1,107 @@
+#include "image_mask.h"
+
+#if CPU_X86
+#include <immintrin.h>
+#include <string.h>
+
+// Same math as ApplyMask_C on 16-bit lanes: the alpha of a pixel is
+// spread over its four channels, the products are divided by 255 and the
+// alpha byte is put back in place of the premultiplied one.
+
+FORCE_INLINE TARGET_SSE2 __m128i Div255_SSE2(__m128i v)
+{
+    v = _mm_add_epi16(v, _mm_set1_epi16(128));
+    return _mm_srli_epi16(_mm_add_epi16(v, _mm_srli_epi16(v, 8)), 8);
+}
+
+FORCE_INLINE TARGET_AVX2 __m256i Div255_AVX2(__m256i v)
+{
+    v = _mm256_add_epi16(v, _mm256_set1_epi16(128));
+    return _mm256_srli_epi16(_mm256_add_epi16(v, _mm256_srli_epi16(v, 8)), 8);
+}
+
+// Four pixels.
+FORCE_INLINE TARGET_SSE2 void MaskPixels_SSE2(uint8_t* p, const uint8_t* m, __m128i opacity)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i alpha_bytes = _mm_set1_epi32((int)0xFF000000);
+
+    int32_t m4 = 0;
+    memcpy(&m4, m, 4);
+    __m128i a = _mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128(m4), zero), zero);
+    a = Div255_SSE2(_mm_mullo_epi16(a, opacity));
+    a = _mm_or_si128(a, _mm_slli_epi32(a, 8));
+    a = _mm_or_si128(a, _mm_slli_epi32(a, 16));
+
+    __m128i px = _mm_loadu_si128((const __m128i*)p);
+    __m128i lo = Div255_SSE2(_mm_mullo_epi16(_mm_unpacklo_epi8(px, zero), _mm_unpacklo_epi8(a, zero)));
+    __m128i hi = Div255_SSE2(_mm_mullo_epi16(_mm_unpackhi_epi8(px, zero), _mm_unpackhi_epi8(a, zero)));
+    px = _mm_packus_epi16(lo, hi);
+    px = _mm_or_si128(_mm_andnot_si128(alpha_bytes, px), _mm_and_si128(alpha_bytes, a));
+    _mm_storeu_si128((__m128i*)p, px);
+}
+
+TARGET_SSE2 void ApplyMask_SSE2(uint8_t* data, int32_t stride,
+    const uint8_t* mask, uint32_t width, uint32_t height, uint8_t opacity)
+{
+    const uint32_t vec_width = width & ~3u;
+    const __m128i op = _mm_set1_epi32(opacity);
+
+    for (uint32_t y = 0; y < height; ++y) {
+        uint8_t* row = data + (intptr_t)y * stride;
+        for (uint32_t x = 0; x < vec_width; x += 4)
+            MaskPixels_SSE2(row + x * 4, mask + x, op);
+
+        if (vec_width < width) {
+            ApplyMask_C(row + vec_width * 4, stride, mask + vec_width,
+                width - vec_width, 1, opacity);
+        }
+
+        mask += width;
+    }
+}
+
+TARGET_AVX2 void ApplyMask_AVX2(uint8_t* data, int32_t stride,
+    const uint8_t* mask, uint32_t width, uint32_t height, uint8_t opacity)
+{
+    const uint32_t vec_width = width & ~7u;
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i op = _mm256_set1_epi32(opacity);
+    const __m256i alpha_bytes = _mm256_set1_epi32((int)0xFF000000);
+    const __m256i spread = _mm256_setr_epi8(
+        0, 0, 0, 0, 4, 4, 4, 4, 8, 8, 8, 8, 12, 12, 12, 12,
+        0, 0, 0, 0, 4, 4, 4, 4, 8, 8, 8, 8, 12, 12, 12, 12);
+
+    for (uint32_t y = 0; y < height; ++y) {
+        uint8_t* row = data + (intptr_t)y * stride;
+        for (uint32_t x = 0; x < vec_width; x += 8) {
+            uint8_t* p = row + x * 4;
+            __m256i a = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)(mask + x)));
+            a = Div255_AVX2(_mm256_mullo_epi16(a, op));
+            a = _mm256_shuffle_epi8(a, spread);
+
+            __m256i px = _mm256_loadu_si256((const __m256i*)p);
+            __m256i lo = Div255_AVX2(_mm256_mullo_epi16(
+                _mm256_unpacklo_epi8(px, zero), _mm256_unpacklo_epi8(a, zero)));
+            __m256i hi = Div255_AVX2(_mm256_mullo_epi16(
+                _mm256_unpackhi_epi8(px, zero), _mm256_unpackhi_epi8(a, zero)));
+            px = _mm256_packus_epi16(lo, hi);
+            px = _mm256_blendv_epi8(px, a, alpha_bytes);
+            _mm256_storeu_si256((__m256i*)p, px);
+        }
+
+        // Four more, then the last few pixels one by one.
+        uint32_t x = vec_width;
+        if (x + 4 <= width) {
+            MaskPixels_SSE2(row + x * 4, mask + x, _mm_set1_epi32(opacity));
+            x += 4;
+        }
+
+        if (x < width)
+            ApplyMask_C(row + x * 4, stride, mask + x, width - x, 1, opacity);
+
+        mask += width;
+    }
+}
+
+#endif
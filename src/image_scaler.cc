@@ -0,0 +1,224 @@
+#include "image_scaler.h"
+#include <math.h>
+#include "worker_pool.h"
+
+static const int kWeightOne = 1 << 14;
+
+// Source pixels and their share of output pixel |i|.
+static void FilterTaps(uint32_t src_size, uint32_t dst_size, uint32_t i,
+    std::vector<double>* w, uint32_t* first)
+{
+    const double ratio = (double)src_size / dst_size;
+    w->clear();
+
+    if (ratio > 1.0) {
+        // Output pixel i covers [i * ratio, (i + 1) * ratio) of the source.
+        const double begin = i * ratio;
+        const double end = begin + ratio;
+        uint32_t j = (uint32_t)begin;
+        *first = j;
+        for (; j < src_size && j < end; ++j) {
+            double lo = j > begin ? j : begin;
+            double hi = j + 1 < end ? j + 1 : end;
+            w->push_back((hi - lo) / ratio);
+        }
+
+        return;
+    }
+
+    // Pixel centers line up, the edges repeat the outermost pixels.
+    double pos = (i + 0.5) * ratio - 0.5;
+    if (pos < 0)
+        pos = 0;
+
+    uint32_t j = (uint32_t)floor(pos);
+    if (j >= src_size - 1) {
+        *first = src_size - 1;
+        w->push_back(1.0);
+        return;
+    }
+
+    const double f = pos - j;
+    *first = j;
+    w->push_back(1.0 - f);
+    w->push_back(f);
+}
+
+void BuildScaleFilter(uint32_t src_size, uint32_t dst_size, bool even_taps,
+    ScaleFilter* filter)
+{
+    const double ratio = (double)src_size / dst_size;
+    uint32_t taps = ratio > 1.0 ? (uint32_t)ceil(ratio) + 1 : 2;
+    if (even_taps)
+        taps = (taps + 1) & ~1u;
+
+    // Small sources may have fewer pixels than taps; the window then
+    // covers all of them.
+    const uint32_t window = taps < src_size ? taps : src_size;
+
+    filter->taps = taps;
+    filter->offset.assign(dst_size, 0);
+    filter->weights.assign((size_t)dst_size * taps, 0);
+
+    std::vector<double> w;
+    for (uint32_t i = 0; i < dst_size; ++i) {
+        uint32_t first = 0;
+        FilterTaps(src_size, dst_size, i, &w, &first);
+
+        // Keep the window inside the source, so that no kernel reads past
+        // it, even for taps of zero weight.
+        uint32_t offset = first;
+        if (offset + window > src_size)
+            offset = src_size - window;
+
+        int16_t* weights = &filter->weights[(size_t)i * taps];
+        int sum = 0;
+        uint32_t largest = 0;
+        for (size_t k = 0; k < w.size(); ++k) {
+            const uint32_t t = first + (uint32_t)k - offset;
+            weights[t] = (int16_t)floor(w[k] * kWeightOne + 0.5);
+            sum += weights[t];
+            if (weights[t] > weights[largest])
+                largest = t;
+        }
+
+        // Rounding may leave the sum off by a few units.
+        weights[largest] = (int16_t)(weights[largest] + kWeightOne - sum);
+        filter->offset[i] = offset;
+    }
+
+    filter->pairs.clear();
+    if (!even_taps)
+        return;
+
+    filter->pairs.resize((size_t)taps / 2 * dst_size);
+    for (uint32_t p = 0; p < taps / 2; ++p) {
+        for (uint32_t i = 0; i < dst_size; ++i) {
+            const int16_t* w = &filter->weights[(size_t)i * taps + p * 2];
+            filter->pairs[(size_t)p * dst_size + i] =
+                (int32_t)(((uint32_t)(uint16_t)w[1] << 16) | (uint16_t)w[0]);
+        }
+    }
+}
+
+void ScaleVertical_C(const uint8_t* src, int32_t stride,
+    const int16_t* weights, uint32_t taps, int16_t* dst, uint32_t count)
+{
+    for (uint32_t i = 0; i < count; ++i) {
+        int sum = 0;
+        for (uint32_t t = 0; t < taps; ++t)
+            sum += src[(intptr_t)t * stride + i] * weights[t];
+
+        dst[i] = (int16_t)((sum + (1 << 6)) >> 7);
+    }
+}
+
+void ScaleHorizontal_C(const int16_t* src, const ScaleFilter& filter,
+    uint8_t* dst, uint32_t x_begin, uint32_t x_end)
+{
+    const uint32_t taps = filter.taps;
+    for (uint32_t x = x_begin; x < x_end; ++x) {
+        const int16_t* p = src + filter.offset[x] * 4;
+        const int16_t* w = &filter.weights[(size_t)x * taps];
+        int sum[4] = {};
+        for (uint32_t t = 0; t < taps; ++t) {
+            for (int c = 0; c < 4; ++c)
+                sum[c] += p[t * 4 + c] * w[t];
+        }
+
+        // Weights are not negative, so the result stays in 0 .. 255.
+        for (int c = 0; c < 4; ++c)
+            dst[x * 4 + c] = (uint8_t)((sum[c] + (1 << 20)) >> 21);
+    }
+}
+
+void ScalePlane_C(const int16_t* src, const ScaleFilter& filter,
+    uint8_t* dst, uint32_t x_begin, uint32_t x_end)
+{
+    const uint32_t taps = filter.taps;
+    for (uint32_t x = x_begin; x < x_end; ++x) {
+        const int16_t* p = src + filter.offset[x];
+        const int16_t* w = &filter.weights[(size_t)x * taps];
+        int sum = 0;
+        for (uint32_t t = 0; t < taps; ++t)
+            sum += p[t] * w[t];
+
+        dst[x] = (uint8_t)((sum + (1 << 20)) >> 21);
+    }
+}
+
+ImageScaler::ImageScaler(bool use_simd)
+{
+    vertical_ = ScaleVertical_C;
+    horizontal_ = ScaleHorizontal_C;
+#if CPU_X86
+    if (use_simd && GetCpuFeatures().avx2) {
+        vertical_ = ScaleVertical_AVX2;
+        horizontal_ = ScaleHorizontal_AVX2;
+    }
+#else
+    (void)use_simd;
+#endif
+}
+
+void ImageScaler::Prepare(const BgraImage& src, const BgraImage& dst)
+{
+    if (src.width == src_w_ && src.height == src_h_
+        && dst.width == dst_w_ && dst.height == dst_h_)
+        return;
+
+    src_w_ = src.width;
+    src_h_ = src.height;
+    dst_w_ = dst.width;
+    dst_h_ = dst.height;
+    BuildScaleFilter(src_w_, dst_w_, true, &filter_x_);
+    BuildScaleFilter(src_h_, dst_h_, false, &filter_y_);
+}
+
+void ImageScaler::ScaleRows(const BgraImage& src, const BgraImage& dst,
+    uint32_t y_begin, uint32_t y_end, std::vector<int16_t>* row)
+{
+    // The window of a horizontal tap pair may reach one pixel past the row.
+    const uint32_t count = src.width * 4;
+    row->resize((size_t)count + 4 * filter_x_.taps);
+
+    const uint32_t taps = filter_y_.taps < src.height ? filter_y_.taps : src.height;
+    for (uint32_t y = y_begin; y < y_end; ++y) {
+        const uint8_t* first = src.data + (intptr_t)filter_y_.offset[y] * src.stride;
+        vertical_(first, src.stride, &filter_y_.weights[(size_t)y * filter_y_.taps],
+            taps, row->data(), count);
+        horizontal_(row->data(), filter_x_,
+            dst.data + (intptr_t)y * dst.stride, 0, dst.width);
+    }
+}
+
+void ImageScaler::Scale(const BgraImage& src, const BgraImage& dst, WorkerPool* pool)
+{
+    if (!src.width || !src.height || !dst.width || !dst.height)
+        return;
+
+    Prepare(src, dst);
+
+    // Same split as the frame conversion: about a quarter megapixel of
+    // output per stripe.
+    const uint64_t kPixelsPerStripe = 256 * 1024;
+    uint32_t stripe_num = (uint32_t)((uint64_t)dst.width * dst.height / kPixelsPerStripe);
+    if (pool && stripe_num > (uint32_t)pool->Concurrency())
+        stripe_num = (uint32_t)pool->Concurrency();
+
+    if (!pool || stripe_num <= 1) {
+        rows_.resize(1);
+        ScaleRows(src, dst, 0, dst.height, &rows_[0]);
+        return;
+    }
+
+    const uint32_t stripe_rows = (dst.height + stripe_num - 1) / stripe_num;
+    stripe_num = (dst.height + stripe_rows - 1) / stripe_rows;
+    rows_.resize(stripe_num);
+
+    pool->Run((int)stripe_num, [&](int i) {
+        uint32_t y = (uint32_t)i * stripe_rows;
+        uint32_t y_end = y + stripe_rows < dst.height ? y + stripe_rows : dst.height;
+        ScaleRows(src, dst, y, y_end, &rows_[i]);
+    });
+}
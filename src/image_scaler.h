@@ -0,0 +1,86 @@
+#pragma once
+#include <stdint.h>
+#include <vector>
+#include "cpu_features.h"
+
+class WorkerPool;
+
+// 32-bit BGRA rows, |data| points at row 0.
+struct BgraImage {
+    uint8_t* data;
+    int32_t stride;
+    uint32_t width;
+    uint32_t height;
+};
+
+// Weights of one axis. Output pixel i is the sum of |taps| source pixels
+// from offset[i], weighted by weights[i * taps ..] in Q14, which add up to
+// exactly 1 << 14.
+struct ScaleFilter {
+    uint32_t taps;
+    std::vector<uint32_t> offset;
+    std::vector<int16_t> weights;
+    // With even taps, the weights of tap pair p for output i packed into
+    // pairs[p * outputs + i], for kernels that filter 8 outputs at once.
+    std::vector<int32_t> pairs;
+};
+
+// Builds an area averaging filter when |dst_size| is smaller and a bilinear
+// one when it is larger. With |even_taps| the tap count is rounded up for
+// kernels that take taps in pairs.
+void BuildScaleFilter(uint32_t src_size, uint32_t dst_size, bool even_taps,
+    ScaleFilter* filter);
+
+// The vertical pass sums rows into a Q7 row of |count| 16-bit channels,
+// the horizontal pass filters such a row into pixels |x_begin| ..
+// |x_end| - 1 of a BGRA row.
+typedef void (*SCALE_VERTICAL_FN)(const uint8_t* src, int32_t stride,
+    const int16_t* weights, uint32_t taps, int16_t* dst, uint32_t count);
+typedef void (*SCALE_HORIZONTAL_FN)(const int16_t* src, const ScaleFilter& filter,
+    uint8_t* dst, uint32_t x_begin, uint32_t x_end);
+
+// Single channel version of the horizontal pass, for YUV planes.
+typedef void (*SCALE_PLANE_FN)(const int16_t* src, const ScaleFilter& filter,
+    uint8_t* dst, uint32_t x_begin, uint32_t x_end);
+
+void ScaleVertical_C(const uint8_t* src, int32_t stride,
+    const int16_t* weights, uint32_t taps, int16_t* dst, uint32_t count);
+void ScaleHorizontal_C(const int16_t* src, const ScaleFilter& filter,
+    uint8_t* dst, uint32_t x_begin, uint32_t x_end);
+void ScalePlane_C(const int16_t* src, const ScaleFilter& filter,
+    uint8_t* dst, uint32_t x_begin, uint32_t x_end);
+
+#if CPU_X86
+void ScaleVertical_AVX2(const uint8_t* src, int32_t stride,
+    const int16_t* weights, uint32_t taps, int16_t* dst, uint32_t count);
+void ScaleHorizontal_AVX2(const int16_t* src, const ScaleFilter& filter,
+    uint8_t* dst, uint32_t x_begin, uint32_t x_end);
+void ScalePlane_AVX2(const int16_t* src, const ScaleFilter& filter,
+    uint8_t* dst, uint32_t x_begin, uint32_t x_end);
+#endif
+
+// Resamples BGRA images in two separable passes. The filters are kept
+// while the source and target sizes stay the same, so scaling a stream
+// costs no setup per frame.
+class ImageScaler
+{
+public:
+    explicit ImageScaler(bool use_simd = true);
+
+    void Scale(const BgraImage& src, const BgraImage& dst, WorkerPool* pool = nullptr);
+
+private:
+    void Prepare(const BgraImage& src, const BgraImage& dst);
+    void ScaleRows(const BgraImage& src, const BgraImage& dst,
+        uint32_t y_begin, uint32_t y_end, std::vector<int16_t>* row);
+
+    SCALE_VERTICAL_FN vertical_;
+    SCALE_HORIZONTAL_FN horizontal_;
+    uint32_t src_w_ = 0;
+    uint32_t src_h_ = 0;
+    uint32_t dst_w_ = 0;
+    uint32_t dst_h_ = 0;
+    ScaleFilter filter_x_;
+    ScaleFilter filter_y_;
+    std::vector<std::vector<int16_t>> rows_;  // one per stripe
+};
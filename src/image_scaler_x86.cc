@@ -0,0 +1,129 @@
+#include "image_scaler.h"
+
+#if CPU_X86
+#include <immintrin.h>
+#include <string.h>
+
+// Same integer math as the scalar passes, taps are multiplied in pairs
+// with madd, so the output is bit-identical.
+
+FORCE_INLINE TARGET_AVX2 __m256i WeightPair(int16_t lo, int16_t hi)
+{
+    return _mm256_set1_epi32((int)(((uint32_t)(uint16_t)hi << 16) | (uint16_t)lo));
+}
+
+TARGET_AVX2 void ScaleVertical_AVX2(const uint8_t* src, int32_t stride,
+    const int16_t* weights, uint32_t taps, int16_t* dst, uint32_t count)
+{
+    const uint32_t vec_count = count & ~15u;
+    const __m256i round = _mm256_set1_epi32(1 << 6);
+
+    for (uint32_t i = 0; i < vec_count; i += 16) {
+        __m256i lo = round;
+        __m256i hi = round;
+
+        for (uint32_t t = 0; t < taps; t += 2) {
+            const uint8_t* row = src + (intptr_t)t * stride + i;
+            __m256i a = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*)row));
+            __m256i b = a;
+            __m256i w = WeightPair(weights[t], 0);
+            if (t + 1 < taps) {
+                b = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*)(row + stride)));
+                w = WeightPair(weights[t], weights[t + 1]);
+            }
+
+            lo = _mm256_add_epi32(lo, _mm256_madd_epi16(_mm256_unpacklo_epi16(a, b), w));
+            hi = _mm256_add_epi32(hi, _mm256_madd_epi16(_mm256_unpackhi_epi16(a, b), w));
+        }
+
+        __m256i v = _mm256_packs_epi32(_mm256_srai_epi32(lo, 7), _mm256_srai_epi32(hi, 7));
+        _mm256_storeu_si256((__m256i*)(dst + i), v);
+    }
+
+    if (vec_count < count) {
+        ScaleVertical_C(src + vec_count, stride, weights, taps,
+            dst + vec_count, count - vec_count);
+    }
+}
+
+// Two output pixels per step, one in each lane. A tap pair loads two
+// neighbouring Q7 pixels and interleaves their channels for madd.
+TARGET_AVX2 void ScaleHorizontal_AVX2(const int16_t* src, const ScaleFilter& filter,
+    uint8_t* dst, uint32_t x_begin, uint32_t x_end)
+{
+    const uint32_t taps = filter.taps;
+    const uint32_t vec_end = x_begin + ((x_end - x_begin) & ~1u);
+    const __m256i interleave = _mm256_setr_epi8(
+        0, 1, 8, 9, 2, 3, 10, 11, 4, 5, 12, 13, 6, 7, 14, 15,
+        0, 1, 8, 9, 2, 3, 10, 11, 4, 5, 12, 13, 6, 7, 14, 15);
+    const __m256i round = _mm256_set1_epi32(1 << 20);
+    const __m256i gather = _mm256_setr_epi32(0, 4, 0, 0, 0, 0, 0, 0);
+
+    for (uint32_t x = x_begin; x < vec_end; x += 2) {
+        const int16_t* p0 = src + filter.offset[x] * 4;
+        const int16_t* p1 = src + filter.offset[x + 1] * 4;
+        const int16_t* w0 = &filter.weights[(size_t)x * taps];
+        const int16_t* w1 = w0 + taps;
+        __m256i sum = round;
+
+        for (uint32_t t = 0; t < taps; t += 2) {
+            __m256i v = _mm256_inserti128_si256(_mm256_castsi128_si256(
+                _mm_loadu_si128((const __m128i*)(p0 + t * 4))),
+                _mm_loadu_si128((const __m128i*)(p1 + t * 4)), 1);
+
+            int32_t pair0 = 0;
+            int32_t pair1 = 0;
+            memcpy(&pair0, w0 + t, 4);
+            memcpy(&pair1, w1 + t, 4);
+            __m256i w = _mm256_inserti128_si256(_mm256_castsi128_si256(
+                _mm_set1_epi32(pair0)), _mm_set1_epi32(pair1), 1);
+
+            sum = _mm256_add_epi32(sum,
+                _mm256_madd_epi16(_mm256_shuffle_epi8(v, interleave), w));
+        }
+
+        __m256i v = _mm256_srai_epi32(sum, 21);
+        v = _mm256_packs_epi32(v, v);
+        v = _mm256_packus_epi16(v, v);
+        v = _mm256_permutevar8x32_epi32(v, gather);
+        _mm_storel_epi64((__m128i*)(dst + x * 4), _mm256_castsi256_si128(v));
+    }
+
+    if (vec_end < x_end)
+        ScaleHorizontal_C(src, filter, dst, vec_end, x_end);
+}
+
+// Eight outputs per step. Each lane gathers the Q7 sample pair a tap pair
+// starts at, and madds it with that output's packed weight pair.
+TARGET_AVX2 void ScalePlane_AVX2(const int16_t* src, const ScaleFilter& filter,
+    uint8_t* dst, uint32_t x_begin, uint32_t x_end)
+{
+    const uint32_t pair_num = filter.taps / 2;
+    const size_t outputs = filter.offset.size();
+    const uint32_t vec_end = x_begin + ((x_end - x_begin) & ~7u);
+    const __m256i round = _mm256_set1_epi32(1 << 20);
+    const __m256i gather = _mm256_setr_epi32(0, 4, 0, 0, 0, 0, 0, 0);
+
+    for (uint32_t x = x_begin; x < vec_end; x += 8) {
+        __m256i index = _mm256_loadu_si256((const __m256i*)&filter.offset[x]);
+        __m256i sum = round;
+
+        for (uint32_t p = 0; p < pair_num; ++p) {
+            __m256i v = _mm256_i32gather_epi32((const int*)src, index, 2);
+            __m256i w = _mm256_loadu_si256((const __m256i*)&filter.pairs[p * outputs + x]);
+            sum = _mm256_add_epi32(sum, _mm256_madd_epi16(v, w));
+            index = _mm256_add_epi32(index, _mm256_set1_epi32(2));
+        }
+
+        __m256i v = _mm256_srai_epi32(sum, 21);
+        v = _mm256_packs_epi32(v, v);
+        v = _mm256_packus_epi16(v, v);
+        v = _mm256_permutevar8x32_epi32(v, gather);
+        _mm_storel_epi64((__m128i*)(dst + x), _mm256_castsi256_si128(v));
+    }
+
+    if (vec_end < x_end)
+        ScalePlane_C(src, filter, dst, vec_end, x_end);
+}
+
+#endif
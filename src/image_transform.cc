@@ -0,0 +1,375 @@
+#include "image_transform.h"
+#include <math.h>
+#include <string.h>
+#include "worker_pool.h"
+#include "yuv_format.h"
+
+// Q8 of |v|, rounded away from zero like the hand-tuned BT.601 constants.
+static int16_t FixedQ8(double v)
+{
+    return (int16_t)(v < 0 ? -floor(-v * 256 + 0.5) : floor(v * 256 + 0.5));
+}
+
+static void InitYuvConstants(
+    YuvConstants* k, double kr, double kb, bool full_range)
+{
+    const double kg = 1.0 - kr - kb;
+    const double y_scale = full_range ? 1.0 : 255.0 / 219.0;
+    const double c_scale = full_range ? 1.0 : 255.0 / 224.0;
+
+    k->y_offset = full_range ? 0 : 16;
+    k->y_coef = FixedQ8(y_scale);
+    k->r_cr = FixedQ8(2 * (1 - kr) * c_scale);
+    k->g_cb = FixedQ8(-2 * kb * (1 - kb) / kg * c_scale);
+    k->g_cr = FixedQ8(-2 * kr * (1 - kr) / kg * c_scale);
+    k->b_cb = FixedQ8(2 * (1 - kb) * c_scale);
+
+    for (int i = 0; i < 256; ++i) {
+        k->y_term[i] = k->y_coef * (i - k->y_offset) + 128;
+        k->r_term[i] = k->r_cr * (i - 128);
+        k->g_cb_term[i] = k->g_cb * (i - 128);
+        k->g_cr_term[i] = k->g_cr * (i - 128);
+        k->b_term[i] = k->b_cb * (i - 128);
+    }
+}
+
+struct YuvConstantsSet {
+    YuvConstants k[3][2];
+
+    YuvConstantsSet()
+    {
+        static const double weights[3][2] = {
+            { 0.299,  0.114  },  // BT.601
+            { 0.2126, 0.0722 },  // BT.709
+            { 0.2627, 0.0593 },  // BT.2020
+        };
+
+        for (int m = 0; m < 3; ++m) {
+            for (int full = 0; full < 2; ++full)
+                InitYuvConstants(&k[m][full], weights[m][0], weights[m][1], full != 0);
+        }
+    }
+};
+
+const YuvConstants* GetYuvConstants(YuvMatrix matrix, bool full_range)
+{
+    static const YuvConstantsSet set;
+    return &set.k[matrix][full_range ? 1 : 0];
+}
+
+SourceImage MakeSourceImage(PlaneLayout layout,
+    const uint8_t* scanline0, int32_t stride, uint32_t height)
+{
+    SourceImage src = {};
+    src.data[0] = scanline0;
+    src.stride[0] = stride;
+    src.yuv = GetYuvConstants(YUV_MATRIX_BT601, false);
+
+    if (layout == PLANE_LAYOUT_NV12) {
+        src.data[1] = scanline0 + (intptr_t)height * stride;
+        src.stride[1] = stride;
+        src.chroma_shift_y = 1;
+    }
+    else if (layout == PLANE_LAYOUT_PLANAR) {
+        src.data[1] = scanline0 + (intptr_t)height * stride;
+        src.stride[1] = stride / 2;
+        src.data[2] = src.data[1] + (intptr_t)((height + 1) / 2) * src.stride[1];
+        src.stride[2] = stride / 2;
+        src.chroma_shift_y = 1;
+    }
+
+    return src;
+}
+
+size_t SourceImageBytes(PlaneLayout layout, int32_t stride, uint32_t height)
+{
+    const size_t row = (size_t)(stride < 0 ? -(int64_t)stride : stride);
+    const size_t chroma_rows = (height + 1) / 2;
+    if (layout == PLANE_LAYOUT_NV12)
+        return row * (height + chroma_rows);
+
+    if (layout == PLANE_LAYOUT_PLANAR)
+        return row * height + row / 2 * chroma_rows * 2;
+
+    return row * height;
+}
+
+SourceImage SliceSourceRows(const SourceImage& src, uint32_t y)
+{
+    SourceImage slice = src;
+    slice.data[0] += (intptr_t)y * src.stride[0];
+
+    for (int i = 1; i < 3; ++i) {
+        if (slice.data[i])
+            slice.data[i] += (intptr_t)(y >> src.chroma_shift_y) * src.stride[i];
+    }
+
+    return slice;
+}
+
+FORCE_INLINE uint8_t Clip(int clr)
+{
+    return (uint8_t)(clr < 0 ? 0 : ( clr > 255 ? 255 : clr ));
+}
+
+// Chroma terms shared by the pixels of one chroma sample.
+struct ChromaTerms {
+    int r;
+    int g;
+    int b;
+};
+
+FORCE_INLINE ChromaTerms LookupChroma(const YuvConstants& k, int cb, int cr)
+{
+    ChromaTerms t;
+    t.r = k.r_term[cr];
+    t.g = k.g_cb_term[cb] + k.g_cr_term[cr];
+    t.b = k.b_term[cb];
+    return t;
+}
+
+// Writes one BGRA pixel.
+FORCE_INLINE void ConvertYCrCbToRGB(
+    uint8_t* pDestPel,
+    const YuvConstants& k,
+    int y,
+    const ChromaTerms& t
+)
+{
+    int c = k.y_term[y];
+
+    pDestPel[0] = Clip((c + t.b) >> 8);
+    pDestPel[1] = Clip((c + t.g) >> 8);
+    pDestPel[2] = Clip((c + t.r) >> 8);
+    pDestPel[3] = 255;
+}
+
+// First pixel of row |y| and the step to the next pixel.
+FORCE_INLINE uint8_t* TargetRow(
+    const TargetImage& dst, uint32_t y, uint32_t width, int* step)
+{
+    uint8_t* row = dst.data + (intptr_t)y * dst.stride;
+    if (!dst.mirror) {
+        *step = 4;
+        return row;
+    }
+
+    *step = -4;
+    return row + (intptr_t)(width - 1) * 4;
+}
+
+TargetImage SliceTargetRows(const TargetImage& dst, uint32_t y)
+{
+    TargetImage slice = dst;
+    slice.data += (intptr_t)y * dst.stride;
+    return slice;
+}
+
+void TransformImage_RGB24(
+    const TargetImage& dst,
+    const SourceImage& src,
+    uint32_t           dwWidthInPixels,
+    uint32_t           dwHeightInPixels
+)
+{
+    for (uint32_t y = 0; y < dwHeightInPixels; y++) {
+        const uint8_t* pSrcPel = src.data[0] + (intptr_t)y * src.stride[0];
+        int step = 0;
+        uint8_t* pDestPel = TargetRow(dst, y, dwWidthInPixels, &step);
+
+        for (uint32_t x = 0; x < dwWidthInPixels; x++) {
+            pDestPel[0] = pSrcPel[0];
+            pDestPel[1] = pSrcPel[1];
+            pDestPel[2] = pSrcPel[2];
+            pDestPel[3] = 255;
+
+            pSrcPel += 3;
+            pDestPel += step;
+        }
+    }
+}
+
+void TransformImage_RGB32(
+    const TargetImage& dst,
+    const SourceImage& src,
+    uint32_t           dwWidthInPixels,
+    uint32_t           dwHeightInPixels
+)
+{
+    for (uint32_t y = 0; y < dwHeightInPixels; y++) {
+        const uint8_t* pSrcPel = src.data[0] + (intptr_t)y * src.stride[0];
+        int step = 0;
+        uint8_t* pDestPel = TargetRow(dst, y, dwWidthInPixels, &step);
+
+        if (!dst.mirror) {
+            memcpy(pDestPel, pSrcPel, dwWidthInPixels * 4);
+            continue;
+        }
+
+        for (uint32_t x = 0; x < dwWidthInPixels; x++) {
+            memcpy(pDestPel, pSrcPel, 4);
+            pSrcPel += 4;
+            pDestPel += step;
+        }
+    }
+}
+
+template <class Format>
+void TransformYuv(
+    const TargetImage& dst,
+    const SourceImage& src,
+    uint32_t           dwWidthInPixels,
+    uint32_t           dwHeightInPixels
+)
+{
+    const YuvConstants& k = *src.yuv;
+    const uint32_t evenWidth = dwWidthInPixels & ~1u;
+
+    for (uint32_t y = 0; y < dwHeightInPixels; y++) {
+        const uint8_t* lpLineY = src.data[0] + (intptr_t)y * src.stride[0];
+        const uint8_t* lpLineC0 = NULL;
+        const uint8_t* lpLineC1 = NULL;
+        Format::ChromaRows(src, y, &lpLineC0, &lpLineC1);
+
+        int step = 0;
+        uint8_t* pDestPel = TargetRow(dst, y, dwWidthInPixels, &step);
+
+        int cb = 0;
+        int cr = 0;
+        for (uint32_t x = 0; x < evenWidth; x += 2) {
+            Format::Chroma(lpLineC0, lpLineC1, x, &cb, &cr);
+            const ChromaTerms t = LookupChroma(k, cb, cr);
+            ConvertYCrCbToRGB(pDestPel, k, Format::Luma(lpLineY, x), t);
+            ConvertYCrCbToRGB(pDestPel + step, k, Format::Luma(lpLineY, x + 1), t);
+            pDestPel += 2 * step;
+        }
+
+        if (evenWidth < dwWidthInPixels) {
+            Format::Chroma(lpLineC0, lpLineC1, evenWidth, &cb, &cr);
+            ConvertYCrCbToRGB(pDestPel, k, Format::Luma(lpLineY, evenWidth),
+                LookupChroma(k, cb, cr));
+        }
+    }
+}
+
+#define INSTANTIATE_TRANSFORM_YUV(Format) \
+    template DECLARE_IMAGE_TRANSFORM(TransformYuv<Format>);
+
+FOR_EACH_YUV_FORMAT(INSTANTIATE_TRANSFORM_YUV)
+
+static IMAGE_TRANSFORM_FN SelectTransform_RGB32()
+{
+#if CPU_X86
+    const CpuFeatures& cpu = GetCpuFeatures();
+    if (cpu.avx2)
+        return TransformImage_RGB32_AVX2;
+
+    if (cpu.sse2)
+        return TransformImage_RGB32_SSE2;
+#endif
+    return TransformImage_RGB32;
+}
+
+template <class Format>
+static ImageTransformEntry YuvTransformEntry()
+{
+    const uint32_t pixel_bytes =
+        Format::layout == PLANE_LAYOUT_PACKED ? 2 : (uint32_t)sizeof(typename Format::Sample);
+    ImageTransformEntry entry = {
+        Format::fourcc, Format::layout, TransformYuv<Format>, pixel_bytes, true,
+    };
+#if CPU_X86
+    const CpuFeatures& cpu = GetCpuFeatures();
+    if (cpu.avx2)
+        entry.xform = TransformYuv_AVX2<Format>;
+    else if (cpu.sse2)
+        entry.xform = TransformYuv_SSE2<Format>;
+#endif
+    return entry;
+}
+
+#define YUV_TRANSFORM_ENTRY(Format) YuvTransformEntry<Format>(),
+
+const ImageTransformEntry* GetImageTransforms(uint32_t* count)
+{
+    // D3DFMT_X8R8G8B8 and D3DFMT_R8G8B8.
+    static const ImageTransformEntry entries[] = {
+        { 22, PLANE_LAYOUT_PACKED, SelectTransform_RGB32(), 4, false },
+        { 20, PLANE_LAYOUT_PACKED, TransformImage_RGB24, 3, false },
+        FOR_EACH_YUV_FORMAT(YUV_TRANSFORM_ENTRY)
+    };
+
+    *count = sizeof(entries) / sizeof(entries[0]);
+    return entries;
+}
+
+const ImageTransformEntry* FindImageTransform(uint32_t format)
+{
+    uint32_t count = 0;
+    const ImageTransformEntry* entries = GetImageTransforms(&count);
+    for (uint32_t i = 0; i < count; i++) {
+        if (entries[i].format == format)
+            return &entries[i];
+    }
+
+    return nullptr;
+}
+
+size_t SourceRowBytes(const ImageTransformEntry& entry, uint32_t width)
+{
+    const size_t pixels = entry.chroma_pairs ? ((size_t)width + 1) & ~(size_t)1 : width;
+    return pixels * entry.pixel_bytes;
+}
+
+bool SourceImageFits(const ImageTransformEntry& entry, int32_t stride, size_t size,
+    uint32_t width, uint32_t height)
+{
+    // Media Foundation has YUV with chroma planes top-down only, and
+    // MakeSourceImage would put the chroma of such a frame before it.
+    if (stride < 0 && entry.layout != PLANE_LAYOUT_PACKED)
+        return false;
+
+    const size_t row = (size_t)(stride < 0 ? -(int64_t)stride : stride);
+    return row >= SourceRowBytes(entry, width)
+        && size >= SourceImageBytes(entry.layout, stride, height);
+}
+
+void TransformImageStripes(
+    WorkerPool*        pool,
+    IMAGE_TRANSFORM_FN xform,
+    const TargetImage& dst,
+    const SourceImage& src,
+    uint32_t           dwWidthInPixels,
+    uint32_t           dwHeightInPixels
+)
+{
+    // About a quarter megapixel per stripe: 480p stays on one thread,
+    // 1080p and 4K spread over every core.
+    const uint64_t kPixelsPerStripe = 256 * 1024;
+    const uint64_t pixel_num = (uint64_t)dwWidthInPixels * dwHeightInPixels;
+
+    uint32_t stripe_num = (uint32_t)(pixel_num / kPixelsPerStripe);
+    if (pool && stripe_num > (uint32_t)pool->Concurrency())
+        stripe_num = (uint32_t)pool->Concurrency();
+
+    if (!pool || stripe_num <= 1) {
+        xform(dst, src, dwWidthInPixels, dwHeightInPixels);
+        return;
+    }
+
+    // Stripes start on a row that begins a chroma row.
+    const uint32_t row_align = 1u << src.chroma_shift_y;
+    uint32_t stripe_rows = (dwHeightInPixels + stripe_num - 1) / stripe_num;
+    stripe_rows = (stripe_rows + row_align - 1) & ~(row_align - 1);
+    stripe_num = (dwHeightInPixels + stripe_rows - 1) / stripe_rows;
+
+    pool->Run((int)stripe_num, [&](int i) {
+        uint32_t y = (uint32_t)i * stripe_rows;
+        uint32_t rows = dwHeightInPixels - y;
+        if (rows > stripe_rows)
+            rows = stripe_rows;
+
+        xform(SliceTargetRows(dst, y), SliceSourceRows(src, y),
+            dwWidthInPixels, rows);
+    });
+}
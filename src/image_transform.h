@@ -0,0 +1,128 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+#include "cpu_features.h"
+
+class WorkerPool;
+
+enum PlaneLayout {
+    PLANE_LAYOUT_PACKED,
+    PLANE_LAYOUT_NV12,    // Y plane, then a CbCr plane with half the rows
+    PLANE_LAYOUT_PLANAR,  // Y plane, then two chroma planes of half size
+};
+
+enum YuvMatrix {
+    YUV_MATRIX_BT601,
+    YUV_MATRIX_BT709,
+    YUV_MATRIX_BT2020,
+};
+
+// One YCbCr to RGB conversion. The SIMD kernels multiply by the 8.8 fixed
+// point coefficients, the scalar ones look up terms with the same values
+// per sample, so both produce the same bytes.
+struct YuvConstants {
+    int16_t y_offset;  // 16, or 0 for full range
+    int16_t y_coef;
+    int16_t r_cr;
+    int16_t g_cb;
+    int16_t g_cr;
+    int16_t b_cb;
+    int32_t y_term[256];  // y_coef * (Y - y_offset) + 128
+    int32_t r_term[256];  // r_cr * (Cr - 128), and so on
+    int32_t g_cb_term[256];
+    int32_t g_cr_term[256];
+    int32_t b_term[256];
+};
+
+// Tables are built on first use and live for the whole process.
+const YuvConstants* GetYuvConstants(YuvMatrix matrix, bool full_range);
+
+// Scan line 0 of each plane. Planes 1 and 2 have 1 << chroma_shift_y
+// luma rows per row.
+struct SourceImage {
+    const uint8_t* data[3];
+    int32_t stride[3];
+    uint32_t chroma_shift_y;
+    const YuvConstants* yuv;  // unused by RGB sources
+};
+
+// Frames handed over by Media Foundation store the planes back to back;
+// planar chroma rows have half the stride. YUV is taken as BT.601 limited
+// range until the caller sets |yuv|.
+SourceImage MakeSourceImage(PlaneLayout layout,
+    const uint8_t* scanline0, int32_t stride, uint32_t height);
+
+// Bytes the planes of such a frame span, with |stride| the luma stride.
+size_t SourceImageBytes(PlaneLayout layout, int32_t stride, uint32_t height);
+
+// The image starting at luma row |y|, which must be a multiple of
+// 1 << chroma_shift_y.
+SourceImage SliceSourceRows(const SourceImage& src, uint32_t y);
+
+// 32-bit BGRA rows written top-down from |data|. A bottom-up bitmap is
+// filled by pointing at its last scan line with a negative stride, and
+// |mirror| reverses the pixels of every row.
+struct TargetImage {
+    uint8_t* data;
+    int32_t stride;
+    bool mirror;
+};
+
+// The image starting at row |y|.
+TargetImage SliceTargetRows(const TargetImage& dst, uint32_t y);
+
+// Converts a frame into the orientation |dst| asks for in a single pass.
+typedef void (*IMAGE_TRANSFORM_FN)(
+    const TargetImage& dst,
+    const SourceImage& src,
+    uint32_t           dwWidthInPixels,
+    uint32_t           dwHeightInPixels
+);
+
+#define DECLARE_IMAGE_TRANSFORM(name) \
+    void name(const TargetImage& dst, const SourceImage& src, \
+        uint32_t dwWidthInPixels, uint32_t dwHeightInPixels)
+
+DECLARE_IMAGE_TRANSFORM(TransformImage_RGB24);
+DECLARE_IMAGE_TRANSFORM(TransformImage_RGB32);
+
+#if CPU_X86
+DECLARE_IMAGE_TRANSFORM(TransformImage_RGB32_SSE2);
+DECLARE_IMAGE_TRANSFORM(TransformImage_RGB32_AVX2);
+#endif
+
+// A conversion from a Media Foundation subtype, identified by the first
+// field of its GUID: a FOURCC, or a D3DFORMAT value for RGB.
+struct ImageTransformEntry {
+    uint32_t format;
+    PlaneLayout layout;
+    IMAGE_TRANSFORM_FN xform;  // fastest variant the running CPU supports
+    uint32_t pixel_bytes;      // in the first plane
+    bool chroma_pairs;         // pixels come in pairs that share chroma
+};
+
+// All conversions in order of preference. The SIMD variants produce the
+// same bytes as the scalar ones.
+const ImageTransformEntry* GetImageTransforms(uint32_t* count);
+const ImageTransformEntry* FindImageTransform(uint32_t format);
+
+// Bytes of the first plane that a row of |width| pixels is read from.
+size_t SourceRowBytes(const ImageTransformEntry& entry, uint32_t width);
+
+// Whether |size| bytes with luma stride |stride| hold a |width| x |height|
+// frame of |entry|'s format, so that converting it stays inside them.
+// Only packed frames may be bottom-up.
+bool SourceImageFits(const ImageTransformEntry& entry, int32_t stride, size_t size,
+    uint32_t width, uint32_t height);
+
+// Splits the frame into horizontal stripes and converts them on |pool|.
+// Small frames are converted on the calling thread, where waking the
+// workers would cost more than it saves.
+void TransformImageStripes(
+    WorkerPool*        pool,
+    IMAGE_TRANSFORM_FN xform,
+    const TargetImage& dst,
+    const SourceImage& src,
+    uint32_t           dwWidthInPixels,
+    uint32_t           dwHeightInPixels
+);
@@ -0,0 +1,529 @@
+#include "image_transform.h"
+#include <string.h>
+#include "yuv_format.h"
+
+#if CPU_X86
+#include <immintrin.h>
+
+// The kernels evaluate the same fixed-point formula as the scalar path
+// with 32-bit madd lanes, then clip by saturating packs, so the output is
+// bit-identical. Chroma terms are computed once per chroma sample from
+// interleaved (Cb - 128, Cr - 128) pairs and duplicated to both pixels.
+//
+// Each kernel converts the columns that fill whole vectors and hands the
+// rest to a narrower one. In mirror mode the vector part lands to the
+// right of the narrow columns.
+
+FORCE_INLINE TargetImage BodyTarget(
+    const TargetImage& dst, uint32_t vec_width, uint32_t width)
+{
+    TargetImage body = dst;
+    if (dst.mirror)
+        body.data += (width - vec_width) * 4;
+
+    return body;
+}
+
+FORCE_INLINE TargetImage TailTarget(const TargetImage& dst, uint32_t vec_width)
+{
+    TargetImage tail = dst;
+    if (!dst.mirror)
+        tail.data += vec_width * 4;
+
+    return tail;
+}
+
+FORCE_INLINE TARGET_SSE2 __m128i PairEpi16(int lo, int hi)
+{
+    return _mm_set1_epi32((int)(((uint32_t)(uint16_t)hi << 16) | (uint16_t)lo));
+}
+
+FORCE_INLINE TARGET_SSE2 __m128i Reverse4(__m128i v)
+{
+    return _mm_shuffle_epi32(v, _MM_SHUFFLE(0, 1, 2, 3));
+}
+
+// Stores pixels x .. x + 7 of a row, |lo| holding the first four.
+template <bool kMirror>
+FORCE_INLINE TARGET_SSE2 void StorePixels8(
+    uint8_t* row, uint32_t x, uint32_t width, __m128i lo, __m128i hi)
+{
+    if (kMirror) {
+        uint8_t* p = row + (width - x - 8) * 4;
+        _mm_storeu_si128((__m128i*)p, Reverse4(hi));
+        _mm_storeu_si128((__m128i*)(p + 16), Reverse4(lo));
+    } else {
+        uint8_t* p = row + x * 4;
+        _mm_storeu_si128((__m128i*)p, lo);
+        _mm_storeu_si128((__m128i*)(p + 16), hi);
+    }
+}
+
+// YuvConstants coefficients as madd operands.
+struct YuvCoefs128 {
+    __m128i y_offset;
+    __m128i luma;
+    __m128i r;
+    __m128i g;
+    __m128i b;
+};
+
+FORCE_INLINE TARGET_SSE2 YuvCoefs128 LoadCoefs128(const YuvConstants& k)
+{
+    YuvCoefs128 c;
+    c.y_offset = _mm_set1_epi16(k.y_offset);
+    c.luma = PairEpi16(k.y_coef, 128);
+    c.r = PairEpi16(0, k.r_cr);
+    c.g = PairEpi16(k.g_cb, k.g_cr);
+    c.b = PairEpi16(k.b_cb, 0);
+    return c;
+}
+
+struct ChromaTerms128 {
+    __m128i r;
+    __m128i g;
+    __m128i b;
+};
+
+// |uv| holds 4 zero-extended (Cb, Cr) pairs.
+FORCE_INLINE TARGET_SSE2 ChromaTerms128 ComputeChroma(
+    __m128i uv, const YuvCoefs128& k)
+{
+    __m128i de = _mm_sub_epi16(uv, _mm_set1_epi16(128));
+    ChromaTerms128 t;
+    t.r = _mm_madd_epi16(de, k.r);
+    t.g = _mm_madd_epi16(de, k.g);
+    t.b = _mm_madd_epi16(de, k.b);
+    return t;
+}
+
+FORCE_INLINE TARGET_SSE2 __m128i PackChannel(
+    __m128i y_lo, __m128i y_hi, __m128i c)
+{
+    __m128i lo = _mm_add_epi32(y_lo, _mm_unpacklo_epi32(c, c));
+    __m128i hi = _mm_add_epi32(y_hi, _mm_unpackhi_epi32(c, c));
+    return _mm_packs_epi32(_mm_srai_epi32(lo, 8), _mm_srai_epi32(hi, 8));
+}
+
+// Converts 8 pixels; |y| holds 8 zero-extended luma samples and |t| the
+// terms of the 4 chroma samples they share.
+template <bool kMirror>
+FORCE_INLINE TARGET_SSE2 void StoreBgra8(uint8_t* row, uint32_t x,
+    uint32_t width, __m128i y, const ChromaTerms128& t, const YuvCoefs128& k)
+{
+    const __m128i one = _mm_set1_epi16(1);
+    __m128i c = _mm_sub_epi16(y, k.y_offset);
+    __m128i y_lo = _mm_madd_epi16(_mm_unpacklo_epi16(c, one), k.luma);
+    __m128i y_hi = _mm_madd_epi16(_mm_unpackhi_epi16(c, one), k.luma);
+
+    __m128i r = PackChannel(y_lo, y_hi, t.r);
+    __m128i g = PackChannel(y_lo, y_hi, t.g);
+    __m128i b = PackChannel(y_lo, y_hi, t.b);
+
+    __m128i br = _mm_packus_epi16(b, r);
+    __m128i ga = _mm_packus_epi16(g, _mm_set1_epi16(255));
+    __m128i bg = _mm_unpacklo_epi8(br, ga);
+    __m128i ra = _mm_unpackhi_epi8(br, ga);
+
+    StorePixels8<kMirror>(row, x, width,
+        _mm_unpacklo_epi16(bg, ra), _mm_unpackhi_epi16(bg, ra));
+}
+
+TARGET_SSE2 void TransformImage_RGB32_SSE2(
+    const TargetImage& dst,
+    const SourceImage& src,
+    uint32_t           dwWidthInPixels,
+    uint32_t           dwHeightInPixels
+)
+{
+    if (!dst.mirror) {
+        TransformImage_RGB32(dst, src, dwWidthInPixels, dwHeightInPixels);
+        return;
+    }
+
+    const uint32_t vec_width = dwWidthInPixels & ~7u;
+    const TargetImage body = BodyTarget(dst, vec_width, dwWidthInPixels);
+
+    for (uint32_t y = 0; y < dwHeightInPixels; y++) {
+        const uint8_t* src_line = src.data[0] + (intptr_t)y * src.stride[0];
+        uint8_t* dst_line = body.data + (intptr_t)y * body.stride;
+
+        for (uint32_t x = 0; x < vec_width; x += 8) {
+            __m128i lo = _mm_loadu_si128((const __m128i*)(src_line + x * 4));
+            __m128i hi = _mm_loadu_si128((const __m128i*)(src_line + x * 4 + 16));
+            StorePixels8<true>(dst_line, x, vec_width, lo, hi);
+        }
+    }
+
+    if (vec_width < dwWidthInPixels) {
+        SourceImage tail = src;
+        tail.data[0] += vec_width * 4;
+        TransformImage_RGB32(TailTarget(dst, vec_width), tail,
+            dwWidthInPixels - vec_width, dwHeightInPixels);
+    }
+}
+
+FORCE_INLINE TARGET_SSE2 __m128i Narrow16(__m128i v)
+{
+    return _mm_srli_epi16(_mm_adds_epu16(v, _mm_set1_epi16(0x80)), 8);
+}
+
+FORCE_INLINE TARGET_SSE2 __m128i SwapPairs(__m128i v)
+{
+    v = _mm_shufflelo_epi16(v, _MM_SHUFFLE(2, 3, 0, 1));
+    return _mm_shufflehi_epi16(v, _MM_SHUFFLE(2, 3, 0, 1));
+}
+
+// 8 zero-extended luma samples from column |x|.
+template <class Format>
+FORCE_INLINE TARGET_SSE2 __m128i LoadLuma8(const uint8_t* row, uint32_t x)
+{
+    if (Format::layout == PLANE_LAYOUT_PACKED) {
+        __m128i w = _mm_loadu_si128((const __m128i*)(row + x * 2));
+        if (Format::luma_offset)
+            return _mm_srli_epi16(w, 8);
+
+        return _mm_and_si128(w, _mm_set1_epi16(0xFF));
+    }
+
+    if (sizeof(typename Format::Sample) == 2)
+        return Narrow16(_mm_loadu_si128((const __m128i*)(row + x * 2)));
+
+    return _mm_unpacklo_epi8(
+        _mm_loadl_epi64((const __m128i*)(row + x)), _mm_setzero_si128());
+}
+
+// The 4 (Cb, Cr) pairs of columns |x| .. |x| + 7.
+template <class Format>
+FORCE_INLINE TARGET_SSE2 __m128i LoadChroma8(
+    const uint8_t* c0, const uint8_t* c1, uint32_t x)
+{
+    __m128i uv;
+    if (Format::layout == PLANE_LAYOUT_PLANAR) {
+        int32_t u = 0;
+        int32_t v = 0;
+        memcpy(&u, c0 + x / 2, 4);
+        memcpy(&v, c1 + x / 2, 4);
+        return _mm_unpacklo_epi8(_mm_unpacklo_epi8(
+            _mm_cvtsi32_si128(u), _mm_cvtsi32_si128(v)), _mm_setzero_si128());
+    }
+
+    if (Format::layout == PLANE_LAYOUT_PACKED) {
+        __m128i w = _mm_loadu_si128((const __m128i*)(c0 + x * 2));
+        if (Format::luma_offset)
+            uv = _mm_and_si128(w, _mm_set1_epi16(0xFF));
+        else
+            uv = _mm_srli_epi16(w, 8);
+    } else if (sizeof(typename Format::Sample) == 2) {
+        uv = Narrow16(_mm_loadu_si128((const __m128i*)(c0 + x * 2)));
+    } else {
+        uv = _mm_unpacklo_epi8(
+            _mm_loadl_epi64((const __m128i*)(c0 + x)), _mm_setzero_si128());
+    }
+
+    return Format::swap_uv ? SwapPairs(uv) : uv;
+}
+
+// With vertically subsampled chroma both rows of a pair share one chroma
+// row, and its terms are computed once per 2x2 block.
+template <class Format, bool kMirror>
+TARGET_SSE2 void Yuv_SSE2(const TargetImage& dst,
+    const SourceImage& src, uint32_t width, uint32_t height)
+{
+    const YuvCoefs128 k = LoadCoefs128(*src.yuv);
+    const uint32_t rows = 1u << Format::chroma_shift_y;
+
+    for (uint32_t y = 0; y < height; y += rows) {
+        const uint8_t* line1 = src.data[0] + (intptr_t)y * src.stride[0];
+        const uint8_t* line2 = line1 + src.stride[0];
+        const uint8_t* c0 = NULL;
+        const uint8_t* c1 = NULL;
+        Format::ChromaRows(src, y, &c0, &c1);
+        uint8_t* dst1 = dst.data + (intptr_t)y * dst.stride;
+        uint8_t* dst2 = dst1 + dst.stride;
+
+        if (rows == 2 && y + 1 < height) {
+            for (uint32_t x = 0; x < width; x += 8) {
+                ChromaTerms128 t = ComputeChroma(LoadChroma8<Format>(c0, c1, x), k);
+                StoreBgra8<kMirror>(dst1, x, width, LoadLuma8<Format>(line1, x), t, k);
+                StoreBgra8<kMirror>(dst2, x, width, LoadLuma8<Format>(line2, x), t, k);
+            }
+        } else {
+            for (uint32_t x = 0; x < width; x += 8) {
+                ChromaTerms128 t = ComputeChroma(LoadChroma8<Format>(c0, c1, x), k);
+                StoreBgra8<kMirror>(dst1, x, width, LoadLuma8<Format>(line1, x), t, k);
+            }
+        }
+    }
+}
+
+template <class Format>
+TARGET_SSE2 void TransformYuv_SSE2(
+    const TargetImage& dst,
+    const SourceImage& src,
+    uint32_t           dwWidthInPixels,
+    uint32_t           dwHeightInPixels
+)
+{
+    const uint32_t vec_width = dwWidthInPixels & ~7u;
+    const TargetImage body = BodyTarget(dst, vec_width, dwWidthInPixels);
+    if (dst.mirror)
+        Yuv_SSE2<Format, true>(body, src, vec_width, dwHeightInPixels);
+    else
+        Yuv_SSE2<Format, false>(body, src, vec_width, dwHeightInPixels);
+
+    if (vec_width < dwWidthInPixels) {
+        TransformYuv<Format>(TailTarget(dst, vec_width),
+            Format::SkipColumns(src, vec_width),
+            dwWidthInPixels - vec_width, dwHeightInPixels);
+    }
+}
+
+FORCE_INLINE TARGET_AVX2 __m256i PairEpi16x2(int lo, int hi)
+{
+    return _mm256_set1_epi32((int)(((uint32_t)(uint16_t)hi << 16) | (uint16_t)lo));
+}
+
+FORCE_INLINE TARGET_AVX2 __m256i Reverse4x2(__m256i v)
+{
+    return _mm256_shuffle_epi32(v, _MM_SHUFFLE(0, 1, 2, 3));
+}
+
+// Stores pixels x .. x + 15 of a row. Lane 0 of |lo| holds pixels 0-3,
+// lane 1 pixels 8-11, and |hi| the four pixels after each.
+template <bool kMirror>
+FORCE_INLINE TARGET_AVX2 void StorePixels16(
+    uint8_t* row, uint32_t x, uint32_t width, __m256i lo, __m256i hi)
+{
+    if (kMirror) {
+        uint8_t* p = row + (width - x - 16) * 4;
+        _mm256_storeu_si256((__m256i*)p,
+            Reverse4x2(_mm256_permute2x128_si256(hi, lo, 0x31)));
+        _mm256_storeu_si256((__m256i*)(p + 32),
+            Reverse4x2(_mm256_permute2x128_si256(hi, lo, 0x20)));
+    } else {
+        uint8_t* p = row + x * 4;
+        _mm256_storeu_si256((__m256i*)p, _mm256_permute2x128_si256(lo, hi, 0x20));
+        _mm256_storeu_si256((__m256i*)(p + 32), _mm256_permute2x128_si256(lo, hi, 0x31));
+    }
+}
+
+struct YuvCoefs256 {
+    __m256i y_offset;
+    __m256i luma;
+    __m256i r;
+    __m256i g;
+    __m256i b;
+};
+
+FORCE_INLINE TARGET_AVX2 YuvCoefs256 LoadCoefs256(const YuvConstants& k)
+{
+    YuvCoefs256 c;
+    c.y_offset = _mm256_set1_epi16(k.y_offset);
+    c.luma = PairEpi16x2(k.y_coef, 128);
+    c.r = PairEpi16x2(0, k.r_cr);
+    c.g = PairEpi16x2(k.g_cb, k.g_cr);
+    c.b = PairEpi16x2(k.b_cb, 0);
+    return c;
+}
+
+struct ChromaTerms256 {
+    __m256i r;
+    __m256i g;
+    __m256i b;
+};
+
+// The 256-bit helpers work on two independent 128-bit lanes, each laid out
+// like the SSE2 version.
+FORCE_INLINE TARGET_AVX2 ChromaTerms256 ComputeChroma(
+    __m256i uv, const YuvCoefs256& k)
+{
+    __m256i de = _mm256_sub_epi16(uv, _mm256_set1_epi16(128));
+    ChromaTerms256 t;
+    t.r = _mm256_madd_epi16(de, k.r);
+    t.g = _mm256_madd_epi16(de, k.g);
+    t.b = _mm256_madd_epi16(de, k.b);
+    return t;
+}
+
+FORCE_INLINE TARGET_AVX2 __m256i PackChannel(
+    __m256i y_lo, __m256i y_hi, __m256i c)
+{
+    __m256i lo = _mm256_add_epi32(y_lo, _mm256_unpacklo_epi32(c, c));
+    __m256i hi = _mm256_add_epi32(y_hi, _mm256_unpackhi_epi32(c, c));
+    return _mm256_packs_epi32(_mm256_srai_epi32(lo, 8), _mm256_srai_epi32(hi, 8));
+}
+
+// Converts 16 pixels, lane 0 of |y| and |t| covers pixels 0-7 and lane 1
+// pixels 8-15.
+template <bool kMirror>
+FORCE_INLINE TARGET_AVX2 void StoreBgra16(uint8_t* row, uint32_t x,
+    uint32_t width, __m256i y, const ChromaTerms256& t, const YuvCoefs256& k)
+{
+    const __m256i one = _mm256_set1_epi16(1);
+    __m256i c = _mm256_sub_epi16(y, k.y_offset);
+    __m256i y_lo = _mm256_madd_epi16(_mm256_unpacklo_epi16(c, one), k.luma);
+    __m256i y_hi = _mm256_madd_epi16(_mm256_unpackhi_epi16(c, one), k.luma);
+
+    __m256i r = PackChannel(y_lo, y_hi, t.r);
+    __m256i g = PackChannel(y_lo, y_hi, t.g);
+    __m256i b = PackChannel(y_lo, y_hi, t.b);
+
+    __m256i br = _mm256_packus_epi16(b, r);
+    __m256i ga = _mm256_packus_epi16(g, _mm256_set1_epi16(255));
+    __m256i bg = _mm256_unpacklo_epi8(br, ga);
+    __m256i ra = _mm256_unpackhi_epi8(br, ga);
+
+    StorePixels16<kMirror>(row, x, width,
+        _mm256_unpacklo_epi16(bg, ra), _mm256_unpackhi_epi16(bg, ra));
+}
+
+TARGET_AVX2 void TransformImage_RGB32_AVX2(
+    const TargetImage& dst,
+    const SourceImage& src,
+    uint32_t           dwWidthInPixels,
+    uint32_t           dwHeightInPixels
+)
+{
+    if (!dst.mirror) {
+        TransformImage_RGB32(dst, src, dwWidthInPixels, dwHeightInPixels);
+        return;
+    }
+
+    const uint32_t vec_width = dwWidthInPixels & ~7u;
+    const TargetImage body = BodyTarget(dst, vec_width, dwWidthInPixels);
+    const __m256i reverse = _mm256_setr_epi32(7, 6, 5, 4, 3, 2, 1, 0);
+
+    for (uint32_t y = 0; y < dwHeightInPixels; y++) {
+        const uint8_t* src_line = src.data[0] + (intptr_t)y * src.stride[0];
+        uint8_t* dst_line = body.data + (intptr_t)y * body.stride;
+
+        for (uint32_t x = 0; x < vec_width; x += 8) {
+            __m256i v = _mm256_loadu_si256((const __m256i*)(src_line + x * 4));
+            _mm256_storeu_si256((__m256i*)(dst_line + (vec_width - x - 8) * 4),
+                _mm256_permutevar8x32_epi32(v, reverse));
+        }
+    }
+
+    if (vec_width < dwWidthInPixels) {
+        SourceImage tail = src;
+        tail.data[0] += vec_width * 4;
+        TransformImage_RGB32(TailTarget(dst, vec_width), tail,
+            dwWidthInPixels - vec_width, dwHeightInPixels);
+    }
+}
+
+FORCE_INLINE TARGET_AVX2 __m256i Narrow16x2(__m256i v)
+{
+    return _mm256_srli_epi16(_mm256_adds_epu16(v, _mm256_set1_epi16(0x80)), 8);
+}
+
+FORCE_INLINE TARGET_AVX2 __m256i SwapPairs(__m256i v)
+{
+    v = _mm256_shufflelo_epi16(v, _MM_SHUFFLE(2, 3, 0, 1));
+    return _mm256_shufflehi_epi16(v, _MM_SHUFFLE(2, 3, 0, 1));
+}
+
+template <class Format>
+FORCE_INLINE TARGET_AVX2 __m256i LoadLuma16(const uint8_t* row, uint32_t x)
+{
+    if (Format::layout == PLANE_LAYOUT_PACKED) {
+        __m256i w = _mm256_loadu_si256((const __m256i*)(row + x * 2));
+        if (Format::luma_offset)
+            return _mm256_srli_epi16(w, 8);
+
+        return _mm256_and_si256(w, _mm256_set1_epi16(0xFF));
+    }
+
+    if (sizeof(typename Format::Sample) == 2)
+        return Narrow16x2(_mm256_loadu_si256((const __m256i*)(row + x * 2)));
+
+    return _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*)(row + x)));
+}
+
+template <class Format>
+FORCE_INLINE TARGET_AVX2 __m256i LoadChroma16(
+    const uint8_t* c0, const uint8_t* c1, uint32_t x)
+{
+    __m256i uv;
+    if (Format::layout == PLANE_LAYOUT_PLANAR) {
+        return _mm256_cvtepu8_epi16(_mm_unpacklo_epi8(
+            _mm_loadl_epi64((const __m128i*)(c0 + x / 2)),
+            _mm_loadl_epi64((const __m128i*)(c1 + x / 2))));
+    }
+
+    if (Format::layout == PLANE_LAYOUT_PACKED) {
+        __m256i w = _mm256_loadu_si256((const __m256i*)(c0 + x * 2));
+        if (Format::luma_offset)
+            uv = _mm256_and_si256(w, _mm256_set1_epi16(0xFF));
+        else
+            uv = _mm256_srli_epi16(w, 8);
+    } else if (sizeof(typename Format::Sample) == 2) {
+        uv = Narrow16x2(_mm256_loadu_si256((const __m256i*)(c0 + x * 2)));
+    } else {
+        uv = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*)(c0 + x)));
+    }
+
+    return Format::swap_uv ? SwapPairs(uv) : uv;
+}
+
+template <class Format, bool kMirror>
+TARGET_AVX2 void Yuv_AVX2(const TargetImage& dst,
+    const SourceImage& src, uint32_t width, uint32_t height)
+{
+    const YuvCoefs256 k = LoadCoefs256(*src.yuv);
+    const uint32_t rows = 1u << Format::chroma_shift_y;
+
+    for (uint32_t y = 0; y < height; y += rows) {
+        const uint8_t* line1 = src.data[0] + (intptr_t)y * src.stride[0];
+        const uint8_t* line2 = line1 + src.stride[0];
+        const uint8_t* c0 = NULL;
+        const uint8_t* c1 = NULL;
+        Format::ChromaRows(src, y, &c0, &c1);
+        uint8_t* dst1 = dst.data + (intptr_t)y * dst.stride;
+        uint8_t* dst2 = dst1 + dst.stride;
+
+        if (rows == 2 && y + 1 < height) {
+            for (uint32_t x = 0; x < width; x += 16) {
+                ChromaTerms256 t = ComputeChroma(LoadChroma16<Format>(c0, c1, x), k);
+                StoreBgra16<kMirror>(dst1, x, width, LoadLuma16<Format>(line1, x), t, k);
+                StoreBgra16<kMirror>(dst2, x, width, LoadLuma16<Format>(line2, x), t, k);
+            }
+        } else {
+            for (uint32_t x = 0; x < width; x += 16) {
+                ChromaTerms256 t = ComputeChroma(LoadChroma16<Format>(c0, c1, x), k);
+                StoreBgra16<kMirror>(dst1, x, width, LoadLuma16<Format>(line1, x), t, k);
+            }
+        }
+    }
+}
+
+template <class Format>
+TARGET_AVX2 void TransformYuv_AVX2(
+    const TargetImage& dst,
+    const SourceImage& src,
+    uint32_t           dwWidthInPixels,
+    uint32_t           dwHeightInPixels
+)
+{
+    const uint32_t vec_width = dwWidthInPixels & ~15u;
+    const TargetImage body = BodyTarget(dst, vec_width, dwWidthInPixels);
+    if (dst.mirror)
+        Yuv_AVX2<Format, true>(body, src, vec_width, dwHeightInPixels);
+    else
+        Yuv_AVX2<Format, false>(body, src, vec_width, dwHeightInPixels);
+
+    if (vec_width < dwWidthInPixels) {
+        TransformYuv_SSE2<Format>(TailTarget(dst, vec_width),
+            Format::SkipColumns(src, vec_width),
+            dwWidthInPixels - vec_width, dwHeightInPixels);
+    }
+}
+
+#define INSTANTIATE_TRANSFORM_YUV_X86(Format) \
+    template DECLARE_IMAGE_TRANSFORM(TransformYuv_SSE2<Format>); \
+    template DECLARE_IMAGE_TRANSFORM(TransformYuv_AVX2<Format>);
+
+FOR_EACH_YUV_FORMAT(INSTANTIATE_TRANSFORM_YUV_X86)
+
+#endif
@@ -0,0 +1,938 @@
+#include "jpeg_decoder.h"
+#include <string.h>
+#include <atomic>
+#include <math.h>
+#include "worker_pool.h"
+
+static const uint8_t kZigzag[64] = {
+     0,  1,  8, 16,  9,  2,  3, 10, 17, 24, 32, 25, 18, 11,  4,  5,
+    12, 19, 26, 33, 40, 48, 41, 34, 27, 20, 13,  6,  7, 14, 21, 28,
+    35, 42, 49, 56, 57, 50, 43, 36, 29, 22, 15, 23, 30, 37, 44, 51,
+    58, 59, 52, 45, 38, 31, 39, 46, 53, 60, 61, 54, 47, 55, 62, 63,
+};
+
+// Tables of ITU-T T.81 K.3, which MJPEG streams leave out.
+static const uint8_t kDcLumaBits[16] = {
+    0, 1, 5, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 0, 0 };
+static const uint8_t kDcChromaBits[16] = {
+    0, 3, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0 };
+static const uint8_t kDcValues[12] = {
+    0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11 };
+
+static const uint8_t kAcLumaBits[16] = {
+    0, 2, 1, 3, 3, 2, 4, 3, 5, 5, 4, 4, 0, 0, 1, 0x7d };
+static const uint8_t kAcLumaValues[162] = {
+    0x01, 0x02, 0x03, 0x00, 0x04, 0x11, 0x05, 0x12, 0x21, 0x31, 0x41, 0x06,
+    0x13, 0x51, 0x61, 0x07, 0x22, 0x71, 0x14, 0x32, 0x81, 0x91, 0xa1, 0x08,
+    0x23, 0x42, 0xb1, 0xc1, 0x15, 0x52, 0xd1, 0xf0, 0x24, 0x33, 0x62, 0x72,
+    0x82, 0x09, 0x0a, 0x16, 0x17, 0x18, 0x19, 0x1a, 0x25, 0x26, 0x27, 0x28,
+    0x29, 0x2a, 0x34, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3a, 0x43, 0x44, 0x45,
+    0x46, 0x47, 0x48, 0x49, 0x4a, 0x53, 0x54, 0x55, 0x56, 0x57, 0x58, 0x59,
+    0x5a, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69, 0x6a, 0x73, 0x74, 0x75,
+    0x76, 0x77, 0x78, 0x79, 0x7a, 0x83, 0x84, 0x85, 0x86, 0x87, 0x88, 0x89,
+    0x8a, 0x92, 0x93, 0x94, 0x95, 0x96, 0x97, 0x98, 0x99, 0x9a, 0xa2, 0xa3,
+    0xa4, 0xa5, 0xa6, 0xa7, 0xa8, 0xa9, 0xaa, 0xb2, 0xb3, 0xb4, 0xb5, 0xb6,
+    0xb7, 0xb8, 0xb9, 0xba, 0xc2, 0xc3, 0xc4, 0xc5, 0xc6, 0xc7, 0xc8, 0xc9,
+    0xca, 0xd2, 0xd3, 0xd4, 0xd5, 0xd6, 0xd7, 0xd8, 0xd9, 0xda, 0xe1, 0xe2,
+    0xe3, 0xe4, 0xe5, 0xe6, 0xe7, 0xe8, 0xe9, 0xea, 0xf1, 0xf2, 0xf3, 0xf4,
+    0xf5, 0xf6, 0xf7, 0xf8, 0xf9, 0xfa,
+};
+
+static const uint8_t kAcChromaBits[16] = {
+    0, 2, 1, 2, 4, 4, 3, 4, 7, 5, 4, 4, 0, 1, 2, 0x77 };
+static const uint8_t kAcChromaValues[162] = {
+    0x00, 0x01, 0x02, 0x03, 0x11, 0x04, 0x05, 0x21, 0x31, 0x06, 0x12, 0x41,
+    0x51, 0x07, 0x61, 0x71, 0x13, 0x22, 0x32, 0x81, 0x08, 0x14, 0x42, 0x91,
+    0xa1, 0xb1, 0xc1, 0x09, 0x23, 0x33, 0x52, 0xf0, 0x15, 0x62, 0x72, 0xd1,
+    0x0a, 0x16, 0x24, 0x34, 0xe1, 0x25, 0xf1, 0x17, 0x18, 0x19, 0x1a, 0x26,
+    0x27, 0x28, 0x29, 0x2a, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3a, 0x43, 0x44,
+    0x45, 0x46, 0x47, 0x48, 0x49, 0x4a, 0x53, 0x54, 0x55, 0x56, 0x57, 0x58,
+    0x59, 0x5a, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69, 0x6a, 0x73, 0x74,
+    0x75, 0x76, 0x77, 0x78, 0x79, 0x7a, 0x82, 0x83, 0x84, 0x85, 0x86, 0x87,
+    0x88, 0x89, 0x8a, 0x92, 0x93, 0x94, 0x95, 0x96, 0x97, 0x98, 0x99, 0x9a,
+    0xa2, 0xa3, 0xa4, 0xa5, 0xa6, 0xa7, 0xa8, 0xa9, 0xaa, 0xb2, 0xb3, 0xb4,
+    0xb5, 0xb6, 0xb7, 0xb8, 0xb9, 0xba, 0xc2, 0xc3, 0xc4, 0xc5, 0xc6, 0xc7,
+    0xc8, 0xc9, 0xca, 0xd2, 0xd3, 0xd4, 0xd5, 0xd6, 0xd7, 0xd8, 0xd9, 0xda,
+    0xe2, 0xe3, 0xe4, 0xe5, 0xe6, 0xe7, 0xe8, 0xe9, 0xea, 0xf2, 0xf3, 0xf4,
+    0xf5, 0xf6, 0xf7, 0xf8, 0xf9, 0xfa,
+};
+
+// Rows of this size are converted on one task.
+static const uint32_t kPixelsPerStripe = 256 * 1024;
+
+static inline uint32_t ReadU16(const uint8_t* p)
+{
+    return (uint32_t)p[0] << 8 | p[1];
+}
+
+static inline uint8_t ClampSample(int x)
+{
+    return (uint8_t)(x < 0 ? 0 : (x > 255 ? 255 : x));
+}
+
+// Coefficients of 8-bit samples stay within 11 bits; corrupt streams are
+// kept there too so that the IDCT cannot overflow.
+static inline int32_t ClampCoef(int32_t x)
+{
+    return x < -2048 ? -2048 : (x > 2047 ? 2047 : x);
+}
+
+static inline int Log2Ratio(int num, int den)
+{
+    switch (num % den ? 0 : num / den) {
+    case 1: return 0;
+    case 2: return 1;
+    case 4: return 2;
+    default: return -1;
+    }
+}
+
+class JpegDecoder::BitReader
+{
+public:
+    BitReader(const uint8_t* begin, const uint8_t* end) : p_(begin), end_(end) {}
+
+    // Keeps at least 57 bits buffered. Past the end of the segment the
+    // stream reads as zeros.
+    void Fill()
+    {
+        while (bits_ <= 56) {
+            uint32_t b = 0;
+            if (p_ < end_) {
+                b = *p_++;
+                if (b == 0xFF) {
+                    if (p_ < end_ && *p_ == 0x00)
+                        ++p_;
+                    else
+                        p_ = end_, b = 0;
+                }
+            }
+
+            buf_ |= (uint64_t)b << (56 - bits_);
+            bits_ += 8;
+        }
+    }
+
+    int Bits() const { return bits_; }
+    uint32_t Peek(int n) const { return (uint32_t)(buf_ >> (64 - n)); }
+
+    void Skip(int n)
+    {
+        buf_ <<= n;
+        bits_ -= n;
+    }
+
+    // The signed value of an |n| bit magnitude category.
+    int Receive(int n)
+    {
+        int v = (int)Peek(n);
+        Skip(n);
+        return v < (1 << (n - 1)) ? v - (1 << n) + 1 : v;
+    }
+
+    int Decode(const HuffmanTable& t)
+    {
+        uint32_t e = t.fast[Peek(9)];
+        if (e) {
+            Skip(e >> 8);
+            return e & 0xFF;
+        }
+
+        for (int len = 10; len <= 16; ++len) {
+            int32_t code = (int32_t)Peek(len);
+            if (code <= t.max_code[len]) {
+                Skip(len);
+                return t.values[(t.val_offset[len] + code) & 0xFF];
+            }
+        }
+
+        return -1;
+    }
+
+private:
+    const uint8_t* p_;
+    const uint8_t* end_;
+    uint64_t buf_ = 0;
+    int bits_ = 0;
+};
+
+// Integer IDCT of the LLM algorithm, as in jidctint.c of the IJG library.
+static void Idct8x8(const int32_t* in, uint8_t* out, uint32_t stride)
+{
+    enum { CONST_BITS = 13, PASS1_BITS = 2 };
+    const int32_t FIX_0_298631336 = 2446;
+    const int32_t FIX_0_390180644 = 3196;
+    const int32_t FIX_0_541196100 = 4433;
+    const int32_t FIX_0_765366865 = 6270;
+    const int32_t FIX_0_899976223 = 7373;
+    const int32_t FIX_1_175875602 = 9633;
+    const int32_t FIX_1_501321110 = 12299;
+    const int32_t FIX_1_847759065 = 15137;
+    const int32_t FIX_1_961570560 = 16069;
+    const int32_t FIX_2_053119869 = 16819;
+    const int32_t FIX_2_562915447 = 20995;
+    const int32_t FIX_3_072711026 = 25172;
+
+    int32_t ws[64];
+
+    // Coefficients are clamped, so the column pass fits 32 bits. Its
+    // outputs can approach 2^18 in a corrupt block, which times the 13-bit
+    // constants would not, so the row pass works in 64 bits.
+#define IDCT_1D(T, s0, s1, s2, s3, s4, s5, s6, s7) \
+    T z1, z2, z3, z4, z5, tmp0, tmp1, tmp2, tmp3, tmp10, tmp11, tmp12, tmp13; \
+    z2 = s2; z3 = s6; \
+    z1 = (z2 + z3) * FIX_0_541196100; \
+    tmp2 = z1 - z3 * FIX_1_847759065; \
+    tmp3 = z1 + z2 * FIX_0_765366865; \
+    tmp0 = (s0 + s4) * (1 << CONST_BITS); \
+    tmp1 = (s0 - s4) * (1 << CONST_BITS); \
+    tmp10 = tmp0 + tmp3; \
+    tmp13 = tmp0 - tmp3; \
+    tmp11 = tmp1 + tmp2; \
+    tmp12 = tmp1 - tmp2; \
+    tmp0 = s7; tmp1 = s5; tmp2 = s3; tmp3 = s1; \
+    z1 = tmp0 + tmp3; \
+    z2 = tmp1 + tmp2; \
+    z3 = tmp0 + tmp2; \
+    z4 = tmp1 + tmp3; \
+    z5 = (z3 + z4) * FIX_1_175875602; \
+    tmp0 *= FIX_0_298631336; \
+    tmp1 *= FIX_2_053119869; \
+    tmp2 *= FIX_3_072711026; \
+    tmp3 *= FIX_1_501321110; \
+    z1 *= -FIX_0_899976223; \
+    z2 *= -FIX_2_562915447; \
+    z3 = z3 * -FIX_1_961570560 + z5; \
+    z4 = z4 * -FIX_0_390180644 + z5; \
+    tmp0 += z1 + z3; \
+    tmp1 += z2 + z4; \
+    tmp2 += z2 + z3; \
+    tmp3 += z1 + z4;
+
+    for (int c = 0; c < 8; ++c) {
+        const int32_t* s = in + c;
+        int32_t* d = ws + c;
+        if (!(s[8] | s[16] | s[24] | s[32] | s[40] | s[48] | s[56])) {
+            int32_t dc = s[0] * (1 << PASS1_BITS);
+            for (int r = 0; r < 8; ++r)
+                d[r * 8] = dc;
+
+            continue;
+        }
+
+        IDCT_1D(int32_t, s[0], s[8], s[16], s[24], s[32], s[40], s[48], s[56]);
+        const int shift = CONST_BITS - PASS1_BITS;
+        const int32_t round = 1 << (shift - 1);
+        d[0]  = (tmp10 + tmp3 + round) >> shift;
+        d[56] = (tmp10 - tmp3 + round) >> shift;
+        d[8]  = (tmp11 + tmp2 + round) >> shift;
+        d[48] = (tmp11 - tmp2 + round) >> shift;
+        d[16] = (tmp12 + tmp1 + round) >> shift;
+        d[40] = (tmp12 - tmp1 + round) >> shift;
+        d[24] = (tmp13 + tmp0 + round) >> shift;
+        d[32] = (tmp13 - tmp0 + round) >> shift;
+    }
+
+    for (int r = 0; r < 8; ++r, out += stride) {
+        const int32_t* s = ws + r * 8;
+        if (!(s[1] | s[2] | s[3] | s[4] | s[5] | s[6] | s[7])) {
+            memset(out, ClampSample(((s[0] + (1 << (PASS1_BITS + 2))) >> (PASS1_BITS + 3)) + 128), 8);
+            continue;
+        }
+
+        IDCT_1D(int64_t, s[0], s[1], s[2], s[3], s[4], s[5], s[6], s[7]);
+        const int shift = CONST_BITS + PASS1_BITS + 3;
+        const int64_t round = (1 << (shift - 1)) + (128 << shift);
+        out[0] = ClampSample((int)((tmp10 + tmp3 + round) >> shift));
+        out[7] = ClampSample((int)((tmp10 - tmp3 + round) >> shift));
+        out[1] = ClampSample((int)((tmp11 + tmp2 + round) >> shift));
+        out[6] = ClampSample((int)((tmp11 - tmp2 + round) >> shift));
+        out[2] = ClampSample((int)((tmp12 + tmp1 + round) >> shift));
+        out[5] = ClampSample((int)((tmp12 - tmp1 + round) >> shift));
+        out[3] = ClampSample((int)((tmp13 + tmp0 + round) >> shift));
+        out[4] = ClampSample((int)((tmp13 - tmp0 + round) >> shift));
+    }
+
+#undef IDCT_1D
+}
+
+static inline int Log2BlockSize(int n)
+{
+    return n == 8 ? 3 : n >> 1;
+}
+
+// Basis functions of the 1, 2, 4 and 8 point IDCT, indexed by log2 of the
+// size and normalized like the 8 point one, so that the low frequency
+// corner of a block yields its downscaled pixels.
+struct ScaledIdctTables {
+    float basis[4][8][8];
+
+    ScaledIdctTables()
+    {
+        const double pi = 3.14159265358979323846;
+        for (int i = 0; i < 4; ++i) {
+            const int n = 1 << i;
+            for (int x = 0; x < n; ++x) {
+                for (int u = 0; u < n; ++u)
+                    basis[i][x][u] = (float)((u ? 0.5 : 0.5 / sqrt(2.0)) * cos((2 * x + 1) * u * pi / (2 * n)));
+            }
+        }
+    }
+};
+
+// IDCT of the top left W x H coefficients into W x H pixels.
+template <int W, int H>
+static void IdctScaled(const int32_t* in, uint8_t* out, uint32_t stride)
+{
+    static const ScaledIdctTables tables;
+    const float (*basis_x)[8] = tables.basis[Log2BlockSize(W)];
+    const float (*basis_y)[8] = tables.basis[Log2BlockSize(H)];
+
+    float tmp[H][W];
+    for (int v = 0; v < H; ++v) {
+        for (int x = 0; x < W; ++x) {
+            float sum = 0;
+            for (int u = 0; u < W; ++u)
+                sum += basis_x[x][u] * (float)in[v * 8 + u];
+
+            tmp[v][x] = sum;
+        }
+    }
+
+    for (int y = 0; y < H; ++y, out += stride) {
+        for (int x = 0; x < W; ++x) {
+            float sum = 128.5f;
+            for (int v = 0; v < H; ++v)
+                sum += basis_y[y][v] * tmp[v][x];
+
+            // Truncation only differs from floor() below zero, which clamps
+            // to 0 either way.
+            out[x] = ClampSample((int)sum);
+        }
+    }
+}
+
+typedef void (*IDCT_FN)(const int32_t* in, uint8_t* out, uint32_t stride);
+
+#define IDCT_ROW(W) \
+    { IdctScaled<W, 1>, IdctScaled<W, 2>, IdctScaled<W, 4>, IdctScaled<W, 8> }
+
+// Indexed by log2 of the block width and height.
+static const IDCT_FN kIdctScaled[4][4] = {
+    IDCT_ROW(1), IDCT_ROW(2), IDCT_ROW(4), IDCT_ROW(8),
+};
+
+#undef IDCT_ROW
+
+JpegDecoder::JpegDecoder(WorkerPool* pool) : pool_(pool)
+{
+    LoadDefaultHuffman();
+}
+
+uint32_t JpegDecoder::ScaledSize(uint32_t size, uint32_t scale_denom)
+{
+    return (size + scale_denom - 1) / scale_denom;
+}
+
+void JpegDecoder::LoadDefaultHuffman()
+{
+    if (!custom_tables_)
+        return;
+
+    for (int i = 0; i < 4; ++i) {
+        BuildHuffman(&dc_tables_[i], i ? kDcChromaBits : kDcLumaBits, kDcValues);
+        BuildHuffman(&ac_tables_[i], i ? kAcChromaBits : kAcLumaBits,
+            i ? kAcChromaValues : kAcLumaValues);
+    }
+
+    custom_tables_ = false;
+}
+
+bool JpegDecoder::BuildHuffman(HuffmanTable* t, const uint8_t* bits, const uint8_t* values)
+{
+    int count = 0;
+    for (int i = 0; i < 16; ++i)
+        count += bits[i];
+
+    if (count > 256)
+        return false;
+
+    memcpy(t->values, values, count);
+    memset(t->fast, 0, sizeof(t->fast));
+    t->defined = false;
+
+    int32_t code = 0;
+    int k = 0;
+    for (int len = 1; len <= 16; ++len) {
+        t->val_offset[len] = k - code;
+        for (int i = 0; i < bits[len - 1]; ++i, ++code, ++k) {
+            if (code >= (1 << len))
+                return false;
+
+            if (len <= 9) {
+                int first = code << (9 - len);
+                for (int j = 0; j < (1 << (9 - len)); ++j)
+                    t->fast[first + j] = (uint16_t)(len << 8 | t->values[k]);
+            }
+        }
+
+        t->max_code[len] = bits[len - 1] ? code - 1 : -1;
+        code <<= 1;
+    }
+
+    // Run, length and value of AC coefficients whose code and magnitude
+    // bits fit in 9 bits together.
+    for (int i = 0; i < (1 << 9); ++i) {
+        t->fast_ac[i] = 0;
+        int len = t->fast[i] >> 8;
+        if (!len)
+            continue;
+
+        int rs = t->fast[i] & 0xFF;
+        int run = rs >> 4;
+        int size = rs & 15;
+        if (!size || len + size > 9)
+            continue;
+
+        int v = ((i << len) & 0x1FF) >> (9 - size);
+        if (v < (1 << (size - 1)))
+            v -= (1 << size) - 1;
+
+        if (v >= -128 && v <= 127)
+            t->fast_ac[i] = (int16_t)(v * 256 + run * 16 + len + size);
+    }
+
+    t->defined = true;
+    return true;
+}
+
+bool JpegDecoder::ParseDqt(const uint8_t* p, size_t len)
+{
+    while (len > 0) {
+        int pq = p[0] >> 4;
+        int tq = p[0] & 15;
+        size_t n = 1 + 64 * (pq ? 2 : 1);
+        if (pq > 1 || tq > 3 || len < n)
+            return false;
+
+        for (int k = 0; k < 64; ++k)
+            qt_[tq][k] = (uint16_t)(pq ? ReadU16(p + 1 + k * 2) : p[1 + k]);
+
+        p += n;
+        len -= n;
+    }
+
+    return true;
+}
+
+bool JpegDecoder::ParseDht(const uint8_t* p, size_t len)
+{
+    custom_tables_ = true;
+    while (len > 0) {
+        if (len < 17)
+            return false;
+
+        int tc = p[0] >> 4;
+        int th = p[0] & 15;
+        size_t count = 0;
+        for (int i = 1; i <= 16; ++i)
+            count += p[i];
+
+        if (tc > 1 || th > 3 || len < 17 + count)
+            return false;
+
+        HuffmanTable* t = tc ? &ac_tables_[th] : &dc_tables_[th];
+        if (!BuildHuffman(t, p + 1, p + 17))
+            return false;
+
+        p += 17 + count;
+        len -= 17 + count;
+    }
+
+    return true;
+}
+
+bool JpegDecoder::ParseSof(const uint8_t* p, size_t len)
+{
+    if (len < 6 || p[0] != 8)
+        return false;
+
+    height_ = ReadU16(p + 1);
+    width_ = ReadU16(p + 3);
+    size_t nf = p[5];
+    if (!width_ || !height_ || (nf != 1 && nf != 3) || len < 6 + nf * 3)
+        return false;
+
+    comps_.resize(nf);
+    h_max_ = 1;
+    v_max_ = 1;
+    for (size_t i = 0; i < nf; ++i) {
+        Component& c = comps_[i];
+        c.id = p[6 + i * 3];
+        c.h = p[7 + i * 3] >> 4;
+        c.v = p[7 + i * 3] & 15;
+        c.tq = p[8 + i * 3];
+        if (c.h < 1 || c.h > 4 || c.v < 1 || c.v > 4 || c.tq > 3)
+            return false;
+
+        h_max_ = c.h > h_max_ ? c.h : h_max_;
+        v_max_ = c.v > v_max_ ? c.v : v_max_;
+    }
+
+    for (const Component& c : comps_) {
+        if (Log2Ratio(h_max_, c.h) < 0 || Log2Ratio(v_max_, c.v) < 0)
+            return false;
+    }
+
+    mcus_x_ = (width_ + 8 * h_max_ - 1) / (8 * h_max_);
+    mcus_y_ = (height_ + 8 * v_max_ - 1) / (8 * v_max_);
+    return true;
+}
+
+bool JpegDecoder::ParseSos(const uint8_t* p, size_t len)
+{
+    size_t ns = len ? p[0] : 0;
+    if (!ns || ns != comps_.size() || len < 1 + ns * 2)
+        return false;
+
+    scan_comps_.resize(ns);
+    for (size_t i = 0; i < ns; ++i) {
+        int id = p[1 + i * 2];
+        size_t index = 0;
+        while (index < comps_.size() && comps_[index].id != id)
+            ++index;
+
+        if (index == comps_.size())
+            return false;
+
+        Component& c = comps_[index];
+        c.td = p[2 + i * 2] >> 4;
+        c.ta = p[2 + i * 2] & 15;
+        if (c.td > 3 || c.ta > 3 || !dc_tables_[c.td].defined || !ac_tables_[c.ta].defined)
+            return false;
+
+        scan_comps_[i] = (int)index;
+    }
+
+    // A single component scan is not interleaved: one block per MCU.
+    if (ns == 1) {
+        scan_mcus_x_ = (width_ + 7) / 8;
+        scan_mcus_ = scan_mcus_x_ * ((height_ + 7) / 8);
+    }
+    else {
+        scan_mcus_x_ = mcus_x_;
+        scan_mcus_ = mcus_x_ * mcus_y_;
+    }
+
+    return true;
+}
+
+bool JpegDecoder::ParseHeaders(const uint8_t* data, size_t size)
+{
+    const uint8_t* p = data;
+    const uint8_t* end = data + size;
+    if (size < 4 || p[0] != 0xFF || p[1] != 0xD8)
+        return false;
+
+    LoadDefaultHuffman();
+    restart_interval_ = 0;
+    comps_.clear();
+    p += 2;
+
+    for (;;) {
+        while (p < end && *p != 0xFF)
+            ++p;
+
+        while (p < end && *p == 0xFF)
+            ++p;
+
+        if (p >= end)
+            return false;
+
+        uint8_t marker = *p++;
+        if (marker == 0x01 || (marker >= 0xD0 && marker <= 0xD7))
+            continue;
+
+        if (marker == 0xD9 || end - p < 2)
+            return false;
+
+        size_t len = ReadU16(p);
+        if (len < 2 || (size_t)(end - p) < len)
+            return false;
+
+        const uint8_t* seg = p + 2;
+        size_t seg_len = len - 2;
+        p += len;
+
+        switch (marker) {
+        case 0xC0:
+        case 0xC1:
+            if (!ParseSof(seg, seg_len))
+                return false;
+            break;
+
+        case 0xC4:
+            if (!ParseDht(seg, seg_len))
+                return false;
+            break;
+
+        case 0xDB:
+            if (!ParseDqt(seg, seg_len))
+                return false;
+            break;
+
+        case 0xDD:
+            if (seg_len < 2)
+                return false;
+            restart_interval_ = ReadU16(seg);
+            break;
+
+        case 0xDA:
+            if (comps_.empty() || !ParseSos(seg, seg_len))
+                return false;
+            scan_data_ = p;
+            return true;
+
+        default:
+            // Progressive, lossless and arithmetic coded frames.
+            if (marker >= 0xC2 && marker <= 0xCF)
+                return false;
+            break;
+        }
+    }
+}
+
+bool JpegDecoder::ReadInfo(const uint8_t* data, size_t size,
+    uint32_t* width, uint32_t* height)
+{
+    if (!ParseHeaders(data, size))
+        return false;
+
+    *width = width_;
+    *height = height_;
+    return true;
+}
+
+void JpegDecoder::SplitSegments(const uint8_t* end)
+{
+    segments_.clear();
+    const uint8_t* begin = scan_data_;
+    const uint8_t* p = scan_data_;
+
+    while (p < end) {
+        p = (const uint8_t*)memchr(p, 0xFF, end - p);
+        if (!p || p + 1 >= end) {
+            p = end;
+            break;
+        }
+
+        uint8_t b = p[1];
+        if (b == 0x00) {
+            p += 2;
+        }
+        else if (b == 0xFF) {
+            ++p;
+        }
+        else if (b >= 0xD0 && b <= 0xD7) {
+            segments_.push_back({ begin, p });
+            p += 2;
+            begin = p;
+        }
+        else {
+            break;
+        }
+    }
+
+    segments_.push_back({ begin, p });
+}
+
+bool JpegDecoder::DecodeSegment(size_t index)
+{
+    const uint32_t interval = restart_interval_ ? restart_interval_ : scan_mcus_;
+    const uint32_t mcu_begin = (uint32_t)index * interval;
+    uint32_t mcu_end = mcu_begin + interval;
+    if (mcu_end > scan_mcus_)
+        mcu_end = scan_mcus_;
+
+    BitReader br(segments_[index].begin, segments_[index].end);
+    const bool interleaved = scan_comps_.size() > 1;
+    int dc_pred[4] = {};
+    int32_t coef[64] = {};
+
+    for (uint32_t mcu = mcu_begin; mcu < mcu_end; ++mcu) {
+        const uint32_t mcu_x = mcu % scan_mcus_x_;
+        const uint32_t mcu_y = mcu / scan_mcus_x_;
+
+        for (size_t i = 0; i < scan_comps_.size(); ++i) {
+            Component& c = comps_[scan_comps_[i]];
+            const HuffmanTable& dc_table = dc_tables_[c.td];
+            const HuffmanTable& ac_table = ac_tables_[c.ta];
+            const uint16_t* q = qt_[c.tq];
+            const int blocks_x = interleaved ? c.h : 1;
+            const int blocks_y = interleaved ? c.v : 1;
+
+            for (int by = 0; by < blocks_y; ++by) {
+                for (int bx = 0; bx < blocks_x; ++bx) {
+                    br.Fill();
+
+                    int s = br.Decode(dc_table);
+                    if (s < 0 || s > 11)
+                        return false;
+
+                    dc_pred[i] += s ? br.Receive(s) : 0;
+                    coef[0] = ClampCoef(dc_pred[i] * q[0]);
+
+                    int last = 0;
+                    for (int k = 1; k < 64; ) {
+                        if (br.Bits() < 32)
+                            br.Fill();
+
+                        int fast = ac_table.fast_ac[br.Peek(9)];
+                        if (fast) {
+                            k += (fast >> 4) & 15;
+                            br.Skip(fast & 15);
+                            if (k > 63)
+                                return false;
+
+                            coef[kZigzag[k]] = ClampCoef((fast >> 8) * q[k]);
+                            last = k++;
+                            continue;
+                        }
+
+                        int rs = br.Decode(ac_table);
+                        if (rs < 0)
+                            return false;
+
+                        int r = rs >> 4;
+                        s = rs & 15;
+                        if (!s) {
+                            if (r != 15)
+                                break;
+
+                            k += 16;
+                            continue;
+                        }
+
+                        k += r;
+                        if (k > 63)
+                            return false;
+
+                        coef[kZigzag[k]] = ClampCoef(br.Receive(s) * q[k]);
+                        last = k++;
+                    }
+
+                    const uint32_t x = (mcu_x * blocks_x + bx) * c.block_w;
+                    const uint32_t y = (mcu_y * blocks_y + by) * c.block_h;
+                    uint8_t* out = c.plane.data() + (size_t)y * c.plane_stride + x;
+
+                    if (!last || c.block_w * c.block_h == 1) {
+                        uint8_t dc = ClampSample(((coef[0] + 4) >> 3) + 128);
+                        for (int r = 0; r < c.block_h; ++r)
+                            memset(out + (size_t)r * c.plane_stride, dc, c.block_w);
+                    }
+                    else if (c.block_w == 8 && c.block_h == 8) {
+                        Idct8x8(coef, out, c.plane_stride);
+                    }
+                    else {
+                        kIdctScaled[Log2BlockSize(c.block_w)][Log2BlockSize(c.block_h)](
+                            coef, out, c.plane_stride);
+                    }
+
+                    for (int k = 0; k <= last; ++k)
+                        coef[kZigzag[k]] = 0;
+                }
+            }
+        }
+    }
+
+    return true;
+}
+
+// Full range BT.601 in 16.16 fixed point.
+static const int32_t kCrR = 91881;
+static const int32_t kCbG = -22554;
+static const int32_t kCrG = -46802;
+static const int32_t kCbB = 116130;
+
+// Clamps luma plus a chroma term, -384 .. 639, without branches.
+struct ClampTable {
+    uint8_t values[1024];
+
+    ClampTable()
+    {
+        for (int i = 0; i < 1024; ++i)
+            values[i] = ClampSample(i - 384);
+    }
+
+    uint32_t operator()(int x) const { return values[x + 384]; }
+};
+
+static const ClampTable kClamp;
+
+static inline void StoreBgra(uint8_t* out, int luma, int b, int g, int r)
+{
+    uint32_t pel = kClamp(luma + b) | kClamp(luma + g) << 8 | kClamp(luma + r) << 16 | 0xFF000000;
+    memcpy(out, &pel, 4);
+}
+
+static inline void StorePixel(uint8_t* out, int luma, int d, int e)
+{
+    StoreBgra(out, luma, (kCbB * d + 32768) >> 16,
+        (kCbG * d + kCrG * e + 32768) >> 16, (kCrR * e + 32768) >> 16);
+}
+
+// Rows whose chroma is full width or shared by pixel pairs.
+template <int kChromaShift>
+static void ConvertRow(uint8_t* out, int step, const uint8_t* luma,
+    const uint8_t* cb, const uint8_t* cr, uint32_t width)
+{
+    const uint32_t pair_end = width & ~((1u << kChromaShift) - 1);
+    uint32_t x = 0;
+    for (; x < pair_end; x += 1 << kChromaShift) {
+        const int d = cb[x >> kChromaShift] - 128;
+        const int e = cr[x >> kChromaShift] - 128;
+        const int b = (kCbB * d + 32768) >> 16;
+        const int g = (kCbG * d + kCrG * e + 32768) >> 16;
+        const int r = (kCrR * e + 32768) >> 16;
+
+        StoreBgra(out, luma[x], b, g, r);
+        out += step;
+        if (kChromaShift) {
+            StoreBgra(out, luma[x + 1], b, g, r);
+            out += step;
+        }
+    }
+
+    if (x < width)
+        StorePixel(out, luma[x], cb[x >> kChromaShift] - 128, cr[x >> kChromaShift] - 128);
+}
+
+void JpegDecoder::ColorConvert(const TargetImage& dst, uint32_t y_begin, uint32_t y_end)
+{
+    const int step = dst.mirror ? -4 : 4;
+    const uint32_t width = out_width_;
+
+    if (comps_.size() == 1) {
+        const Component& c = comps_[0];
+        for (uint32_t y = y_begin; y < y_end; ++y) {
+            const uint8_t* luma = c.plane.data() + (size_t)y * c.plane_stride;
+            uint8_t* out = dst.data + (intptr_t)y * dst.stride;
+            if (dst.mirror)
+                out += (intptr_t)(width - 1) * 4;
+
+            for (uint32_t x = 0; x < width; ++x, out += step) {
+                uint32_t pel = luma[x] * 0x010101u | 0xFF000000;
+                memcpy(out, &pel, 4);
+            }
+        }
+
+        return;
+    }
+
+    const Component& cy = comps_[0];
+    const Component& cb = comps_[1];
+    const Component& cr = comps_[2];
+    const bool fast = !cy.shift_x && cb.shift_x == cr.shift_x && cb.shift_x <= 1;
+
+    for (uint32_t y = y_begin; y < y_end; ++y) {
+        const uint8_t* row_y = cy.plane.data() + (size_t)(y >> cy.shift_y) * cy.plane_stride;
+        const uint8_t* row_cb = cb.plane.data() + (size_t)(y >> cb.shift_y) * cb.plane_stride;
+        const uint8_t* row_cr = cr.plane.data() + (size_t)(y >> cr.shift_y) * cr.plane_stride;
+        uint8_t* out = dst.data + (intptr_t)y * dst.stride;
+        if (dst.mirror)
+            out += (intptr_t)(width - 1) * 4;
+
+        if (fast && cb.shift_x) {
+            ConvertRow<1>(out, step, row_y, row_cb, row_cr, width);
+            continue;
+        }
+
+        if (fast) {
+            ConvertRow<0>(out, step, row_y, row_cb, row_cr, width);
+            continue;
+        }
+
+        for (uint32_t x = 0; x < width; ++x, out += step) {
+            StorePixel(out, row_y[x >> cy.shift_x],
+                row_cb[x >> cb.shift_x] - 128, row_cr[x >> cr.shift_x] - 128);
+        }
+    }
+}
+
+bool JpegDecoder::Decode(const uint8_t* data, size_t size,
+    uint32_t scale_denom, const TargetImage& dst)
+{
+    if (scale_denom != 1 && scale_denom != 2 && scale_denom != 4 && scale_denom != 8)
+        return false;
+
+    if (!ParseHeaders(data, size))
+        return false;
+
+    out_width_ = ScaledSize(width_, scale_denom);
+    out_height_ = ScaledSize(height_, scale_denom);
+
+    // Subsampled components run a larger IDCT rather than being upsampled
+    // later, as far as the 8 x 8 coefficients allow.
+    for (Component& c : comps_) {
+        c.block_w = (8 / scale_denom) << Log2Ratio(h_max_, c.h);
+        c.block_h = (8 / scale_denom) << Log2Ratio(v_max_, c.v);
+        c.shift_x = 0;
+        c.shift_y = 0;
+        for (; c.block_w > 8; c.block_w >>= 1)
+            ++c.shift_x;
+        for (; c.block_h > 8; c.block_h >>= 1)
+            ++c.shift_y;
+
+        c.plane_stride = mcus_x_ * c.h * c.block_w;
+        c.plane.resize((size_t)c.plane_stride * mcus_y_ * c.v * c.block_h);
+    }
+
+    SplitSegments(data + size);
+    const uint32_t interval = restart_interval_ ? restart_interval_ : scan_mcus_;
+    const size_t segment_num = (scan_mcus_ + interval - 1) / interval;
+    if (segments_.size() < segment_num)
+        return false;
+
+    segments_.resize(segment_num);
+
+    // Restart intervals are independent, so each task takes a run of them.
+    int task_num = pool_ ? pool_->Concurrency() : 1;
+    if ((size_t)task_num > segment_num)
+        task_num = (int)segment_num;
+
+    std::atomic<bool> ok(true);
+    auto decode = [&](int task) {
+        size_t first = segment_num * task / task_num;
+        size_t last = segment_num * (task + 1) / task_num;
+        for (size_t i = first; i < last && ok; ++i) {
+            if (!DecodeSegment(i))
+                ok = false;
+        }
+    };
+
+    if (task_num > 1)
+        pool_->Run(task_num, decode);
+    else
+        decode(0);
+
+    if (!ok)
+        return false;
+
+    uint64_t pixels = (uint64_t)out_width_ * out_height_;
+    int stripe_num = (int)((pixels + kPixelsPerStripe - 1) / kPixelsPerStripe);
+    if (!pool_ || stripe_num < 2) {
+        ColorConvert(dst, 0, out_height_);
+        return true;
+    }
+
+    if (stripe_num > pool_->Concurrency())
+        stripe_num = pool_->Concurrency();
+
+    pool_->Run(stripe_num, [&](int stripe) {
+        ColorConvert(dst,
+            (uint32_t)((uint64_t)out_height_ * stripe / stripe_num),
+            (uint32_t)((uint64_t)out_height_ * (stripe + 1) / stripe_num));
+    });
+
+    return true;
+}
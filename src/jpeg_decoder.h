@@ -0,0 +1,93 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+#include "image_transform.h"
+
+class WorkerPool;
+
+// Baseline (sequential, Huffman coded, 8-bit) JPEG decoder for MJPEG
+// frames. Restart intervals are decoded in parallel, and frames can be
+// decoded at 1/2, 1/4 or 1/8 size by running a reduced IDCT over the low
+// frequency coefficients. Frames without a DHT segment, as most cameras
+// send them, use the standard tables from the JPEG specification.
+class JpegDecoder
+{
+public:
+    explicit JpegDecoder(WorkerPool* pool = nullptr);
+
+    // Parses the headers up to the first scan.
+    bool ReadInfo(const uint8_t* data, size_t size,
+        uint32_t* width, uint32_t* height);
+
+    // |scale_denom| is 1, 2, 4 or 8 and |dst| must hold ScaledSize() of the
+    // frame size in both directions.
+    bool Decode(const uint8_t* data, size_t size,
+        uint32_t scale_denom, const TargetImage& dst);
+
+    static uint32_t ScaledSize(uint32_t size, uint32_t scale_denom);
+
+private:
+    struct HuffmanTable {
+        bool defined;
+        uint16_t fast[1 << 9];  // (length << 8) | symbol, 0 for long codes
+        int16_t fast_ac[1 << 9];  // (value << 8) | (run << 4) | length
+        int32_t max_code[18];
+        int32_t val_offset[17];
+        uint8_t values[256];
+    };
+
+    struct Component {
+        int id;
+        int h;
+        int v;
+        int tq;
+        int td;
+        int ta;
+        int block_w;   // pixels an 8 x 8 block decodes to
+        int block_h;
+        int shift_x;   // upsampling left to the color conversion
+        int shift_y;
+        std::vector<uint8_t> plane;
+        uint32_t plane_stride;
+    };
+
+    struct Segment {
+        const uint8_t* begin;
+        const uint8_t* end;
+    };
+
+    class BitReader;
+
+    bool ParseHeaders(const uint8_t* data, size_t size);
+    bool ParseDqt(const uint8_t* p, size_t len);
+    bool ParseDht(const uint8_t* p, size_t len);
+    bool ParseSof(const uint8_t* p, size_t len);
+    bool ParseSos(const uint8_t* p, size_t len);
+    bool BuildHuffman(HuffmanTable* t, const uint8_t* bits, const uint8_t* values);
+    void LoadDefaultHuffman();
+    void SplitSegments(const uint8_t* end);
+    bool DecodeSegment(size_t index);
+    void ColorConvert(const TargetImage& dst, uint32_t y_begin, uint32_t y_end);
+
+    WorkerPool* pool_ = nullptr;
+    uint16_t qt_[4][64] = {};
+    HuffmanTable dc_tables_[4] = {};
+    HuffmanTable ac_tables_[4] = {};
+    bool custom_tables_ = true;
+    std::vector<Component> comps_;
+    std::vector<int> scan_comps_;
+    std::vector<Segment> segments_;
+    const uint8_t* scan_data_ = nullptr;
+    uint32_t width_ = 0;
+    uint32_t height_ = 0;
+    uint32_t restart_interval_ = 0;
+    int h_max_ = 1;
+    int v_max_ = 1;
+    uint32_t mcus_x_ = 0;
+    uint32_t mcus_y_ = 0;
+    uint32_t scan_mcus_x_ = 0;
+    uint32_t scan_mcus_ = 0;
+    uint32_t out_width_ = 0;
+    uint32_t out_height_ = 0;
+};
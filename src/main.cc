@@ -6,6 +6,7 @@
 #pragma comment(lib, "mfuuid.lib")
 #pragma comment(lib, "mfreadwrite.lib")
 #pragma comment(lib, "gdiplus.lib")
+#pragma comment(lib, "comdlg32.lib")
 
 INT WINAPI wWinMain(
     _In_ HINSTANCE instance,
@@ -0,0 +1,211 @@
+#include "mask_shape.h"
+#include <math.h>
+
+// Strips an ellipse's edge pixel is cut into.
+static const int kEllipseStrips = 16;
+
+static double Clamp01(double c)
+{
+    return c < 0 ? 0 : (c > 1 ? 1 : c);
+}
+
+// A convex outline, symmetric about (cx, cy). HalfWidth gives its extent
+// on the line through |y|, or a negative value if the line misses it;
+// Coverage is the part of pixel (x, y) that is inside.
+struct Ellipse {
+    double cx, cy, a, b;
+
+    double HalfWidth(double y) const
+    {
+        if (a <= 0 || b <= 0)
+            return -1;
+
+        const double dy = (y - cy) / b;
+        return dy * dy > 1 ? -1 : a * sqrt(1 - dy * dy);
+    }
+
+    double Coverage(uint32_t x, uint32_t y) const
+    {
+        const double px = x + 0.5 - cx;
+        const double py = y + 0.5 - cy;
+        if (a == b)
+            return Clamp01(0.5 - (sqrt(px * px + py * py) - a));
+
+        // How far the center is from the outline says little of how much
+        // of a pixel the tip of a thin ellipse covers. The pixel is cut
+        // into strips across the edge instead, each cut exactly by the
+        // outline.
+        const bool rows = fabs(px) * b * b > fabs(py) * a * a;
+        const double along = rows ? y - cy : x - cx;
+        const double across = rows ? x - cx : y - cy;
+        const double r_along = rows ? b : a;
+        const double r_across = rows ? a : b;
+        double covered = 0;
+        for (int i = 0; i < kEllipseStrips; ++i) {
+            const double u = (along + (i + 0.5) / kEllipseStrips) / r_along;
+            if (u * u >= 1)
+                continue;
+
+            const double half = r_across * sqrt(1 - u * u);
+            const double lo = across > -half ? across : -half;
+            const double hi = across + 1 < half ? across + 1 : half;
+            if (hi > lo)
+                covered += hi - lo;
+        }
+
+        return covered / kEllipseStrips;
+    }
+};
+
+struct RoundedRect {
+    double cx, cy, half_w, half_h, r;
+
+    double HalfWidth(double y) const
+    {
+        const double dy = fabs(y - cy);
+        if (half_h <= 0 || dy > half_h)
+            return -1;
+
+        if (r <= 0 || dy <= half_h - r)
+            return half_w;
+
+        const double ey = dy - (half_h - r);
+        return half_w - r + sqrt(r * r - ey * ey);
+    }
+
+    double Distance(double x, double y) const
+    {
+        const double qx = fabs(x - cx) - (half_w - r);
+        const double qy = fabs(y - cy) - (half_h - r);
+        const double ox = qx > 0 ? qx : 0;
+        const double oy = qy > 0 ? qy : 0;
+        const double inside = qx > qy ? qx : qy;
+        return sqrt(ox * ox + oy * oy) + (inside < 0 ? inside : 0) - r;
+    }
+
+    double Coverage(uint32_t x, uint32_t y) const
+    {
+        return Clamp01(0.5 - Distance(x + 0.5, y + 0.5));
+    }
+};
+
+static uint32_t ClampX(double x, uint32_t width)
+{
+    return x <= 0 ? 0 : (x >= width ? width : (uint32_t)x);
+}
+
+template <class Shape>
+static void BuildRows(const Shape& shape, uint32_t width, uint32_t height, SpanMask* mask)
+{
+    std::vector<uint8_t> edge;
+    mask->Reset(width, height);
+
+    for (uint32_t y = 0; y < height; ++y) {
+        // The shape is widest in the row where it is nearest its center,
+        // and narrowest at one of the row's two sides. Pixels under the
+        // widest extent are touched, those under the narrowest opaque.
+        const double nearest = shape.cy < y ? y : (shape.cy > y + 1 ? y + 1 : shape.cy);
+        const double outer = shape.HalfWidth(nearest);
+        if (outer <= 0) {
+            mask->EndRow();
+            continue;
+        }
+
+        const uint32_t begin = ClampX(floor(shape.cx - outer), width);
+        uint32_t end = ClampX(ceil(shape.cx + outer), width);
+        if (end < begin)
+            end = begin;
+
+        uint32_t opaque_begin = end;
+        uint32_t opaque_end = end;
+        const double top = shape.HalfWidth(y);
+        const double bottom = shape.HalfWidth(y + 1);
+        const double inner = top < bottom ? top : bottom;
+        if (inner >= 0) {
+            opaque_begin = ClampX(ceil(shape.cx - inner), width);
+            opaque_end = ClampX(floor(shape.cx + inner), width);
+            if (opaque_begin < begin)
+                opaque_begin = begin;
+            if (opaque_end > end)
+                opaque_end = end;
+            if (opaque_end < opaque_begin)
+                opaque_end = opaque_begin;
+        }
+
+        auto add_edge = [&](uint32_t x0, uint32_t x1) {
+            edge.resize(x1 > x0 ? x1 - x0 : 0);
+            for (uint32_t x = x0; x < x1; ++x)
+                edge[x - x0] = (uint8_t)(shape.Coverage(x, y) * 255 + 0.5);
+
+            mask->AddEdge(x0, x1 - x0, edge.data());
+        };
+
+        add_edge(begin, opaque_begin);
+        mask->AddOpaque(opaque_begin, opaque_end - opaque_begin);
+        add_edge(opaque_end, end);
+        mask->EndRow();
+    }
+}
+
+void BuildShapeMask(MaskShape shape, uint32_t width, uint32_t height, SpanMask* mask)
+{
+    switch (shape) {
+    case MASK_SHAPE_CIRCLE: {
+        // Where the GDI+ ellipse of circle mode used to be.
+        const uint32_t ox = width / 2;
+        const uint32_t radius = ox < height / 2 ? ox : height / 2;
+        const Ellipse e = { (double)ox, (double)radius, (double)radius, (double)radius };
+        BuildRows(e, width, height, mask);
+        break;
+    }
+
+    case MASK_SHAPE_ELLIPSE: {
+        const Ellipse e = { width / 2.0, height / 2.0, width / 2.0, height / 2.0 };
+        BuildRows(e, width, height, mask);
+        break;
+    }
+
+    case MASK_SHAPE_ROUNDED_RECT: {
+        const double half_w = width / 2.0;
+        const double half_h = height / 2.0;
+        const RoundedRect r = { half_w, half_h, half_w, half_h,
+            (half_w < half_h ? half_w : half_h) / 4 };
+        BuildRows(r, width, height, mask);
+        break;
+    }
+    }
+}
+
+MaskCache::MaskCache()
+{
+    // Entries never move, so a returned mask outlives other lookups that
+    // hit the cache.
+    entries_.reserve(kCapacity);
+}
+
+const SpanMask& MaskCache::Get(MaskShape shape, uint32_t width, uint32_t height)
+{
+    ++clock_;
+    Entry* oldest = nullptr;
+    for (Entry& e : entries_) {
+        if (e.shape == shape && e.width == width && e.height == height) {
+            e.last_use = clock_;
+            return e.mask;
+        }
+
+        if (!oldest || e.last_use < oldest->last_use)
+            oldest = &e;
+    }
+
+    if (entries_.size() < kCapacity) {
+        entries_.emplace_back();
+        oldest = &entries_.back();
+    }
+
+    oldest->shape = shape;
+    oldest->width = width;
+    oldest->height = height;
+    oldest->last_use = clock_;
+    BuildShapeMask(shape, width, height, &oldest->mask);
+    return oldest->mask;
+}
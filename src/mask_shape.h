@@ -0,0 +1,41 @@
+#pragma once
+#include <stdint.h>
+#include <vector>
+#include "image_mask.h"
+
+enum MaskShape {
+    MASK_SHAPE_CIRCLE,        // inscribed, at the top of a portrait frame
+    MASK_SHAPE_ELLIPSE,       // touching all four sides
+    MASK_SHAPE_ROUNDED_RECT,  // corners of an eighth of the shorter side
+};
+
+// Renders |shape| into a |width| x |height| span mask. Coverage is worked
+// out only for pixels the outline passes through; whole runs inside are
+// opaque. It is taken from the distance of a pixel center to the outline,
+// or for ellipses from strips of the pixel cut by it.
+void BuildShapeMask(MaskShape shape, uint32_t width, uint32_t height, SpanMask* mask);
+
+// The masks of the last few display sizes, so that going back to a scale
+// used before costs nothing. A returned mask stays valid until the next
+// Get.
+class MaskCache
+{
+public:
+    MaskCache();
+    const SpanMask& Get(MaskShape shape, uint32_t width, uint32_t height);
+
+private:
+    struct Entry {
+        MaskShape shape;
+        uint32_t width;
+        uint32_t height;
+        uint64_t last_use;
+        SpanMask mask;
+    };
+
+    // One per scale menu item, and a few more for resized windows.
+    static const uint32_t kCapacity = 12;
+
+    std::vector<Entry> entries_;
+    uint64_t clock_ = 0;
+};
@@ -1,8 +1,11 @@
 #include <mfidl.h>
+#include <commdlg.h>
+#include <fstream>
 #include <functional>
 #include <map>
 #include <sstream>
 
+#include "frame_trace.h"
 #include "util.h"
 #include "window.h"
 
@@ -111,7 +114,7 @@ void MakeScaleMenu(PopupMenu* menu, LayeredWindow* win)
     menu->SetRadioMode();
     int scale_now = (int)(win->Scale() * 100);
 
-    for (int scale : {50, 75, 100, 125, 150, 200}) {
+    for (int scale : {25, 50, 75, 100, 125, 150, 200, 300, 400}) {
         std::wstringstream ss;
         ss << scale << "%";
         menu->Add(ss.str().c_str(), [win, scale]() {
@@ -135,43 +138,223 @@ void MakeOpacityMenu(PopupMenu* menu, LayeredWindow* win)
     }
 }
 
+// Asks where to save |name|, or with no name which file to open.
+bool AskFilePath(HWND win, PCWSTR name, PCWSTR filter, PCWSTR ext, std::wstring* path)
+{
+    WCHAR buffer[MAX_PATH] = {};
+    if (name)
+        wcscpy_s(buffer, name);
+
+    OPENFILENAMEW ofn = {};
+    ofn.lStructSize = sizeof(ofn);
+    ofn.hwndOwner = win;
+    ofn.lpstrFilter = filter;
+    ofn.lpstrFile = buffer;
+    ofn.nMaxFile = _countof(buffer);
+    ofn.lpstrDefExt = ext;
+    if (name) {
+        ofn.Flags = OFN_OVERWRITEPROMPT | OFN_PATHMUSTEXIST;
+        if (!GetSaveFileNameW(&ofn))
+            return false;
+    } else {
+        ofn.Flags = OFN_FILEMUSTEXIST | OFN_PATHMUSTEXIST;
+        if (!GetOpenFileNameW(&ofn))
+            return false;
+    }
+
+    *path = buffer;
+    return true;
+}
+
+// Asks where to save |name| and has |write| fill the file.
+void SaveFile(HWND win, PCWSTR name, PCWSTR filter, PCWSTR ext,
+    std::function<void(std::ostream*)> write)
+{
+    std::wstring path;
+    if (!AskFilePath(win, name, filter, ext, &path))
+        return;
+
+    std::ofstream file(path);
+    write(&file);
+}
+
+void SaveStats(HWND win, const StatsReport& report, bool csv)
+{
+    if (csv) {
+        SaveFile(win, L"webcam-stats.csv", L"CSV\0*.csv\0", L"csv",
+            [&](std::ostream* out) { WriteStatsCsv(report, out); });
+    } else {
+        SaveFile(win, L"webcam-stats.json", L"JSON\0*.json\0", L"json",
+            [&](std::ostream* out) { WriteStatsJson(report, out); });
+    }
+}
+
+void MakeStatsMenu(PopupMenu* menu, HWND hwnd, LayeredWindow* win)
+{
+    menu->Add(L"Show Overlay", [win]() {
+        win->ToggleStatsOverlay();
+    }, win->IsStatsOverlay());
+    menu->AddSeparator();
+
+    // The report is taken before the dialog shows.
+    menu->Add(L"Save as JSON...", [hwnd, win]() {
+        SaveStats(hwnd, win->Report(), false);
+    });
+
+    menu->Add(L"Save as CSV...", [hwnd, win]() {
+        SaveStats(hwnd, win->Report(), true);
+    });
+    menu->AddSeparator();
+
+    // Stopping asks where to save the trace.
+    menu->Add(L"Record Trace", [hwnd]() {
+        if (!Tracer::Enabled()) {
+            Tracer::Start();
+            return;
+        }
+
+        Tracer::Stop();
+        SaveFile(hwnd, L"webcam-trace.json", L"Trace\0*.json\0", L"json",
+            [](std::ostream* out) { Tracer::WriteJson(out); });
+    }, Tracer::Enabled());
+}
+
 int ShowSwitchDeviceMenu(HWND win,
-    const DeviceSelector& ds, const std::wstring& pre_uid)
+    const std::vector<DeviceInfo>& devices, const std::wstring& pre_uid)
 {
     int selection = -1;
     PopupMenu menu(win);
     menu.SetRadioMode();
 
-    for (DWORD i = 0; i < ds.DevNum(); ++i) {
-        IMFActivate* act = ds[i];
-        std::wstring friendly_name = GetDevPropStr(act,
-            MF_DEVSOURCE_ATTRIBUTE_FRIENDLY_NAME);
-
-        if (friendly_name.empty())
-            friendly_name = L"unknown";
-
-        std::wstring dev_id = GetDevPropStr(act,
-            MF_DEVSOURCE_ATTRIBUTE_SOURCE_TYPE_VIDCAP_SYMBOLIC_LINK);
-
-        menu.Add(friendly_name.c_str(), [&, i]() { selection = i; },
-            (pre_uid.size() && dev_id == pre_uid));
+    for (size_t i = 0; i < devices.size(); ++i) {
+        menu.Add(devices[i].name.c_str(), [&, i]() { selection = (int)i; },
+            (pre_uid.size() && devices[i].link == pre_uid));
     }
 
     menu.Show();
     return selection;
 }
 
-void OnSwitchDevice(MainWindow* win, const std::wstring& dev_uid)
+// The devices as the registry last listed them, so that the menu shows
+// at once.
+void MainWindow::SwitchDevice()
 {
-    DeviceSelector dev(win);
-    if (!dev.List() || !dev.DevNum())
+    const std::vector<DeviceInfo> devices = devices_.Devices();
+    if (devices.empty())
         return;
 
-    int select = ShowSwitchDeviceMenu(*win, dev, dev_uid);
+    int select = ShowSwitchDeviceMenu(m_hWnd, devices, dev_uid_);
     if (select == -1)
         return;
 
-    dev.Select(select, {});
+    SelectDevice(devices[select].link, {});
+}
+
+void MakeTestPatternMenu(PopupMenu* menu, MainWindow* win)
+{
+    static const PCWSTR names[TEST_PATTERN_NUM] = {
+        L"Color Bars", L"Zone Plate", L"Noise", L"Gradient",
+    };
+
+    for (int i = 0; i < TEST_PATTERN_NUM; ++i) {
+        menu->Add(names[i], [win, i]() {
+            win->SelectTestPattern((TestPattern)i);
+        });
+    }
+}
+
+void MainWindow::ToggleRecording()
+{
+    if (previewer_.IsRecording()) {
+        previewer_.StopRecording();
+        return;
+    }
+
+    std::wstring path;
+    if (!AskFilePath(m_hWnd, L"webcam.wcr", L"Raw Frames\0*.wcr\0", L"wcr", &path))
+        return;
+
+    if (!previewer_.StartRecording(ToUtf8(path)))
+        ErrorMsg(L"Failed to start recording.");
+}
+
+void MainWindow::OpenReplay()
+{
+    std::wstring path;
+    if (!AskFilePath(m_hWnd, NULL, L"Raw Frames\0*.wcr\0", L"wcr", &path))
+        return;
+
+    if (!SelectReplay(path))
+        ErrorMsg(L"Failed to replay the recording.");
+}
+
+void MainWindow::SaveSnapshot()
+{
+    // The frame shown when the item was picked, not when the dialog closes.
+    layered_win_.RequestSnapshot();
+
+    std::wstring path;
+    const bool asked = AskFilePath(m_hWnd, L"webcam.png",
+        L"PNG\0*.png\0BMP\0*.bmp\0", L"png", &path);
+    FrameRef frame = layered_win_.TakeSnapshot();
+    if (!asked)
+        return;
+
+    if (!frame) {
+        ErrorMsg(L"No frame to save yet.");
+        return;
+    }
+
+    const std::string utf8 = ToUtf8(path);
+    HWND hwnd = m_hWnd;
+    const bool queued = snapshots_.Save(std::move(frame), utf8, SnapshotFormatOf(utf8),
+        [hwnd](bool ok) { ::PostMessage(hwnd, kSnapshotMessage, ok, 0); });
+    if (!queued)
+        ErrorMsg(L"Failed to save the snapshot.");
+}
+
+void MakeModeMenu(PopupMenu* menu, MainWindow* win, const Previewer& previewer)
+{
+    CaptureFormat pinned = {};
+    const bool is_pinned = previewer.PinnedMode(&pinned);
+    menu->SetRadioMode();
+
+    // Auto names the mode it picked.
+    std::string name = "Auto";
+    if (!is_pinned)
+        name += " (" + ModeName(previewer.CurrentMode()) + ")";
+
+    menu->Add(std::wstring(name.begin(), name.end()).c_str(), [win]() {
+        win->PinMode(nullptr);
+    }, !is_pinned);
+    menu->AddSeparator();
+
+    for (const CaptureFormat& mode : previewer.Modes()) {
+        name = ModeName(mode);
+        menu->Add(std::wstring(name.begin(), name.end()).c_str(), [win, mode]() {
+            win->PinMode(&mode);
+        }, is_pinned && SameMode(mode, pinned));
+    }
+}
+
+// Opens the device again, for a new mode to take effect.
+void MainWindow::PinMode(const CaptureFormat* mode)
+{
+    previewer_.PinMode(mode);
+    if (!ReopenDevice())
+        ErrorMsg(L"Failed to open the device in that mode.");
+}
+
+void MainWindow::SaveInstantReplay()
+{
+    std::wstring path;
+    if (!AskFilePath(m_hWnd, L"webcam-replay.wcr", L"Raw Frames\0*.wcr\0", L"wcr", &path))
+        return;
+
+    HWND hwnd = m_hWnd;
+    if (!previewer_.DumpReplayRing(ToUtf8(path),
+        [hwnd](bool ok) { ::PostMessage(hwnd, kReplaySavedMessage, ok, 0); }))
+        ErrorMsg(L"Nothing to save, or a replay is still being saved.");
 }
 
 void MainWindow::ShowMenu(LPARAM lp)
@@ -198,12 +381,50 @@ void MainWindow::ShowMenu(LPARAM lp)
     menu.Add(L"Circle Mode", [this]() {
         layered_win_.ToggleMaskMode();
     }, layered_win_.IsMaskMode());
+
+    PopupMenu stats(&menu);
+    MakeStatsMenu(&stats, m_hWnd, &layered_win_);
+    menu.Add(stats, L"Statistics");
     menu.AddSeparator();
 
     menu.Add(L"Switch Device", [this]() {
-        OnSwitchDevice(this, dev_uid_);
+        SwitchDevice();
+    });
+
+    PopupMenu modes(&menu);
+    if (!previewer_.Modes().empty()) {
+        MakeModeMenu(&modes, this, previewer_);
+        menu.Add(modes, L"Capture Mode");
+    }
+
+    PopupMenu patterns(&menu);
+    MakeTestPatternMenu(&patterns, this);
+    menu.Add(patterns, L"Test Pattern");
+    menu.AddSeparator();
+
+    menu.Add(L"Save Snapshot...", [this]() {
+        SaveSnapshot();
+    });
+
+    menu.Add(L"Record Raw Frames...", [this]() {
+        ToggleRecording();
+    }, previewer_.IsRecording());
+
+    menu.Add(L"Replay Recording...", [this]() {
+        OpenReplay();
     });
 
+    menu.Add(L"Instant Replay", [this]() {
+        previewer_.EnableReplayRing(!previewer_.IsReplayRingOn());
+    }, previewer_.IsReplayRingOn());
+
+    if (previewer_.IsReplayRingOn()) {
+        menu.Add(L"Save Instant Replay...", [this]() {
+            SaveInstantReplay();
+        });
+    }
+    menu.AddSeparator();
+
     menu.Add(L"Quit", [this]() {
         ShowWindow(SW_HIDE);
         PostMessage(WM_CLOSE);
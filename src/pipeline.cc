@@ -0,0 +1,163 @@
+#include "pipeline.h"
+#include "frame_trace.h"
+
+Pipeline::~Pipeline()
+{
+    Stop();
+}
+
+void Pipeline::AddStage(PipelineStage* stage, const StageConfig& config)
+{
+    std::unique_ptr<Node> node(new Node);
+    node->stage = stage;
+    node->config = config;
+    if (node->config.queue_depth < 1)
+        node->config.queue_depth = 1;
+
+    stages_.push_back(std::move(node));
+}
+
+void Pipeline::Start()
+{
+    {
+        std::unique_lock<std::mutex> lock(mtx_);
+        if (running_)
+            return;
+
+        running_ = true;
+    }
+
+    for (size_t i = 0; i < stages_.size(); ++i)
+        stages_[i]->thread = std::thread(&Pipeline::StageMain, this, i);
+}
+
+void Pipeline::Stop()
+{
+    {
+        std::unique_lock<std::mutex> lock(mtx_);
+        if (!running_)
+            return;
+
+        running_ = false;
+    }
+
+    // Producers waiting for room and callers of Flush return at once; the
+    // frames stages are working on finish before the threads are joined.
+    for (auto& node : stages_)
+        node->cv.notify_all();
+
+    idle_cv_.notify_all();
+    for (auto& node : stages_)
+        node->thread.join();
+
+    std::unique_lock<std::mutex> lock(mtx_);
+    for (auto& node : stages_)
+        node->queue.clear();
+}
+
+bool Pipeline::Push(FrameRef frame)
+{
+    if (stages_.empty())
+        return false;
+
+    return Enqueue(0, std::move(frame));
+}
+
+bool Pipeline::Enqueue(size_t index, FrameRef frame)
+{
+    Node& node = *stages_[index];
+    std::unique_lock<std::mutex> lock(mtx_);
+
+    if (node.queue.size() >= node.config.queue_depth) {
+        switch (node.config.drop) {
+        case DROP_OLDEST:
+            node.queue.pop_front();
+            ++node.stats.dropped;
+            break;
+
+        case DROP_NEWEST:
+            ++node.stats.dropped;
+            idle_cv_.notify_all();
+            return false;
+
+        case DROP_NONE:
+            node.cv.wait(lock, [&]() {
+                return !running_ || node.queue.size() < node.config.queue_depth;
+            });
+
+            if (!running_)
+                return false;
+            break;
+        }
+    }
+
+    node.queue.push_back(std::move(frame));
+    node.cv.notify_all();
+    return true;
+}
+
+void Pipeline::StageMain(size_t index)
+{
+    Node& node = *stages_[index];
+    Tracer::SetThreadName(node.stage->Name());
+
+    for (;;) {
+        FrameRef frame;
+        {
+            std::unique_lock<std::mutex> lock(mtx_);
+            node.cv.wait(lock, [&]() { return !running_ || !node.queue.empty(); });
+            if (!running_)
+                return;
+
+            frame = std::move(node.queue.front());
+            node.queue.pop_front();
+            node.busy = true;
+
+            // A producer may be waiting for room.
+            node.cv.notify_all();
+        }
+
+        bool keep = false;
+        {
+            TRACE_SCOPE_ID(node.stage->Name(), frame ? frame->Timestamp() : -1);
+            keep = node.stage->Process(&frame);
+        }
+
+        if (keep && frame && index + 1 < stages_.size())
+            Enqueue(index + 1, std::move(frame));
+
+        // Frames leave the stage before it counts as idle again, so that
+        // Flush sees them in the next queue.
+        frame.Reset();
+        std::unique_lock<std::mutex> lock(mtx_);
+        node.busy = false;
+        if (keep)
+            ++node.stats.processed;
+        else
+            ++node.stats.dropped;
+
+        idle_cv_.notify_all();
+    }
+}
+
+void Pipeline::Flush()
+{
+    std::unique_lock<std::mutex> lock(mtx_);
+    idle_cv_.wait(lock, [&]() {
+        if (!running_)
+            return true;
+
+        for (auto& node : stages_) {
+            if (node->busy || !node->queue.empty())
+                return false;
+        }
+
+        return true;
+    });
+}
+
+StageStats Pipeline::Stats(size_t index) const
+{
+    std::unique_lock<std::mutex> lock(mtx_);
+    return stages_[index]->stats;
+}
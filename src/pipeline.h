@@ -0,0 +1,83 @@
+#pragma once
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <stdint.h>
+#include <thread>
+#include <vector>
+#include "frame_pool.h"
+
+// One step of the frame processing. Process works on |frame| in place or
+// replaces it with a frame of its own; returning false drops the frame.
+class PipelineStage
+{
+public:
+    virtual ~PipelineStage() {}
+    virtual const char* Name() const = 0;
+    virtual bool Process(FrameRef* frame) = 0;
+};
+
+// What a stage does when a frame arrives and its queue is full.
+enum DropPolicy {
+    DROP_OLDEST,  // keep the newest frames, as live preview wants
+    DROP_NEWEST,  // keep what is queued
+    DROP_NONE,    // wait for room; nothing is lost
+};
+
+struct StageConfig {
+    uint32_t queue_depth = 1;
+    DropPolicy drop = DROP_OLDEST;
+};
+
+struct StageStats {
+    uint64_t processed;
+    uint64_t dropped;  // by the queue policy or by Process
+};
+
+// Runs each stage on a thread of its own, fed by a bounded queue, so
+// consecutive frames overlap: while one stage works on frame N, the stage
+// before it already works on frame N + 1. Frames reach stages in the
+// order they were pushed.
+class Pipeline
+{
+public:
+    Pipeline() = default;
+    ~Pipeline();
+
+    // Stages are added before Start and are not owned.
+    void AddStage(PipelineStage* stage, const StageConfig& config = StageConfig());
+    void Start();
+    void Stop();
+
+    // Hands a frame to the first stage; false if its queue dropped it.
+    bool Push(FrameRef frame);
+
+    // Waits until every frame pushed so far has left the last stage.
+    void Flush();
+
+    size_t StageNum() const { return stages_.size(); }
+    StageStats Stats(size_t index) const;
+
+private:
+    Pipeline(const Pipeline&) = delete;
+    Pipeline& operator=(const Pipeline&) = delete;
+
+    struct Node {
+        PipelineStage* stage;
+        StageConfig config;
+        std::deque<FrameRef> queue;
+        bool busy = false;
+        StageStats stats = {};
+        std::condition_variable cv;  // the queue took a frame or made room
+        std::thread thread;
+    };
+
+    bool Enqueue(size_t index, FrameRef frame);
+    void StageMain(size_t index);
+
+    std::vector<std::unique_ptr<Node>> stages_;
+    mutable std::mutex mtx_;
+    std::condition_variable idle_cv_;
+    bool running_ = false;
+};
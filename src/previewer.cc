@@ -2,7 +2,10 @@
 
 #include <shlwapi.h>
 #include <mfapi.h>
+#include <stdio.h>
+#include <algorithm>
 
+#include "frame_trace.h"
 #include "window.h"
 #include "util.h"
 
@@ -21,12 +24,93 @@ bool Previewer::Init(LayeredWindow* layered_win)
 Previewer::~Previewer()
 {
     CloseDevice();
+    EnableReplayRing(false);
 }
 
 void Previewer::CloseDevice()
 {
+    StopRecording();
+
+    // The check holds a reference of its own to the reader.
+    if (validator_.joinable())
+        validator_.join();
+
+    // The source thread takes the lock for every frame, so it is stopped
+    // without holding it.
+    if (source_) {
+        source_->Stop();
+        source_.reset();
+    }
+
     std::unique_lock<std::mutex> lock(mtx_);
     SafeRelease(&reader_);
+    modes_.clear();
+}
+
+bool Previewer::StartRecording(const std::string& path)
+{
+    std::unique_ptr<FrameRecorder> recorder(new FrameRecorder);
+    std::unique_lock<std::mutex> lock(mtx_);
+    if (recorder_ || !(reader_ || source_))
+        return false;
+
+    if (!recorder->Open(path, draw_.StreamInfo()))
+        return false;
+
+    recorder_ = std::move(recorder);
+    draw_.SetRecorder(recorder_.get());
+    return true;
+}
+
+// The file is finished without holding the lock, so that frames keep
+// coming while the rest of it is written.
+void Previewer::StopRecording()
+{
+    std::unique_ptr<FrameRecorder> recorder;
+    {
+        std::unique_lock<std::mutex> lock(mtx_);
+        draw_.SetRecorder(nullptr);
+        recorder = std::move(recorder_);
+    }
+
+    if (recorder)
+        recorder->Close();
+}
+
+bool Previewer::IsRecording() const
+{
+    return recorder_ != nullptr;
+}
+
+// Like the recorder, the ring is let go of without holding the lock; it
+// waits for a dump that is still running.
+void Previewer::EnableReplayRing(bool enable)
+{
+    std::unique_ptr<ReplayRing> ring;
+    if (enable) {
+        ring.reset(new ReplayRing(kReplaySeconds, kReplayBudget));
+        ring->SetStats(layered_win_->Stats());
+    }
+
+    {
+        std::unique_lock<std::mutex> lock(mtx_);
+        if (enable == (ring_ != nullptr))
+            return;
+
+        ring_.swap(ring);
+        draw_.SetReplayRing(ring_.get());
+    }
+}
+
+bool Previewer::IsReplayRingOn() const
+{
+    return ring_ != nullptr;
+}
+
+bool Previewer::DumpReplayRing(const std::string& path, std::function<void(bool ok)> done)
+{
+    std::unique_lock<std::mutex> lock(mtx_);
+    return ring_ && ring_->Dump(path, done);
 }
 
 HRESULT Previewer::QueryInterface(REFIID riid, void** ppv)
@@ -74,18 +158,22 @@ HRESULT Previewer::OnReadSample(
     IMFSample* sample)
 {
     UNUSED(stream_index);
-    UNUSED(stream_flags);
-    UNUSED(timestamp);
+
+    Tracer::SetThreadName("capture");
+    TRACE_SCOPE_ID("OnReadSample", timestamp);
 
     HRESULT hr = status;
     IMFMediaBuffer* buffer = NULL;
     std::unique_lock<std::mutex> lock(mtx_);
 
     if (SUCCEEDED(hr)) {
+        if (sample && first_frame_pending_)
+            LogFirstFrame();
+
         if (sample) {
             hr = sample->GetBufferByIndex(0, &buffer);
             if (SUCCEEDED(hr))
-                hr = draw_.DrawFrame(buffer);
+                hr = draw_.DrawFrame(buffer, timestamp, stream_flags);
         }
     } else {
         layered_win_->OnFrameError(hr);
@@ -98,6 +186,23 @@ HRESULT Previewer::OnReadSample(
     return hr;
 }
 
+// Into the stats, the trace when on and the debugger output.
+void Previewer::LogFirstFrame()
+{
+    first_frame_pending_ = false;
+    const uint64_t now = StatsClockNs();
+    layered_win_->Stats()->Set(GAUGE_FIRST_FRAME_US, (now - open_begin_) / 1000);
+    layered_win_->Stats()->Set(GAUGE_MODE_CACHED, mode_cached_);
+    if (Tracer::Enabled())
+        Tracer::Record("FirstFrame", open_begin_, now, -1);
+
+    char msg[128];
+    snprintf(msg, sizeof(msg), "First frame after %.1f ms, %s mode %s\n",
+        (now - open_begin_) / 1e6, mode_cached_ ? "cached" : "listed",
+        ModeName(mode_).c_str());
+    OutputDebugStringA(msg);
+}
+
 HRESULT Previewer::GetSymbolicLink(IMFActivate* act)
 {
     PWSTR value = NULL;
@@ -123,8 +228,14 @@ HRESULT Previewer::TryMediaType(IMFMediaType* type)
     hr = type->GetGUID(MF_MT_SUBTYPE, &subtype);
     HR_FAIL_RET(hr);
 
-    if (draw_.IsFormatSupported(subtype))
+    if (draw_.IsFormatSupported(subtype)) {
+        hr = reader_->SetCurrentMediaType(
+            (DWORD)MF_SOURCE_READER_FIRST_VIDEO_STREAM,
+            NULL, type);
+
+        HR_FAIL_RET(hr);
         return draw_.SetVideoType(type);
+    }
 
     for (DWORD i = 0; ; i++) {
         hr = draw_.GetFormat(i, &subtype);
@@ -142,28 +253,266 @@ HRESULT Previewer::TryMediaType(IMFMediaType* type)
     }
 }
 
-HRESULT Previewer::CheckSupportedMediaType()
+static bool ReadMode(IMFMediaType* type, CaptureFormat* mode)
 {
-    HRESULT hr = S_OK;
-    IMFMediaType* type = NULL;
+    GUID subtype = {};
+    *mode = {};
+    if (FAILED(type->GetGUID(MF_MT_SUBTYPE, &subtype))
+        || FAILED(MFGetAttributeSize(type, MF_MT_FRAME_SIZE, &mode->width, &mode->height)))
+        return false;
 
+    mode->fourcc = subtype.Data1;
+    if (FAILED(MFGetAttributeRatio(type, MF_MT_FRAME_RATE, &mode->fps_num, &mode->fps_den))) {
+        mode->fps_num = 0;
+        mode->fps_den = 0;
+    }
+
+    return true;
+}
+
+// The native types of |reader|, which the caller releases, and the modes
+// of those that |draw| shows as they are, with the index of their type.
+static HRESULT ListNativeTypes(IMFSourceReader* reader, const DrawDevice& draw,
+    std::vector<IMFMediaType*>* types, std::vector<CaptureFormat>* modes,
+    std::vector<size_t>* mode_types)
+{
+    HRESULT hr = S_OK;
     for (DWORD i = 0;; i++) {
-        hr = reader_->GetNativeMediaType(
+        IMFMediaType* type = NULL;
+        hr = reader->GetNativeMediaType(
             (DWORD)MF_SOURCE_READER_FIRST_VIDEO_STREAM,
             i, &type);
 
+        if (hr == MF_E_NO_MORE_TYPES)
+            return S_OK;
+
         HR_FAIL_RET(hr);
+        types->push_back(type);
+
+        GUID subtype = {};
+        CaptureFormat mode = {};
+        if (ReadMode(type, &mode) && SUCCEEDED(type->GetGUID(MF_MT_SUBTYPE, &subtype))
+            && draw.IsFormatSupported(subtype)) {
+            modes->push_back(mode);
+            if (mode_types)
+                mode_types->push_back(types->size() - 1);
+        }
+    }
+}
+
+// Cameras list their modes in no useful order, often a small or slow one
+// first; all of them are ranked, and the pinned one goes first.
+HRESULT Previewer::CheckSupportedMediaType()
+{
+    HRESULT hr = S_OK;
+    std::vector<IMFMediaType*> types;
+    SCOPE_EXIT([&]() {
+        for (IMFMediaType* type : types)
+            SafeRelease(&type);
+    });
+
+    std::vector<CaptureFormat> modes;
+    std::vector<size_t> mode_types;
+    hr = ListNativeTypes(reader_, draw_, &types, &modes, &mode_types);
+    HR_FAIL_RET(hr);
 
-        hr = TryMediaType(type);
-        SafeRelease(&type);
+    std::vector<size_t> order = RankModes(modes, mode_needs_);
+    DeviceCaps caps = {};
+    if (cache_.Find(ToUtf8(symbolic_link_), &caps) && caps.pinned) {
+        for (size_t k = 0; k < order.size(); ++k) {
+            if (SameMode(modes[order[k]], caps.pin)) {
+                std::rotate(order.begin(), order.begin() + k, order.begin() + k + 1);
+                break;
+            }
+        }
+    }
 
-        if (SUCCEEDED(hr))
+    modes_ = modes;
+    for (size_t i : order) {
+        if (SUCCEEDED(TryMediaType(types[mode_types[i]]))) {
+            mode_ = modes[i];
             return S_OK;
+        }
+    }
+
+    // Types that cannot be shown as they are may be offered in another
+    // subtype.
+    for (IMFMediaType* type : types) {
+        if (SUCCEEDED(TryMediaType(type))) {
+            ReadMode(type, &mode_);
+            return S_OK;
+        }
+    }
+
+    return MF_E_NO_MORE_TYPES;
+}
+
+// Sets |mode| without listing the native types first; the reader looks
+// for a type that matches it, which must be the mode asked for.
+HRESULT Previewer::SetCachedMode(const CaptureFormat& mode)
+{
+    GUID subtype = MFVideoFormat_Base;
+    subtype.Data1 = mode.fourcc;
+    if (!draw_.IsFormatSupported(subtype))
+        return MF_E_INVALIDMEDIATYPE;
+
+    HRESULT hr = S_OK;
+    IMFMediaType* type = NULL;
+    hr = MFCreateMediaType(&type);
+    HR_FAIL_RET(hr);
+    SCOPE_EXIT([&]() { SafeRelease(&type); });
+
+    hr = type->SetGUID(MF_MT_MAJOR_TYPE, MFMediaType_Video);
+    HR_FAIL_RET(hr);
+
+    hr = type->SetGUID(MF_MT_SUBTYPE, subtype);
+    HR_FAIL_RET(hr);
+
+    hr = MFSetAttributeSize(type, MF_MT_FRAME_SIZE, mode.width, mode.height);
+    HR_FAIL_RET(hr);
+
+    if (mode.fps_num && mode.fps_den) {
+        hr = MFSetAttributeRatio(type, MF_MT_FRAME_RATE, mode.fps_num, mode.fps_den);
+        HR_FAIL_RET(hr);
+    }
+
+    hr = reader_->SetCurrentMediaType(
+        (DWORD)MF_SOURCE_READER_FIRST_VIDEO_STREAM,
+        NULL, type);
+    HR_FAIL_RET(hr);
+
+    IMFMediaType* current = NULL;
+    hr = reader_->GetCurrentMediaType(
+        (DWORD)MF_SOURCE_READER_FIRST_VIDEO_STREAM,
+        &current);
+    HR_FAIL_RET(hr);
+    SCOPE_EXIT([&]() { SafeRelease(&current); });
+
+    CaptureFormat set = {};
+    if (!ReadMode(current, &set) || !SameMode(set, mode))
+        return MF_E_INVALIDMEDIATYPE;
+
+    hr = draw_.SetVideoType(current);
+    HR_FAIL_RET(hr);
+
+    DeviceCaps caps = {};
+    cache_.Find(ToUtf8(symbolic_link_), &caps);
+    modes_ = caps.modes;
+    mode_ = set;
+    return S_OK;
+}
+
+void Previewer::LoadCapabilityCache(const std::string& path)
+{
+    cache_path_ = path;
+    cache_.Load(path);
+}
+
+void Previewer::SetModesChanged(std::function<void()> changed)
+{
+    modes_changed_ = changed;
+}
+
+void Previewer::SaveCache()
+{
+    if (!cache_path_.empty())
+        cache_.Save(cache_path_);
+}
+
+// Lists the modes of the device with a reference of its own to the
+// reader, so that frames come meanwhile. The mode in use is recorded as
+// chosen if the device still lists it.
+void Previewer::StartValidation()
+{
+    IMFSourceReader* reader = reader_;
+    reader->AddRef();
+    const std::string link = ToUtf8(symbolic_link_);
+    const CaptureFormat mode = mode_;
+    const ModeNeeds needs = mode_needs_;
+
+    validator_ = std::thread([this, reader, link, mode, needs]() {
+        Tracer::SetThreadName("validate");
+        TRACE_SCOPE("ValidateModes");
+        const HRESULT co_hr = CoInitializeEx(NULL, COINIT_MULTITHREADED);
+
+        std::vector<IMFMediaType*> types;
+        std::vector<CaptureFormat> modes;
+        const HRESULT hr = ListNativeTypes(reader, draw_, &types, &modes, nullptr);
+        for (IMFMediaType* type : types)
+            SafeRelease(&type);
+
+        IMFSourceReader* released = reader;
+        SafeRelease(&released);
+
+        if (SUCCEEDED(hr)) {
+            const uint64_t now = CapabilityCache::Now();
+            const bool same = cache_.Validate(link, modes, now);
+            for (const CaptureFormat& m : modes) {
+                if (SameMode(m, mode)) {
+                    cache_.Put(link, modes, mode, needs, now);
+                    break;
+                }
+            }
+
+            SaveCache();
+            if (!same && modes_changed_)
+                modes_changed_();
+        }
+
+        if (SUCCEEDED(co_hr))
+            CoUninitialize();
+    });
+}
+
+bool Previewer::RefreshModes()
+{
+    DeviceCaps caps = {};
+    if (symbolic_link_.empty() || !cache_.Find(ToUtf8(symbolic_link_), &caps))
+        return true;
+
+    modes_ = caps.modes;
+    for (const CaptureFormat& mode : modes_) {
+        if (SameMode(mode, mode_))
+            return true;
     }
+
+    return modes_.empty();
+}
+
+void Previewer::SetModeNeeds(const ModeNeeds& needs)
+{
+    mode_needs_ = needs;
+}
+
+const std::vector<CaptureFormat>& Previewer::Modes() const
+{
+    return modes_;
+}
+
+CaptureFormat Previewer::CurrentMode() const
+{
+    return mode_;
+}
+
+void Previewer::PinMode(const CaptureFormat* mode)
+{
+    cache_.Pin(ToUtf8(symbolic_link_), mode, CapabilityCache::Now());
+    SaveCache();
+}
+
+bool Previewer::PinnedMode(CaptureFormat* mode) const
+{
+    DeviceCaps caps = {};
+    if (!cache_.Find(ToUtf8(symbolic_link_), &caps) || !caps.pinned)
+        return false;
+
+    *mode = caps.pin;
+    return true;
 }
 
 HRESULT Previewer::SetDevice(IMFActivate* act, std::function<void(SIZE)> get_size)
 {
+    const uint64_t begin = StatsClockNs();
     HRESULT hr = S_OK;
     CloseDevice();
     std::unique_lock<std::mutex> lock(mtx_);
@@ -190,8 +539,20 @@ HRESULT Previewer::SetDevice(IMFActivate* act, std::function<void(SIZE)> get_siz
     hr = MFCreateSourceReaderFromMediaSource(source, attributes, &reader_);
     HR_FAIL_RET(hr);
 
-    hr = CheckSupportedMediaType();
-    HR_FAIL_RET(hr);
+    // A device seen before is opened in the mode it was last opened in,
+    // or the best of its cached modes; its modes are checked afterwards.
+    const std::string link = ToUtf8(symbolic_link_);
+    CaptureFormat cached = {};
+    const bool from_cache = cache_.CachedMode(link, mode_needs_, &cached)
+        && SUCCEEDED(SetCachedMode(cached));
+    if (!from_cache) {
+        hr = CheckSupportedMediaType();
+        HR_FAIL_RET(hr);
+    }
+
+    open_begin_ = begin;
+    mode_cached_ = from_cache;
+    first_frame_pending_ = true;
 
 	get_size(draw_.FrameSize());
     hr = RequestNextFrame();
@@ -202,11 +563,52 @@ HRESULT Previewer::SetDevice(IMFActivate* act, std::function<void(SIZE)> get_siz
             source->Shutdown();
 
         CloseDevice();
+        return hr;
+    }
+
+    if (from_cache) {
+        StartValidation();
+    } else {
+        cache_.Put(link, modes_, mode_, mode_needs_, CapabilityCache::Now());
+        SaveCache();
     }
 
     return hr;
 }
 
+HRESULT Previewer::SetSource(std::unique_ptr<CaptureSource> source,
+    std::function<void(SIZE)> get_size)
+{
+    CloseDevice();
+
+    HRESULT hr = S_OK;
+    {
+        std::unique_lock<std::mutex> lock(mtx_);
+        symbolic_link_.clear();
+        modes_.clear();
+        mode_ = source->Format();
+        hr = draw_.SetFormat(source->Format());
+        HR_FAIL_RET(hr);
+    }
+
+    get_size(draw_.FrameSize());
+    source_ = std::move(source);
+
+    bool started = source_->Start([this](const RawFrame& frame) {
+        std::unique_lock<std::mutex> lock(mtx_);
+        HRESULT frame_hr = draw_.DrawRawFrame(frame);
+        if (FAILED(frame_hr))
+            layered_win_->OnFrameError(frame_hr);
+    });
+
+    if (!started) {
+        source_.reset();
+        return E_FAIL;
+    }
+
+    return S_OK;
+}
+
 bool Previewer::IsDeviceLost(PDEV_BROADCAST_HDR hdr)
 {
     if (!hdr)
@@ -215,7 +617,8 @@ bool Previewer::IsDeviceLost(PDEV_BROADCAST_HDR hdr)
     if (hdr->dbch_devicetype != DBT_DEVTYP_DEVICEINTERFACE)
         return false;
 
-    std::unique_lock<std::mutex> lock(mtx_);
+    // The link is only set by SetDevice, on this same thread, so there is
+    // no need to wait for a frame in flight.
     PCWSTR name = ((DEV_BROADCAST_DEVICEINTERFACE*)hdr)->dbcc_name;
     return symbolic_link_.size()
         && (_wcsicmp(symbolic_link_.c_str(), name) == 0);
@@ -3,9 +3,17 @@
 #include <mfreadwrite.h>
 #include <dbt.h>  // PDEV_BROADCAST_HDR
 
+#include <memory>
 #include <mutex>
 #include <functional>
+#include <thread>
+#include <vector>
+#include "capability_cache.h"
+#include "capture_mode.h"
+#include "capture_source.h"
 #include "draw_device.h"
+#include "raw_recording.h"
+#include "replay_ring.h"
 
 class LayeredWindow;
 
@@ -30,8 +38,55 @@ public:
         LONGLONG timestamp,
         IMFSample* sample);
 
+    // The mode is the one pinned for the device, or else the best the
+    // CPU can convert for |needs|, ranked by RankModes.
+    void SetModeNeeds(const ModeNeeds& needs);
     HRESULT SetDevice(IMFActivate* act, std::function<void(SIZE)> get_size);
+
+    // Devices in the cache at |path| (UTF-8) are opened in the mode they
+    // were cached with, without listing their modes first; the modes are
+    // listed on a thread of their own meanwhile and checked against the
+    // cache. If they changed, |changed| is called there, and the window
+    // thread is to call RefreshModes.
+    void LoadCapabilityCache(const std::string& path);
+    void SetModesChanged(std::function<void()> changed);
+
+    // Window thread. Takes the modes from the cache; false if the mode in
+    // use is not among them any more, and the device is to be opened
+    // again.
+    bool RefreshModes();
+
+    // Window thread. The modes of the device that can be shown as they
+    // are, in the order it lists them, and the one in use.
+    const std::vector<CaptureFormat>& Modes() const;
+    CaptureFormat CurrentMode() const;
+
+    // Pins |mode| for the device, or with nullptr goes back to picking
+    // one; takes effect when the device is opened again.
+    void PinMode(const CaptureFormat* mode);
+    bool PinnedMode(CaptureFormat* mode) const;
+
+    // Shows the frames of |source| in place of a camera.
+    HRESULT SetSource(std::unique_ptr<CaptureSource> source,
+        std::function<void(SIZE)> get_size);
     void CloseDevice();
+
+    // Writes the native frames of the stream to |path| (UTF-8) until
+    // stopped or the device is closed.
+    bool StartRecording(const std::string& path);
+    void StopRecording();
+    bool IsRecording() const;
+
+    // Keeps the last kReplaySeconds of native frames in memory, within
+    // kReplayBudget bytes, across device changes, so that they can be
+    // saved after the fact as a recording. The dump runs on a thread of
+    // the ring; |done| is called there.
+    static const int kReplaySeconds = 30;
+    static const uint64_t kReplayBudget = 512ull << 20;
+    void EnableReplayRing(bool enable);
+    bool IsReplayRingOn() const;
+    bool DumpReplayRing(const std::string& path, std::function<void(bool ok)> done);
+
     bool IsDeviceLost(PDEV_BROADCAST_HDR hdr);
 
     HRESULT RequestNextFrame();
@@ -39,11 +94,31 @@ public:
 private:
     HRESULT GetSymbolicLink(IMFActivate* act);
     HRESULT TryMediaType(IMFMediaType* type);
+    HRESULT SetCachedMode(const CaptureFormat& mode);
     HRESULT CheckSupportedMediaType();
+    void StartValidation();
+    void SaveCache();
+    void LogFirstFrame();
 
     LayeredWindow* layered_win_ = nullptr;
     std::mutex mtx_;
     DrawDevice draw_;
     IMFSourceReader* reader_ = NULL;
+    std::unique_ptr<CaptureSource> source_;
+    std::unique_ptr<FrameRecorder> recorder_;
+    std::unique_ptr<ReplayRing> ring_;
     std::wstring symbolic_link_;
+    ModeNeeds mode_needs_ = { 1920, 1080, 1.0 };
+    std::vector<CaptureFormat> modes_;
+    CaptureFormat mode_ = {};
+
+    CapabilityCache cache_;
+    std::string cache_path_;
+    std::thread validator_;
+    std::function<void()> modes_changed_;
+
+    // Time to first frame, from the start of SetDevice.
+    uint64_t open_begin_ = 0;
+    bool mode_cached_ = false;
+    bool first_frame_pending_ = false;
 };
\ No newline at end of file
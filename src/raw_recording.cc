@@ -0,0 +1,498 @@
+#include "raw_recording.h"
+#include <chrono>
+#include <string.h>
+#include "file_util.h"
+#include "image_transform.h"
+
+#if defined(_WIN32)
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+static const char kFileMagic[8] = { 'W', 'C', 'A', 'M', 'R', 'A', 'W', 0 };
+static const uint32_t kFileVersion = 1;
+static const uint32_t kRecordMagic = 0x454d5246;  // "FRME"
+static const uint32_t kIndexMagic = 0x58444e49;   // "INDX"
+static const uint64_t kAlign = 64;
+
+struct FileHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t header_bytes;
+    uint32_t fourcc;
+    uint32_t width;
+    uint32_t height;
+    uint32_t fps_num;
+    uint32_t fps_den;
+    uint8_t subtype[16];
+    uint8_t reserved[12];
+};
+
+struct RecordHeader {
+    uint32_t magic;
+    uint32_t flags;
+    int64_t timestamp;
+    int32_t stride;
+    uint32_t data_offset;  // of scan line 0 in the frame bytes
+    uint64_t bytes;
+    uint8_t reserved[32];
+};
+
+// Follows the index, one file offset per record.
+struct IndexTrailer {
+    uint32_t magic;
+    uint32_t reserved0;
+    uint64_t frame_num;
+    uint64_t index_offset;
+    uint64_t reserved1;
+};
+
+static_assert(sizeof(FileHeader) == kAlign, "file header size");
+static_assert(sizeof(RecordHeader) == kAlign, "record header size");
+static_assert(sizeof(IndexTrailer) == 32, "index trailer size");
+
+static uint64_t AlignUp(uint64_t n)
+{
+    return (n + kAlign - 1) & ~(kAlign - 1);
+}
+
+// Maps all of |path| read-only; the mapping outlives the handles.
+static const uint8_t* MapFile(const std::string& path, size_t* size)
+{
+#if defined(_WIN32)
+    HANDLE file = CreateFileW(WidePath(path).c_str(), GENERIC_READ,
+        FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE)
+        return nullptr;
+
+    LARGE_INTEGER file_size = {};
+    void* view = nullptr;
+    if (GetFileSizeEx(file, &file_size) && file_size.QuadPart > 0
+        && (uint64_t)file_size.QuadPart <= SIZE_MAX) {
+        HANDLE mapping = CreateFileMappingW(file, NULL, PAGE_READONLY, 0, 0, NULL);
+        if (mapping) {
+            view = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+            CloseHandle(mapping);
+        }
+    }
+
+    CloseHandle(file);
+    *size = (size_t)file_size.QuadPart;
+    return (const uint8_t*)view;
+#else
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+        return nullptr;
+
+    struct stat st;
+    void* view = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && st.st_size > 0 && (uint64_t)st.st_size <= SIZE_MAX) {
+        view = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (view != MAP_FAILED)
+            madvise(view, (size_t)st.st_size, MADV_SEQUENTIAL);
+    }
+
+    close(fd);
+    if (view == MAP_FAILED)
+        return nullptr;
+
+    *size = (size_t)st.st_size;
+    return (const uint8_t*)view;
+#endif
+}
+
+static void UnmapFile(const uint8_t* data, size_t size)
+{
+#if defined(_WIN32)
+    (void)size;
+    UnmapViewOfFile(data);
+#else
+    munmap((void*)data, size);
+#endif
+}
+
+// Whether the frame of |rec| is laid out as the writer lays out a frame of
+// |format|: uncompressed frames must hold all their rows, with scan line 0
+// at the start or, bottom-up, |stride| before the end; other formats have
+// no stride.
+static bool FrameFits(const RecordHeader& rec, const CaptureFormat& format)
+{
+    const ImageTransformEntry* entry = FindImageTransform(format.fourcc);
+    if (!entry)
+        return rec.stride == 0 && rec.data_offset == 0;
+
+    const uint64_t row = (uint64_t)(rec.stride < 0 ? -(int64_t)rec.stride : rec.stride);
+    return row <= rec.bytes && rec.bytes <= SIZE_MAX
+        && rec.data_offset == (rec.stride < 0 ? rec.bytes - row : 0)
+        && SourceImageFits(*entry, rec.stride, (size_t)rec.bytes, format.width, format.height);
+}
+
+// The header of the record at |offset|, if the record is whole and holds
+// a frame of |format|.
+static bool ReadRecord(const uint8_t* data, uint64_t size, uint64_t offset,
+    const CaptureFormat& format, RecordHeader* rec)
+{
+    if (offset < sizeof(FileHeader) || offset % kAlign || offset + kAlign > size)
+        return false;
+
+    memcpy(rec, data + offset, sizeof(*rec));
+    const uint64_t room = size - offset - kAlign;
+    return rec->magic == kRecordMagic && rec->bytes <= room
+        && AlignUp(rec->bytes) <= room && FrameFits(*rec, format);
+}
+
+FrameRecorder::~FrameRecorder()
+{
+    Close();
+}
+
+bool FrameRecorder::Open(const std::string& path, const RecordingInfo& info)
+{
+    if (file_)
+        return false;
+
+    file_ = CreateFileForWrite(path);
+    if (!file_)
+        return false;
+
+    FileHeader header = {};
+    memcpy(header.magic, kFileMagic, sizeof(header.magic));
+    header.version = kFileVersion;
+    header.header_bytes = sizeof(header);
+    header.fourcc = info.format.fourcc;
+    header.width = info.format.width;
+    header.height = info.format.height;
+    header.fps_num = info.format.fps_num;
+    header.fps_den = info.format.fps_den;
+    memcpy(header.subtype, info.subtype, sizeof(header.subtype));
+
+    if (fwrite(&header, sizeof(header), 1, file_) != 1) {
+        fclose(file_);
+        file_ = nullptr;
+        return false;
+    }
+
+    file_size_ = sizeof(header);
+    index_.clear();
+    closing_ = false;
+    failed_ = false;
+    written_ = 0;
+    dropped_ = 0;
+    thread_ = std::thread(&FrameRecorder::WriterMain, this);
+    return true;
+}
+
+bool FrameRecorder::Close()
+{
+    if (!file_)
+        return false;
+
+    {
+        std::unique_lock<std::mutex> lock(mtx_);
+        closing_ = true;
+    }
+
+    cv_.notify_one();
+    thread_.join();
+
+    bool ok = !failed_;
+    if (ok) {
+        IndexTrailer trailer = {};
+        trailer.magic = kIndexMagic;
+        trailer.frame_num = index_.size();
+        trailer.index_offset = file_size_;
+        ok = fwrite(index_.data(), sizeof(uint64_t), index_.size(), file_) == index_.size()
+            && fwrite(&trailer, sizeof(trailer), 1, file_) == 1;
+    }
+
+    ok = (fclose(file_) == 0) && ok;
+    file_ = nullptr;
+    queue_.clear();
+    spare_.clear();
+    index_.clear();
+    return ok;
+}
+
+bool FrameRecorder::Write(const RawFrame& frame)
+{
+    if (!file_ || failed_)
+        return false;
+
+    // Bottom-up frames start |size| - |stride| bytes before scan line 0.
+    const size_t before = frame.stride < 0 ? frame.size - (size_t)-(int64_t)frame.stride : 0;
+    if (before > frame.size)
+        return false;
+
+    Pending pending;
+    {
+        std::unique_lock<std::mutex> lock(mtx_);
+        if (queue_.size() >= kMaxQueued) {
+            ++dropped_;
+            return false;
+        }
+
+        if (!spare_.empty()) {
+            pending.bytes.swap(spare_.back());
+            spare_.pop_back();
+        }
+    }
+
+    pending.timestamp = frame.timestamp;
+    pending.flags = frame.flags;
+    pending.stride = frame.stride;
+    pending.data_offset = (uint32_t)before;
+    pending.bytes.assign(frame.data - before, frame.data - before + frame.size);
+
+    {
+        std::unique_lock<std::mutex> lock(mtx_);
+        queue_.push_back(std::move(pending));
+    }
+
+    cv_.notify_one();
+    return true;
+}
+
+void FrameRecorder::WriterMain()
+{
+    for (;;) {
+        Pending pending;
+        {
+            std::unique_lock<std::mutex> lock(mtx_);
+            cv_.wait(lock, [this]() { return closing_ || !queue_.empty(); });
+            if (queue_.empty())
+                return;
+
+            pending = std::move(queue_.front());
+            queue_.pop_front();
+        }
+
+        if (!failed_) {
+            if (WriteRecord(pending))
+                ++written_;
+            else
+                failed_ = true;
+        }
+
+        std::unique_lock<std::mutex> lock(mtx_);
+        spare_.push_back(std::move(pending.bytes));
+    }
+}
+
+bool FrameRecorder::WriteRecord(const Pending& frame)
+{
+    static const uint8_t zeros[kAlign] = {};
+
+    RecordHeader rec = {};
+    rec.magic = kRecordMagic;
+    rec.flags = frame.flags;
+    rec.timestamp = frame.timestamp;
+    rec.stride = frame.stride;
+    rec.data_offset = frame.data_offset;
+    rec.bytes = frame.bytes.size();
+
+    const size_t pad = (size_t)(AlignUp(rec.bytes) - rec.bytes);
+    if (fwrite(&rec, sizeof(rec), 1, file_) != 1
+        || fwrite(frame.bytes.data(), 1, frame.bytes.size(), file_) != frame.bytes.size()
+        || fwrite(zeros, 1, pad, file_) != pad)
+        return false;
+
+    index_.push_back(file_size_);
+    file_size_ += sizeof(rec) + AlignUp(rec.bytes);
+    return true;
+}
+
+RecordingReader::~RecordingReader()
+{
+    Close();
+}
+
+bool RecordingReader::Open(const std::string& path)
+{
+    Close();
+
+    size_t size = 0;
+    data_ = MapFile(path, &size);
+    if (!data_)
+        return false;
+
+    size_ = size;
+    FileHeader header = {};
+    if (size_ >= sizeof(header))
+        memcpy(&header, data_, sizeof(header));
+
+    if (size_ < sizeof(header) || memcmp(header.magic, kFileMagic, sizeof(header.magic))
+        || header.version != kFileVersion || header.header_bytes != sizeof(header)) {
+        Close();
+        return false;
+    }
+
+    info_.format.fourcc = header.fourcc;
+    info_.format.width = header.width;
+    info_.format.height = header.height;
+    info_.format.fps_num = header.fps_num;
+    info_.format.fps_den = header.fps_den;
+    memcpy(info_.subtype, header.subtype, sizeof(info_.subtype));
+
+    recovered_ = !ReadIndex();
+    if (recovered_)
+        ScanRecords();
+
+    return true;
+}
+
+void RecordingReader::Close()
+{
+    if (data_)
+        UnmapFile(data_, size_);
+
+    data_ = nullptr;
+    size_ = 0;
+    info_ = RecordingInfo();
+    index_.clear();
+    recovered_ = false;
+}
+
+bool RecordingReader::ReadIndex()
+{
+    IndexTrailer trailer = {};
+    if (size_ < sizeof(FileHeader) + sizeof(trailer))
+        return false;
+
+    memcpy(&trailer, data_ + size_ - sizeof(trailer), sizeof(trailer));
+    const uint64_t index_end = size_ - sizeof(trailer);
+    if (trailer.magic != kIndexMagic || trailer.index_offset > index_end
+        || trailer.frame_num != (index_end - trailer.index_offset) / sizeof(uint64_t)
+        || (index_end - trailer.index_offset) % sizeof(uint64_t))
+        return false;
+
+    index_.resize((size_t)trailer.frame_num);
+    if (!index_.empty())
+        memcpy(index_.data(), data_ + trailer.index_offset, index_.size() * sizeof(uint64_t));
+
+    for (uint64_t offset : index_) {
+        RecordHeader rec;
+        if (!ReadRecord(data_, trailer.index_offset, offset, info_.format, &rec)) {
+            index_.clear();
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// Records up to the first one that is cut off, which is where a writer
+// stopped, or damaged.
+void RecordingReader::ScanRecords()
+{
+    uint64_t offset = sizeof(FileHeader);
+    RecordHeader rec;
+    while (ReadRecord(data_, size_, offset, info_.format, &rec)) {
+        index_.push_back(offset);
+        offset += sizeof(rec) + AlignUp(rec.bytes);
+    }
+}
+
+RawFrame RecordingReader::Frame(size_t n) const
+{
+    RecordHeader rec;
+    memcpy(&rec, data_ + index_[n], sizeof(rec));
+
+    RawFrame frame = {};
+    frame.format = info_.format;
+    frame.data = data_ + index_[n] + sizeof(rec) + rec.data_offset;
+    frame.stride = rec.stride;
+    frame.size = (size_t)rec.bytes;
+    frame.timestamp = rec.timestamp;
+    frame.flags = rec.flags;
+    return frame;
+}
+
+ReplaySource::ReplaySource(bool paced, bool loop)
+    : paced_(paced), loop_(loop)
+{
+}
+
+ReplaySource::~ReplaySource()
+{
+    Stop();
+}
+
+bool ReplaySource::Open(const std::string& path)
+{
+    Stop();
+    return reader_.Open(path);
+}
+
+CaptureFormat ReplaySource::Format() const
+{
+    return reader_.Info().format;
+}
+
+bool ReplaySource::Start(const RawFrameCallback& callback)
+{
+    if (!reader_.FrameNum() || running_.exchange(true))
+        return false;
+
+    thread_ = std::thread(&ReplaySource::SourceMain, this, callback);
+    return true;
+}
+
+void ReplaySource::Stop()
+{
+    running_ = false;
+    if (thread_.joinable())
+        thread_.join();
+}
+
+void ReplaySource::SourceMain(RawFrameCallback callback)
+{
+    using namespace std::chrono;
+    typedef duration<int64_t, std::ratio<1, 10000000>> Ticks;
+
+    // Gaps of more than a second are cut short, so that Stop never waits
+    // long.
+    const int64_t kMaxGap = 10000000;
+
+    const size_t num = reader_.FrameNum();
+    const CaptureFormat& format = reader_.Info().format;
+    const int64_t first = reader_.Frame(0).timestamp;
+    const int64_t last = reader_.Frame(num - 1).timestamp;
+
+    // Passes after the first continue the timestamps one frame on.
+    int64_t period = 0;
+    if (format.fps_num && format.fps_den)
+        period = (int64_t)10000000 * format.fps_den / format.fps_num;
+    else if (num > 1 && last > first)
+        period = (last - first) / (int64_t)(num - 1);
+
+    const auto start = steady_clock::now();
+    int64_t due = 0;
+    int64_t prev = first;
+    int64_t pass_offset = 0;
+
+    for (size_t n = 0; running_; ) {
+        RawFrame frame = reader_.Frame(n);
+        frame.timestamp += pass_offset;
+
+        if (paced_) {
+            int64_t gap = frame.timestamp - prev;
+            due += gap < 0 ? 0 : (gap > kMaxGap ? kMaxGap : gap);
+            std::this_thread::sleep_until(start + duration_cast<steady_clock::duration>(Ticks(due)));
+        }
+
+        prev = frame.timestamp;
+        callback(frame);
+
+        if (++n == num) {
+            if (!loop_)
+                break;
+
+            n = 0;
+            pass_offset = prev + period - first;
+        }
+    }
+}
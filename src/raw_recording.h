@@ -0,0 +1,134 @@
+#pragma once
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <stdint.h>
+#include <stdio.h>
+#include <string>
+#include <thread>
+#include <vector>
+#include "capture_source.h"
+
+// Recordings of the native buffers of a stream, byte for byte with their
+// stride, timestamp and flags, to play a session back through everything
+// past the camera.
+//
+// A file is a 64-byte header, one record per frame and, once the writer
+// closed it, an index of the records and a trailer. A record is a 64-byte
+// header and the frame padded to 64 bytes, so that frames stay aligned in
+// a mapping. Records are only appended; readers of a file without index
+// rebuild it from the records.
+struct RecordingInfo {
+    CaptureFormat format;
+    uint8_t subtype[16];  // media subtype GUID, as laid out in memory
+};
+
+// Copies frames on the calling thread and writes them on its own.
+class FrameRecorder
+{
+public:
+    // Frames copied but not written yet; more are dropped.
+    static const size_t kMaxQueued = 8;
+
+    ~FrameRecorder();
+
+    // |path| is UTF-8.
+    bool Open(const std::string& path, const RecordingInfo& info);
+
+    // Writes what is queued and the index. False if anything failed.
+    bool Close();
+
+    // False if the frame was dropped or the file cannot be written.
+    bool Write(const RawFrame& frame);
+
+    uint64_t Written() const { return written_; }
+    uint64_t Dropped() const { return dropped_; }
+
+private:
+    struct Pending {
+        int64_t timestamp;
+        uint32_t flags;
+        int32_t stride;
+        uint32_t data_offset;  // of scan line 0 in |bytes|
+        std::vector<uint8_t> bytes;
+    };
+
+    void WriterMain();
+    bool WriteRecord(const Pending& frame);
+
+    FILE* file_ = nullptr;
+    uint64_t file_size_ = 0;
+    std::vector<uint64_t> index_;
+
+    std::thread thread_;
+    std::mutex mtx_;
+    std::condition_variable cv_;
+    std::deque<Pending> queue_;
+    std::vector<std::vector<uint8_t>> spare_;
+    bool closing_ = false;
+    std::atomic<bool> failed_{ false };
+    std::atomic<uint64_t> written_{ 0 };
+    std::atomic<uint64_t> dropped_{ 0 };
+};
+
+// A recording mapped into memory. Frames point into the mapping, so
+// nothing is copied to read them. A record whose stride and size cannot
+// hold a frame of the header's format ends the recording, as one that is
+// cut off does.
+class RecordingReader
+{
+public:
+    ~RecordingReader();
+
+    // |path| is UTF-8.
+    bool Open(const std::string& path);
+    void Close();
+
+    const RecordingInfo& Info() const { return info_; }
+    size_t FrameNum() const { return index_.size(); }
+
+    // Valid until Close.
+    RawFrame Frame(size_t n) const;
+
+    // The writer did not finish, and the index was rebuilt.
+    bool Recovered() const { return recovered_; }
+
+private:
+    bool ReadIndex();
+    void ScanRecords();
+
+    const uint8_t* data_ = nullptr;
+    size_t size_ = 0;
+    RecordingInfo info_ = {};
+    std::vector<uint64_t> index_;
+    bool recovered_ = false;
+};
+
+// Plays a recording back at its original cadence, or as fast as frames
+// are taken if not paced, once or over and over.
+class ReplaySource : public CaptureSource
+{
+public:
+    explicit ReplaySource(bool paced = true, bool loop = false);
+    ~ReplaySource();
+
+    bool Open(const std::string& path);
+    const RecordingReader& Reader() const { return reader_; }
+
+    CaptureFormat Format() const override;
+    bool Start(const RawFrameCallback& callback) override;
+    void Stop() override;
+
+private:
+    ReplaySource(const ReplaySource&) = delete;
+    ReplaySource& operator=(const ReplaySource&) = delete;
+
+    void SourceMain(RawFrameCallback callback);
+
+    RecordingReader reader_;
+    bool paced_;
+    bool loop_;
+    std::thread thread_;
+    std::atomic<bool> running_{ false };
+};
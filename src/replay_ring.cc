@@ -0,0 +1,413 @@
+#include "replay_ring.h"
+#include <string.h>
+#include "frame_stats.h"
+#include "frame_trace.h"
+
+enum DeltaTag {
+    DELTA_ZERO,
+    DELTA_NIBBLES,
+    DELTA_RAW,
+};
+
+static const size_t kDeltaGroup = 16;
+
+// Buffers kept for reuse beyond the frames, so that a running ring
+// allocates little.
+static const size_t kMaxSpare = 4;
+
+size_t DeltaEncodeBound(size_t size)
+{
+    return size + (size + kDeltaGroup - 1) / kDeltaGroup;
+}
+
+size_t DeltaEncode(const uint8_t* cur, const uint8_t* ref, size_t size, uint8_t* out)
+{
+    uint8_t* o = out;
+    for (size_t i = 0; i < size; i += kDeltaGroup) {
+        const size_t n = size - i < kDeltaGroup ? size - i : kDeltaGroup;
+
+        // Deltas biased by 8, so that -8..7 are the values below 16.
+        uint8_t d[kDeltaGroup] = {};
+        uint8_t any = 0;
+        uint8_t high = 0;
+        for (size_t k = 0; k < n; ++k) {
+            const uint8_t delta = (uint8_t)(cur[i + k] - ref[i + k]);
+            d[k] = (uint8_t)(delta + 8);
+            any |= delta;
+            high |= d[k] & 0xF0;
+        }
+
+        if (!any) {
+            *o++ = DELTA_ZERO;
+        } else if (!high) {
+            *o++ = DELTA_NIBBLES;
+            for (size_t k = 0; k < n; k += 2)
+                *o++ = (uint8_t)(d[k] | (k + 1 < n ? d[k + 1] : 8) << 4);
+        } else {
+            *o++ = DELTA_RAW;
+            memcpy(o, cur + i, n);
+            o += n;
+        }
+    }
+
+    return o - out;
+}
+
+bool DeltaDecode(const uint8_t* in, size_t in_size, const uint8_t* ref, size_t size, uint8_t* out)
+{
+    const uint8_t* end = in + in_size;
+    for (size_t i = 0; i < size; i += kDeltaGroup) {
+        const size_t n = size - i < kDeltaGroup ? size - i : kDeltaGroup;
+        if (in == end)
+            return false;
+
+        switch (*in++) {
+        case DELTA_ZERO:
+            memcpy(out + i, ref + i, n);
+            break;
+        case DELTA_NIBBLES:
+            if ((size_t)(end - in) < (n + 1) / 2)
+                return false;
+
+            for (size_t k = 0; k < n; ++k) {
+                const int nibble = (in[k / 2] >> (k & 1 ? 4 : 0)) & 0xF;
+                out[i + k] = (uint8_t)(ref[i + k] + nibble - 8);
+            }
+
+            in += (n + 1) / 2;
+            break;
+        case DELTA_RAW:
+            if ((size_t)(end - in) < n)
+                return false;
+
+            memcpy(out + i, in, n);
+            in += n;
+            break;
+        default:
+            return false;
+        }
+    }
+
+    return in == end;
+}
+
+ReplayRing::ReplayRing(double seconds, uint64_t byte_budget)
+    : duration_((int64_t)(seconds * 1e7))
+    , byte_budget_(byte_budget)
+{
+    coder_ = std::thread(&ReplayRing::CoderMain, this);
+}
+
+ReplayRing::~ReplayRing()
+{
+    {
+        std::unique_lock<std::mutex> lock(mtx_);
+        quit_ = true;
+    }
+
+    cv_.notify_one();
+    coder_.join();
+    if (dump_.joinable())
+        dump_.join();
+
+    std::unique_lock<std::mutex> lock(mtx_);
+    ClearEntries();
+}
+
+void ReplayRing::SetStats(FrameStats* stats)
+{
+    stats_ = stats;
+}
+
+void ReplayRing::Push(const RecordingInfo& info, const RawFrame& frame)
+{
+    const uint64_t begin = StatsClockNs();
+    TRACE_SCOPE_ID("RingPush", frame.timestamp);
+
+    // Bottom-up frames start |size| - |stride| bytes before scan line 0.
+    const size_t before = frame.stride < 0 ? frame.size - (size_t)-(int64_t)frame.stride : 0;
+    if (before > frame.size || !frame.size)
+        return;
+
+    Buffer buffer;
+    {
+        std::unique_lock<std::mutex> lock(mtx_);
+        buffer = TakeBuffer();
+    }
+
+    buffer->assign(frame.data - before, frame.data - before + frame.size);
+
+    Entry entry = {};
+    entry.timestamp = frame.timestamp;
+    entry.flags = frame.flags;
+    entry.stride = frame.stride;
+    entry.data_offset = (uint32_t)before;
+    entry.raw_size = frame.size;
+    entry.data = std::move(buffer);
+
+    {
+        std::unique_lock<std::mutex> lock(mtx_);
+        if (memcmp(&info, &info_, sizeof(info)) != 0) {
+            ClearEntries();
+            info_ = info;
+        }
+
+        entry.seq = next_seq_++;
+        bytes_ += frame.size;
+        raw_bytes_ += frame.size;
+        entries_.push_back(std::move(entry));
+        Evict();
+        PublishUsage();
+    }
+
+    cv_.notify_one();
+    if (stats_)
+        stats_->Record(STATS_RING, begin, StatsClockNs());
+}
+
+void ReplayRing::Clear()
+{
+    std::unique_lock<std::mutex> lock(mtx_);
+    ClearEntries();
+}
+
+void ReplayRing::ClearEntries()
+{
+    for (Entry& e : entries_)
+        Recycle(std::move(e.data));
+
+    entries_.clear();
+    bytes_ = 0;
+    raw_bytes_ = 0;
+
+    // No frame after this is coded against one before it.
+    ++next_seq_;
+    PublishUsage();
+}
+
+ReplayRingUsage ReplayRing::Usage() const
+{
+    std::unique_lock<std::mutex> lock(mtx_);
+    ReplayRingUsage usage = {};
+    usage.frames = entries_.size();
+    usage.bytes = bytes_;
+    usage.raw_bytes = raw_bytes_;
+    usage.duration = entries_.empty() ? 0 : entries_.back().timestamp - entries_.front().timestamp;
+    usage.evicted = evicted_;
+    return usage;
+}
+
+bool ReplayRing::Dump(const std::string& path, std::function<void(bool ok)> done)
+{
+    // The frames are shared with the dump, not copied; those evicted while
+    // it runs are freed when it is done.
+    std::vector<Entry> entries;
+    RecordingInfo info;
+    {
+        std::unique_lock<std::mutex> lock(mtx_);
+        if (dumping_ || entries_.empty())
+            return false;
+
+        entries.assign(entries_.begin(), entries_.end());
+        info = info_;
+        dumping_ = true;
+    }
+
+    if (dump_.joinable())
+        dump_.join();
+
+    dump_ = std::thread([this, path, info, entries, done]() {
+        const bool ok = DumpEntries(path, info, entries);
+        {
+            std::unique_lock<std::mutex> lock(mtx_);
+            dumping_ = false;
+        }
+
+        if (done)
+            done(ok);
+    });
+
+    return true;
+}
+
+bool ReplayRing::DumpEntries(const std::string& path, const RecordingInfo& info,
+    const std::vector<Entry>& entries)
+{
+    TRACE_SCOPE("RingDump");
+    FrameRecorder recorder;
+    if (!recorder.Open(path, info))
+        return false;
+
+    std::vector<uint8_t> prev;
+    std::vector<uint8_t> cur;
+    bool ok = true;
+    for (const Entry& e : entries) {
+        if (e.delta) {
+            cur.resize((size_t)e.raw_size);
+            if (prev.size() != e.raw_size
+                || !DeltaDecode(e.data->data(), e.data->size(), prev.data(), cur.size(), cur.data())) {
+                ok = false;
+                break;
+            }
+        } else {
+            cur.assign(e.data->begin(), e.data->end());
+        }
+
+        RawFrame frame = {};
+        frame.format = info.format;
+        frame.data = cur.data() + e.data_offset;
+        frame.stride = e.stride;
+        frame.size = cur.size();
+        frame.timestamp = e.timestamp;
+        frame.flags = e.flags;
+
+        // The recorder drops what it cannot queue; wait for it instead.
+        for (;;) {
+            const uint64_t dropped = recorder.Dropped();
+            if (recorder.Write(frame))
+                break;
+
+            if (recorder.Dropped() == dropped) {
+                ok = false;
+                break;
+            }
+
+            std::this_thread::yield();
+        }
+
+        if (!ok)
+            break;
+
+        prev.swap(cur);
+    }
+
+    return recorder.Close() && ok;
+}
+
+void ReplayRing::CoderMain()
+{
+    Buffer ref;
+    uint64_t ref_seq = UINT64_MAX;
+
+    for (;;) {
+        Entry entry;
+        {
+            std::unique_lock<std::mutex> lock(mtx_);
+
+            // Frames are coded in order, so those left are at the end.
+            size_t first = entries_.size();
+            cv_.wait(lock, [&]() {
+                first = entries_.size();
+                while (first > 0 && !entries_[first - 1].coded)
+                    --first;
+
+                return quit_ || first < entries_.size();
+            });
+
+            if (quit_)
+                break;
+
+            entry = entries_[first];
+        }
+
+        // Compressed frames are kept as they come, and so is every
+        // kKeyInterval-th frame, to bound what is lost with the oldest.
+        Buffer coded;
+        const bool delta = entry.stride != 0 && entry.seq % kKeyInterval != 0
+            && ref && ref_seq == entry.seq - 1 && ref->size() == entry.raw_size;
+        if (delta) {
+            TRACE_SCOPE_ID("RingCode", entry.timestamp);
+            {
+                std::unique_lock<std::mutex> lock(mtx_);
+                coded = TakeBuffer();
+            }
+
+            coded->resize(DeltaEncodeBound(entry.data->size()));
+            coded->resize(DeltaEncode(entry.data->data(), ref->data(), entry.data->size(), coded->data()));
+        }
+
+        std::unique_lock<std::mutex> lock(mtx_);
+        Recycle(std::move(ref));
+        ref = entry.stride != 0 ? entry.data : nullptr;
+        ref_seq = entry.seq;
+
+        // The frame may have gone meanwhile, and so may the one it was
+        // coded against.
+        if (entries_.empty() || entry.seq < entries_.front().seq)
+            continue;
+
+        const size_t index = (size_t)(entry.seq - entries_.front().seq);
+        if (index >= entries_.size())
+            continue;
+
+        Entry& e = entries_[index];
+        e.coded = true;
+        if (delta && index > 0 && coded->size() < e.data->size()) {
+            bytes_ -= e.data->size();
+            bytes_ += coded->size();
+            e.data = std::move(coded);
+            e.delta = true;
+            Evict();
+            PublishUsage();
+        }
+
+        Recycle(std::move(coded));
+    }
+
+    std::unique_lock<std::mutex> lock(mtx_);
+    Recycle(std::move(ref));
+}
+
+// The oldest key frame and those coded against it go together, while the
+// rest still spans the duration or the budget is exceeded. The newest key
+// frame and what follows it always stay.
+void ReplayRing::Evict()
+{
+    while (!entries_.empty()) {
+        size_t group = 1;
+        while (group < entries_.size() && entries_[group].delta)
+            ++group;
+
+        if (group == entries_.size())
+            break;
+
+        const bool too_long = entries_.back().timestamp - entries_[group].timestamp >= duration_;
+        if (bytes_ <= byte_budget_ && !too_long)
+            break;
+
+        for (size_t i = 0; i < group; ++i) {
+            bytes_ -= entries_.front().data->size();
+            raw_bytes_ -= entries_.front().raw_size;
+            Recycle(std::move(entries_.front().data));
+            entries_.pop_front();
+            ++evicted_;
+        }
+    }
+}
+
+void ReplayRing::PublishUsage()
+{
+    if (!stats_)
+        return;
+
+    stats_->Set(GAUGE_RING_FRAMES, entries_.size());
+    stats_->Set(GAUGE_RING_BYTES, bytes_);
+    stats_->Set(GAUGE_RING_RAW_BYTES, raw_bytes_);
+}
+
+ReplayRing::Buffer ReplayRing::TakeBuffer()
+{
+    if (spare_.empty())
+        return std::make_shared<std::vector<uint8_t>>();
+
+    Buffer buffer = std::move(spare_.back());
+    spare_.pop_back();
+    return buffer;
+}
+
+// Buffers a dump or the coder still holds are left to them.
+void ReplayRing::Recycle(Buffer buffer)
+{
+    if (buffer && buffer.use_count() == 1 && spare_.size() < kMaxSpare)
+        spare_.push_back(std::move(buffer));
+}
@@ -0,0 +1,109 @@
+#pragma once
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <thread>
+#include <vector>
+#include "capture_source.h"
+#include "raw_recording.h"
+
+class FrameStats;
+
+// Lossless delta coding of a frame against the one before it, cheap
+// enough to keep up with capture. Every 16 bytes of |cur| - |ref| are led
+// by a tag: all zero, all within -8..7 as nibbles, or the bytes of |cur|
+// as they are. Still scenes shrink to a 16th, sensor noise to about half.
+size_t DeltaEncodeBound(size_t size);
+size_t DeltaEncode(const uint8_t* cur, const uint8_t* ref, size_t size, uint8_t* out);
+bool DeltaDecode(const uint8_t* in, size_t in_size, const uint8_t* ref, size_t size, uint8_t* out);
+
+struct ReplayRingUsage {
+    uint64_t frames;     // kept
+    uint64_t bytes;      // held for them
+    uint64_t raw_bytes;  // they would take uncompressed
+    int64_t duration;    // from the first to the last, 100 ns units
+    uint64_t evicted;
+};
+
+// The last seconds of native frames, kept in memory so that what just
+// happened can be saved after the fact. Push copies a frame and returns;
+// a thread of the ring delta codes the frames after the first of every
+// kKeyInterval against the one before. Compressed frames such as MJPEG
+// are kept as they come. The oldest frames go, a key frame and those
+// coded against it at a time, once the ring spans more than its duration
+// or holds more than its byte budget.
+class ReplayRing
+{
+public:
+    static const uint32_t kKeyInterval = 30;
+
+    ReplayRing(double seconds, uint64_t byte_budget);
+    ~ReplayRing();
+
+    // The cost of Push goes to STATS_RING and the usage to the ring
+    // gauges of |stats|; set before the first frame.
+    void SetStats(FrameStats* stats);
+
+    // Capture thread. Frames of another stream than the ones kept clear
+    // the ring first.
+    void Push(const RecordingInfo& info, const RawFrame& frame);
+    void Clear();
+
+    ReplayRingUsage Usage() const;
+
+    // Writes the frames kept now as a recording at |path| (UTF-8) on a
+    // thread of its own and calls |done| there. False if there is nothing
+    // to write or a dump is still running.
+    bool Dump(const std::string& path, std::function<void(bool ok)> done);
+
+private:
+    ReplayRing(const ReplayRing&) = delete;
+    ReplayRing& operator=(const ReplayRing&) = delete;
+
+    typedef std::shared_ptr<std::vector<uint8_t>> Buffer;
+
+    struct Entry {
+        uint64_t seq;
+        int64_t timestamp;
+        uint32_t flags;
+        int32_t stride;
+        uint32_t data_offset;  // of scan line 0 in the frame bytes
+        uint64_t raw_size;
+        bool delta;            // coded against the entry before
+        bool coded;            // done with by the coder
+        Buffer data;
+    };
+
+    void CoderMain();
+    void ClearEntries();
+    void Evict();
+    void PublishUsage();
+    Buffer TakeBuffer();
+    void Recycle(Buffer buffer);
+    static bool DumpEntries(const std::string& path, const RecordingInfo& info,
+        const std::vector<Entry>& entries);
+
+    const int64_t duration_;
+    const uint64_t byte_budget_;
+    FrameStats* stats_ = nullptr;
+
+    mutable std::mutex mtx_;
+    std::condition_variable cv_;
+    std::deque<Entry> entries_;
+    RecordingInfo info_ = {};
+    uint64_t next_seq_ = 0;
+    uint64_t bytes_ = 0;
+    uint64_t raw_bytes_ = 0;
+    uint64_t evicted_ = 0;
+    std::vector<Buffer> spare_;
+    bool quit_ = false;
+    std::thread coder_;
+
+    std::thread dump_;
+    bool dumping_ = false;
+};
@@ -0,0 +1,126 @@
+#include "snapshot_writer.h"
+#include <ctype.h>
+#include <vector>
+#include "file_util.h"
+#include "frame_trace.h"
+#include "image_encoder.h"
+#include "worker_pool.h"
+
+SnapshotFormat SnapshotFormatOf(const std::string& path)
+{
+    static const char kBmp[] = ".bmp";
+    const size_t n = sizeof(kBmp) - 1;
+    if (path.size() < n)
+        return SNAPSHOT_PNG;
+
+    for (size_t i = 0; i < n; ++i) {
+        if (tolower((unsigned char)path[path.size() - n + i]) != kBmp[i])
+            return SNAPSHOT_PNG;
+    }
+
+    return SNAPSHOT_BMP;
+}
+
+SnapshotWriter::SnapshotWriter(int worker_num)
+    : worker_num_(worker_num)
+{
+}
+
+SnapshotWriter::~SnapshotWriter()
+{
+    {
+        std::unique_lock<std::mutex> lock(mtx_);
+        quit_ = true;
+    }
+
+    cv_.notify_one();
+    if (thread_.joinable())
+        thread_.join();
+}
+
+bool SnapshotWriter::Save(FrameRef frame, const std::string& path, SnapshotFormat format, Done done)
+{
+    if (!frame || frame->Format().fourcc != kFrameFormatBgra || path.empty())
+        return false;
+
+    Job job;
+    job.frame = std::move(frame);
+    job.path = path;
+    job.format = format;
+    job.done = std::move(done);
+
+    {
+        std::unique_lock<std::mutex> lock(mtx_);
+        if (quit_)
+            return false;
+
+        // The thread and its pool start with the first save.
+        if (!thread_.joinable())
+            thread_ = std::thread(&SnapshotWriter::WriterMain, this);
+
+        queue_.push_back(std::move(job));
+    }
+
+    cv_.notify_one();
+    return true;
+}
+
+size_t SnapshotWriter::Pending() const
+{
+    std::unique_lock<std::mutex> lock(mtx_);
+    return queue_.size() + busy_;
+}
+
+void SnapshotWriter::WriterMain()
+{
+    pool_.reset(new WorkerPool(worker_num_));
+
+    for (;;) {
+        Job job;
+        {
+            std::unique_lock<std::mutex> lock(mtx_);
+            cv_.wait(lock, [this]() { return quit_ || !queue_.empty(); });
+            if (queue_.empty())
+                break;
+
+            job = std::move(queue_.front());
+            queue_.pop_front();
+            ++busy_;
+        }
+
+        const bool ok = WriteJob(job);
+        job.frame.Reset();
+        if (job.done)
+            job.done(ok);
+
+        std::unique_lock<std::mutex> lock(mtx_);
+        --busy_;
+    }
+
+    pool_.reset();
+}
+
+bool SnapshotWriter::WriteJob(const Job& job)
+{
+    TRACE_SCOPE_ID("Snapshot", job.frame->Timestamp());
+
+    BgraImage image = {};
+    image.data = job.frame->Data();
+    image.stride = job.frame->Stride();
+    image.width = job.frame->Width();
+    image.height = job.frame->Height();
+
+    std::vector<uint8_t> bytes;
+    const bool encoded = job.format == SNAPSHOT_BMP
+        ? EncodeBmp(image, &bytes)
+        : EncodePng(image, pool_.get(), &bytes);
+    if (!encoded)
+        return false;
+
+    FILE* file = CreateFileForWrite(job.path);
+    if (!file)
+        return false;
+
+    const bool ok = fwrite(bytes.data(), 1, bytes.size(), file) == bytes.size();
+    return (fclose(file) == 0) && ok;
+}
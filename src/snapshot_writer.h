@@ -0,0 +1,66 @@
+#pragma once
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include "frame_pool.h"
+
+class WorkerPool;
+
+enum SnapshotFormat {
+    SNAPSHOT_PNG,
+    SNAPSHOT_BMP,
+};
+
+// PNG unless |path| ends in ".bmp", in any case.
+SnapshotFormat SnapshotFormatOf(const std::string& path);
+
+// Encodes frames and writes them on a thread of its own, so that saving
+// holds up neither capture nor the window. A frame is held by reference
+// until it is written; the pipeline copies it before writing to it again.
+// Encoding runs on a pool of its own, not on the one frames are scaled on.
+class SnapshotWriter
+{
+public:
+    // Called on the writer's thread once the file is written or failed.
+    typedef std::function<void(bool ok)> Done;
+
+    explicit SnapshotWriter(int worker_num = -1);
+
+    // Writes what is queued.
+    ~SnapshotWriter();
+
+    // |frame| must be BGRA, |path| is UTF-8. False if the frame cannot be
+    // saved; |done| is not called then.
+    bool Save(FrameRef frame, const std::string& path, SnapshotFormat format, Done done);
+
+    // Saves queued or being written.
+    size_t Pending() const;
+
+private:
+    SnapshotWriter(const SnapshotWriter&) = delete;
+    SnapshotWriter& operator=(const SnapshotWriter&) = delete;
+
+    struct Job {
+        FrameRef frame;
+        std::string path;
+        SnapshotFormat format;
+        Done done;
+    };
+
+    void WriterMain();
+    bool WriteJob(const Job& job);
+
+    int worker_num_;
+    std::unique_ptr<WorkerPool> pool_;
+
+    std::thread thread_;
+    mutable std::mutex mtx_;
+    std::condition_variable cv_;
+    std::deque<Job> queue_;
+    size_t busy_ = 0;
+    bool quit_ = false;
+};
@@ -0,0 +1,345 @@
+#include "test_pattern.h"
+#include <chrono>
+#include <math.h>
+#include <string.h>
+#include "image_transform.h"
+#include "yuv_format.h"
+
+// D3DFORMAT values of the RGB subtypes, as in GetImageTransforms.
+static const uint32_t kFormatRGB32 = 22;
+static const uint32_t kFormatRGB24 = 20;
+
+typedef void (*PACK_ROW_FN)(uint8_t* frame, int32_t stride, uint32_t height,
+    uint32_t y, uint32_t width, const uint8_t* luma, const uint8_t* cb, const uint8_t* cr);
+
+struct PackEntry {
+    uint32_t fourcc;
+    uint32_t pixel_bytes;  // of a row of plane 0
+    PACK_ROW_FN pack;
+};
+
+static uint8_t* PlaneRow(const SourceImage& planes, int plane, uint32_t row)
+{
+    return (uint8_t*)planes.data[plane] + (intptr_t)row * planes.stride[plane];
+}
+
+// The inverse of what YuvFormat reads, for one luma row and, on rows
+// that start a chroma row, the chroma of it.
+template <class Format>
+static void PackYuvRow(uint8_t* frame, int32_t stride, uint32_t height,
+    uint32_t y, uint32_t width, const uint8_t* luma, const uint8_t* cb, const uint8_t* cr)
+{
+    typedef typename Format::Sample Sample;
+    const int shift = sizeof(Sample) == 1 ? 0 : 8;  // MSB aligned
+    const uint8_t* first = Format::swap_uv ? cr : cb;
+    const uint8_t* second = Format::swap_uv ? cb : cr;
+    const SourceImage planes = MakeSourceImage(Format::layout, frame, stride, height);
+
+    if (Format::layout == PLANE_LAYOUT_PACKED) {
+        uint8_t* row = PlaneRow(planes, 0, y);
+        const int l = Format::luma_offset;
+        for (uint32_t i = 0; i < width / 2; ++i) {
+            row[i * 4 + l] = luma[i * 2];
+            row[i * 4 + 2 + l] = luma[i * 2 + 1];
+            row[i * 4 + 1 - l] = first[i];
+            row[i * 4 + 3 - l] = second[i];
+        }
+
+        return;
+    }
+
+    Sample* row = (Sample*)PlaneRow(planes, 0, y);
+    for (uint32_t x = 0; x < width; ++x)
+        row[x] = (Sample)(luma[x] << shift);
+
+    if (y & 1)
+        return;
+
+    if (Format::layout == PLANE_LAYOUT_NV12) {
+        Sample* c = (Sample*)PlaneRow(planes, 1, y / 2);
+        for (uint32_t i = 0; i < width / 2; ++i) {
+            c[i * 2] = (Sample)(first[i] << shift);
+            c[i * 2 + 1] = (Sample)(second[i] << shift);
+        }
+    } else {
+        // Planar formats keep Cb in plane 1 unless they swap.
+        Sample* c0 = (Sample*)PlaneRow(planes, 1, y / 2);
+        Sample* c1 = (Sample*)PlaneRow(planes, 2, y / 2);
+        for (uint32_t i = 0; i < width / 2; ++i) {
+            c0[i] = (Sample)(first[i] << shift);
+            c1[i] = (Sample)(second[i] << shift);
+        }
+    }
+}
+
+// BT.601 limited range, which the RGB subtypes are taken back with.
+static void PackRgbRow(uint8_t* row, uint32_t pixel_bytes, uint32_t width,
+    const uint8_t* luma, const uint8_t* cb, const uint8_t* cr)
+{
+    for (uint32_t x = 0; x < width; ++x) {
+        const int c = 298 * (luma[x] - 16) + 128;
+        const int u = cb[x / 2] - 128;
+        const int v = cr[x / 2] - 128;
+        const int rgb[3] = {
+            (c + 516 * u) >> 8,
+            (c - 100 * u - 208 * v) >> 8,
+            (c + 409 * v) >> 8,
+        };
+
+        uint8_t* p = row + x * pixel_bytes;
+        for (int i = 0; i < 3; ++i)
+            p[i] = (uint8_t)(rgb[i] < 0 ? 0 : (rgb[i] > 255 ? 255 : rgb[i]));
+
+        if (pixel_bytes == 4)
+            p[3] = 0xFF;
+    }
+}
+
+static void PackRgb32Row(uint8_t* frame, int32_t stride, uint32_t height,
+    uint32_t y, uint32_t width, const uint8_t* luma, const uint8_t* cb, const uint8_t* cr)
+{
+    (void)height;
+    PackRgbRow(frame + (intptr_t)y * stride, 4, width, luma, cb, cr);
+}
+
+static void PackRgb24Row(uint8_t* frame, int32_t stride, uint32_t height,
+    uint32_t y, uint32_t width, const uint8_t* luma, const uint8_t* cb, const uint8_t* cr)
+{
+    (void)height;
+    PackRgbRow(frame + (intptr_t)y * stride, 3, width, luma, cb, cr);
+}
+
+#define PACK_ENTRY(Format) \
+    { Format::fourcc, Format::layout == PLANE_LAYOUT_PACKED ? 2u : (uint32_t)sizeof(Format::Sample), \
+        PackYuvRow<Format> },
+
+static const PackEntry* FindPackEntry(uint32_t fourcc)
+{
+    static const PackEntry entries[] = {
+        { kFormatRGB32, 4, PackRgb32Row },
+        { kFormatRGB24, 3, PackRgb24Row },
+        FOR_EACH_YUV_FORMAT(PACK_ENTRY)
+    };
+
+    for (const PackEntry& e : entries) {
+        if (e.fourcc == fourcc && FindImageTransform(fourcc))
+            return &e;
+    }
+
+    return nullptr;
+}
+
+// sin over 1024 steps, scaled so that 126 + value stays in 16 .. 235.
+static const int8_t* SineTable()
+{
+    static int8_t table[1024];
+    static bool ready = [] {
+        for (int i = 0; i < 1024; ++i)
+            table[i] = (int8_t)floor(109.0 * sin(i * 3.14159265358979 / 512) + 0.5);
+
+        return true;
+    }();
+
+    (void)ready;
+    return table;
+}
+
+static uint64_t XorShift(uint64_t* s)
+{
+    uint64_t x = *s;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    *s = x;
+    return x;
+}
+
+const char* TestPatternName(TestPattern pattern)
+{
+    static const char* const names[TEST_PATTERN_NUM] = {
+        "bars", "zoneplate", "noise", "gradient",
+    };
+
+    return names[pattern];
+}
+
+TestPatternSource::TestPatternSource(TestPattern pattern, const CaptureFormat& format, bool paced)
+    : pattern_(pattern), format_(format), paced_(paced && format.fps_num && format.fps_den)
+{
+    // Chroma is shared by pixel pairs and, in 4:2:0, by row pairs.
+    format_.width &= ~1u;
+    format_.height &= ~1u;
+
+    const PackEntry* entry = FindPackEntry(format_.fourcc);
+    if (!entry || !format_.width || !format_.height)
+        return;
+
+    stride_ = (int32_t)((format_.width * entry->pixel_bytes + 3) & ~3u);
+    buffer_.assign(SourceImageBytes(FindImageTransform(format_.fourcc)->layout,
+        stride_, format_.height), 0);
+    luma_.resize(format_.width);
+    cb_.resize(format_.width / 2);
+    cr_.resize(format_.width / 2);
+
+    frame_.format = format_;
+    frame_.data = buffer_.data();
+    frame_.stride = stride_;
+    frame_.size = buffer_.size();
+}
+
+TestPatternSource::~TestPatternSource()
+{
+    Stop();
+}
+
+bool TestPatternSource::IsSupported(uint32_t fourcc)
+{
+    return FindPackEntry(fourcc) != nullptr;
+}
+
+CaptureFormat TestPatternSource::Format() const
+{
+    return format_;
+}
+
+bool TestPatternSource::Start(const RawFrameCallback& callback)
+{
+    if (buffer_.empty() || running_.exchange(true))
+        return false;
+
+    thread_ = std::thread(&TestPatternSource::SourceMain, this, callback);
+    return true;
+}
+
+void TestPatternSource::Stop()
+{
+    running_ = false;
+    if (thread_.joinable())
+        thread_.join();
+}
+
+void TestPatternSource::SourceMain(RawFrameCallback callback)
+{
+    using namespace std::chrono;
+    const auto start = steady_clock::now();
+
+    for (uint64_t n = 0; running_; ++n) {
+        if (paced_) {
+            const auto due = start + duration_cast<steady_clock::duration>(
+                duration<double>((double)n * format_.fps_den / format_.fps_num));
+            std::this_thread::sleep_until(due);
+        }
+
+        callback(Render(n));
+    }
+}
+
+const RawFrame& TestPatternSource::Render(uint64_t index)
+{
+    if (buffer_.empty())
+        return frame_;
+
+    // Timestamps are on the nominal rate, or the clock without one.
+    if (format_.fps_num && format_.fps_den)
+        frame_.timestamp = (int64_t)(index * 10000000 * format_.fps_den / format_.fps_num);
+    else
+        frame_.timestamp = (int64_t)(std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count() / 100);
+
+    const PACK_ROW_FN pack = FindPackEntry(format_.fourcc)->pack;
+    for (uint32_t y = 0; y < format_.height; ++y) {
+        RenderRow(y, index);
+        pack(buffer_.data(), stride_, format_.height, y, format_.width,
+            luma_.data(), cb_.data(), cr_.data());
+    }
+
+    return frame_;
+}
+
+void TestPatternSource::RenderRow(uint32_t y, uint64_t index)
+{
+    const uint32_t w = format_.width;
+    const uint32_t h = format_.height;
+    uint8_t* luma = luma_.data();
+    uint8_t* cb = cb_.data();
+    uint8_t* cr = cr_.data();
+
+    switch (pattern_) {
+    case TEST_PATTERN_COLOR_BARS: {
+        // White, yellow, cyan, green, magenta, red, blue and black.
+        static const uint8_t bars[8][3] = {
+            { 180, 128, 128 }, { 162, 44, 142 }, { 131, 156, 44 }, { 112, 72, 58 },
+            { 84, 184, 198 }, { 65, 100, 212 }, { 35, 212, 114 }, { 16, 128, 128 },
+        };
+
+        // Every row is the same.
+        if (y)
+            break;
+
+        const uint32_t shift = (uint32_t)(index * 4 % w);
+        for (uint32_t x = 0; x < w; ++x) {
+            const uint8_t* bar = bars[(uint64_t)((x + shift) % w) * 8 / w];
+            luma[x] = bar[0];
+            if (!(x & 1)) {
+                cb[x / 2] = bar[1];
+                cr[x / 2] = bar[2];
+            }
+        }
+
+        break;
+    }
+
+    case TEST_PATTERN_ZONE_PLATE: {
+        // The phase grows with the squared radius, so that the frequency
+        // reaches half the sample rate at the left and right edges.
+        const int8_t* sine = SineTable();
+        const uint64_t scale = ((uint64_t)512 << 16) / w;
+        const int64_t dy = (int64_t)y - h / 2;
+        const uint32_t phase = (uint32_t)(index * 8);
+        for (uint32_t x = 0; x < w; ++x) {
+            const int64_t dx = (int64_t)x - w / 2;
+            const uint64_t r2 = (uint64_t)(dx * dx + dy * dy);
+            luma[x] = (uint8_t)(126 + sine[((uint32_t)((r2 * scale) >> 16) + phase) & 1023]);
+        }
+
+        memset(cb, 128, w / 2);
+        memset(cr, 128, w / 2);
+        break;
+    }
+
+    case TEST_PATTERN_NOISE: {
+        uint64_t s = (index + 1) * 0x9E3779B97F4A7C15ull ^ (y + 1) * 0xD1B54A32D192ED03ull;
+        for (uint32_t x = 0; x < w; x += 2) {
+            const uint64_t r = XorShift(&s);
+            luma[x] = (uint8_t)(16 + ((r & 0xFF) * 220 >> 8));
+            luma[x + 1] = (uint8_t)(16 + ((r >> 8 & 0xFF) * 220 >> 8));
+            cb[x / 2] = (uint8_t)(16 + ((r >> 16 & 0xFF) * 225 >> 8));
+            cr[x / 2] = (uint8_t)(16 + ((r >> 24 & 0xFF) * 225 >> 8));
+        }
+
+        break;
+    }
+
+    default: {
+        // The luma ramp repeats every w + h pixels along the diagonal;
+        // the table holds two periods, so that no index wraps.
+        const uint32_t period = w + h;
+        const uint32_t offset = (uint32_t)(index * 4 % period);
+        if (ramp_.empty()) {
+            ramp_.resize(period * 2);
+            for (uint32_t i = 0; i < period * 2; ++i)
+                ramp_[i] = (uint8_t)(16 + (uint64_t)(i % period) * 219 / period);
+        }
+
+        memcpy(luma, &ramp_[y + offset], w);
+        memset(cr, (uint8_t)(16 + (uint64_t)y * 224 / h), w / 2);
+        if (y)
+            break;
+
+        for (uint32_t i = 0; i < w / 2; ++i)
+            cb[i] = (uint8_t)(16 + (uint64_t)((i * 2 + offset) % w) * 224 / w);
+
+        break;
+    }
+    }
+}
@@ -0,0 +1,59 @@
+#pragma once
+#include <atomic>
+#include <stdint.h>
+#include <thread>
+#include <vector>
+#include "capture_source.h"
+
+enum TestPattern {
+    TEST_PATTERN_COLOR_BARS,  // 75% bars, scrolling sideways
+    TEST_PATTERN_ZONE_PLATE,  // circular zone plate up to Nyquist, phase moving
+    TEST_PATTERN_NOISE,       // new random luma and chroma every frame
+    TEST_PATTERN_GRADIENT,    // diagonal ramps, scrolling
+    TEST_PATTERN_NUM,
+};
+
+const char* TestPatternName(TestPattern pattern);
+
+// Generates moving test patterns in any uncompressed format there is a
+// transform for, at any even size, so that everything past the camera can
+// run without one. Paced sources keep the rate of their format, unpaced
+// ones deliver frames as fast as they are taken.
+class TestPatternSource : public CaptureSource
+{
+public:
+    TestPatternSource(TestPattern pattern, const CaptureFormat& format, bool paced = true);
+    ~TestPatternSource();
+
+    static bool IsSupported(uint32_t fourcc);
+
+    CaptureFormat Format() const override;
+    bool Start(const RawFrameCallback& callback) override;
+    void Stop() override;
+
+    // Frame |index| of the stream, rendered on the calling thread; valid
+    // until the next call. Start and Stop call it on the source thread.
+    const RawFrame& Render(uint64_t index);
+
+private:
+    TestPatternSource(const TestPatternSource&) = delete;
+    TestPatternSource& operator=(const TestPatternSource&) = delete;
+
+    // One row as 8-bit Y for every pixel and Cb, Cr for every pair.
+    void RenderRow(uint32_t y, uint64_t index);
+    void SourceMain(RawFrameCallback callback);
+
+    TestPattern pattern_;
+    CaptureFormat format_;
+    bool paced_;
+    int32_t stride_ = 0;
+    std::vector<uint8_t> buffer_;
+    std::vector<uint8_t> luma_;
+    std::vector<uint8_t> cb_;
+    std::vector<uint8_t> cr_;
+    std::vector<uint8_t> ramp_;
+    RawFrame frame_ = {};
+
+    std::thread thread_;
+    std::atomic<bool> running_{ false };
+};
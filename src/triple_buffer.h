@@ -0,0 +1,46 @@
+#pragma once
+#include <atomic>
+#include <stdint.h>
+
+// Hands the newest of a stream of values from one producer thread to one
+// consumer thread without locks. Each side owns one slot, the third is
+// swapped with it atomically: the producer fills Back() and publishes it,
+// the consumer takes whatever was published last and skips the rest.
+// Neither side ever waits for the other.
+template <class T>
+class TripleBuffer
+{
+public:
+    // Producer side. Publish tells whether it replaced a value the
+    // consumer never saw.
+    T& Back() { return slots_[back_]; }
+    bool Publish()
+    {
+        const uint8_t old = middle_.exchange(back_ | kFresh, std::memory_order_acq_rel);
+        back_ = old & kIndex;
+        return (old & kFresh) != 0;
+    }
+
+    // Consumer side. Update makes the newest published value the front
+    // one, and tells whether there was one it had not seen.
+    bool Update()
+    {
+        if (!(middle_.load(std::memory_order_relaxed) & kFresh))
+            return false;
+
+        const uint8_t old = middle_.exchange(front_, std::memory_order_acq_rel);
+        front_ = old & kIndex;
+        return true;
+    }
+
+    T& Front() { return slots_[front_]; }
+
+private:
+    static const uint8_t kIndex = 3;
+    static const uint8_t kFresh = 4;
+
+    T slots_[3];
+    uint8_t back_ = 0;
+    uint8_t front_ = 1;
+    std::atomic<uint8_t> middle_{ 2 };
+};
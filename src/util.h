@@ -31,19 +31,6 @@ void SafeRelease(T** ppT)
     }
 }
 
-template <class T>
-__forceinline void ReverseMemcpy(T* dst, T* src, int num)
-{
-    T* _src = src;
-    T* _dst = dst + num - 1;
-
-    for (int i = 0; i < num; ++i) {
-        *_dst = *_src;
-        ++_src;
-        --_dst;
-    }
-}
-
 template <class T>
 __forceinline void SafeMulti(T* v, double d)
 {
@@ -80,6 +67,16 @@ inline std::wstring GetDevPropStr(IMFActivate* act, const IID id)
     return value_cp;
 }
 
+inline std::string ToUtf8(const std::wstring& s)
+{
+    int n = WideCharToMultiByte(CP_UTF8, 0, s.c_str(), (int)s.size(), NULL, 0, NULL, NULL);
+    std::string utf8(n, '\0');
+    if (n > 0)
+        WideCharToMultiByte(CP_UTF8, 0, s.c_str(), (int)s.size(), &utf8[0], n, NULL, NULL);
+
+    return utf8;
+}
+
 inline bool Equals(const wchar_t* s1, const wchar_t* s2)
 {
     return 0 == wcscmp(s1, s2);
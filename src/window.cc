@@ -8,22 +8,12 @@
 #include <gdiplus.h>
 #pragma warning(pop)
 
+#include <iomanip>
 #include <sstream>
+#include <thread>
+#include "frame_trace.h"
 #include "util.h"
-
-__forceinline void LayeredWindowCastPixel(RGBQUAD* p, BYTE a)
-{
-    if (!a) {
-        ZeroMemory(p, sizeof(RGBQUAD));
-        return;
-    }
-
-    const double ratio = ((double)a / 255);
-    p->rgbReserved = a;
-    SafeMulti(&p->rgbRed, ratio);
-    SafeMulti(&p->rgbGreen, ratio);
-    SafeMulti(&p->rgbBlue, ratio);
-}
+#include "yuv_format.h"
 
 void MemoryDC::Create(HWND hwnd, SIZE size)
 {
@@ -33,8 +23,6 @@ void MemoryDC::Create(HWND hwnd, SIZE size)
     HDC hdc = GetDC(hwnd);
     CreateBitmap(hdc);
     ReleaseDC(hwnd, hdc);
-
-    SetStretchBltMode(mem_dc_, COLORONCOLOR);
 }
 
 SIZE MemoryDC::Size()
@@ -62,10 +50,14 @@ const BITMAPINFO* MemoryDC::BmpInfo()
     return &bmp_info_;
 }
 
-void MemoryDC::StretchTo(MemoryDC* dst_dc, SIZE size)
+BgraImage MemoryDC::Image()
 {
-    StretchDIBits(*dst_dc, 0, 0, size.cx, size.cy,
-        0, 0, Size().cx, Size().cy, Data(), BmpInfo(), DIB_RGB_COLORS, SRCCOPY);
+    BgraImage image = {};
+    image.data = (uint8_t*)(Data() + size_.cx * (size_.cy - 1));
+    image.stride = -(int32_t)(size_.cx * sizeof(RGBQUAD));
+    image.width = size_.cx;
+    image.height = size_.cy;
+    return image;
 }
 
 void MemoryDC::Clear()
@@ -74,20 +66,26 @@ void MemoryDC::Clear()
     ZeroMemory(Data(), byte_num);
 }
 
-void MemoryDC::UpdateLayered(double opacity)
+// The top left |size| of the bitmap selected into |dc|.
+static void UpdateLayered(HWND hwnd, HDC dc, SIZE size, double opacity)
 {
-    if (!hwnd_)
-        return;
-
+    TRACE_SCOPE("UpdateLayered");
     BYTE alpha = 0xFF;
     if (opacity != 1.0)
         SafeMulti(&alpha, opacity);
 
     POINT pt_src = { 0, 0 };
     BLENDFUNCTION blend_func = { AC_SRC_OVER, 0, alpha, AC_SRC_ALPHA };
-    SIZE size = Size();
-    ::UpdateLayeredWindow(hwnd_, NULL, NULL, &size,
-        mem_dc_, &pt_src, 0, &blend_func, ULW_ALPHA);
+    ::UpdateLayeredWindow(hwnd, NULL, NULL, &size,
+        dc, &pt_src, 0, &blend_func, ULW_ALPHA);
+}
+
+void MemoryDC::UpdateLayered(double opacity)
+{
+    if (!hwnd_)
+        return;
+
+    ::UpdateLayered(hwnd_, mem_dc_, Size(), opacity);
 }
 
 void MemoryDC::CreateBitmap(HDC hdc)
@@ -110,16 +108,82 @@ void MemoryDC::CreateBitmap(HDC hdc)
     SelectObject(mem_dc_, bitmap_);
 }
 
-void LayeredWindow::Create(HWND hwnd, SIZE size)
+uint8_t* DibAllocator::Allocate(const FrameFormat& format, void** handle)
+{
+    if (format.fourcc != kFrameFormatBgra || format.stride <= 0 || format.stride % 4
+        || !format.height)
+        return nullptr;
+
+    BITMAPINFO info = {};
+    info.bmiHeader.biSize = sizeof(BITMAPINFOHEADER);
+    info.bmiHeader.biWidth = format.stride / 4;
+    info.bmiHeader.biHeight = -(LONG)format.height;  // top-down, as frames are
+    info.bmiHeader.biPlanes = 1;
+    info.bmiHeader.biBitCount = 32;
+    info.bmiHeader.biCompression = BI_RGB;
+
+    void* bits = NULL;
+    HBITMAP bitmap = CreateDIBSection(NULL, &info, DIB_RGB_COLORS, &bits, NULL, 0);
+    if (!bitmap)
+        return nullptr;
+
+    *handle = bitmap;
+    return (uint8_t*)bits;
+}
+
+void DibAllocator::Free(uint8_t* data, void* handle)
+{
+    UNUSED(data);
+    DeleteObject((HBITMAP)handle);
+}
+
+BitmapDC::~BitmapDC()
+{
+    Deselect();
+    if (dc_)
+        DeleteDC(dc_);
+}
+
+HDC BitmapDC::Select(HBITMAP bitmap)
+{
+    Deselect();
+    if (!dc_)
+        dc_ = CreateCompatibleDC(NULL);
+
+    if (!dc_)
+        return NULL;
+
+    old_ = SelectObject(dc_, bitmap);
+    return old_ ? dc_ : NULL;
+}
+
+// A bitmap that is still selected could not be deleted.
+void BitmapDC::Deselect()
 {
-    content_dc_.Create(hwnd, size);
+    if (old_) {
+        SelectObject(dc_, old_);
+        old_ = NULL;
+    }
+}
 
-    SIZE x2_size = { size.cx * 2, size.cy * 2 };
-    scale_x1_dc_.Create(hwnd, size);
-    scale_x2_dc_.Create(hwnd, x2_size);
+const double LayeredWindow::kMinScale = 0.1;
+const double LayeredWindow::kMaxScale = 4.0;
 
-    bmp_buf_.reset(new RGBQUAD[size.cx * size.cy]);
-    bmp_stride_ = size.cx * sizeof(RGBQUAD);
+LayeredWindow::LayeredWindow()
+{
+    // Composing keeps the newest frame, presenting the newest composed
+    // one; the window thread takes the newest of those in turn.
+    frame_pool_.SetAllocator(&dibs_);
+    compose_.SetFrameAllocator(&dibs_);
+    compose_.SetStats(&stats_);
+    pipeline_.AddStage(&compose_);
+    pipeline_.AddStage(this);
+    pipeline_.Start();
+}
+
+LayeredWindow::~LayeredWindow()
+{
+    pipeline_.Stop();
 }
 
 void LayeredWindow::Reset(HWND hwnd, SIZE size)
@@ -127,49 +191,276 @@ void LayeredWindow::Reset(HWND hwnd, SIZE size)
     if (!size.cx || !size.cy)
         return;
 
-    if (size == content_dc_.Size())
+    hwnd_ = hwnd;
+    if (size == frame_size_)
         return;
 
-    content_dc_.Release();
-    scale_x1_dc_.Release();
-    scale_x2_dc_.Release();
-    bmp_buf_.release();
+    frame_size_ = size;
+    UpdateCompose();
+}
 
-    Create(hwnd, size);
+void LayeredWindow::SetWorkerPool(WorkerPool* pool)
+{
+    compose_.SetWorkerPool(pool);
 }
 
-RGBQUAD* LayeredWindow::BmpBuffer()
+TargetImage LayeredWindow::FrameTarget(SIZE size)
 {
-    return bmp_buf_.get();
+    FrameFormat format = {};
+    format.fourcc = kFrameFormatBgra;
+    format.width = size.cx;
+    format.height = size.cy;
+    format.stride = (int32_t)(size.cx * sizeof(RGBQUAD));
+
+    // A frame that was never pushed goes back to the pool here.
+    capture_frame_ = frame_pool_.Acquire(format);
+
+    TargetImage target = {};
+    target.data = capture_frame_->Data();
+    target.stride = capture_frame_->Stride();
+    target.mirror = mirror_mode_;
+    return target;
 }
 
-int LayeredWindow::BmpStride()
+void LayeredWindow::OnNewFrame(int64_t timestamp, uint64_t arrival)
 {
-    return bmp_stride_;
+    TRACE_SCOPE_ID("OnNewFrame", timestamp);
+    capture_frame_->SetTimestamp(timestamp);
+    capture_frame_->SetArrival(arrival);
+    stats_.Count(FRAMES_CAPTURED);
+    if (snapshot_requested_.exchange(false)) {
+        std::unique_lock<std::mutex> lock(snapshot_mtx_);
+        snapshot_ = capture_frame_;
+    }
+
+    pipeline_.Push(std::move(capture_frame_));
 }
 
-void LayeredWindow::OnNewFrame()
+void LayeredWindow::RequestSnapshot()
 {
-    SIZE size = content_dc_.Size();
-    RGBQUAD* src = BmpBuffer();
-    int reverse_offset = size.cx * (size.cy - 1);
-    RGBQUAD* dst = content_dc_.Data() + reverse_offset;
+    snapshot_requested_ = true;
+}
 
-    const bool mirror_mode = mirror_mode_;
-    for (int y = 0; y < size.cy; ++y) {
-        if (mirror_mode)
-            ReverseMemcpy<RGBQUAD>(dst, src, size.cx);
+FrameRef LayeredWindow::TakeSnapshot()
+{
+    snapshot_requested_ = false;
+    std::unique_lock<std::mutex> lock(snapshot_mtx_);
+    FrameRef frame = std::move(snapshot_);
+    return frame;
+}
+
+void LayeredWindow::OnFrameError(HRESULT hr)
+{
+    frame_error_ = hr;
+    PostPresent();
+}
+
+const char* LayeredWindow::Name() const
+{
+    return "present";
+}
+
+bool LayeredWindow::Process(FrameRef* frame)
+{
+    frames_.Back() = std::move(*frame);
+    if (frames_.Publish())
+        stats_.Count(FRAMES_DROPPED);
+
+    PostPresent();
+    return true;
+}
+
+FrameStats* LayeredWindow::Stats()
+{
+    return &stats_;
+}
+
+// Frames the pipeline queues dropped are counted there.
+StatsReport LayeredWindow::Report() const
+{
+    StatsReport report = stats_.Report();
+    for (size_t i = 0; i < pipeline_.StageNum(); ++i)
+        report.frames[FRAMES_DROPPED] += pipeline_.Stats(i).dropped;
+
+    return report;
+}
+
+void LayeredWindow::UpdateCompose()
+{
+    const SIZE display_size = DisplaySize();
+    ComposeSettings settings = {};
+    settings.width = display_size.cx > 0 ? display_size.cx : 0;
+    settings.height = display_size.cy > 0 ? display_size.cy : 0;
+    settings.mask = mask_mode_;
+    settings.shape = MASK_SHAPE_CIRCLE;
+    settings.opacity = 0xFF;
+    SafeMulti(&settings.opacity, opacity_);
+    compose_.SetSettings(settings);
+}
+
+// One message in the queue at a time; Present takes whatever arrived
+// until it runs.
+void LayeredWindow::PostPresent()
+{
+    if (hwnd_ && !present_posted_.exchange(true))
+        PostMessage(hwnd_, kPresentMessage, 0, 0);
+}
+
+void LayeredWindow::Present()
+{
+    present_posted_ = false;
+
+    HRESULT hr = frame_error_.exchange(S_OK);
+    if (FAILED(hr)) {
+        DrawError(hr);
+        return;
+    }
+
+    if (!frames_.Update())
+        return;
+
+    // The window takes the size of the frame, which may still be of the
+    // scale before the last change.
+    const uint64_t begin = StatsClockNs();
+    const FrameRef& frame = frames_.Front();
+    TRACE_SCOPE_ID("Present", frame->Timestamp());
+    SIZE size = { (LONG)frame->Width(), (LONG)frame->Height() };
+    if (!hwnd_ || size.cx < 1 || size.cy < 1)
+        return;
+
+    if (!PresentInPlace(frame))
+        PresentCopy(frame);
+
+    const uint64_t end = StatsClockNs();
+    stats_.Record(STATS_PRESENT, begin, end);
+    if (frame->Arrival())
+        stats_.Record(STATS_LATENCY, frame->Arrival(), end);
+
+    stats_.Count(FRAMES_PRESENTED);
+    ResetWindowPos(size.cx);
+}
+
+// The window is updated from the frame's own DIB section, with the
+// overlay drawn on it; not if a snapshot still holds the frame and the
+// overlay would go into the snapshot.
+bool LayeredWindow::PresentInPlace(const FrameRef& frame)
+{
+    HBITMAP bitmap = (HBITMAP)frame->Handle();
+    if (!bitmap || (stats_overlay_ && !frame.Unique()))
+        return false;
+
+    HDC dc = frame_dc_.Select(bitmap);
+    if (!dc)
+        return false;
+
+    BgraImage image = {};
+    image.data = frame->Data();
+    image.stride = frame->Stride();
+    image.width = frame->Width();
+    image.height = frame->Height();
+    if (stats_overlay_)
+        DrawStatsOverlay(dc, image);
+
+    // The mask pass folds the opacity into the pixels' own alpha.
+    const SIZE size = { (LONG)image.width, (LONG)image.height };
+    ::UpdateLayered(hwnd_, dc, size, mask_mode_ ? 1.0 : opacity_);
+    frame_dc_.Deselect();
+    return true;
+}
+
+void LayeredWindow::PresentCopy(const FrameRef& frame)
+{
+    SIZE size = { (LONG)frame->Width(), (LONG)frame->Height() };
+    MemoryDC* dc = PrepareDisplayDc(size);
+    if (!dc)
+        return;
+
+    BgraImage dst = dc->Image();
+    for (uint32_t y = 0; y < dst.height; ++y) {
+        memcpy(dst.data + (intptr_t)y * dst.stride,
+            frame->Data() + (intptr_t)y * frame->Stride(), dst.width * sizeof(RGBQUAD));
+    }
+
+    if (stats_overlay_)
+        DrawStatsOverlay(*dc, dst);
+
+    dc->UpdateLayered(mask_mode_ ? 1.0 : opacity_);
+}
+
+// The text is redone twice a second, so that it can be read; FPS is over
+// that same period.
+void LayeredWindow::DrawStatsOverlay(HDC hdc, const BgraImage& image)
+{
+    const uint64_t kPeriodNs = 500 * 1000 * 1000;
+    const uint64_t now = StatsClockNs();
+    if (overlay_text_.empty() || now - overlay_time_ >= kPeriodNs) {
+        const StatsReport report = Report();
+        const uint64_t presented = report.frames[FRAMES_PRESENTED];
+
+        std::wstringstream ss;
+        ss << std::fixed << std::setprecision(1);
+        if (overlay_time_)
+            ss << (presented - overlay_presented_) * 1e9 / (now - overlay_time_);
         else
-            memcpy(dst, src, size.cx * sizeof(RGBQUAD));
+            ss << L"-";
+
+        ss << L" fps  " << report.frames[FRAMES_DROPPED] << L" dropped\r\n";
+        ss << std::setprecision(2) << L"ms        p50    p99";
+        for (int i = 0; i < STATS_STAGE_NUM; ++i) {
+            const LatencyHistogram::Snapshot& s = report.stages[i];
+            ss << L"\r\n" << std::left << std::setw(8) << StatsStageName((StatsStage)i)
+                << std::right << std::setw(7) << s.Percentile(50) / 1e6
+                << std::setw(7) << s.Percentile(99) / 1e6;
+        }
+
+        if (report.gauges[GAUGE_FIRST_FRAME_US]) {
+            ss << std::setprecision(1) << L"\r\nfirst frame "
+                << report.gauges[GAUGE_FIRST_FRAME_US] / 1000.0 << L" ms"
+                << (report.gauges[GAUGE_MODE_CACHED] ? L", cached mode" : L"");
+        }
+
+        if (report.gauges[GAUGE_RING_FRAMES]) {
+            ss << std::setprecision(0) << L"\r\nring " << report.gauges[GAUGE_RING_FRAMES]
+                << L" frames, " << report.gauges[GAUGE_RING_BYTES] / 1048576.0 << L" of "
+                << report.gauges[GAUGE_RING_RAW_BYTES] / 1048576.0 << L" MB";
+        }
 
-        src += size.cx;
-        dst -= size.cx;
+        overlay_text_ = ss.str();
+        overlay_time_ = now;
+        overlay_presented_ = presented;
     }
 
-    Update();
+    HGDIOBJ old_font = SelectObject(hdc, GetStockObject(ANSI_FIXED_FONT));
+    RECT text_rect = { 0, 0, 0, 0 };
+    DrawTextW(hdc, overlay_text_.c_str(), -1, &text_rect, DT_CALCRECT | DT_NOPREFIX);
+
+    const SIZE size = { (LONG)image.width, (LONG)image.height };
+    const LONG margin = 4;
+    RECT box = { margin, margin,
+        text_rect.right + 3 * margin, text_rect.bottom + 3 * margin };
+    if (box.right > size.cx)
+        box.right = size.cx;
+
+    if (box.bottom > size.cy)
+        box.bottom = size.cy;
+
+    FillRect(hdc, &box, (HBRUSH)GetStockObject(BLACK_BRUSH));
+    OffsetRect(&text_rect, 2 * margin, 2 * margin);
+    SetBkMode(hdc, TRANSPARENT);
+    SetTextColor(hdc, RGB(255, 255, 255));
+    DrawTextW(hdc, overlay_text_.c_str(), -1, &text_rect, DT_NOPREFIX);
+    SelectObject(hdc, old_font);
+    GdiFlush();
+
+    // GDI leaves the alpha it drew over at zero; the box is opaque.
+    for (LONG y = box.top; y < box.bottom; ++y) {
+        uint8_t* row = image.data + (intptr_t)y * image.stride;
+        for (LONG x = box.left; x < box.right; ++x)
+            row[x * 4 + 3] = 0xFF;
+    }
 }
 
-void LayeredWindow::OnFrameError(HRESULT hr)
+void LayeredWindow::DrawError(HRESULT hr)
 {
     std::wstring msg;
     if (hr == MF_E_HW_MFT_FAILED_START_STREAMING) {
@@ -181,10 +472,14 @@ void LayeredWindow::OnFrameError(HRESULT hr)
         msg = ss.str();
     }
 
+    SIZE size = DisplaySize();
+    MemoryDC* dc = PrepareDisplayDc(size);
+    if (!dc)
+        return;
+
     using namespace Gdiplus;
-    SIZE size = content_dc_.Size();
-    content_dc_.Clear();
-    Graphics graph((HDC)content_dc_);
+    dc->Clear();
+    Graphics graph((HDC)*dc);
 
     LinearGradientBrush bg_brush(Rect(0, 0, size.cx * 2, size.cy),
         Color(255, 0, 212, 255), Color(255, 0, 25, 29),
@@ -195,7 +490,8 @@ void LayeredWindow::OnFrameError(HRESULT hr)
     SolidBrush text_brush(Color(200, 255, 255, 255));
     graph.DrawString(msg.c_str(), -1, &font, PointF(10, 10), &text_brush);
 
-    Update();
+    dc->UpdateLayered(opacity_);
+    ResetWindowPos(size.cx);
 }
 
 bool LayeredWindow::IsMirrorMode() const
@@ -216,6 +512,7 @@ bool LayeredWindow::IsMaskMode() const
 void LayeredWindow::ToggleMaskMode()
 {
     mask_mode_ = !mask_mode_;
+    UpdateCompose();
 }
 
 double LayeredWindow::Scale() const
@@ -225,7 +522,16 @@ double LayeredWindow::Scale() const
 
 void LayeredWindow::SetScale(double v)
 {
-    scale_ = v;
+    scale_ = v < kMinScale ? kMinScale : (v > kMaxScale ? kMaxScale : v);
+    UpdateCompose();
+}
+
+SIZE LayeredWindow::DisplaySize() const
+{
+    SIZE size = frame_size_;
+    SafeMulti(&size.cx, scale_);
+    SafeMulti(&size.cy, scale_);
+    return size;
 }
 
 double LayeredWindow::Opacity() const
@@ -236,6 +542,19 @@ double LayeredWindow::Opacity() const
 void LayeredWindow::SetOpacity(double v)
 {
     opacity_ = v;
+    UpdateCompose();
+}
+
+bool LayeredWindow::IsStatsOverlay() const
+{
+    return stats_overlay_;
+}
+
+void LayeredWindow::ToggleStatsOverlay()
+{
+    stats_overlay_ = !stats_overlay_;
+    overlay_text_.clear();
+    overlay_time_ = 0;
 }
 
 void LayeredWindow::ResetWindowPos()
@@ -250,179 +569,27 @@ void LayeredWindow::ResetWindowPos(int win_width)
 
     reset_win_pos_ = false;
 
-    HWND hwnd = content_dc_.Window();
     RECT rect = {};
-    GetWindowRect(hwnd, &rect);
+    GetWindowRect(hwnd_, &rect);
     const int min_visable_width = 30;
     if (rect.left + win_width < min_visable_width)
-        SetWindowPos(hwnd, NULL, 0, rect.top, NULL, NULL,
+        SetWindowPos(hwnd_, NULL, 0, rect.top, NULL, NULL,
             SWP_NOSIZE | SWP_NOZORDER | SWP_NOACTIVATE);
 }
 
-void LayeredWindow::Update()
+MemoryDC* LayeredWindow::PrepareDisplayDc(SIZE size)
 {
-    SIZE display_size;
-    MemoryDC* dc = SelectDisplayDc(&display_size);
-    if (!dc)
-        return;
-
-    if (mask_mode_)
-        BlendMask(dc, display_size);
-
-    dc->UpdateLayered(opacity_);
-    ResetWindowPos(display_size.cx);
-}
-
-void LayeredWindow::BlendMask(MemoryDC* dc, SIZE display_size)
-{
-    SIZE size = dc->Size();
-    RGBQUAD* dst = dc->Data();
-
-    int reverse_h = size.cy - display_size.cy;
-    BYTE* mask = PrepareMask(display_size);
-    for (int y = 0; y < size.cy; ++y) {
-        if (y >= reverse_h) {
-            for (int x = 0; x < display_size.cx; ++x)
-                LayeredWindowCastPixel(&dst[x], mask[x]);
-
-            mask += display_size.cx;
-        }
-
-        dst += size.cx;
-    }
-}
-
-MemoryDC* LayeredWindow::SelectDisplayDc(SIZE* display_size)
-{
-    *display_size = content_dc_.Size();
-    if (scale_ == 1.0)
-        return &content_dc_;
-
-    MemoryDC* scale_dc = nullptr;
-    double scale = scale_;
-
-    if (scale < 1.0) {
-        scale_dc = &scale_x1_dc_;
-    }
-    else if (scale <= 2.0) {
-        scale_dc = &scale_x2_dc_;
-    }
-    else {
-        DebugBreak();
+    if (!hwnd_ || size.cx < 1 || size.cy < 1)
         return nullptr;
-    }
-
-    if (scale != pre_scale_) {
-        scale_dc->Clear();
-        pre_scale_ = scale;
-    }
-
-    SafeMulti(&display_size->cx, scale);
-    SafeMulti(&display_size->cy, scale);
-    content_dc_.StretchTo(scale_dc, *display_size);
-    return scale_dc;
-}
-
-BYTE* LayeredWindow::PrepareMask(SIZE size)
-{
-    using namespace Gdiplus;
-
-    if (size.cx == mask_size_.cx
-        && size.cy == mask_size_.cy
-        && mask_data_.get())
-        return mask_data_.get();
-
-    mask_size_ = size;
-    INT ox = size.cx / 2;
-    INT oy = size.cy / 2;
-    INT radius = min(ox, oy);
-    INT ellipse_size = radius * 2;
-
-    MemoryDC mask_dc;
-    mask_dc.Create(content_dc_.Window(), size);
-    Graphics graph((HDC)mask_dc);
-    SolidBrush brush(Color(255, 0, 0, 0));
-    graph.SetSmoothingMode(SmoothingMode::SmoothingModeAntiAlias);
-    graph.FillEllipse(&brush, ox - radius, 0, ellipse_size, ellipse_size);
-
-    const int pixel_num = size.cx * size.cy;
-    mask_data_.reset(new BYTE[size.cx * size.cy]);
-    BYTE* data = mask_data_.get();
-    RGBQUAD* dc_data = mask_dc.Data();
-
-    for (int i = 0; i < pixel_num; ++i) {
-        *data = dc_data->rgbReserved;
-        ++data;
-        ++dc_data;
-    }
-
-    return mask_data_.get();
-}
-
-DeviceSelector::DeviceSelector(MainWindow* win)
-{
-    win_ = win;
-}
-
-bool DeviceSelector::List()
-{
-    HRESULT hr = S_OK;
-    hr = MFCreateAttributes(&attr_, 1);
-    if (FAILED(hr)) {
-        attr_ = nullptr;
-        return false;
-    }
-
-    hr = attr_->SetGUID(
-        MF_DEVSOURCE_ATTRIBUTE_SOURCE_TYPE,
-        MF_DEVSOURCE_ATTRIBUTE_SOURCE_TYPE_VIDCAP_GUID);
-
-    if (FAILED(hr))
-        return false;
-
-    hr = MFEnumDeviceSources(attr_, &devices_, &dev_num_);
-    if (FAILED(hr)) {
-        devices_ = nullptr;
-        dev_num_ = 0;
-        return false;
-    }
-
-    return true;
-}
-
-bool DeviceSelector::Select(int dev_id, std::function<void(SIZE)> get_size)
-{
-    IMFActivate* act = devices_[dev_id];
-    if (!act)
-        return false;
-
-    return win_->SelectDevice(act, get_size);
-}
-
-UINT32 DeviceSelector::DevNum() const
-{
-    return dev_num_;
-}
-
-IMFActivate* DeviceSelector::operator[](int n) const
-{
-    return devices_[n];
-}
 
-DeviceSelector::~DeviceSelector()
-{
-    if (devices_) {
-        for (DWORD i = 0; i < dev_num_; i++)
-            devices_[i]->Release();
+    TRACE_SCOPE("PrepareDisplayDc");
 
-        CoTaskMemFree(devices_);
-        devices_ = nullptr;
+    if (!(size == display_dc_.Size())) {
+        display_dc_.Release();
+        display_dc_.Create(hwnd_, size);
     }
 
-    if (attr_) {
-        attr_->Release();
-        attr_ = nullptr;
-    }
+    return &display_dc_;
 }
 
 MemoryDC::~MemoryDC()
@@ -441,6 +608,22 @@ void MemoryDC::Release()
         DeleteObject(bitmap_);
         bitmap_ = NULL;
     }
+
+    size_ = {};
+    raw_data_ = NULL;
+}
+
+// The capability cache goes under %LOCALAPPDATA%; none without it.
+static std::string CapabilityCachePath()
+{
+    WCHAR dir[MAX_PATH] = {};
+    const DWORD n = GetEnvironmentVariableW(L"LOCALAPPDATA", dir, _countof(dir));
+    if (!n || n >= _countof(dir))
+        return std::string();
+
+    std::wstring path = std::wstring(dir) + L"\\" + MainWindow::ProgramName();
+    CreateDirectoryW(path.c_str(), NULL);
+    return ToUtf8(path + L"\\devices.bin");
 }
 
 MainWindow::~MainWindow()
@@ -503,6 +686,8 @@ bool MainWindow::CreateMainWindow(std::wstring* msg)
 
 bool MainWindow::Init(std::wstring* msg)
 {
+    Tracer::SetThreadName("window");
+
     Gdiplus::GdiplusStartupInput gdip_input;
     Gdiplus::GdiplusStartup(&gdip_token_, &gdip_input, NULL);
 
@@ -529,16 +714,22 @@ bool MainWindow::Init(std::wstring* msg)
     if (!previewer_.Init(&layered_win_))
         return false;
 
-    DeviceSelector dev(this);
-    if (!dev.List())
-        return false;
+    HWND hwnd = m_hWnd;
+    previewer_.LoadCapabilityCache(CapabilityCachePath());
+    previewer_.SetModesChanged([hwnd]() {
+        ::PostMessage(hwnd, kModesChangedMessage, 0, 0);
+    });
 
-    if (!dev.DevNum()) {
+    // The first device is opened once listed; later changes are listed
+    // in the background.
+    devices_.Start();
+    const std::vector<DeviceInfo> devices = devices_.WaitDevices();
+    if (devices.empty()) {
         *msg = L"No camera fonud!";
         return false;
     }
 
-    return dev.Select(0, [this](SIZE size) {
+    return SelectDevice(devices[0].link, [this](SIZE size) {
         SetCenterIn(size, CurScreenRect());
     });
 }
@@ -550,6 +741,7 @@ void MainWindow::CleanUp()
 
     previewer_.CloseDevice();
     previewer_.Release();
+    devices_.Stop();
 
     MFShutdown();
     CoUninitialize();
@@ -578,10 +770,10 @@ LRESULT MainWindow::OnNcHitTest(UINT msg, WPARAM wp, LPARAM lp, BOOL& handled) {
 
 LRESULT MainWindow::OnDeviceChange(UINT msg, WPARAM wp, LPARAM lp, BOOL& handled) {
     UNUSED(msg);
-    UNUSED(wp);
     UNUSED(handled);
 
     PDEV_BROADCAST_HDR hdr = (PDEV_BROADCAST_HDR)lp;
+    devices_.OnDeviceChange(wp, hdr);
     if (previewer_.IsDeviceLost(hdr)) {
         previewer_.CloseDevice();
         InfoMsg(L"Lost the capture device.");
@@ -601,6 +793,50 @@ LRESULT MainWindow::OnClose(UINT msg, WPARAM wp, LPARAM lp, BOOL& handled) {
     return 0;
 }
 
+LRESULT MainWindow::OnPresent(UINT msg, WPARAM wp, LPARAM lp, BOOL& handled) {
+    UNUSED(msg);
+    UNUSED(wp);
+    UNUSED(lp);
+    UNUSED(handled);
+
+    layered_win_.Present();
+    return 0;
+}
+
+LRESULT MainWindow::OnSnapshotSaved(UINT msg, WPARAM wp, LPARAM lp, BOOL& handled) {
+    UNUSED(msg);
+    UNUSED(lp);
+    UNUSED(handled);
+
+    if (!wp)
+        ErrorMsg(L"Failed to save the snapshot.");
+
+    return 0;
+}
+
+LRESULT MainWindow::OnReplaySaved(UINT msg, WPARAM wp, LPARAM lp, BOOL& handled) {
+    UNUSED(msg);
+    UNUSED(lp);
+    UNUSED(handled);
+
+    if (!wp)
+        ErrorMsg(L"Failed to save the instant replay.");
+
+    return 0;
+}
+
+LRESULT MainWindow::OnModesChanged(UINT msg, WPARAM wp, LPARAM lp, BOOL& handled) {
+    UNUSED(msg);
+    UNUSED(wp);
+    UNUSED(lp);
+    UNUSED(handled);
+
+    if (!previewer_.RefreshModes() && !ReopenDevice())
+        ErrorMsg(L"Failed to open the device again after its modes changed.");
+
+    return 0;
+}
+
 PCWSTR MainWindow::ProgramName()
 {
     return L"WebcamViewer";
@@ -630,10 +866,29 @@ int MainWindow::Exec(int show_cmd)
     return (int)msg.wParam;
 }
 
-bool MainWindow::SelectDevice(IMFActivate* act, std::function<void(SIZE)> get_size)
+// Frames larger than the screen at the current scale are not shown at
+// full resolution, and converting may take half the CPUs.
+ModeNeeds MainWindow::CurrentModeNeeds()
 {
-    dev_uid_ = GetDevPropStr(act,
-        MF_DEVSOURCE_ATTRIBUTE_SOURCE_TYPE_VIDCAP_SYMBOLIC_LINK);
+    const RECT screen = CurScreenRect();
+    ModeNeeds needs = {};
+    needs.width = (uint32_t)((screen.right - screen.left) / layered_win_.Scale());
+    needs.height = (uint32_t)((screen.bottom - screen.top) / layered_win_.Scale());
+    const double cores = std::thread::hardware_concurrency() / 2.0;
+    needs.cores = cores > 1.0 ? cores : 1.0;
+    return needs;
+}
+
+bool MainWindow::SelectDevice(const std::wstring& link, std::function<void(SIZE)> get_size)
+{
+    IMFActivate* act = NULL;
+    if (FAILED(DeviceRegistry::Activate(link, &act)))
+        return false;
+
+    SCOPE_EXIT([&]() { SafeRelease(&act); });
+    dev_uid_ = link;
+
+    previewer_.SetModeNeeds(CurrentModeNeeds());
 
     HRESULT hr = previewer_.SetDevice(act,
         [this, get_size](SIZE size) {
@@ -649,6 +904,45 @@ bool MainWindow::SelectDevice(IMFActivate* act, std::function<void(SIZE)> get_si
     return true;
 }
 
+// Opens the device in use again, with what is cached for it now.
+bool MainWindow::ReopenDevice()
+{
+    const std::wstring link = dev_uid_;
+    return link.size() && SelectDevice(link, {});
+}
+
+// 720p YUY2 at 30 fps, the mode most webcams default to.
+bool MainWindow::SelectTestPattern(TestPattern pattern)
+{
+    CaptureFormat format = {};
+    format.fourcc = FormatYUY2::fourcc;
+    format.width = 1280;
+    format.height = 720;
+    format.fps_num = 30;
+    format.fps_den = 1;
+
+    dev_uid_.clear();
+    HRESULT hr = previewer_.SetSource(
+        std::unique_ptr<CaptureSource>(new TestPatternSource(pattern, format)),
+        [this](SIZE size) { layered_win_.Reset(m_hWnd, size); });
+
+    return SUCCEEDED(hr);
+}
+
+// Plays the recording over and over at its own pace.
+bool MainWindow::SelectReplay(const std::wstring& path)
+{
+    std::unique_ptr<ReplaySource> source(new ReplaySource(true, true));
+    if (!source->Open(ToUtf8(path)))
+        return false;
+
+    dev_uid_.clear();
+    HRESULT hr = previewer_.SetSource(std::move(source),
+        [this](SIZE size) { layered_win_.Reset(m_hWnd, size); });
+
+    return SUCCEEDED(hr);
+}
+
 void MainWindow::SetCenterIn(SIZE self_size, const RECT& rect)
 {
     LONG x = (rect.right + rect.left - self_size.cx) / 2;
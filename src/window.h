@@ -3,9 +3,19 @@
 #include <atlwin.h>
 #include <atltypes.h>
 
+#include <atomic>
 #include <memory>
+#include <mutex>
 #include <string>
+#include "compose_stage.h"
+#include "device_registry.h"
+#include "frame_pool.h"
+#include "frame_stats.h"
+#include "pipeline.h"
 #include "previewer.h"
+#include "snapshot_writer.h"
+#include "test_pattern.h"
+#include "triple_buffer.h"
 
 class MemoryDC
 {
@@ -18,7 +28,8 @@ public:
     HWND Window();
     operator HDC();
     const BITMAPINFO* BmpInfo();
-    void StretchTo(MemoryDC* dst_dc, SIZE size);
+    // Rows from the top, as shown; the DIB section itself is bottom-up.
+    BgraImage Image();
     void Clear();
     void UpdateLayered(double opacity = 1.0);
 
@@ -33,80 +44,159 @@ private:
     RGBQUAD* raw_data_ = NULL;
 };
 
-class LayeredWindow
+// BGRA frames as top-down DIB sections, so that they are converted and
+// composed straight into memory the window is updated from. The handle
+// is the HBITMAP.
+class DibAllocator : public FrameAllocator
 {
 public:
+    uint8_t* Allocate(const FrameFormat& format, void** handle) override;
+    void Free(uint8_t* data, void* handle) override;
+};
+
+// A memory DC that shows DIB sections made elsewhere, one at a time, and
+// puts them back when done.
+class BitmapDC
+{
+public:
+    ~BitmapDC();
+    HDC Select(HBITMAP bitmap);
+    void Deselect();
+
+private:
+    HDC dc_ = NULL;
+    HGDIOBJ old_ = NULL;
+};
+
+// Frames are converted on the capture thread, composed on a pipeline
+// stage of their own and shown on the window's thread, so that one frame
+// is composed while the next converts. The capture side only fills and
+// pushes a frame; the last stage publishes it and posts kPresentMessage,
+// and Present picks up the newest frame, so a slow stage drops frames
+// instead of holding up capture. Frames are DIB sections, which Present
+// updates the window from as they are.
+class LayeredWindow : private PipelineStage
+{
+public:
+    static const UINT kPresentMessage = WM_APP + 1;
+
+    LayeredWindow();
+    ~LayeredWindow();
+
     void Reset(HWND hwnd, SIZE size);
-    RGBQUAD* BmpBuffer();
-    int BmpStride();
-    void OnNewFrame();
-    void ResetWindowPos();
+    void SetWorkerPool(WorkerPool* pool);
+
+    // Capture thread. |size| is the frame size, or less when the frame
+    // is decoded or converted downscaled; the content is resampled to the
+    // display size.
+    TargetImage FrameTarget(SIZE size);
+    void OnNewFrame(int64_t timestamp, uint64_t arrival);
     void OnFrameError(HRESULT hr);
 
+    // Any thread.
+    FrameStats* Stats();
+    StatsReport Report() const;
+
+    // Window thread.
+    void Present();
+    void ResetWindowPos();
+
     bool IsMirrorMode() const;
     void ToggleMirrorMode();
 
     bool IsMaskMode() const;
     void ToggleMaskMode();
 
+    // Any scale from kMinScale to kMaxScale; frames are resampled in
+    // process, area averaged when shrunk and bilinear when enlarged.
+    static const double kMinScale;
+    static const double kMaxScale;
     double Scale() const;
     void SetScale(double v);
 
+    // The frame size at the current scale.
+    SIZE DisplaySize() const;
+
     double Opacity() const;
     void SetOpacity(double v);
 
-private:
-    void Create(HWND hwnd, SIZE size);
+    // FPS, drops and per-stage latency in a corner of the frame.
+    bool IsStatsOverlay() const;
+    void ToggleStatsOverlay();
 
-    void Update();
-    void ResetWindowPos(int win_width);
-    void BlendMask(MemoryDC* dc, SIZE display_size);
-    MemoryDC* SelectDisplayDc(SIZE* display_size);
-    BYTE* PrepareMask(SIZE size);
+    // Any thread. The next frame captured after the request is kept, as
+    // converted and before it is scaled or masked; taking it hands it
+    // over, or an empty ref if none came yet. Keeping a frame costs
+    // nothing on capture: the compose stage copies it before masking.
+    void RequestSnapshot();
+    FrameRef TakeSnapshot();
 
-    MemoryDC content_dc_;
-    MemoryDC scale_x1_dc_;
-    MemoryDC scale_x2_dc_;
+private:
+    // The present stage: hands composed frames to the window thread.
+    const char* Name() const override;
+    bool Process(FrameRef* frame) override;
+
+    void UpdateCompose();
+    void PostPresent();
+    void DrawError(HRESULT hr);
+    bool PresentInPlace(const FrameRef& frame);
+    void PresentCopy(const FrameRef& frame);
+    void DrawStatsOverlay(HDC hdc, const BgraImage& image);
+    void ResetWindowPos(int win_width);
+    MemoryDC* PrepareDisplayDc(SIZE size);
 
-    std::unique_ptr<BYTE> mask_data_;
-    SIZE mask_size_ = {};
+    HWND hwnd_ = NULL;
+    SIZE frame_size_ = {};
+    DibAllocator dibs_;  // outlives the pools
+    FramePool frame_pool_;
+    FrameRef capture_frame_;
+    ComposeStage compose_;
+    TripleBuffer<FrameRef> frames_;
+    Pipeline pipeline_;
+    std::atomic<bool> present_posted_{ false };
+    std::atomic<HRESULT> frame_error_{ S_OK };
+    FrameStats stats_;
+
+    std::atomic<bool> snapshot_requested_{ false };
+    std::mutex snapshot_mtx_;
+    FrameRef snapshot_;
+
+    BitmapDC frame_dc_;
+    MemoryDC display_dc_;  // errors, and frames that cannot be shown as they are
 
-    int bmp_stride_ = 0;
-    std::unique_ptr<RGBQUAD> bmp_buf_;
     bool mirror_mode_ = true;
     bool mask_mode_ = false;
     double scale_ = 1.0;
-    double pre_scale_ = scale_;
     bool reset_win_pos_ = false;
     double opacity_ = 1.0;
+
+    bool stats_overlay_ = false;
+    std::wstring overlay_text_;
+    uint64_t overlay_time_ = 0;
+    uint64_t overlay_presented_ = 0;
 };
 
-class MainWindow;
-class DeviceSelector {
+class MainWindow : public CWindowImpl<MainWindow> {
 public:
-    DeviceSelector(MainWindow* win);
-    ~DeviceSelector();
-    bool List();
-    bool Select(int dev_id, std::function<void(SIZE)> get_size);
-    UINT32 DevNum() const;
-    IMFActivate* operator[](int n) const;
+    // Posted by the snapshot writer; |wp| is nonzero if the file was
+    // written.
+    static const UINT kSnapshotMessage = WM_APP + 2;
 
-private:
-    DeviceSelector(const DeviceSelector&) = delete;
+    // Posted when the instant replay is saved, the same way.
+    static const UINT kReplaySavedMessage = WM_APP + 3;
 
-    MainWindow* win_ = nullptr;
-    IMFAttributes* attr_ = nullptr;
-    IMFActivate** devices_ = nullptr;
-    UINT32 dev_num_ = 0;
-};
+    // Posted when a device lists other modes than it was cached with.
+    static const UINT kModesChangedMessage = WM_APP + 4;
 
-class MainWindow : public CWindowImpl<MainWindow> {
-public:
     BEGIN_MSG_MAP(MainWindow)
         MESSAGE_HANDLER(WM_NCRBUTTONDOWN, OnRButtonDown)
         MESSAGE_HANDLER(WM_NCHITTEST, OnNcHitTest)
         MESSAGE_HANDLER(WM_DEVICECHANGE, OnDeviceChange)
         MESSAGE_HANDLER(WM_CLOSE, OnClose)
+        MESSAGE_HANDLER(LayeredWindow::kPresentMessage, OnPresent)
+        MESSAGE_HANDLER(kSnapshotMessage, OnSnapshotSaved)
+        MESSAGE_HANDLER(kReplaySavedMessage, OnReplaySaved)
+        MESSAGE_HANDLER(kModesChangedMessage, OnModesChanged)
     END_MSG_MAP()
 
     static PCWSTR ProgramName();
@@ -118,22 +208,42 @@ public:
     void ErrorMsg(PCWSTR msg);
     void InfoMsg(PCWSTR msg);
 
-    bool SelectDevice(IMFActivate* act, std::function<void(SIZE)> get_size);
+    // Opens the device with symbolic link |link|.
+    bool SelectDevice(const std::wstring& link, std::function<void(SIZE)> get_size);
+    bool SelectTestPattern(TestPattern pattern);
+    bool SelectReplay(const std::wstring& path);
+
+    // Pins the capture mode of the device, or goes back to picking one
+    // with nullptr, and opens the device again in it.
+    void PinMode(const CaptureFormat* mode);
 
 private:
     LRESULT OnRButtonDown(UINT msg, WPARAM wp, LPARAM lp, BOOL& handled);
     LRESULT OnNcHitTest(UINT msg, WPARAM wp, LPARAM lp, BOOL& handled);
     LRESULT OnDeviceChange(UINT msg, WPARAM wp, LPARAM lp, BOOL& handled);
     LRESULT OnClose(UINT msg, WPARAM wp, LPARAM lp, BOOL& handled);
+    LRESULT OnPresent(UINT msg, WPARAM wp, LPARAM lp, BOOL& handled);
+    LRESULT OnSnapshotSaved(UINT msg, WPARAM wp, LPARAM lp, BOOL& handled);
+    LRESULT OnReplaySaved(UINT msg, WPARAM wp, LPARAM lp, BOOL& handled);
+    LRESULT OnModesChanged(UINT msg, WPARAM wp, LPARAM lp, BOOL& handled);
 
     bool CreateMainWindow(std::wstring* msg);
     void ShowMenu(LPARAM lp);
+    void SwitchDevice();
+    void ToggleRecording();
+    void OpenReplay();
+    void SaveSnapshot();
+    void SaveInstantReplay();
+    ModeNeeds CurrentModeNeeds();
+    bool ReopenDevice();
     void SetCenterIn(SIZE self_size, const RECT& rect);
     RECT CurScreenRect();
 
     HDEVNOTIFY hdev_notify_ = NULL;
+    DeviceRegistry devices_;
     Previewer previewer_;
     LayeredWindow layered_win_;
+    SnapshotWriter snapshots_;  // holds frames of |layered_win_|
     ULONG_PTR gdip_token_ = NULL;
     std::wstring dev_uid_;
 };
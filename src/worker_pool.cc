@@ -0,0 +1,134 @@
+#include "worker_pool.h"
+
+#if defined(_WIN32)
+#include <windows.h>
+#else
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+static void PinThreadToCpu(std::thread& thread, unsigned cpu)
+{
+#if defined(_WIN32)
+    if (cpu < sizeof(DWORD_PTR) * 8)
+        SetThreadAffinityMask(thread.native_handle(), (DWORD_PTR)1 << cpu);
+#elif defined(__linux__)
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    pthread_setaffinity_np(thread.native_handle(), sizeof(set), &set);
+#else
+    (void)thread;
+    (void)cpu;
+#endif
+}
+
+WorkerPool::WorkerPool(int worker_num)
+{
+    const unsigned cpu_num = std::thread::hardware_concurrency();
+    if (worker_num < 0)
+        worker_num = cpu_num > 1 ? (int)cpu_num - 1 : 0;
+
+    for (int i = 0; i < worker_num; ++i) {
+        workers_.emplace_back(&WorkerPool::WorkerMain, this);
+
+        // Keep CPU 0 for the thread that feeds the pool.
+        if (cpu_num > 1)
+            PinThreadToCpu(workers_.back(), 1 + (unsigned)i % (cpu_num - 1));
+    }
+}
+
+WorkerPool::~WorkerPool()
+{
+    {
+        std::unique_lock<std::mutex> lock(mtx_);
+        quit_ = true;
+    }
+
+    work_cv_.notify_all();
+    for (std::thread& t : workers_)
+        t.join();
+}
+
+int WorkerPool::Concurrency() const
+{
+    return (int)workers_.size() + 1;
+}
+
+void WorkerPool::Run(int task_num, const Task& task)
+{
+    if (task_num <= 0)
+        return;
+
+    if (task_num == 1 || workers_.empty()) {
+        for (int i = 0; i < task_num; ++i)
+            task(i);
+
+        return;
+    }
+
+    Job job = { &task, task_num, 0, 0 };
+    {
+        std::unique_lock<std::mutex> lock(mtx_);
+        jobs_.push_back(&job);
+    }
+
+    work_cv_.notify_all();
+
+    int index = 0;
+    while (TakeTask(&job, &index)) {
+        task(index);
+        FinishTask(&job);
+    }
+
+    std::unique_lock<std::mutex> lock(mtx_);
+    done_cv_.wait(lock, [&job]() { return job.done == job.task_num; });
+}
+
+bool WorkerPool::TakeTask(Job* job, int* index)
+{
+    std::unique_lock<std::mutex> lock(mtx_);
+    if (job->next == job->task_num)
+        return false;
+
+    *index = job->next++;
+    if (job->next == job->task_num) {
+        for (auto it = jobs_.begin(); it != jobs_.end(); ++it) {
+            if (*it == job) {
+                jobs_.erase(it);
+                break;
+            }
+        }
+    }
+
+    return true;
+}
+
+void WorkerPool::FinishTask(Job* job)
+{
+    std::unique_lock<std::mutex> lock(mtx_);
+    if (++job->done == job->task_num)
+        done_cv_.notify_all();
+}
+
+void WorkerPool::WorkerMain()
+{
+    for (;;) {
+        Job* job = nullptr;
+        int task_index = 0;
+        {
+            std::unique_lock<std::mutex> lock(mtx_);
+            work_cv_.wait(lock, [this]() { return quit_ || !jobs_.empty(); });
+            if (quit_)
+                return;
+
+            job = jobs_.front();
+            task_index = job->next++;
+            if (job->next == job->task_num)
+                jobs_.pop_front();
+        }
+
+        (*job->task)(task_index);
+        FinishTask(job);
+    }
+}
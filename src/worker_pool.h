@@ -0,0 +1,49 @@
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// A fixed set of threads, each pinned to its own logical CPU, that share
+// the tasks of Run() with the calling thread. Several threads may call
+// Run() at once; their jobs are served in order.
+class WorkerPool
+{
+public:
+    typedef std::function<void(int)> Task;
+
+    // By default one worker per logical CPU besides the caller's.
+    explicit WorkerPool(int worker_num = -1);
+    ~WorkerPool();
+
+    // Worker threads plus the calling thread.
+    int Concurrency() const;
+
+    // Runs task(0) .. task(task_num - 1) and returns when all finished.
+    void Run(int task_num, const Task& task);
+
+private:
+    WorkerPool(const WorkerPool&) = delete;
+    WorkerPool& operator=(const WorkerPool&) = delete;
+
+    struct Job {
+        const Task* task;
+        int task_num;
+        int next;
+        int done;
+    };
+
+    void WorkerMain();
+    bool TakeTask(Job* job, int* index);
+    void FinishTask(Job* job);
+
+    std::vector<std::thread> workers_;
+    std::mutex mtx_;
+    std::condition_variable work_cv_;
+    std::condition_variable done_cv_;
+    std::deque<Job*> jobs_;
+    bool quit_ = false;
+};
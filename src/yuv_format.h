@@ -0,0 +1,137 @@
+#pragma once
+#include <stdint.h>
+#include "image_transform.h"
+
+// Compile-time description of a YUV layout. The scalar and SIMD kernels
+// are generated from it, so a new format only needs a typedef below and
+// an entry in FOR_EACH_YUV_FORMAT.
+//
+// kLumaOffset is the byte of Y0 in a packed macropixel, kSwapUV puts Cr
+// before Cb. 16-bit samples are MSB aligned, as in P010, and are rounded
+// to their top 8 bits.
+template <uint32_t kFourcc, PlaneLayout kLayout, typename TSample,
+    int kLumaOffset, bool kSwapUV>
+struct YuvFormat
+{
+    typedef TSample Sample;
+
+    static const uint32_t fourcc = kFourcc;
+    static const int luma_offset = kLumaOffset;
+    static const bool swap_uv = kSwapUV;
+    static const PlaneLayout layout = kLayout;
+    static const uint32_t chroma_shift_y = kLayout == PLANE_LAYOUT_PACKED ? 0 : 1;
+
+    static FORCE_INLINE int Narrow(uint32_t v)
+    {
+        if (sizeof(Sample) == 1)
+            return (int)v;
+
+        v = (v + 0x80) >> 8;
+        return (int)(v > 255 ? 255 : v);
+    }
+
+    static FORCE_INLINE int Luma(const uint8_t* row, uint32_t x)
+    {
+        if (layout == PLANE_LAYOUT_PACKED)
+            return row[x * 2 + kLumaOffset];
+
+        return Narrow(((const Sample*)row)[x]);
+    }
+
+    // The chroma rows of luma row |y|. |c1| is only used by planar
+    // layouts, which always get the Cb plane as |c0|.
+    static FORCE_INLINE void ChromaRows(const SourceImage& src, uint32_t y,
+        const uint8_t** c0, const uint8_t** c1)
+    {
+        if (layout == PLANE_LAYOUT_PACKED) {
+            *c0 = src.data[0] + (intptr_t)y * src.stride[0];
+            *c1 = nullptr;
+            return;
+        }
+
+        const uint32_t cy = y >> chroma_shift_y;
+        *c0 = src.data[1] + (intptr_t)cy * src.stride[1];
+        *c1 = nullptr;
+
+        if (layout == PLANE_LAYOUT_PLANAR) {
+            *c1 = src.data[2] + (intptr_t)cy * src.stride[2];
+            if (kSwapUV) {
+                const uint8_t* t = *c0;
+                *c0 = *c1;
+                *c1 = t;
+            }
+        }
+    }
+
+    // Cb and Cr shared by pixel |x| and its neighbour.
+    static FORCE_INLINE void Chroma(const uint8_t* c0, const uint8_t* c1,
+        uint32_t x, int* cb, int* cr)
+    {
+        const uint32_t i = x / 2;
+        if (layout == PLANE_LAYOUT_PLANAR) {
+            *cb = Narrow(((const Sample*)c0)[i]);
+            *cr = Narrow(((const Sample*)c1)[i]);
+            return;
+        }
+
+        int u = 0;
+        int v = 0;
+        if (layout == PLANE_LAYOUT_PACKED) {
+            u = c0[i * 4 + 1 - kLumaOffset];
+            v = c0[i * 4 + 3 - kLumaOffset];
+        } else {
+            u = Narrow(((const Sample*)c0)[i * 2]);
+            v = Narrow(((const Sample*)c0)[i * 2 + 1]);
+        }
+
+        *cb = kSwapUV ? v : u;
+        *cr = kSwapUV ? u : v;
+    }
+
+    // The image starting at column |x|, which must be even.
+    static FORCE_INLINE SourceImage SkipColumns(const SourceImage& src, uint32_t x)
+    {
+        SourceImage s = src;
+        if (layout == PLANE_LAYOUT_PACKED) {
+            s.data[0] += x * 2;
+        } else if (layout == PLANE_LAYOUT_NV12) {
+            s.data[0] += x * sizeof(Sample);
+            s.data[1] += x * sizeof(Sample);
+        } else {
+            s.data[0] += x * sizeof(Sample);
+            s.data[1] += x / 2 * sizeof(Sample);
+            s.data[2] += x / 2 * sizeof(Sample);
+        }
+
+        return s;
+    }
+};
+
+#define YUV_FOURCC(a, b, c, d) \
+    ((uint32_t)(a) | (uint32_t)(b) << 8 | (uint32_t)(c) << 16 | (uint32_t)(d) << 24)
+
+typedef YuvFormat<YUV_FOURCC('Y', 'U', 'Y', '2'), PLANE_LAYOUT_PACKED, uint8_t, 0, false> FormatYUY2;
+typedef YuvFormat<YUV_FOURCC('Y', 'V', 'Y', 'U'), PLANE_LAYOUT_PACKED, uint8_t, 0, true> FormatYVYU;
+typedef YuvFormat<YUV_FOURCC('U', 'Y', 'V', 'Y'), PLANE_LAYOUT_PACKED, uint8_t, 1, false> FormatUYVY;
+typedef YuvFormat<YUV_FOURCC('N', 'V', '1', '2'), PLANE_LAYOUT_NV12, uint8_t, 0, false> FormatNV12;
+typedef YuvFormat<YUV_FOURCC('P', '0', '1', '0'), PLANE_LAYOUT_NV12, uint16_t, 0, false> FormatP010;
+typedef YuvFormat<YUV_FOURCC('I', '4', '2', '0'), PLANE_LAYOUT_PLANAR, uint8_t, 0, false> FormatI420;
+typedef YuvFormat<YUV_FOURCC('Y', 'V', '1', '2'), PLANE_LAYOUT_PLANAR, uint8_t, 0, true> FormatYV12;
+
+#define FOR_EACH_YUV_FORMAT(X) \
+    X(FormatYUY2) \
+    X(FormatYVYU) \
+    X(FormatUYVY) \
+    X(FormatNV12) \
+    X(FormatP010) \
+    X(FormatI420) \
+    X(FormatYV12)
+
+// Generated in image_transform.cc and image_transform_x86.cc for each
+// format of FOR_EACH_YUV_FORMAT.
+template <class Format> DECLARE_IMAGE_TRANSFORM(TransformYuv);
+
+#if CPU_X86
+template <class Format> DECLARE_IMAGE_TRANSFORM(TransformYuv_SSE2);
+template <class Format> DECLARE_IMAGE_TRANSFORM(TransformYuv_AVX2);
+#endif
@@ -0,0 +1,172 @@
+#include "yuv_scaler.h"
+#include "worker_pool.h"
+#include "yuv_format.h"
+
+template <class Format>
+YuvScaler::Layout YuvScaler::MakeLayout()
+{
+    Layout l = {};
+    if (sizeof(typename Format::Sample) != 1)
+        return l;
+
+    l.format = Format::fourcc;
+    const bool swap = Format::swap_uv;
+
+    if (Format::layout == PLANE_LAYOUT_PACKED) {
+        // Y0 Cb Y1 Cr, or the order the traits give.
+        const uint32_t c = Format::luma_offset ? 0 : 1;
+        l.planes[0] = { 0, 2, (uint32_t)Format::luma_offset, 0, 0 };
+        l.planes[1] = { 0, 4, c + (swap ? 2 : 0), 1, 0 };
+        l.planes[2] = { 0, 4, c + (swap ? 0 : 2), 1, 0 };
+    } else if (Format::layout == PLANE_LAYOUT_NV12) {
+        l.planes[0] = { 0, 1, 0, 0, 0 };
+        l.planes[1] = { 1, 2, swap ? 1u : 0u, 1, 1 };
+        l.planes[2] = { 1, 2, swap ? 0u : 1u, 1, 1 };
+    } else {
+        l.planes[0] = { 0, 1, 0, 0, 0 };
+        l.planes[1] = { swap ? 2 : 1, 1, 0, 1, 1 };
+        l.planes[2] = { swap ? 1 : 2, 1, 0, 1, 1 };
+    }
+
+    return l;
+}
+
+#define YUV_SCALE_LAYOUT(Format) MakeLayout<Format>(),
+
+const YuvScaler::Layout* YuvScaler::FindLayout(uint32_t format)
+{
+    static const Layout layouts[] = {
+        FOR_EACH_YUV_FORMAT(YUV_SCALE_LAYOUT)
+    };
+
+    for (const Layout& l : layouts) {
+        if (l.format && l.format == format)
+            return &l;
+    }
+
+    return nullptr;
+}
+
+YuvScaler::YuvScaler(bool use_simd)
+{
+    vertical_ = ScaleVertical_C;
+    horizontal_ = ScalePlane_C;
+#if CPU_X86
+    if (use_simd && GetCpuFeatures().avx2) {
+        vertical_ = ScaleVertical_AVX2;
+        horizontal_ = ScalePlane_AVX2;
+    }
+#else
+    (void)use_simd;
+#endif
+}
+
+bool YuvScaler::IsSupported(uint32_t format)
+{
+    return FindLayout(format) != nullptr;
+}
+
+void YuvScaler::ScalePlaneRows(const SourceImage& src, const PlaneSpec& spec,
+    const PlaneFilters& f, uint8_t* dst, uint32_t dst_stride,
+    uint32_t y_begin, uint32_t y_end, std::vector<int16_t>* rows)
+{
+    // The vertical pass filters every byte of the rows the samples are
+    // in; interleaved samples are then picked into a row of their own.
+    // Both rows leave room for the taps that reach past their end.
+    const uint32_t count = (f.src_w - 1) * spec.step + spec.offset + 1;
+    const size_t summed_size = (size_t)count + f.x.taps + 8;
+    rows->resize(summed_size + f.src_w + f.x.taps + 8);
+    int16_t* summed = rows->data();
+    int16_t* picked = spec.step == 1 && spec.offset == 0 ? summed : summed + summed_size;
+
+    const uint8_t* plane = src.data[spec.plane];
+    const int32_t stride = src.stride[spec.plane];
+    const uint32_t taps = f.y.taps < f.src_h ? f.y.taps : f.src_h;
+
+    for (uint32_t y = y_begin; y < y_end; ++y) {
+        vertical_(plane + (intptr_t)f.y.offset[y] * stride, stride,
+            &f.y.weights[(size_t)y * f.y.taps], taps, summed, count);
+
+        if (picked != summed) {
+            const int16_t* s = summed + spec.offset;
+            for (uint32_t x = 0; x < f.src_w; ++x)
+                picked[x] = s[x * spec.step];
+        }
+
+        horizontal_(picked, f.x, dst + (size_t)y * dst_stride, 0, f.dst_w);
+    }
+}
+
+void YuvScaler::ScaleConvert(uint32_t format, const SourceImage& src,
+    uint32_t width, uint32_t height, const TargetImage& dst,
+    uint32_t dst_width, uint32_t dst_height, WorkerPool* pool)
+{
+    const Layout* layout = FindLayout(format);
+    if (!layout || !width || !height || !dst_width || !dst_height)
+        return;
+
+    const uint32_t chroma_w = (dst_width + 1) / 2;
+    const uint32_t chroma_h = (dst_height + 1) / 2;
+    i420_.resize((size_t)dst_width * dst_height + (size_t)chroma_w * chroma_h * 2);
+
+    uint8_t* out[3] = {
+        i420_.data(),
+        i420_.data() + (size_t)dst_width * dst_height,
+        i420_.data() + (size_t)dst_width * dst_height + (size_t)chroma_w * chroma_h,
+    };
+
+    for (int i = 0; i < 3; ++i) {
+        const PlaneSpec& spec = layout->planes[i];
+        const uint32_t src_w = (width + (1u << spec.shift_x) - 1) >> spec.shift_x;
+        const uint32_t src_h = (height + (1u << spec.shift_y) - 1) >> spec.shift_y;
+        const uint32_t dst_w = i ? chroma_w : dst_width;
+        const uint32_t dst_h = i ? chroma_h : dst_height;
+
+        PlaneFilters& f = filters_[i];
+        if (f.src_w != src_w || f.src_h != src_h || f.dst_w != dst_w || f.dst_h != dst_h) {
+            f.src_w = src_w;
+            f.src_h = src_h;
+            f.dst_w = dst_w;
+            f.dst_h = dst_h;
+            BuildScaleFilter(src_w, dst_w, true, &f.x);
+            BuildScaleFilter(src_h, dst_h, false, &f.y);
+        }
+
+        // Stripes of output rows; every row reads whole source rows, so
+        // the source size decides how much to split.
+        const uint64_t kPixelsPerStripe = 256 * 1024;
+        uint32_t stripe_num = (uint32_t)((uint64_t)src_w * src_h / kPixelsPerStripe);
+        if (pool && stripe_num > (uint32_t)pool->Concurrency())
+            stripe_num = (uint32_t)pool->Concurrency();
+
+        if (!pool || stripe_num <= 1) {
+            rows_.resize(1);
+            ScalePlaneRows(src, spec, f, out[i], dst_w, 0, dst_h, &rows_[0]);
+            continue;
+        }
+
+        const uint32_t stripe_rows = (dst_h + stripe_num - 1) / stripe_num;
+        stripe_num = (dst_h + stripe_rows - 1) / stripe_rows;
+        if (rows_.size() < stripe_num)
+            rows_.resize(stripe_num);
+
+        pool->Run((int)stripe_num, [&](int s) {
+            uint32_t y = (uint32_t)s * stripe_rows;
+            uint32_t y_end = y + stripe_rows < dst_h ? y + stripe_rows : dst_h;
+            ScalePlaneRows(src, spec, f, out[i], dst_w, y, y_end, &rows_[s]);
+        });
+    }
+
+    SourceImage i420 = {};
+    i420.data[0] = out[0];
+    i420.data[1] = out[1];
+    i420.data[2] = out[2];
+    i420.stride[0] = (int32_t)dst_width;
+    i420.stride[1] = (int32_t)chroma_w;
+    i420.stride[2] = (int32_t)chroma_w;
+    i420.chroma_shift_y = 1;
+    i420.yuv = src.yuv;
+
+    TransformImageStripes(pool, FindImageTransform(FormatI420::fourcc)->xform,
+        dst, i420, dst_width, dst_height);
+}
@@ -0,0 +1,66 @@
+#pragma once
+#include <stdint.h>
+#include <vector>
+#include "image_scaler.h"
+#include "image_transform.h"
+
+class WorkerPool;
+
+// Shrinks a YUV frame before it is converted: the luma and chroma planes
+// are resampled to an I420 image of the target size, and only that is
+// converted to RGB. The planes are read in place, so packed and planar
+// formats need no unpacking pass.
+class YuvScaler
+{
+public:
+    explicit YuvScaler(bool use_simd = true);
+
+    // The 8-bit formats of FOR_EACH_YUV_FORMAT.
+    static bool IsSupported(uint32_t format);
+
+    // Scales the |width| x |height| frame |src| of |format| to |dst_width|
+    // x |dst_height| and converts it into |dst|, with the colorimetry of
+    // |src|.
+    void ScaleConvert(uint32_t format, const SourceImage& src,
+        uint32_t width, uint32_t height, const TargetImage& dst,
+        uint32_t dst_width, uint32_t dst_height, WorkerPool* pool = nullptr);
+
+private:
+    // Where the samples of one output plane are in the source.
+    struct PlaneSpec {
+        int plane;        // index into SourceImage::data
+        uint32_t step;    // bytes from one sample to the next
+        uint32_t offset;  // byte of the first sample
+        uint32_t shift_x;
+        uint32_t shift_y;
+    };
+
+    struct Layout {
+        uint32_t format;
+        PlaneSpec planes[3];  // Y, Cb, Cr
+    };
+
+    // Filters of one output plane, kept while the sizes stay the same.
+    struct PlaneFilters {
+        uint32_t src_w;
+        uint32_t src_h;
+        uint32_t dst_w;
+        uint32_t dst_h;
+        ScaleFilter x;
+        ScaleFilter y;
+    };
+
+    template <class Format>
+    static Layout MakeLayout();
+    static const Layout* FindLayout(uint32_t format);
+
+    void ScalePlaneRows(const SourceImage& src, const PlaneSpec& spec,
+        const PlaneFilters& f, uint8_t* dst, uint32_t dst_stride,
+        uint32_t y_begin, uint32_t y_end, std::vector<int16_t>* rows);
+
+    SCALE_VERTICAL_FN vertical_;
+    SCALE_PLANE_FN horizontal_;
+    PlaneFilters filters_[3] = {};
+    std::vector<uint8_t> i420_;
+    std::vector<std::vector<int16_t>> rows_;  // one per stripe
+};
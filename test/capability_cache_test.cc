@@ -0,0 +1,277 @@
+// The capability cache file and the rules it keeps devices by: files
+// that are damaged, cut short or of another version load as an empty
+// cache, devices go after kMaxAge unused and beyond kMaxDevices, and the
+// mode to open in follows the pin, the last choice and the ranking.
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "capability_cache.h"
+#include "check.h"
+#include "file_util.h"
+#include "yuv_format.h"
+
+static const char kPath[] = "capability_cache_test.bin";
+static const char kLink[] = "\\\\?\\usb#vid_046d&pid_0825#a&1";
+
+static const uint32_t kYuy2 = FormatYUY2::fourcc;
+
+static CaptureFormat Mode(uint32_t fourcc, uint32_t width, uint32_t height)
+{
+    CaptureFormat mode = { fourcc, width, height, 30, 1 };
+    return mode;
+}
+
+static double FixedRate(uint32_t fourcc)
+{
+    return fourcc == kFourccMjpg ? 80 : 200;
+}
+
+static const std::vector<CaptureFormat> kModes = {
+    Mode(kYuy2, 640, 480), Mode(kYuy2, 1280, 720), Mode(kFourccMjpg, 1920, 1080),
+};
+
+static const ModeNeeds kNeeds = { 1920, 1080, 2 };
+
+static bool Exists(const std::string& path)
+{
+    FILE* file = OpenFileForRead(path);
+    if (file)
+        fclose(file);
+
+    return file != nullptr;
+}
+
+static bool WriteFile(const std::string& path, const std::vector<uint8_t>& data)
+{
+    FILE* file = CreateFileForWrite(path);
+    if (!file)
+        return false;
+
+    const bool ok = fwrite(data.data(), 1, data.size(), file) == data.size();
+    return (fclose(file) == 0) && ok;
+}
+
+static void TestRoundTrip()
+{
+    remove(kPath);
+    CapabilityCache cache;
+    CHECK(!cache.Load(kPath));
+    CHECK(cache.Size() == 0);
+
+    cache.Put(kLink, kModes, kModes[1], kNeeds, 1000);
+    cache.Pin(kLink, &kModes[2], 1001);
+    cache.Put("other", kModes, kModes[0], kNeeds, 1002);
+    CHECK(cache.Save(kPath));
+    CHECK(!Exists(std::string(kPath) + ".tmp"));
+
+    CapabilityCache loaded;
+    CHECK(loaded.Load(kPath));
+    CHECK(loaded.Size() == 2);
+    CHECK(loaded.Serialize() == cache.Serialize());
+
+    DeviceCaps caps = {};
+    CHECK(loaded.Find(kLink, &caps));
+    CHECK(caps.modes.size() == kModes.size() && SameMode(caps.modes[2], kModes[2]));
+    CHECK(SameMode(caps.chosen, kModes[1]));
+    CHECK(caps.pinned && SameMode(caps.pin, kModes[2]));
+    CHECK(caps.needs.width == 1920 && caps.needs.height == 1080 && caps.needs.cores == 2);
+    CHECK(caps.last_used == 1001);
+
+    // A second save replaces the file.
+    cache.Remove("other");
+    CHECK(cache.Save(kPath));
+    CHECK(loaded.Load(kPath));
+    CHECK(loaded.Size() == 1 && !loaded.Find("other", &caps));
+    remove(kPath);
+}
+
+// Any byte changed, any length cut off or added, and another version are
+// all rejected, and leave the cache empty.
+static void TestDamage()
+{
+    CapabilityCache cache;
+    cache.Put(kLink, kModes, kModes[1], kNeeds, 1000);
+    cache.Pin(kLink, &kModes[0], 1000);
+    const std::vector<uint8_t> data = cache.Serialize();
+
+    bool all_rejected = true;
+    for (size_t i = 0; i < data.size(); ++i) {
+        std::vector<uint8_t> damaged = data;
+        damaged[i] ^= 0x40;
+        CapabilityCache other;
+        all_rejected &= !other.Parse(damaged.data(), damaged.size()) && other.Size() == 0;
+    }
+
+    CHECK(all_rejected);
+
+    bool all_short = true;
+    for (size_t n = 0; n < data.size(); ++n) {
+        CapabilityCache other;
+        all_short &= !other.Parse(data.data(), n);
+    }
+
+    CHECK(all_short);
+
+    std::vector<uint8_t> longer = data;
+    longer.push_back(0);
+    CapabilityCache other;
+    CHECK(!other.Parse(longer.data(), longer.size()));
+
+    // The version is outside what the CRC covers.
+    std::vector<uint8_t> version = data;
+    uint32_t v = 2;
+    memcpy(&version[8], &v, sizeof(v));
+    CHECK(!other.Parse(version.data(), version.size()));
+    CHECK(other.Parse(data.data(), data.size()) && other.Size() == 1);
+
+    // A damaged file empties a cache that had devices.
+    std::vector<uint8_t> damaged = data;
+    damaged.back() ^= 1;
+    CHECK(WriteFile(kPath, damaged));
+    CHECK(!other.Load(kPath));
+    CHECK(other.Size() == 0);
+
+    CHECK(WriteFile(kPath, std::vector<uint8_t>(data.begin(), data.begin() + data.size() / 2)));
+    CHECK(other.Parse(data.data(), data.size()));
+    CHECK(!other.Load(kPath));
+    CHECK(other.Size() == 0);
+    remove(kPath);
+}
+
+static void TestCachedMode()
+{
+    CapabilityCache cache;
+    CaptureFormat mode = {};
+    CHECK(!cache.CachedMode(kLink, kNeeds, &mode, FixedRate));
+
+    // The last choice for the same needs, else the best ranked one.
+    cache.Put(kLink, kModes, kModes[1], kNeeds, 1000);
+    CHECK(cache.CachedMode(kLink, kNeeds, &mode, FixedRate) && SameMode(mode, kModes[1]));
+
+    const ModeNeeds small = { 640, 480, 2 };
+    CHECK(cache.CachedMode(kLink, small, &mode, FixedRate) && SameMode(mode, kModes[0]));
+
+    cache.Pin(kLink, &kModes[2], 1001);
+    CHECK(cache.CachedMode(kLink, small, &mode, FixedRate) && SameMode(mode, kModes[2]));
+    cache.Pin(kLink, nullptr, 1002);
+    CHECK(cache.CachedMode(kLink, kNeeds, &mode, FixedRate) && SameMode(mode, kModes[1]));
+}
+
+static void TestValidate()
+{
+    CapabilityCache cache;
+    cache.Put(kLink, kModes, kModes[1], kNeeds, 1000);
+    cache.Pin(kLink, &kModes[2], 1000);
+    CHECK(cache.Validate(kLink, kModes, 2000));
+
+    // The pinned mode went; the chosen one stays while it is listed.
+    const std::vector<CaptureFormat> fewer = { kModes[0], kModes[1] };
+    DeviceCaps caps = {};
+    CHECK(!cache.Validate(kLink, fewer, 2001));
+    CHECK(cache.Find(kLink, &caps));
+    CHECK(!caps.pinned && caps.modes.size() == 2 && SameMode(caps.chosen, kModes[1]));
+    CHECK(caps.last_used == 2001);
+
+    const std::vector<CaptureFormat> one = { kModes[0] };
+    CHECK(!cache.Validate(kLink, one, 2002));
+    CHECK(cache.Find(kLink, &caps) && caps.chosen.width == 0);
+
+    CaptureFormat mode = {};
+    CHECK(cache.CachedMode(kLink, kNeeds, &mode, FixedRate) && SameMode(mode, kModes[0]));
+}
+
+static void TestAge()
+{
+    const uint64_t t0 = 1700000000;
+    CapabilityCache cache;
+    DeviceCaps caps = {};
+    cache.Put("old", kModes, kModes[0], kNeeds, t0);
+
+    // Unused for exactly kMaxAge is kept, a second more is not.
+    cache.Put("new", kModes, kModes[0], kNeeds, t0 + CapabilityCache::kMaxAge);
+    CHECK(cache.Find("old", &caps));
+    cache.Put("new", kModes, kModes[0], kNeeds, t0 + CapabilityCache::kMaxAge + 1);
+    CHECK(!cache.Find("old", &caps));
+    CHECK(cache.Size() == 1);
+
+    // A clock that went back forgets nothing newer.
+    cache.Put("back", kModes, kModes[0], kNeeds, t0);
+    CHECK(cache.Find("new", &caps) && cache.Find("back", &caps));
+
+    // Being validated counts as being used.
+    cache.Validate("back", kModes, t0 + 2 * CapabilityCache::kMaxAge + 2);
+    CHECK(cache.Find("back", &caps) && !cache.Find("new", &caps));
+}
+
+static void TestLeastRecentlyUsed()
+{
+    const uint64_t t0 = 1700000000;
+    const size_t count = CapabilityCache::kMaxDevices + 8;
+    CapabilityCache cache;
+    for (size_t i = 0; i < CapabilityCache::kMaxDevices; ++i)
+        cache.Put("dev" + std::to_string(i), kModes, kModes[0], kNeeds, t0 + i);
+
+    // The first device is used again, so the next ones go in its place.
+    cache.Validate("dev0", kModes, t0 + 100);
+    for (size_t i = CapabilityCache::kMaxDevices; i < count; ++i)
+        cache.Put("dev" + std::to_string(i), kModes, kModes[0], kNeeds, t0 + 100 + i);
+
+    CHECK(cache.Size() == CapabilityCache::kMaxDevices);
+
+    DeviceCaps caps = {};
+    bool kept = cache.Find("dev0", &caps);
+    for (size_t i = 1; i <= 8; ++i)
+        kept &= !cache.Find("dev" + std::to_string(i), &caps);
+
+    for (size_t i = 9; i < count; ++i)
+        kept &= cache.Find("dev" + std::to_string(i), &caps);
+
+    CHECK(kept);
+
+    // The limits hold in the file as well.
+    const std::vector<uint8_t> data = cache.Serialize();
+    CapabilityCache loaded;
+    CHECK(loaded.Parse(data.data(), data.size()));
+    CHECK(loaded.Size() == CapabilityCache::kMaxDevices);
+}
+
+// Saves while another thread changes the cache write whole files.
+static void TestSaveWhileChanging()
+{
+    CapabilityCache cache;
+    const std::vector<CaptureFormat> fewer = { kModes[0], kModes[1] };
+    std::thread changer([&]() {
+        for (int i = 0; i < 2000; ++i) {
+            cache.Validate("dev" + std::to_string(i % 40), i % 2 ? kModes : fewer, 1000 + i);
+        }
+    });
+
+    bool whole = true;
+    for (int i = 0; i < 50; ++i) {
+        whole &= cache.Save(kPath);
+        CapabilityCache loaded;
+        whole &= loaded.Load(kPath);
+    }
+
+    changer.join();
+    CHECK(whole);
+    remove(kPath);
+}
+
+int main()
+{
+    TestRoundTrip();
+    TestDamage();
+    TestCachedMode();
+    TestValidate();
+    TestAge();
+    TestLeastRecentlyUsed();
+    TestSaveWhileChanging();
+    return CheckResult();
+}
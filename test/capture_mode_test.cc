@@ -0,0 +1,135 @@
+// The mode scorer with fixed conversion rates, so that rankings do not
+// depend on the machine, and the measured rates and mode names.
+
+#include <math.h>
+#include <stdint.h>
+
+#include <vector>
+
+#include "capture_mode.h"
+#include "check.h"
+#include "yuv_format.h"
+
+static const uint32_t kYuy2 = FormatYUY2::fourcc;
+static const uint32_t kNv12 = FormatNV12::fourcc;
+static const uint32_t kUnknown = 0x12345678;
+
+static double FixedRate(uint32_t fourcc)
+{
+    if (fourcc == kYuy2)
+        return 200;
+
+    if (fourcc == kNv12)
+        return 400;
+
+    if (fourcc == kFourccMjpg)
+        return 80;
+
+    return 0;
+}
+
+static CaptureFormat Mode(uint32_t fourcc, uint32_t width, uint32_t height,
+    uint32_t fps_num, uint32_t fps_den = 1)
+{
+    CaptureFormat mode = { fourcc, width, height, fps_num, fps_den };
+    return mode;
+}
+
+static std::vector<size_t> Rank(const std::vector<CaptureFormat>& modes,
+    uint32_t width, uint32_t height, double cores)
+{
+    const ModeNeeds needs = { width, height, cores };
+    return RankModes(modes, needs, FixedRate);
+}
+
+static void TestSameMode()
+{
+    CHECK(SameMode(Mode(kYuy2, 640, 480, 30, 1), Mode(kYuy2, 640, 480, 60, 2)));
+    CHECK(SameMode(Mode(kYuy2, 640, 480, 30000, 1001), Mode(kYuy2, 640, 480, 30000, 1001)));
+    CHECK(!SameMode(Mode(kYuy2, 640, 480, 30, 1), Mode(kYuy2, 640, 480, 30000, 1001)));
+    CHECK(!SameMode(Mode(kYuy2, 640, 480, 30), Mode(kNv12, 640, 480, 30)));
+    CHECK(!SameMode(Mode(kYuy2, 640, 480, 30), Mode(kYuy2, 640, 360, 30)));
+
+    // A zero denominator would make any two rates cross-multiply equal.
+    CHECK(SameMode(Mode(kYuy2, 640, 480, 0, 0), Mode(kYuy2, 640, 480, 0, 0)));
+    CHECK(!SameMode(Mode(kYuy2, 640, 480, 0, 0), Mode(kYuy2, 640, 480, 30, 1)));
+    CHECK(!SameMode(Mode(kYuy2, 640, 480, 30, 1), Mode(kYuy2, 640, 480, 0, 0)));
+    CHECK(!SameMode(Mode(kYuy2, 640, 480, 30, 0), Mode(kYuy2, 640, 480, 60, 0)));
+    CHECK(!SameMode(Mode(kYuy2, 640, 480, 0, 1), Mode(kYuy2, 640, 480, 0, 0)));
+}
+
+static void TestScore()
+{
+    const ModeNeeds needs = { 1920, 1080, 1 };
+
+    // 1280x720 at 30 fps of YUY2 is 27.6 MPix/s, so 0.138 of a core.
+    CHECK(fabs(ModeLoad(Mode(kYuy2, 1280, 720, 30), 200) - 0.13824) < 1e-9);
+    CHECK(ModeLoad(Mode(kYuy2, 1280, 720, 0, 0), 200) == ModeLoad(Mode(kYuy2, 1280, 720, 30), 200));
+    CHECK(ModeLoad(Mode(kYuy2, 1280, 720, 30), 0) == HUGE_VAL);
+
+    const double score = ScoreMode(Mode(kYuy2, 1280, 720, 30), 200, needs);
+    CHECK(fabs(score - (log2(1280.0 * 720) + log2(30.0) - 0.13824)) < 1e-9);
+    CHECK(ScoreMode(Mode(kUnknown, 1280, 720, 30), 0, needs) == -HUGE_VAL);
+    CHECK(ScoreMode(Mode(kYuy2, 0, 0, 30), 200, needs) == -HUGE_VAL);
+}
+
+static void TestRank()
+{
+    // More of what is shown wins, up to the size it is shown at.
+    std::vector<CaptureFormat> modes = {
+        Mode(kYuy2, 640, 480, 30), Mode(kYuy2, 1280, 720, 30), Mode(kYuy2, 1920, 1080, 30),
+    };
+    CHECK(Rank(modes, 1920, 1080, 4) == std::vector<size_t>({ 2, 1, 0 }));
+    CHECK(Rank(modes, 1280, 720, 4) == std::vector<size_t>({ 1, 2, 0 }));
+
+    // Frame rates count up to 60 fps; beyond, they only cost.
+    modes = { Mode(kNv12, 1280, 720, 120), Mode(kNv12, 1280, 720, 60), Mode(kNv12, 1280, 720, 15) };
+    CHECK(Rank(modes, 1920, 1080, 4) == std::vector<size_t>({ 1, 0, 2 }));
+
+    // A mode that needs more than the cores allowed ranks below all
+    // others; 4K NV12 at 30 fps is 0.62 of a core at 400 MPix/s.
+    modes = { Mode(kNv12, 3840, 2160, 30), Mode(kYuy2, 320, 240, 5) };
+    CHECK(Rank(modes, 3840, 2160, 1)[0] == 0);
+    CHECK(Rank(modes, 3840, 2160, 0.5)[0] == 1);
+
+    // MJPEG costs more per pixel than NV12, so NV12 wins at the same size
+    // and rate; modes with no conversion are left out.
+    modes = { Mode(kFourccMjpg, 1920, 1080, 30), Mode(kUnknown, 1920, 1080, 30),
+        Mode(kNv12, 1920, 1080, 30) };
+    CHECK(Rank(modes, 1920, 1080, 4) == std::vector<size_t>({ 2, 0 }));
+
+    // Equal modes keep the order the device lists them in.
+    modes = { Mode(kYuy2, 640, 480, 30), Mode(kYuy2, 640, 480, 60, 2), Mode(kYuy2, 640, 480, 30) };
+    CHECK(Rank(modes, 1920, 1080, 4) == std::vector<size_t>({ 0, 1, 2 }));
+    CHECK(Rank(std::vector<CaptureFormat>(), 1920, 1080, 4).empty());
+}
+
+static void TestConversionRate()
+{
+    CHECK(ConversionRate(kFourccMjpg) == 80);
+    CHECK(ConversionRate(kUnknown) == 0);
+
+    // Measured once, then the same for the rest of the process.
+    const double rate = ConversionRate(kYuy2);
+    CHECK(rate > 0);
+    CHECK(ConversionRate(kYuy2) == rate);
+}
+
+static void TestModeName()
+{
+    CHECK(ModeName(Mode(kYuy2, 1280, 720, 30)) == "1280x720 30 fps YUY2");
+    CHECK(ModeName(Mode(kNv12, 640, 480, 30000, 1001)) == "640x480 29.97 fps NV12");
+    CHECK(ModeName(Mode(kFourccMjpg, 1920, 1080, 0, 0)) == "1920x1080 MJPG");
+    CHECK(ModeName(Mode(22, 640, 480, 15)) == "640x480 15 fps RGB32");
+    CHECK(ModeName(Mode(20, 640, 480, 15)) == "640x480 15 fps RGB24");
+}
+
+int main()
+{
+    TestSameMode();
+    TestScore();
+    TestRank();
+    TestConversionRate();
+    TestModeName();
+    return CheckResult();
+}
@@ -0,0 +1,26 @@
+#pragma once
+#include <stdio.h>
+
+// What the tests under test/ check with. A CHECK that fails is printed
+// and the test goes on; main returns CheckResult().
+inline int& CheckFailures()
+{
+    static int failures = 0;
+    return failures;
+}
+
+inline int CheckResult()
+{
+    if (CheckFailures())
+        fprintf(stderr, "%d checks failed\n", CheckFailures());
+
+    return CheckFailures() ? 1 : 0;
+}
+
+#define CHECK(cond) \
+    do { \
+        if (!(cond)) { \
+            fprintf(stderr, "%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #cond); \
+            ++CheckFailures(); \
+        } \
+    } while (0)
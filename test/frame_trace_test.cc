@@ -0,0 +1,312 @@
+// Records known spans into the Tracer and reads them back from the JSON
+// it writes: every span from every thread, in each thread's order, the
+// newest kRingCapacity only once a ring wraps, and nothing from before
+// Start or while stopped.
+
+#include <ctype.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include <map>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "check.h"
+#include "frame_trace.h"
+
+// Enough JSON for the trace: objects, arrays, strings and numbers.
+struct Json {
+    enum Type { NUL, NUMBER, STRING, ARRAY, OBJECT } type = NUL;
+    double number = 0;
+    std::string string;
+    std::vector<Json> items;
+    std::map<std::string, Json> members;
+
+    const Json& operator[](const char* key) const
+    {
+        static const Json none;
+        auto it = members.find(key);
+        return it == members.end() ? none : it->second;
+    }
+};
+
+class JsonParser
+{
+public:
+    explicit JsonParser(const std::string& text) : p_(text.c_str()) {}
+
+    bool Parse(Json* value)
+    {
+        return Value(value) && (Skip(), *p_ == '\0');
+    }
+
+private:
+    void Skip()
+    {
+        while (isspace((unsigned char)*p_))
+            ++p_;
+    }
+
+    bool String(std::string* s)
+    {
+        if (*p_ != '"')
+            return false;
+
+        for (++p_; *p_ != '"'; ++p_) {
+            if (!*p_)
+                return false;
+
+            if (*p_ == '\\' && !*++p_)
+                return false;
+
+            s->push_back(*p_);
+        }
+
+        ++p_;
+        return true;
+    }
+
+    bool Value(Json* value)
+    {
+        Skip();
+        if (*p_ == '"') {
+            value->type = Json::STRING;
+            return String(&value->string);
+        }
+
+        if (*p_ == '[') {
+            value->type = Json::ARRAY;
+            ++p_;
+            Skip();
+            if (*p_ == ']')
+                return ++p_, true;
+
+            for (;;) {
+                value->items.emplace_back();
+                if (!Value(&value->items.back()))
+                    return false;
+
+                Skip();
+                if (*p_ == ']')
+                    return ++p_, true;
+
+                if (*p_++ != ',')
+                    return false;
+            }
+        }
+
+        if (*p_ == '{') {
+            value->type = Json::OBJECT;
+            ++p_;
+            Skip();
+            if (*p_ == '}')
+                return ++p_, true;
+
+            for (;;) {
+                std::string key;
+                Skip();
+                if (!String(&key))
+                    return false;
+
+                Skip();
+                if (*p_++ != ':' || !Value(&value->members[key]))
+                    return false;
+
+                Skip();
+                if (*p_ == '}')
+                    return ++p_, true;
+
+                if (*p_++ != ',')
+                    return false;
+            }
+        }
+
+        char* end = nullptr;
+        value->type = Json::NUMBER;
+        value->number = strtod(p_, &end);
+        if (end == p_)
+            return false;
+
+        p_ = end;
+        return true;
+    }
+
+    const char* p_;
+};
+
+struct Span {
+    std::string name;
+    double ts;
+    double dur;
+    int64_t frame;
+};
+
+struct Trace {
+    std::map<uint32_t, std::string> thread_names;
+    std::map<uint32_t, std::vector<Span>> spans;  // by thread, as written
+};
+
+static bool ReadTrace(Trace* trace)
+{
+    std::ostringstream out;
+    Tracer::WriteJson(&out);
+
+    Json root;
+    if (!JsonParser(out.str()).Parse(&root) || root["traceEvents"].type != Json::ARRAY)
+        return false;
+
+    for (const Json& e : root["traceEvents"].items) {
+        const uint32_t tid = (uint32_t)e["tid"].number;
+        if (e["ph"].string == "M") {
+            trace->thread_names[tid] = e["args"]["name"].string;
+        } else if (e["ph"].string == "X") {
+            const Json& frame = e["args"]["frame"];
+            trace->spans[tid].push_back({ e["name"].string, e["ts"].number, e["dur"].number,
+                frame.type == Json::NUMBER ? (int64_t)frame.number : -1 });
+        } else {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// The thread whose spans are named |name|; 0 if none or several.
+static uint32_t FindThread(const Trace& trace, const std::string& name)
+{
+    uint32_t found = 0;
+    for (const auto& thread : trace.spans) {
+        for (const Span& span : thread.second) {
+            if (span.name == name) {
+                if (found && found != thread.first)
+                    return 0;
+
+                found = thread.first;
+            }
+        }
+    }
+
+    return found;
+}
+
+static bool Named(const Trace& trace, const char* name)
+{
+    return FindThread(trace, name) != 0;
+}
+
+static void TestNothingBeforeStart()
+{
+    Tracer::Start();
+    const uint64_t before = StatsClockNs();
+    Tracer::Record("first-run", before, before + 1000, -1);
+
+    // Starting again drops the first run, and spans that began before.
+    Tracer::Start();
+    const uint64_t now = StatsClockNs();
+    Tracer::Record("second-run", now, now + 1000, 1);
+    Tracer::Record("straddles", before, now + 1000, 2);
+    Tracer::Stop();
+    {
+        TRACE_SCOPE("stopped");
+    }
+
+    Trace trace;
+    CHECK(ReadTrace(&trace));
+    CHECK(Named(trace, "second-run"));
+    CHECK(!Named(trace, "first-run"));
+    CHECK(!Named(trace, "straddles"));
+    CHECK(!Named(trace, "stopped"));
+}
+
+static const int kThreadNum = 4;
+static const int kSpanNum = 1000;
+static const char* const kSpanNames[kThreadNum] = { "span-0", "span-1", "span-2", "span-3" };
+static const char* const kThreadNames[kThreadNum] = {
+    "worker", "quoted \"worker\"", "back\\slash", "worker 3",
+};
+
+// Spans 1 us apart and 0.5 us long, with the frame id of their order, from
+// threads that run at once. WriteJson is called while they record.
+static void TestThreads()
+{
+    Tracer::Start();
+    const uint64_t base = StatsClockNs();
+    std::vector<std::thread> threads;
+    for (int t = 0; t < kThreadNum; ++t) {
+        threads.emplace_back([t, base]() {
+            Tracer::SetThreadName(kThreadNames[t]);
+            for (int i = 0; i < kSpanNum; ++i) {
+                const uint64_t begin = base + (uint64_t)i * 1000;
+                Tracer::Record(kSpanNames[t], begin, begin + 500, i);
+            }
+        });
+    }
+
+    for (int i = 0; i < 20; ++i) {
+        Trace partial;
+        CHECK(ReadTrace(&partial));
+    }
+
+    for (std::thread& thread : threads)
+        thread.join();
+
+    Tracer::Stop();
+    Trace trace;
+    CHECK(ReadTrace(&trace));
+    for (int t = 0; t < kThreadNum; ++t) {
+        const uint32_t tid = FindThread(trace, kSpanNames[t]);
+        CHECK(tid != 0);
+        CHECK(trace.thread_names[tid] == kThreadNames[t]);
+
+        const std::vector<Span>& spans = trace.spans[tid];
+        CHECK(spans.size() == (size_t)kSpanNum);
+        bool in_order = true;
+        for (size_t i = 0; i < spans.size(); ++i) {
+            in_order &= spans[i].name == kSpanNames[t] && spans[i].frame == (int64_t)i;
+            in_order &= spans[i].dur > 0.499 && spans[i].dur < 0.501;
+            const double step = i ? spans[i].ts - spans[i - 1].ts : 1;
+            in_order &= step > 0.999 && step < 1.001;
+        }
+
+        CHECK(in_order);
+    }
+}
+
+// A ring that wrapped keeps its newest kRingCapacity spans.
+static void TestWraparound()
+{
+    const uint32_t extra = 1000;
+    const uint32_t count = Tracer::kRingCapacity + extra;
+    Tracer::Start();
+    std::thread thread([count]() {
+        const uint64_t base = StatsClockNs();
+        for (uint32_t i = 0; i < count; ++i)
+            Tracer::Record("wrapped", base + (uint64_t)i * 1000, base + (uint64_t)i * 1000 + 1, i);
+    });
+
+    thread.join();
+    Tracer::Stop();
+
+    Trace trace;
+    CHECK(ReadTrace(&trace));
+    const uint32_t tid = FindThread(trace, "wrapped");
+    CHECK(tid != 0);
+
+    const std::vector<Span>& spans = trace.spans[tid];
+    CHECK(spans.size() == Tracer::kRingCapacity);
+    bool newest = !spans.empty();
+    for (size_t i = 0; i < spans.size(); ++i)
+        newest &= spans[i].frame == (int64_t)(extra + i);
+
+    CHECK(newest);
+}
+
+int main()
+{
+    TestNothingBeforeStart();
+    TestThreads();
+    TestWraparound();
+    return CheckResult();
+}
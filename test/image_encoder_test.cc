@@ -0,0 +1,555 @@
+// PNGs from EncodePng read back by a decoder of their own: the signature,
+// the IHDR fields and the CRC of every chunk, the zlib header and Adler-32
+// of the IDAT stream, inflated here from scratch, and pixels that match
+// the image once rows are unfiltered. Noise and gradients of odd sizes,
+// bottom-up, over the deflate block and IDAT chunk sizes, with and
+// without a pool and with every filter tier.
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <vector>
+
+#include "check.h"
+#include "cpu_features.h"
+#include "file_util.h"
+#include "image_encoder.h"
+#include "worker_pool.h"
+
+static uint32_t Next(uint32_t* seed)
+{
+    *seed = *seed * 1664525u + 1013904223u;
+    return *seed >> 8;
+}
+
+// An inflater (RFC 1951) that decodes one bit at a time, kept simple
+// rather than fast, so that it shares nothing with deflate.cc.
+class Inflater
+{
+public:
+    Inflater(const uint8_t* data, size_t size) : data_(data), size_(size) {}
+
+    // False if the stream is not valid deflate or ends early.
+    bool Run(std::vector<uint8_t>* out)
+    {
+        int last = 0;
+        do {
+            last = Bits(1);
+            const int type = Bits(2);
+            bool ok = false;
+            if (type == 0)
+                ok = Stored(out);
+            else if (type == 1)
+                ok = Fixed(out);
+            else if (type == 2)
+                ok = Dynamic(out);
+
+            if (!ok || error_)
+                return false;
+        } while (!last);
+
+        return true;
+    }
+
+    // Bytes taken, the last one whole.
+    size_t Used() const { return pos_; }
+
+private:
+    struct Huffman {
+        uint16_t count[16];  // codes of each length
+        uint16_t symbol[288];  // by code
+    };
+
+    int Bits(int n)
+    {
+        uint32_t v = bits_;
+        while (bit_num_ < n) {
+            if (pos_ == size_) {
+                error_ = true;
+                return 0;
+            }
+
+            v |= (uint32_t)data_[pos_++] << bit_num_;
+            bit_num_ += 8;
+        }
+
+        bits_ = v >> n;
+        bit_num_ -= n;
+        return (int)(v & ((1u << n) - 1));
+    }
+
+    // False if |lengths| has more codes than fit.
+    static bool Build(Huffman* h, const uint8_t* lengths, int num)
+    {
+        memset(h->count, 0, sizeof(h->count));
+        for (int i = 0; i < num; ++i)
+            ++h->count[lengths[i]];
+
+        int left = 1;
+        for (int len = 1; len < 16; ++len) {
+            left = left * 2 - h->count[len];
+            if (left < 0)
+                return false;
+        }
+
+        uint16_t offset[16] = {};
+        for (int len = 1; len < 15; ++len)
+            offset[len + 1] = (uint16_t)(offset[len] + h->count[len]);
+
+        for (int i = 0; i < num; ++i) {
+            if (lengths[i])
+                h->symbol[offset[lengths[i]]++] = (uint16_t)i;
+        }
+
+        return true;
+    }
+
+    int Decode(const Huffman& h)
+    {
+        int code = 0;
+        int first = 0;
+        int index = 0;
+        for (int len = 1; len < 16; ++len) {
+            code |= Bits(1);
+            const int count = h.count[len];
+            if (code - first < count)
+                return h.symbol[index + code - first];
+
+            index += count;
+            first = (first + count) << 1;
+            code <<= 1;
+        }
+
+        error_ = true;
+        return -1;
+    }
+
+    bool Stored(std::vector<uint8_t>* out)
+    {
+        bits_ = 0;
+        bit_num_ = 0;
+        if (size_ - pos_ < 4)
+            return false;
+
+        const uint32_t len = data_[pos_] | data_[pos_ + 1] << 8;
+        const uint32_t nlen = data_[pos_ + 2] | data_[pos_ + 3] << 8;
+        pos_ += 4;
+        if (len != (~nlen & 0xFFFF) || size_ - pos_ < len)
+            return false;
+
+        out->insert(out->end(), data_ + pos_, data_ + pos_ + len);
+        pos_ += len;
+        return true;
+    }
+
+    bool Fixed(std::vector<uint8_t>* out)
+    {
+        uint8_t lengths[288 + 30];
+        for (int i = 0; i < 288; ++i)
+            lengths[i] = i < 144 ? 8 : i < 256 ? 9 : i < 280 ? 7 : 8;
+
+        for (int i = 0; i < 30; ++i)
+            lengths[288 + i] = 5;
+
+        Huffman lit, dist;
+        return Build(&lit, lengths, 288) && Build(&dist, lengths + 288, 30)
+            && Codes(lit, dist, out);
+    }
+
+    bool Dynamic(std::vector<uint8_t>* out)
+    {
+        static const uint8_t kOrder[19] = {
+            16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15,
+        };
+
+        const int lit_num = Bits(5) + 257;
+        const int dist_num = Bits(5) + 1;
+        const int code_len_num = Bits(4) + 4;
+        if (lit_num > 286 || dist_num > 30)
+            return false;
+
+        uint8_t lengths[286 + 30] = {};
+        for (int i = 0; i < code_len_num; ++i)
+            lengths[kOrder[i]] = (uint8_t)Bits(3);
+
+        Huffman code_len;
+        if (!Build(&code_len, lengths, 19))
+            return false;
+
+        int i = 0;
+        while (i < lit_num + dist_num && !error_) {
+            const int symbol = Decode(code_len);
+            if (symbol < 16) {
+                lengths[i++] = (uint8_t)symbol;
+                continue;
+            }
+
+            int len = 0;
+            int repeat = 0;
+            if (symbol == 16) {
+                if (i == 0)
+                    return false;
+
+                len = lengths[i - 1];
+                repeat = 3 + Bits(2);
+            } else if (symbol == 17) {
+                repeat = 3 + Bits(3);
+            } else {
+                repeat = 11 + Bits(7);
+            }
+
+            if (i + repeat > lit_num + dist_num)
+                return false;
+
+            while (repeat--)
+                lengths[i++] = (uint8_t)len;
+        }
+
+        Huffman lit, dist;
+        return !error_ && lengths[256] && Build(&lit, lengths, lit_num)
+            && Build(&dist, lengths + lit_num, dist_num) && Codes(lit, dist, out);
+    }
+
+    bool Codes(const Huffman& lit, const Huffman& dist, std::vector<uint8_t>* out)
+    {
+        static const uint16_t kLengthBase[29] = {
+            3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+            35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258,
+        };
+        static const uint8_t kLengthExtra[29] = {
+            0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+            3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0,
+        };
+        static const uint16_t kDistBase[30] = {
+            1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+            257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577,
+        };
+        static const uint8_t kDistExtra[30] = {
+            0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+            7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13,
+        };
+
+        for (;;) {
+            const int symbol = Decode(lit);
+            if (symbol < 0 || error_)
+                return false;
+
+            if (symbol < 256) {
+                out->push_back((uint8_t)symbol);
+                continue;
+            }
+
+            if (symbol == 256)
+                return true;
+
+            if (symbol > 285)
+                return false;
+
+            const size_t len = kLengthBase[symbol - 257] + Bits(kLengthExtra[symbol - 257]);
+            const int d = Decode(dist);
+            if (d < 0 || d > 29)
+                return false;
+
+            const size_t distance = kDistBase[d] + Bits(kDistExtra[d]);
+            if (error_ || distance > out->size())
+                return false;
+
+            for (size_t k = 0; k < len; ++k)
+                out->push_back((*out)[out->size() - distance]);
+        }
+    }
+
+    const uint8_t* data_;
+    size_t size_;
+    size_t pos_ = 0;
+    uint32_t bits_ = 0;
+    int bit_num_ = 0;
+    bool error_ = false;
+};
+
+// Adler-32 the slow way, to check deflate.cc's by.
+static uint32_t ReferenceAdler32(const std::vector<uint8_t>& data)
+{
+    uint32_t a = 1;
+    uint32_t b = 0;
+    for (uint8_t byte : data) {
+        a = (a + byte) % 65521;
+        b = (b + a) % 65521;
+    }
+
+    return b << 16 | a;
+}
+
+static uint32_t Be32(const uint8_t* p)
+{
+    return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+}
+
+static uint8_t Paeth(int a, int b, int c)
+{
+    const int pa = abs(b - c);
+    const int pb = abs(a - c);
+    const int pc = abs(a + b - 2 * c);
+    if (pa <= pb && pa <= pc)
+        return (uint8_t)a;
+
+    return (uint8_t)(pb <= pc ? b : c);
+}
+
+// The RGB rows of |png|, unfiltered, or nothing if any of it is wrong.
+static std::vector<uint8_t> DecodePng(const std::vector<uint8_t>& png, uint32_t width,
+    uint32_t height, size_t* idat_num)
+{
+    static const uint8_t kSignature[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n' };
+    const std::vector<uint8_t> none;
+    if (png.size() < 8 || memcmp(png.data(), kSignature, 8) != 0)
+        return none;
+
+    // Chunks: IHDR first, IDATs in a row, IEND last and empty.
+    std::vector<uint8_t> zlib;
+    bool header = false;
+    bool end = false;
+    bool in_idat = false;
+    *idat_num = 0;
+    size_t pos = 8;
+    while (pos < png.size()) {
+        if (end || png.size() - pos < 12)
+            return none;
+
+        const uint32_t size = Be32(&png[pos]);
+        if (size > png.size() - pos - 12)
+            return none;
+
+        const uint8_t* type = &png[pos + 4];
+        const uint8_t* data = type + 4;
+        if (Crc32(0, type, size + 4) != Be32(data + size))
+            return none;
+
+        if (memcmp(type, "IHDR", 4) == 0) {
+            const uint8_t rest[5] = { 8, 2, 0, 0, 0 };
+            if (header || pos != 8 || size != 13 || Be32(data) != width
+                || Be32(data + 4) != height || memcmp(data + 8, rest, 5) != 0)
+                return none;
+
+            header = true;
+        } else if (memcmp(type, "IDAT", 4) == 0) {
+            if (!header || (*idat_num && !in_idat))
+                return none;
+
+            zlib.insert(zlib.end(), data, data + size);
+            ++*idat_num;
+            in_idat = true;
+            pos += 12 + size;
+            continue;
+        } else if (memcmp(type, "IEND", 4) == 0) {
+            if (size != 0)
+                return none;
+
+            end = true;
+        } else {
+            return none;
+        }
+
+        in_idat = false;
+        pos += 12 + size;
+    }
+
+    // A zlib header of deflate with a 32 KB window and no dictionary, and
+    // the Adler-32 of what it inflates to right after the last block.
+    if (!end || zlib.size() < 6 || (zlib[0] << 8 | zlib[1]) % 31 != 0 || zlib[0] != 0x78
+        || (zlib[1] & 0x20))
+        return none;
+
+    std::vector<uint8_t> filtered;
+    Inflater inflater(zlib.data() + 2, zlib.size() - 2);
+    if (!inflater.Run(&filtered) || inflater.Used() != zlib.size() - 6
+        || Be32(&zlib[zlib.size() - 4]) != ReferenceAdler32(filtered))
+        return none;
+
+    const size_t row_bytes = (size_t)width * 3;
+    if (filtered.size() != (row_bytes + 1) * height)
+        return none;
+
+    std::vector<uint8_t> rgb(row_bytes * height);
+    for (uint32_t y = 0; y < height; ++y) {
+        const uint8_t* line = &filtered[(row_bytes + 1) * y];
+        uint8_t* row = &rgb[row_bytes * y];
+        const uint8_t* prev = y ? row - row_bytes : nullptr;
+        if (line[0] >= PNG_FILTER_NUM)
+            return none;
+
+        for (size_t i = 0; i < row_bytes; ++i) {
+            const int a = i >= 3 ? row[i - 3] : 0;
+            const int b = prev ? prev[i] : 0;
+            const int c = prev && i >= 3 ? prev[i - 3] : 0;
+            int predicted = 0;
+            switch (line[0]) {
+            case PNG_FILTER_SUB: predicted = a; break;
+            case PNG_FILTER_UP: predicted = b; break;
+            case PNG_FILTER_AVERAGE: predicted = (a + b) / 2; break;
+            case PNG_FILTER_PAETH: predicted = Paeth(a, b, c); break;
+            }
+
+            row[i] = (uint8_t)(line[1 + i] + predicted);
+        }
+    }
+
+    return rgb;
+}
+
+// A BGRA image with a padded stride, bottom-up if asked.
+struct TestImage {
+    std::vector<uint8_t> bytes;
+    BgraImage image;
+
+    TestImage(uint32_t width, uint32_t height, bool noise, bool bottom_up, uint32_t seed)
+        : bytes((size_t)(width * 4 + 12) * height)
+    {
+        const int32_t row = (int32_t)(width * 4 + 12);
+        for (uint32_t y = 0; y < height; ++y) {
+            uint8_t* p = bytes.data() + (size_t)row * y;
+            for (uint32_t x = 0; x < width * 4 + 12; ++x) {
+                if (noise)
+                    p[x] = (uint8_t)(Next(&seed) >> 16);  // the low bits repeat too soon
+                else
+                    p[x] = (uint8_t)(x % 4 == 0 ? x * 3 : x % 4 == 1 ? y * 5 : x + y * 2);
+            }
+        }
+
+        image.data = bytes.data() + (bottom_up ? (size_t)row * (height - 1) : 0);
+        image.stride = bottom_up ? -row : row;
+        image.width = width;
+        image.height = height;
+    }
+
+    bool Matches(const std::vector<uint8_t>& rgb) const
+    {
+        if (rgb.size() != (size_t)image.width * 3 * image.height)
+            return false;
+
+        const uint8_t* out = rgb.data();
+        for (uint32_t y = 0; y < image.height; ++y) {
+            const uint8_t* p = image.data + (intptr_t)y * image.stride;
+            for (uint32_t x = 0; x < image.width; ++x, p += 4, out += 3) {
+                if (out[0] != p[2] || out[1] != p[1] || out[2] != p[0])
+                    return false;
+            }
+        }
+
+        return true;
+    }
+};
+
+static std::vector<PNG_FILTER_ROW_FN> FilterTiers()
+{
+    std::vector<PNG_FILTER_ROW_FN> tiers;
+    tiers.push_back(PngFilterRow_C);
+#if CPU_X86
+    const CpuFeatures& cpu = GetCpuFeatures();
+    if (cpu.sse2)
+        tiers.push_back(PngFilterRow_SSE2);
+
+    if (cpu.avx2)
+        tiers.push_back(PngFilterRow_AVX2);
+#endif
+    return tiers;
+}
+
+// Every tier, with and without |pool|, gives the same file, and that file
+// decodes to the image.
+static bool RoundTrip(const TestImage& test, WorkerPool* pool, size_t* idat_num)
+{
+    std::vector<uint8_t> expected;
+    if (!EncodePng(test.image, nullptr, &expected, PngFilterRow_C))
+        return false;
+
+    bool same = true;
+    for (PNG_FILTER_ROW_FN tier : FilterTiers()) {
+        std::vector<uint8_t> png;
+        same &= EncodePng(test.image, pool, &png, tier) && png == expected;
+    }
+
+    if (!same) {
+        fprintf(stderr, "%ux%u differs between tiers or with a pool\n",
+            test.image.width, test.image.height);
+    }
+
+    return same && test.Matches(DecodePng(expected, test.image.width, test.image.height, idat_num));
+}
+
+static void TestSizes()
+{
+    static const uint32_t kSizes[][2] = {
+        { 1, 1 }, { 2, 1 }, { 1, 3 }, { 3, 2 }, { 5, 7 }, { 17, 5 }, { 33, 31 },
+        { 64, 33 }, { 101, 65 }, { 333, 97 },
+    };
+
+    WorkerPool pool(3);
+    uint32_t seed = 1;
+    for (const auto& size : kSizes) {
+        for (int noise = 0; noise < 2; ++noise) {
+            for (int bottom_up = 0; bottom_up < 2; ++bottom_up) {
+                const TestImage test(size[0], size[1], noise != 0, bottom_up != 0, Next(&seed));
+                size_t idat_num = 0;
+                CHECK(RoundTrip(test, &pool, &idat_num));
+                CHECK(idat_num == 1);
+            }
+        }
+    }
+}
+
+// Past one deflate block, where blocks are compressed at once on the
+// pool, and past one IDAT chunk.
+static void TestLarge()
+{
+    WorkerPool pool(3);
+    size_t idat_num = 0;
+    const TestImage gradient(1023, 301, false, false, 7);
+    CHECK(RoundTrip(gradient, &pool, &idat_num));
+
+    const TestImage noise(703, 601, true, true, 9);
+    CHECK(RoundTrip(noise, &pool, &idat_num));
+    CHECK(idat_num == 2);
+}
+
+// The decoder finds a wrong CRC and a wrong Adler-32, so that it does not
+// pass anything.
+static void TestDamaged()
+{
+    const TestImage test(19, 11, true, false, 3);
+    std::vector<uint8_t> png;
+    CHECK(EncodePng(test.image, nullptr, &png));
+    size_t idat_num = 0;
+    CHECK(test.Matches(DecodePng(png, 19, 11, &idat_num)));
+
+    // The last byte of the IHDR CRC.
+    std::vector<uint8_t> damaged = png;
+    damaged[8 + 12 + 13 - 1] ^= 1;
+    CHECK(DecodePng(damaged, 19, 11, &idat_num).empty());
+
+    // The last byte of the Adler-32, with the IDAT CRC made right again.
+    damaged = png;
+    const size_t idat = 8 + 12 + 13;
+    const uint32_t size = Be32(&damaged[idat]);
+    damaged[idat + 8 + size - 1] ^= 1;
+    const uint32_t crc = Crc32(0, &damaged[idat + 4], size + 4);
+    for (int i = 0; i < 4; ++i)
+        damaged[idat + 8 + size + i] = (uint8_t)(crc >> (24 - 8 * i));
+
+    CHECK(DecodePng(damaged, 19, 11, &idat_num).empty());
+
+    // Sizes EncodePng turns down.
+    BgraImage empty = test.image;
+    empty.width = 0;
+    CHECK(!EncodePng(empty, nullptr, &png));
+}
+
+int main()
+{
+    TestSizes();
+    TestLarge();
+    TestDamaged();
+    return CheckResult();
+}
@@ -0,0 +1,251 @@
+// The SSE2 and AVX2 conversions against the scalar ones they must match
+// byte for byte: every YUV format, every matrix and range, mirrored or
+// not, into top-down and bottom-up targets, at widths and heights that
+// leave vector tails and odd chroma rows. Sources are exactly as large
+// as the frame, so that a kernel reading past them shows under ASan.
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <vector>
+
+#include "check.h"
+#include "cpu_features.h"
+#include "image_transform.h"
+#include "yuv_format.h"
+
+static const uint32_t kWidths[] = { 1, 2, 3, 7, 8, 9, 15, 16, 17, 31, 33, 47, 64, 101 };
+static const uint32_t kHeights[] = { 1, 2, 3, 5, 8 };
+static const uint8_t kGuard = 0xA5;
+
+struct Tier {
+    const char* name;
+    IMAGE_TRANSFORM_FN xform;
+};
+
+static uint32_t Next(uint32_t* seed)
+{
+    *seed = *seed * 1664525u + 1013904223u;
+    return *seed >> 8;
+}
+
+// A target |width| x |height| with a guard row above and below and guard
+// bytes at the end of every row.
+struct Target {
+    std::vector<uint8_t> bytes;
+    int32_t row;
+    uint32_t height;
+
+    Target(uint32_t width, uint32_t height)
+        : bytes((size_t)(width * 4 + 8) * (height + 2), kGuard),
+        row((int32_t)(width * 4 + 8)), height(height)
+    {
+    }
+
+    TargetImage Image(bool bottom_up, bool mirror)
+    {
+        TargetImage dst = {};
+        dst.data = bytes.data() + row * (bottom_up ? height : 1);
+        dst.stride = bottom_up ? -row : row;
+        dst.mirror = mirror;
+        return dst;
+    }
+};
+
+// Converts one random frame with every tier; false if any differs from
+// the first, which is the scalar one, or writes outside the frame.
+static bool SameOutput(const std::vector<Tier>& tiers, const ImageTransformEntry& entry,
+    uint32_t width, uint32_t height, int32_t stride, const YuvConstants* yuv,
+    bool mirror, bool bottom_up, uint32_t* seed)
+{
+    std::vector<uint8_t> source(SourceImageBytes(entry.layout, stride, height));
+    for (uint8_t& b : source)
+        b = (uint8_t)Next(seed);
+
+    const uint8_t* scanline0 = stride < 0 ? source.data() + source.size() + stride : source.data();
+    SourceImage src = MakeSourceImage(entry.layout, scanline0, stride, height);
+    src.yuv = yuv;
+
+    Target expected(width, height);
+    tiers[0].xform(expected.Image(bottom_up, mirror), src, width, height);
+
+    bool same = true;
+    for (size_t i = 1; i < tiers.size(); ++i) {
+        Target actual(width, height);
+        tiers[i].xform(actual.Image(bottom_up, mirror), src, width, height);
+        if (actual.bytes != expected.bytes) {
+            fprintf(stderr, "%s %.4s at %ux%u, stride %d, mirror %d, bottom-up %d differs\n",
+                tiers[i].name, (const char*)&entry.format, width, height, stride,
+                mirror, bottom_up);
+            same = false;
+        }
+    }
+
+    // The guards of the scalar output are untouched, and it set alpha.
+    for (uint32_t y = 0; y < height + 2; ++y) {
+        const uint8_t* p = expected.bytes.data() + (size_t)y * expected.row;
+        for (uint32_t x = 0; x < width * 4 + 8; ++x) {
+            const bool inside = y > 0 && y <= height && x < width * 4;
+            if (!inside && p[x] != kGuard)
+                same = false;
+
+            if (inside && x % 4 == 3 && p[x] != 0xFF)
+                same = false;
+        }
+    }
+
+    return same;
+}
+
+template <class Format>
+static std::vector<Tier> YuvTiers()
+{
+    std::vector<Tier> tiers;
+    tiers.push_back({ "c", TransformYuv<Format> });
+#if CPU_X86
+    const CpuFeatures& cpu = GetCpuFeatures();
+    if (cpu.sse2)
+        tiers.push_back({ "sse2", TransformYuv_SSE2<Format> });
+
+    if (cpu.avx2)
+        tiers.push_back({ "avx2", TransformYuv_AVX2<Format> });
+#endif
+    return tiers;
+}
+
+// Every size with the tightest stride the format allows and with one
+// padded to 64 bytes, packed frames upside down too, in each matrix and
+// range.
+static bool CheckTiers(const std::vector<Tier>& tiers, const ImageTransformEntry& entry)
+{
+    static const YuvMatrix kMatrices[] = { YUV_MATRIX_BT601, YUV_MATRIX_BT709, YUV_MATRIX_BT2020 };
+
+    uint32_t seed = entry.format;
+    bool same = true;
+    for (uint32_t width : kWidths) {
+        for (uint32_t height : kHeights) {
+            const int32_t tight = (int32_t)SourceRowBytes(entry, width);
+            const int32_t padded = (tight + 63) & ~63;
+            const int32_t strides[] = { tight, padded, -tight };
+            for (int32_t stride : strides) {
+                if (!SourceImageFits(entry, stride, SourceImageBytes(entry.layout, stride, height),
+                    width, height))
+                    continue;
+
+                for (int m = 0; m < 3; ++m) {
+                    for (int full = 0; full < 2; ++full) {
+                        const YuvConstants* k = GetYuvConstants(kMatrices[m], full != 0);
+                        for (int mirror = 0; mirror < 2; ++mirror) {
+                            same &= SameOutput(tiers, entry, width, height, stride, k,
+                                mirror != 0, (width + height + m) % 2 != 0, &seed);
+                        }
+                    }
+                }
+            }
+        }
+    }
+
+    return same;
+}
+
+#define CHECK_YUV_FORMAT(Format) \
+    CHECK(CheckTiers(YuvTiers<Format>(), *FindImageTransform(Format::fourcc)));
+
+static void TestYuv()
+{
+    FOR_EACH_YUV_FORMAT(CHECK_YUV_FORMAT)
+}
+
+static void TestRgb32()
+{
+    std::vector<Tier> tiers;
+    tiers.push_back({ "c", TransformImage_RGB32 });
+#if CPU_X86
+    const CpuFeatures& cpu = GetCpuFeatures();
+    if (cpu.sse2)
+        tiers.push_back({ "sse2", TransformImage_RGB32_SSE2 });
+
+    if (cpu.avx2)
+        tiers.push_back({ "avx2", TransformImage_RGB32_AVX2 });
+#endif
+
+    // D3DFMT_X8R8G8B8.
+    const ImageTransformEntry& entry = *FindImageTransform(22);
+    uint32_t seed = 22;
+    bool same = true;
+    for (uint32_t width : kWidths) {
+        for (uint32_t height : kHeights) {
+            for (int mirror = 0; mirror < 2; ++mirror) {
+                const int32_t stride = (int32_t)(width * 4);
+                std::vector<uint8_t> source((size_t)stride * height);
+                for (uint8_t& b : source)
+                    b = (uint8_t)Next(&seed);
+
+                const SourceImage src = MakeSourceImage(entry.layout, source.data(), stride, height);
+                Target expected(width, height);
+                tiers[0].xform(expected.Image(false, mirror != 0), src, width, height);
+                for (size_t i = 1; i < tiers.size(); ++i) {
+                    Target actual(width, height);
+                    tiers[i].xform(actual.Image(false, mirror != 0), src, width, height);
+                    same &= actual.bytes == expected.bytes;
+                }
+            }
+        }
+    }
+
+    CHECK(same);
+}
+
+// A few values of each matrix, from the scalar kernel, so that the tiers
+// do not agree on something wrong.
+static void TestReference()
+{
+    struct Case {
+        YuvMatrix matrix;
+        bool full_range;
+        uint8_t y, cb, cr;
+        uint8_t b, g, r;
+    };
+
+    static const Case kCases[] = {
+        { YUV_MATRIX_BT601, false, 16, 128, 128, 0, 0, 0 },
+        { YUV_MATRIX_BT601, false, 235, 128, 128, 255, 255, 255 },
+        { YUV_MATRIX_BT601, true, 0, 128, 128, 0, 0, 0 },
+        { YUV_MATRIX_BT601, true, 255, 128, 128, 255, 255, 255 },
+        { YUV_MATRIX_BT601, false, 81, 90, 240, 0, 0, 255 },
+        { YUV_MATRIX_BT709, false, 63, 102, 240, 0, 0, 255 },
+        { YUV_MATRIX_BT2020, false, 74, 97, 240, 0, 0, 255 },
+        { YUV_MATRIX_BT709, true, 128, 128, 128, 128, 128, 128 },
+    };
+
+    bool close = true;
+    for (const Case& c : kCases) {
+        // One YUY2 macropixel of two equal pixels.
+        const uint8_t yuy2[4] = { c.y, c.cb, c.y, c.cr };
+        SourceImage src = MakeSourceImage(PLANE_LAYOUT_PACKED, yuy2, 4, 1);
+        src.yuv = GetYuvConstants(c.matrix, c.full_range);
+
+        uint8_t out[8] = {};
+        TargetImage dst = {};
+        dst.data = out;
+        dst.stride = 8;
+        TransformYuv<FormatYUY2>(dst, src, 2, 1);
+
+        const uint8_t want[3] = { c.b, c.g, c.r };
+        for (int i = 0; i < 3; ++i) {
+            const int d = out[i] - want[i];
+            close &= d >= -2 && d <= 2 && out[4 + i] == out[i];
+        }
+    }
+
+    CHECK(close);
+}
+
+int main()
+{
+    TestReference();
+    TestYuv();
+    TestRgb32();
+    return CheckResult();
+}
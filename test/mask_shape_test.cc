@@ -0,0 +1,166 @@
+// BuildShapeMask against coverage from 16 x 16 samples per pixel, at
+// display sizes and at odd and thin ones. Circles and rounded rectangles
+// must be within kTolerance, ellipses of any shape within
+// kEllipseTolerance.
+
+#include <math.h>
+#include <stdint.h>
+
+#include <vector>
+
+#include "check.h"
+#include "mask_shape.h"
+
+static const double kTolerance = 0.07;
+static const double kEllipseTolerance = 0.19;
+static const int kSamples = 16;
+
+// The shapes as BuildShapeMask places them, by whether a point is inside.
+static bool Inside(MaskShape shape, uint32_t width, uint32_t height, double x, double y)
+{
+    switch (shape) {
+    case MASK_SHAPE_CIRCLE: {
+        const uint32_t ox = width / 2;
+        const double r = ox < height / 2 ? ox : height / 2;
+        const double dx = x - ox;
+        const double dy = y - r;
+        return dx * dx + dy * dy <= r * r;
+    }
+
+    case MASK_SHAPE_ELLIPSE: {
+        const double a = width / 2.0;
+        const double b = height / 2.0;
+        const double nx = (x - a) / a;
+        const double ny = (y - b) / b;
+        return nx * nx + ny * ny <= 1;
+    }
+
+    case MASK_SHAPE_ROUNDED_RECT: {
+        const double hw = width / 2.0;
+        const double hh = height / 2.0;
+        const double r = (hw < hh ? hw : hh) / 4;
+        const double qx = fabs(x - hw) - (hw - r);
+        const double qy = fabs(y - hh) - (hh - r);
+        if (qx <= 0 || qy <= 0)
+            return fabs(x - hw) <= hw && fabs(y - hh) <= hh;
+
+        return qx * qx + qy * qy <= r * r;
+    }
+    }
+
+    return false;
+}
+
+// The mask as one byte per pixel; false if its runs overlap, go back or
+// leave the row.
+static bool Dense(const SpanMask& mask, std::vector<uint8_t>* dense)
+{
+    const uint32_t width = mask.Width();
+    dense->assign((size_t)width * mask.Height(), 0);
+    for (uint32_t y = 0; y < mask.Height(); ++y) {
+        uint32_t x = 0;
+        for (const SpanMask::Run* run = mask.RowBegin(y); run != mask.RowEnd(y); ++run) {
+            if (run->x < x || run->length > width - run->x)
+                return false;
+
+            for (uint32_t i = 0; i < run->length; ++i)
+                (*dense)[(size_t)y * width + run->x + i] = run->opaque ? 255 : mask.Coverage(*run)[i];
+
+            x = run->x + run->length;
+        }
+    }
+
+    return true;
+}
+
+// The largest difference from the sampled coverage, or 2 if the mask is
+// malformed.
+static double WorstError(MaskShape shape, uint32_t width, uint32_t height)
+{
+    SpanMask mask;
+    BuildShapeMask(shape, width, height, &mask);
+
+    std::vector<uint8_t> dense;
+    if (mask.Width() != width || mask.Height() != height || !Dense(mask, &dense))
+        return 2;
+
+    double worst = 0;
+    for (uint32_t y = 0; y < height; ++y) {
+        for (uint32_t x = 0; x < width; ++x) {
+            int inside = 0;
+            for (int sy = 0; sy < kSamples; ++sy) {
+                for (int sx = 0; sx < kSamples; ++sx) {
+                    inside += Inside(shape, width, height,
+                        x + (sx + 0.5) / kSamples, y + (sy + 0.5) / kSamples);
+                }
+            }
+
+            const double error = fabs(dense[(size_t)y * width + x] / 255.0
+                - (double)inside / (kSamples * kSamples));
+            if (error > worst)
+                worst = error;
+        }
+    }
+
+    return worst;
+}
+
+static void TestCoverage()
+{
+    // Display sizes, then odd ones and thin ones.
+    static const uint32_t kFixedSizes[][2] = {
+        { 640, 480 }, { 480, 640 }, { 320, 180 }, { 101, 99 }, { 600, 40 }, { 33, 250 },
+        { 116, 5 }, { 7, 300 },
+    };
+
+    std::vector<uint32_t> sizes;
+    for (const auto& size : kFixedSizes) {
+        sizes.push_back(size[0]);
+        sizes.push_back(size[1]);
+    }
+
+    uint32_t seed = 2;
+    for (int i = 0; i < 40; ++i) {
+        seed = seed * 1664525u + 1013904223u;
+        sizes.push_back(4 + (seed >> 8) % 120);
+        seed = seed * 1664525u + 1013904223u;
+        sizes.push_back(4 + (seed >> 8) % 120);
+    }
+
+    for (int shape = MASK_SHAPE_CIRCLE; shape <= MASK_SHAPE_ROUNDED_RECT; ++shape) {
+        const double tolerance = shape == MASK_SHAPE_ELLIPSE ? kEllipseTolerance : kTolerance;
+        for (size_t i = 0; i < sizes.size(); i += 2) {
+            const double worst = WorstError((MaskShape)shape, sizes[i], sizes[i + 1]);
+            if (worst > tolerance) {
+                fprintf(stderr, "shape %d at %ux%u: off by %.3f\n",
+                    shape, sizes[i], sizes[i + 1], worst);
+            }
+
+            CHECK(worst <= tolerance);
+        }
+    }
+}
+
+static void TestCache()
+{
+    MaskCache cache;
+    const SpanMask* first = &cache.Get(MASK_SHAPE_CIRCLE, 640, 480);
+    for (uint32_t i = 0; i < 11; ++i)
+        cache.Get(MASK_SHAPE_CIRCLE, 100 + i, 100);
+
+    // Twelve masks fit, so the first is still there, and as it was just
+    // used, more masks push out the others first.
+    CHECK(&cache.Get(MASK_SHAPE_CIRCLE, 640, 480) == first);
+    cache.Get(MASK_SHAPE_ELLIPSE, 5, 5);
+    const SpanMask& again = cache.Get(MASK_SHAPE_CIRCLE, 100, 100);
+    CHECK(again.Width() == 100 && again.Height() == 100);
+    CHECK(&cache.Get(MASK_SHAPE_CIRCLE, 640, 480) == first);
+    CHECK(first->Width() == 640 && first->Height() == 480);
+}
+
+int main()
+{
+    TestCoverage();
+    TestCache();
+    return CheckResult();
+}
@@ -0,0 +1,346 @@
+// Frames from a synthetic source through a slow stage into a null sink:
+// they arrive whole and in order, each drop policy drops the frames it
+// says it does, a queue that waits holds the producer back, Flush drains
+// every stage, and Stop lets go of a producer or a Flush that waits.
+
+#include <stdint.h>
+#include <string.h>
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "check.h"
+#include "frame_pool.h"
+#include "pipeline.h"
+
+static const uint32_t kWidth = 16;
+static const uint32_t kHeight = 4;
+
+static uint8_t Pixel(int64_t n, size_t i)
+{
+    return (uint8_t)(n * 13 + i);
+}
+
+// Frame n has timestamp n and bytes that tell it from the others.
+class Source
+{
+public:
+    FrameRef Next()
+    {
+        const FrameFormat format = { kFrameFormatBgra, kWidth, kHeight, (int32_t)(kWidth * 4) };
+        FrameRef frame = pool_.Acquire(format);
+        frame->SetTimestamp(next_);
+        for (size_t i = 0; i < kWidth * 4 * kHeight; ++i)
+            frame->Data()[i] = Pixel(next_, i);
+
+        ++next_;
+        return frame;
+    }
+
+private:
+    FramePool pool_;
+    int64_t next_ = 0;
+};
+
+// Sleeps on every frame, or holds it until let go, and says when it has
+// one.
+class SlowStage : public PipelineStage
+{
+public:
+    explicit SlowStage(bool gated = false) : closed_(gated) {}
+
+    const char* Name() const override { return "slow"; }
+
+    bool Process(FrameRef* frame) override
+    {
+        std::unique_lock<std::mutex> lock(mtx_);
+        ++entered_;
+        cv_.notify_all();
+        const bool gated = closed_;
+        cv_.wait(lock, [&]() { return !closed_; });
+        lock.unlock();
+
+        if (!gated)
+            std::this_thread::sleep_for(std::chrono::microseconds(200));
+
+        return (bool)*frame;
+    }
+
+    // Until |n| frames reached Process.
+    void WaitEntered(int n)
+    {
+        std::unique_lock<std::mutex> lock(mtx_);
+        cv_.wait(lock, [&]() { return entered_ >= n; });
+    }
+
+    void Open()
+    {
+        std::unique_lock<std::mutex> lock(mtx_);
+        closed_ = false;
+        cv_.notify_all();
+    }
+
+private:
+    std::mutex mtx_;
+    std::condition_variable cv_;
+    bool closed_;
+    int entered_ = 0;
+};
+
+// Keeps the timestamps of what reaches it, and whether every frame was
+// whole.
+class NullSink : public PipelineStage
+{
+public:
+    const char* Name() const override { return "sink"; }
+
+    bool Process(FrameRef* frame) override
+    {
+        const Frame& f = **frame;
+        bool same = f.Width() == kWidth && f.Height() == kHeight;
+        for (size_t i = 0; same && i < kWidth * 4 * kHeight; ++i)
+            same = f.Data()[i] == Pixel(f.Timestamp(), i);
+
+        std::unique_lock<std::mutex> lock(mtx_);
+        whole_ &= same;
+        seen_.push_back(f.Timestamp());
+        return true;
+    }
+
+    std::vector<int64_t> Seen() const
+    {
+        std::unique_lock<std::mutex> lock(mtx_);
+        return seen_;
+    }
+
+    bool Whole() const
+    {
+        std::unique_lock<std::mutex> lock(mtx_);
+        return whole_;
+    }
+
+private:
+    mutable std::mutex mtx_;
+    std::vector<int64_t> seen_;
+    bool whole_ = true;
+};
+
+static StageConfig Config(uint32_t depth, DropPolicy drop)
+{
+    StageConfig config;
+    config.queue_depth = depth;
+    config.drop = drop;
+    return config;
+}
+
+// Whether |flag| is set within a few seconds.
+static bool BecomesTrue(const std::atomic<bool>& flag)
+{
+    for (int i = 0; i < 5000 && !flag; ++i)
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+
+    return flag;
+}
+
+// Nothing is lost when the queues wait, and frames come out as they went
+// in, through three stages that run at once.
+static void TestOrder()
+{
+    static const int kFrameNum = 300;
+
+    Source source;
+    SlowStage slow;
+    SlowStage slow2;
+    NullSink sink;
+    Pipeline pipeline;
+    pipeline.AddStage(&slow, Config(2, DROP_NONE));
+    pipeline.AddStage(&slow2, Config(3, DROP_NONE));
+    pipeline.AddStage(&sink, Config(1, DROP_NONE));
+    pipeline.Start();
+
+    bool pushed = true;
+    for (int n = 0; n < kFrameNum; ++n)
+        pushed &= pipeline.Push(source.Next());
+
+    pipeline.Flush();
+    CHECK(pushed);
+
+    // Flush came back with every frame through the sink.
+    const std::vector<int64_t> seen = sink.Seen();
+    bool in_order = seen.size() == (size_t)kFrameNum;
+    for (size_t i = 0; in_order && i < seen.size(); ++i)
+        in_order = seen[i] == (int64_t)i;
+
+    CHECK(in_order);
+    CHECK(sink.Whole());
+    for (size_t i = 0; i < pipeline.StageNum(); ++i) {
+        const StageStats stats = pipeline.Stats(i);
+        CHECK(stats.processed == (uint64_t)kFrameNum && stats.dropped == 0);
+    }
+
+    // A second Flush has nothing to wait for.
+    pipeline.Flush();
+    CHECK(sink.Seen().size() == (size_t)kFrameNum);
+    pipeline.Stop();
+}
+
+// The slow stage holds frame 0 while 1 to 5 arrive at its queue of two.
+// DROP_OLDEST keeps 4 and 5, DROP_NEWEST keeps 1 and 2.
+static void TestDropPolicy(DropPolicy drop, const std::vector<int64_t>& expected)
+{
+    Source source;
+    SlowStage slow(true);
+    NullSink sink;
+    Pipeline pipeline;
+    pipeline.AddStage(&slow, Config(2, drop));
+    pipeline.AddStage(&sink, Config(8, DROP_NONE));
+    pipeline.Start();
+
+    CHECK(pipeline.Push(source.Next()));
+    slow.WaitEntered(1);
+
+    std::vector<bool> pushed;
+    for (int n = 1; n <= 5; ++n)
+        pushed.push_back(pipeline.Push(source.Next()));
+
+    slow.Open();
+    pipeline.Flush();
+
+    // Push says which frames the queue turned away, but not which it let
+    // go of later.
+    if (drop == DROP_NEWEST)
+        CHECK(pushed == std::vector<bool>({ true, true, false, false, false }));
+    else
+        CHECK(pushed == std::vector<bool>(5, true));
+
+    CHECK(sink.Seen() == expected);
+    CHECK(sink.Whole());
+    const StageStats stats = pipeline.Stats(0);
+    CHECK(stats.processed == 3 && stats.dropped == 3);
+    CHECK(pipeline.Stats(1).processed == 3);
+    pipeline.Stop();
+}
+
+// With DROP_NONE, a producer that finds the queue full waits until the
+// stage takes a frame, and Stop lets go of one that would wait forever.
+static void TestBackPressure()
+{
+    Source source;
+    SlowStage slow(true);
+    NullSink sink;
+    Pipeline pipeline;
+    pipeline.AddStage(&slow, Config(2, DROP_NONE));
+    pipeline.AddStage(&sink, Config(8, DROP_NONE));
+    pipeline.Start();
+
+    CHECK(pipeline.Push(source.Next()));
+    slow.WaitEntered(1);
+    CHECK(pipeline.Push(source.Next()));
+    CHECK(pipeline.Push(source.Next()));
+
+    std::atomic<bool> returned{ false };
+    bool pushed = false;
+    FrameRef next = source.Next();
+    std::thread producer([&]() {
+        pushed = pipeline.Push(std::move(next));
+        returned = true;
+    });
+
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    CHECK(!returned);
+    slow.Open();
+    CHECK(BecomesTrue(returned));
+    producer.join();
+    CHECK(pushed);
+
+    pipeline.Flush();
+    CHECK(sink.Seen() == std::vector<int64_t>({ 0, 1, 2, 3 }));
+    CHECK(pipeline.Stats(0).dropped == 0);
+    pipeline.Stop();
+
+    // Stop while the stage holds a frame and the producer waits for room:
+    // the producer comes back with false before the stage is let go.
+    SlowStage held(true);
+    Pipeline stopped;
+    stopped.AddStage(&held, Config(1, DROP_NONE));
+    stopped.Start();
+    CHECK(stopped.Push(source.Next()));
+    held.WaitEntered(1);
+    CHECK(stopped.Push(source.Next()));
+
+    returned = false;
+    pushed = true;
+    FrameRef last = source.Next();
+    std::thread waiting([&]() {
+        pushed = stopped.Push(std::move(last));
+        returned = true;
+    });
+
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    CHECK(!returned);
+
+    std::thread stopper([&]() { stopped.Stop(); });
+    CHECK(BecomesTrue(returned));
+    CHECK(!pushed);
+    waiting.join();
+    held.Open();
+    stopper.join();
+}
+
+// A Flush that waits on a stage returns when the pipeline is stopped,
+// without waiting for the stage; one after Stop returns at once.
+static void TestFlushStop()
+{
+    Source source;
+    SlowStage slow(true);
+    NullSink sink;
+    Pipeline pipeline;
+    pipeline.AddStage(&slow, Config(4, DROP_NONE));
+    pipeline.AddStage(&sink, Config(4, DROP_NONE));
+    pipeline.Start();
+
+    for (int n = 0; n < 3; ++n)
+        CHECK(pipeline.Push(source.Next()));
+
+    slow.WaitEntered(1);
+    std::atomic<bool> flushed{ false };
+    std::thread flusher([&]() {
+        pipeline.Flush();
+        flushed = true;
+    });
+
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    CHECK(!flushed);
+
+    std::thread stopper([&]() { pipeline.Stop(); });
+    CHECK(BecomesTrue(flushed));
+    flusher.join();
+    slow.Open();
+    stopper.join();
+
+    // Frames still queued at Stop are let go; frame 0 finishes the stage
+    // but no stage takes it after.
+    CHECK(sink.Seen().empty());
+    pipeline.Flush();
+
+    // Started again, the pipeline runs from empty queues.
+    pipeline.Start();
+    CHECK(pipeline.Push(source.Next()));
+    pipeline.Flush();
+    CHECK(sink.Seen() == std::vector<int64_t>({ 3 }));
+    pipeline.Stop();
+}
+
+int main()
+{
+    TestOrder();
+    TestDropPolicy(DROP_OLDEST, { 0, 4, 5 });
+    TestDropPolicy(DROP_NEWEST, { 0, 1, 2 });
+    TestBackPressure();
+    TestFlushStop();
+    return CheckResult();
+}
@@ -0,0 +1,303 @@
+// Frames written by FrameRecorder and read back by RecordingReader: byte
+// for byte, top-down and bottom-up, with the index rebuilt when the file
+// is cut short, and records that are damaged or too short for a frame of
+// the file's format left out.
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "capture_mode.h"
+#include "check.h"
+#include "file_util.h"
+#include "raw_recording.h"
+#include "yuv_format.h"
+
+static const char kPath[] = "raw_recording_test.wcr";
+static const char kDamagedPath[] = "raw_recording_test_damaged.wcr";
+
+// Offsets in the file header and in a record header, as raw_recording.cc
+// lays them out.
+static const size_t kHeaderBytes = 64;
+static const size_t kWidthAt = 20;
+static const size_t kStrideAt = 16;
+static const size_t kDataOffsetAt = 20;
+static const size_t kBytesAt = 24;
+
+static const uint32_t kWidth = 37;
+static const uint32_t kHeight = 9;
+static const int32_t kStride = 80;  // 76 bytes of YUY2, padded
+static const size_t kFrameBytes = (size_t)kStride * kHeight;
+static const size_t kRecordBytes = kHeaderBytes + 768;  // frame padded to 64
+static const int kFrameNum = 12;
+
+static RecordingInfo Yuy2Info()
+{
+    RecordingInfo info = {};
+    info.format.fourcc = FormatYUY2::fourcc;
+    info.format.width = kWidth;
+    info.format.height = kHeight;
+    info.format.fps_num = 30;
+    info.format.fps_den = 1;
+    info.subtype[0] = 0x59;
+    info.subtype[15] = 0x71;
+    return info;
+}
+
+static std::vector<uint8_t> FrameBytes(int n, size_t size)
+{
+    std::vector<uint8_t> bytes(size);
+    for (size_t i = 0; i < size; ++i)
+        bytes[i] = (uint8_t)(i * 7 + n * 31);
+
+    return bytes;
+}
+
+// Even frames are top-down, odd ones bottom-up, with scan line 0 in the
+// last row of their bytes.
+static RawFrame MakeFrame(const RecordingInfo& info, int n, const std::vector<uint8_t>& bytes)
+{
+    RawFrame frame = {};
+    frame.format = info.format;
+    frame.stride = n % 2 ? -kStride : kStride;
+    frame.data = bytes.data() + (n % 2 ? bytes.size() - kStride : 0);
+    frame.size = bytes.size();
+    frame.timestamp = 333333 * n;
+    frame.flags = (uint32_t)n;
+    return frame;
+}
+
+// Frames that are dropped because the writer fell behind are written
+// again.
+static bool WriteAll(FrameRecorder* recorder, const RawFrame& frame)
+{
+    for (int tries = 0; tries < 1000; ++tries) {
+        if (recorder->Write(frame))
+            return true;
+
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+
+    return false;
+}
+
+static bool Record(const std::string& path, const RecordingInfo& info, int frame_num,
+    size_t frame_bytes)
+{
+    FrameRecorder recorder;
+    if (!recorder.Open(path, info))
+        return false;
+
+    bool ok = true;
+    for (int n = 0; n < frame_num; ++n) {
+        const std::vector<uint8_t> bytes = FrameBytes(n, frame_bytes);
+        ok &= WriteAll(&recorder, MakeFrame(info, n, bytes));
+    }
+
+    return recorder.Close() && ok && recorder.Written() == (uint64_t)frame_num;
+}
+
+static std::vector<uint8_t> ReadAll(const std::string& path)
+{
+    std::vector<uint8_t> data;
+    FILE* file = OpenFileForRead(path);
+    if (!file)
+        return data;
+
+    uint8_t buffer[4096];
+    size_t n = 0;
+    while ((n = fread(buffer, 1, sizeof(buffer), file)) > 0)
+        data.insert(data.end(), buffer, buffer + n);
+
+    fclose(file);
+    return data;
+}
+
+static bool WriteAll(const std::string& path, const uint8_t* data, size_t size)
+{
+    FILE* file = CreateFileForWrite(path);
+    if (!file)
+        return false;
+
+    const bool ok = fwrite(data, 1, size, file) == size;
+    return (fclose(file) == 0) && ok;
+}
+
+// Whether frame |n| of |reader| is the one Record wrote.
+static bool SameFrame(const RecordingReader& reader, size_t n)
+{
+    const std::vector<uint8_t> bytes = FrameBytes((int)n, kFrameBytes);
+    const RawFrame expected = MakeFrame(reader.Info(), (int)n, bytes);
+    const RawFrame frame = reader.Frame(n);
+    const uint8_t* begin = frame.data - (frame.stride < 0 ? frame.size - kStride : 0);
+    return frame.stride == expected.stride && frame.size == expected.size
+        && frame.timestamp == expected.timestamp && frame.flags == expected.flags
+        && frame.format.fourcc == FormatYUY2::fourcc && frame.format.width == kWidth
+        && frame.format.height == kHeight && memcmp(begin, bytes.data(), bytes.size()) == 0;
+}
+
+static void TestRoundTrip()
+{
+    const RecordingInfo info = Yuy2Info();
+    CHECK(Record(kPath, info, kFrameNum, kFrameBytes));
+
+    RecordingReader reader;
+    CHECK(reader.Open(kPath));
+    CHECK(!reader.Recovered());
+    CHECK(reader.FrameNum() == (size_t)kFrameNum);
+    CHECK(memcmp(reader.Info().subtype, info.subtype, sizeof(info.subtype)) == 0);
+    CHECK(reader.Info().format.fps_num == 30 && reader.Info().format.fps_den == 1);
+
+    bool same = reader.FrameNum() == (size_t)kFrameNum;
+    for (size_t n = 0; same && n < reader.FrameNum(); ++n)
+        same &= SameFrame(reader, n);
+
+    CHECK(same);
+
+    // Frames stay 64-byte aligned in the mapping.
+    CHECK(reader.FrameNum() && (uintptr_t)reader.Frame(0).data % 64 == 0);
+    reader.Close();
+    CHECK(reader.FrameNum() == 0);
+
+    // Compressed frames have no stride and any size.
+    RecordingInfo mjpg = info;
+    mjpg.format.fourcc = kFourccMjpg;
+    FrameRecorder recorder;
+    CHECK(recorder.Open(kPath, mjpg));
+    const std::vector<uint8_t> small = FrameBytes(0, 5);
+    RawFrame frame = MakeFrame(mjpg, 0, small);
+    frame.stride = 0;
+    CHECK(WriteAll(&recorder, frame));
+    CHECK(recorder.Close());
+    CHECK(reader.Open(kPath));
+    CHECK(reader.FrameNum() == 1 && reader.Frame(0).size == 5 && reader.Frame(0).stride == 0);
+    CHECK(reader.FrameNum() == 1 && memcmp(reader.Frame(0).data, small.data(), 5) == 0);
+    reader.Close();
+    remove(kPath);
+}
+
+// A file cut anywhere keeps the records before the cut; the index is
+// rebuilt from them.
+static void TestTruncated()
+{
+    CHECK(Record(kPath, Yuy2Info(), kFrameNum, kFrameBytes));
+    const std::vector<uint8_t> data = ReadAll(kPath);
+    const size_t records_end = kHeaderBytes + kFrameNum * kRecordBytes;
+    CHECK(data.size() == records_end + kFrameNum * 8 + 32);
+
+    const size_t cuts[] = {
+        data.size() - 1, data.size() - 32, records_end + 3, records_end,
+        records_end - 1, kHeaderBytes + 5 * kRecordBytes + 100,
+        kHeaderBytes + 5 * kRecordBytes, kHeaderBytes + 40, kHeaderBytes,
+    };
+
+    for (size_t cut : cuts) {
+        const size_t whole = cut < kHeaderBytes ? 0 : (cut - kHeaderBytes) / kRecordBytes;
+        const size_t expected = whole < (size_t)kFrameNum ? whole : kFrameNum;
+        CHECK(WriteAll(kDamagedPath, data.data(), cut));
+
+        RecordingReader reader;
+        CHECK(reader.Open(kDamagedPath));
+        CHECK(reader.Recovered());
+        CHECK(reader.FrameNum() == expected);
+
+        bool same = reader.FrameNum() == expected;
+        for (size_t n = 0; same && n < reader.FrameNum(); ++n)
+            same &= SameFrame(reader, n);
+
+        CHECK(same);
+    }
+
+    // Too short for the file header, or not a recording at all.
+    RecordingReader reader;
+    CHECK(WriteAll(kDamagedPath, data.data(), kHeaderBytes - 1));
+    CHECK(!reader.Open(kDamagedPath));
+    std::vector<uint8_t> other = data;
+    other[0] ^= 1;
+    CHECK(WriteAll(kDamagedPath, other.data(), other.size()));
+    CHECK(!reader.Open(kDamagedPath));
+    remove(kDamagedPath);
+    remove(kPath);
+}
+
+// Record 5 of a whole file, changed by |edit|; the records before it are
+// all that is read.
+template <typename T>
+static size_t FramesWithRecord5(const std::vector<uint8_t>& data, size_t at, T value)
+{
+    std::vector<uint8_t> damaged = data;
+    memcpy(&damaged[kHeaderBytes + 5 * kRecordBytes + at], &value, sizeof(value));
+    if (!WriteAll(kDamagedPath, damaged.data(), damaged.size()))
+        return SIZE_MAX;
+
+    RecordingReader reader;
+    if (!reader.Open(kDamagedPath))
+        return SIZE_MAX;
+
+    return reader.Recovered() ? reader.FrameNum() : SIZE_MAX;
+}
+
+static void TestDamagedRecords()
+{
+    CHECK(Record(kPath, Yuy2Info(), kFrameNum, kFrameBytes));
+    const std::vector<uint8_t> data = ReadAll(kPath);
+    CHECK(data.size() > kHeaderBytes + kFrameNum * kRecordBytes);
+
+    // Record 5 is bottom-up, with scan line 0 at 640.
+    CHECK(FramesWithRecord5(data, 0, (uint32_t)0) == 5);
+    CHECK(FramesWithRecord5(data, kBytesAt, (uint64_t)64) == 5);
+    CHECK(FramesWithRecord5(data, kBytesAt, (uint64_t)kFrameBytes - 1) == 5);
+    CHECK(FramesWithRecord5(data, kBytesAt, (uint64_t)1 << 40) == 5);
+    CHECK(FramesWithRecord5(data, kStrideAt, (int32_t)-74) == 5);
+    CHECK(FramesWithRecord5(data, kStrideAt, (int32_t)INT32_MIN) == 5);
+    CHECK(FramesWithRecord5(data, kStrideAt, (int32_t)kStride) == 5);
+    CHECK(FramesWithRecord5(data, kDataOffsetAt, (uint32_t)0) == 5);
+    CHECK(FramesWithRecord5(data, kDataOffsetAt, (uint32_t)kFrameBytes) == 5);
+
+    // The row a frame must hold is that of its format and width.
+    RecordingInfo info = Yuy2Info();
+    info.format.width = kStride / 2 + 2;
+    std::vector<uint8_t> wider = data;
+    memcpy(&wider[kWidthAt], &info.format.width, sizeof(info.format.width));
+    CHECK(WriteAll(kDamagedPath, wider.data(), wider.size()));
+    RecordingReader reader;
+    CHECK(reader.Open(kDamagedPath));
+    CHECK(reader.FrameNum() == 0);
+
+    // A 640x480 YUY2 recording whose record holds 64 bytes.
+    info = Yuy2Info();
+    info.format.width = 640;
+    info.format.height = 480;
+    FrameRecorder recorder;
+    CHECK(recorder.Open(kPath, info));
+    const std::vector<uint8_t> small = FrameBytes(0, 64);
+    RawFrame frame = MakeFrame(info, 0, small);
+    frame.stride = 1280;
+    CHECK(WriteAll(&recorder, frame));
+    CHECK(recorder.Close());
+    CHECK(reader.Open(kPath));
+    CHECK(reader.FrameNum() == 0);
+
+    // Frames with chroma planes come top-down only; the second is not.
+    info = Yuy2Info();
+    info.format.fourcc = FormatI420::fourcc;
+    CHECK(Record(kPath, info, 2, (size_t)kStride * kHeight + kStride * ((kHeight + 1) / 2)));
+    CHECK(reader.Open(kPath));
+    CHECK(reader.Recovered() && reader.FrameNum() == 1);
+    reader.Close();
+    remove(kDamagedPath);
+    remove(kPath);
+}
+
+int main()
+{
+    TestRoundTrip();
+    TestTruncated();
+    TestDamagedRecords();
+    return CheckResult();
+}
@@ -0,0 +1,138 @@
+// A producer and a consumer thread hammer a TripleBuffer: the consumer
+// must only ever see whole values, each newer than the last, and every
+// value published is either seen or reported as replaced. With frames,
+// the pool behind the buffer must not grow past what it can hold.
+
+#include <stdint.h>
+#include <string.h>
+
+#include <atomic>
+#include <thread>
+
+#include "check.h"
+#include "frame_pool.h"
+#include "triple_buffer.h"
+
+static const uint64_t kValueNum = 200000;
+static const uint64_t kFrameNum = 20000;
+
+struct Value {
+    uint64_t seq;
+    uint32_t words[256];
+};
+
+static uint32_t Word(uint64_t seq, size_t i)
+{
+    return (uint32_t)(seq * 2654435761u + i);
+}
+
+static bool Whole(const Value& value)
+{
+    for (size_t i = 0; i < 256; ++i) {
+        if (value.words[i] != Word(value.seq, i))
+            return false;
+    }
+
+    return true;
+}
+
+static void Fill(Value* value, uint64_t seq)
+{
+    value->seq = seq;
+    for (size_t i = 0; i < 256; ++i)
+        value->words[i] = Word(seq, i);
+}
+
+static void TestValues()
+{
+    static TripleBuffer<Value> buffer;
+    Fill(&buffer.Front(), 0);
+
+    uint64_t replaced = 0;
+    std::thread producer([&]() {
+        for (uint64_t seq = 1; seq <= kValueNum; ++seq) {
+            Fill(&buffer.Back(), seq);
+            if (buffer.Publish())
+                ++replaced;
+        }
+    });
+
+    uint64_t last = 0;
+    uint64_t seen = 0;
+    bool torn = false;
+    bool older = false;
+    bool changed = false;
+    while (last < kValueNum) {
+        const bool fresh = buffer.Update();
+        const Value& value = buffer.Front();
+        torn |= !Whole(value);
+        if (fresh) {
+            older |= value.seq <= last;
+            last = value.seq;
+            ++seen;
+        } else {
+            changed |= value.seq != last;
+        }
+    }
+
+    producer.join();
+    CHECK(!torn);
+    CHECK(!older);
+    CHECK(!changed);
+    CHECK(last == kValueNum);
+    CHECK(seen + replaced == kValueNum);
+    CHECK(!buffer.Update());
+}
+
+// As the window uses it: frames from a pool, moved into the back slot.
+// Three slots and the frame being filled are all the pool ever needs.
+static void TestFrames()
+{
+    FramePool pool;
+    TripleBuffer<FrameRef> buffer;
+    const FrameFormat format = { kFrameFormatBgra, 64, 16, 64 * 4 };
+    std::atomic<size_t> most{ 0 };
+    std::thread producer([&]() {
+        for (uint64_t seq = 1; seq <= kFrameNum; ++seq) {
+            FrameRef frame = pool.Acquire(format);
+            memset(frame->Data(), (int)(seq & 0xFF), (size_t)format.stride * format.height);
+            frame->SetTimestamp((int64_t)seq);
+            buffer.Back() = std::move(frame);
+            buffer.Publish();
+
+            const size_t allocated = pool.Allocated();
+            if (allocated > most)
+                most = allocated;
+        }
+    });
+
+    int64_t last = 0;
+    bool torn = false;
+    bool older = false;
+    while (last < (int64_t)kFrameNum) {
+        if (!buffer.Update())
+            continue;
+
+        const FrameRef& frame = buffer.Front();
+        older |= frame->Timestamp() <= last;
+        last = frame->Timestamp();
+
+        const uint8_t fill = (uint8_t)(last & 0xFF);
+        const size_t size = (size_t)frame->Stride() * frame->Height();
+        for (size_t i = 0; i < size; ++i)
+            torn |= frame->Data()[i] != fill;
+    }
+
+    producer.join();
+    CHECK(!torn);
+    CHECK(!older);
+    CHECK(most <= 4);
+    CHECK(pool.Allocated() <= 4);
+}
+
+int main()
+{
+    TestValues();
+    TestFrames();
+    return CheckResult();
+}